@@ -119,6 +119,7 @@ typedef struct _rfbXCursorColors {
 #define RFB_ENCODING_ZLIB      6
 #define RFB_ENCODING_TIGHT     7
 #define RFB_ENCODING_ZLIBHEX   8
+#define RFB_ENCODING_ZRLE      16
 
 #define RFB_ENCODING_COMPESSLEVEL0  0xFFFFFF00
 #define RFB_ENCODING_COMPESSLEVEL9  0xFFFFFF09
@@ -129,6 +130,8 @@ typedef struct _rfbXCursorColors {
 #define RFB_ENCODING_LASTRECT       0xFFFFFF20
 #define RFB_ENCODING_NEWFBSIZE      0xFFFFFF21
 
+#define RFB_ENCODING_FENCE          0xFFFFFEC8
+
 /*
  * Mouse cursor encodings
  */
@@ -137,6 +140,17 @@ typedef struct _rfbXCursorColors {
 #define RFB_ENCODING_RICHCURSOR     0xFFFFFF11
 #define RFB_ENCODING_POINTERPOS     0xFFFFFF18
 
+/*
+ * Fence messages
+ */
+
+#define RFB_FENCE_BLOCK_BEFORE      0x00000001
+#define RFB_FENCE_BLOCK_AFTER       0x00000002
+#define RFB_FENCE_SYNC_NEXT         0x00000004
+#define RFB_FENCE_REQUEST           0x80000000
+
+#define RFB_FENCE_MAX_PAYLOAD       64
+
 /*
  * Hextile encoding
  */
@@ -36,6 +36,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
 
 #include "tight-decoder.h"
 
@@ -50,6 +52,16 @@
 
 #define TIGHT_MIN_TO_COMPRESS  12
 
+/* Value of num_colors for JPEG-compressed rectangles */
+#define TIGHT_JPEG_NUM_COLORS  -2
+
+/* JPEG error manager returning control to td_func_jpegdata() */
+typedef struct _TD_JPEG_ERROR_MGR {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+  TIGHT_DECODER *td;
+} TD_JPEG_ERROR_MGR;
+
 static int td_func_compctl(TIGHT_DECODER *td, unsigned char *buf);
 static int td_func_fill(TIGHT_DECODER *td, unsigned char *buf);
 static int td_func_filter(TIGHT_DECODER *td, unsigned char *buf);
@@ -60,6 +72,7 @@ static int td_func_len1(TIGHT_DECODER *td, unsigned char *buf);
 static int td_func_len2(TIGHT_DECODER *td, unsigned char *buf);
 static int td_func_len3(TIGHT_DECODER *td, unsigned char *buf);
 static int td_func_zlibdata(TIGHT_DECODER *td, unsigned char *buf);
+static int td_func_jpegdata(TIGHT_DECODER *td, unsigned char *buf);
 
 /************************* Public Functions *************************/
 
@@ -393,10 +406,9 @@ static int td_func_compctl(TIGHT_DECODER *td, unsigned char *buf)
   }
 
   if (comp_ctl == TIGHT_JPEG) {
-    snprintf(td->error_msg, sizeof(td->error_msg),
-             "JPEG is not supported in this version");
-    td->func = NULL;
-    return -1;
+    td->num_colors = TIGHT_JPEG_NUM_COLORS;
+    td->func = &td_func_len1;
+    return 1;
   }
 
   if (comp_ctl > TIGHT_MAX_SUBENCODING) {
@@ -474,6 +486,16 @@ static int td_func_rawdata(TIGHT_DECODER *td, unsigned char *buf)
   return 0;
 }
 
+static int td_expect_compressed_data(TIGHT_DECODER *td)
+{
+  if (td->num_colors == TIGHT_JPEG_NUM_COLORS) {
+    td->func = &td_func_jpegdata;
+  } else {
+    td->func = &td_func_zlibdata;
+  }
+  return td->compressed_size;
+}
+
 static int td_func_len1(TIGHT_DECODER *td, unsigned char *buf)
 {
   td->compressed_size = buf[0] & 0x7F;
@@ -481,8 +503,7 @@ static int td_func_len1(TIGHT_DECODER *td, unsigned char *buf)
     td->func = &td_func_len2;
     return 1;
   } else {
-    td->func = &td_func_zlibdata;
-    return td->compressed_size;
+    return td_expect_compressed_data(td);
   }
 }
 
@@ -493,16 +514,14 @@ static int td_func_len2(TIGHT_DECODER *td, unsigned char *buf)
     td->func = &td_func_len3;
     return 1;
   } else {
-    td->func = &td_func_zlibdata;
-    return td->compressed_size;
+    return td_expect_compressed_data(td);
   }
 }
 
 static int td_func_len3(TIGHT_DECODER *td, unsigned char *buf)
 {
   td->compressed_size |= (buf[0] & 0xFF) << 14;
-  td->func = &td_func_zlibdata;
-  return td->compressed_size;
+  return td_expect_compressed_data(td);
 }
 
 static int td_func_zlibdata(TIGHT_DECODER *td, unsigned char *buf)
@@ -587,3 +606,132 @@ static int td_func_zlibdata(TIGHT_DECODER *td, unsigned char *buf)
   td->func = NULL;
   return 0;
 }
+
+/*
+ * JPEG decompression. Source manager and error handler for the JPEG
+ * library, the whole JPEG image is in memory.
+ */
+
+static void td_jpeg_init_source(j_decompress_ptr dinfo)
+{
+  (void)dinfo;                  /* Nothing to do */
+}
+
+static boolean td_jpeg_fill_input_buffer(j_decompress_ptr dinfo)
+{
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+  /* Data is truncated, insert a fake EOI marker */
+  dinfo->src->next_input_byte = eoi;
+  dinfo->src->bytes_in_buffer = sizeof(eoi);
+  return TRUE;
+}
+
+static void td_jpeg_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+  if (num_bytes > (long)dinfo->src->bytes_in_buffer) {
+    dinfo->src->next_input_byte += dinfo->src->bytes_in_buffer;
+    dinfo->src->bytes_in_buffer = 0;
+  } else if (num_bytes > 0) {
+    dinfo->src->next_input_byte += num_bytes;
+    dinfo->src->bytes_in_buffer -= num_bytes;
+  }
+}
+
+static void td_jpeg_term_source(j_decompress_ptr dinfo)
+{
+  (void)dinfo;                  /* Nothing to do */
+}
+
+static void td_jpeg_error_exit(j_common_ptr cinfo)
+{
+  TD_JPEG_ERROR_MGR *err = (TD_JPEG_ERROR_MGR *)cinfo->err;
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message)(cinfo, msg);
+  snprintf(err->td->error_msg, sizeof(err->td->error_msg),
+           "JPEG decoder: %s", msg);
+  longjmp(err->jmp, 1);
+}
+
+static void td_jpeg_output_message(j_common_ptr cinfo)
+{
+  /* Ignore warnings on corrupt data, don't print them to stderr */
+  (void)cinfo;
+}
+
+static int td_func_jpegdata(TIGHT_DECODER *td, unsigned char *buf)
+{
+  struct jpeg_decompress_struct dinfo;
+  struct jpeg_source_mgr src;
+  TD_JPEG_ERROR_MGR err;
+  JSAMPROW row_ptr[1];
+  unsigned char *volatile row_buf = NULL;
+  unsigned char *read_ptr;
+  u_int32_t *fb_ptr;
+  int x;
+
+  td->func = NULL;
+
+  /* Nothing to do if we don't maintain the framebuffer */
+  if (td->fb == NULL) {
+    return 0;
+  }
+
+  dinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = td_jpeg_error_exit;
+  err.pub.output_message = td_jpeg_output_message;
+  err.td = td;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&dinfo);
+    free(row_buf);
+    return -1;
+  }
+  jpeg_create_decompress(&dinfo);
+
+  src.init_source = td_jpeg_init_source;
+  src.fill_input_buffer = td_jpeg_fill_input_buffer;
+  src.skip_input_data = td_jpeg_skip_input_data;
+  src.resync_to_restart = jpeg_resync_to_restart;
+  src.term_source = td_jpeg_term_source;
+  src.next_input_byte = buf;
+  src.bytes_in_buffer = td->compressed_size;
+  dinfo.src = &src;
+
+  jpeg_read_header(&dinfo, TRUE);
+  if ( dinfo.image_width != (JDIMENSION)td->rect_w ||
+       dinfo.image_height != (JDIMENSION)td->rect_h ) {
+    snprintf(td->error_msg, sizeof(td->error_msg),
+             "JPEG image size does not match the rectangle");
+    jpeg_destroy_decompress(&dinfo);
+    return -1;
+  }
+  dinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&dinfo);
+
+  row_buf = malloc(td->rect_w * 3);
+  if (row_buf == NULL) {
+    snprintf(td->error_msg, sizeof(td->error_msg),
+             "Error allocating memory");
+    jpeg_destroy_decompress(&dinfo);
+    return -1;
+  }
+
+  fb_ptr = &td->fb[td->rect_y * td->fb_stride + td->rect_x];
+  while (dinfo.output_scanline < dinfo.output_height) {
+    row_ptr[0] = row_buf;
+    jpeg_read_scanlines(&dinfo, row_ptr, 1);
+    read_ptr = row_buf;
+    for (x = 0; x < td->rect_w; x++) {
+      fb_ptr[x] = read_ptr[0] << 16 | read_ptr[1] << 8 | read_ptr[2];
+      read_ptr += 3;
+    }
+    fb_ptr += td->fb_stride;
+  }
+
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  free(row_buf);
+
+  return 0;
+}
@@ -0,0 +1,366 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Adaptive encoding quality for each client
+ */
+
+/*
+ * Throughput and round-trip time are measured for each client, and
+ * Tight compression level and JPEG quality are chosen accordingly.
+ * Clients behind slow links get lower JPEG quality, clients on fast
+ * links get lower compression levels to save CPU time, and lossless
+ * compression on the fastest links. The values requested by the
+ * client are never exceeded, and JPEG is never used for clients that
+ * have not requested a JPEG quality level.
+ *
+ * If the client supports Fence messages, a fence is sent after each
+ * update to measure the time the client needs to receive the update.
+ * Otherwise, the time to pass the update to the kernel is measured,
+ * and TCP_INFO is consulted if the data fit in the socket buffer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#include "rfblib.h"
+#include "async_io.h"
+#include "logging.h"
+#include "reflector.h"
+#include "translate.h"
+#include "client_io.h"
+#include "adapt.h"
+
+/* Updates smaller than that do not tell much about throughput */
+#define ADAPT_MIN_SAMPLE_BYTES  16384
+
+/* Updates sent faster than that were probably absorbed by the kernel */
+#define ADAPT_MIN_DRAIN_MSEC    20
+
+/* Clients with higher RTT are treated as one class slower */
+#define ADAPT_HIGH_RTT_MSEC     150
+
+/* Clients not responding to a fence in that time are measured with
+   TCP_INFO from then on */
+#define ADAPT_FENCE_TIMEOUT_MSEC  5000
+
+typedef struct _ADAPT_TIER {
+  long min_bandwidth;           /* Bytes per second                        */
+  int compress_level;           /* Highest Tight compression level to use  */
+  int jpeg_quality;             /* Highest JPEG quality, -1 for lossless   */
+} ADAPT_TIER;
+
+static const ADAPT_TIER s_tiers[] = {
+  { 0,               9,  0 },
+  { 16 * 1024,       9,  2 },
+  { 64 * 1024,       9,  5 },
+  { 256 * 1024,      9,  9 },
+  { 1024 * 1024,     3,  9 },
+  { 8 * 1024 * 1024, 1, -1 }
+};
+
+#define ADAPT_NUM_TIERS  (int)(sizeof(s_tiers) / sizeof(ADAPT_TIER))
+
+static int s_adapt_f = 0;
+
+static void send_fence_request(CL_SLOT *cl);
+static void tf_fence_timeout(void);
+static void add_bandwidth_sample(CL_SLOT *cl, size_t bytes,
+                                 unsigned long msec);
+static void add_rtt_sample(CL_SLOT *cl, long msec);
+static long get_tcp_bandwidth(CL_SLOT *cl, long *rtt_ptr);
+static void choose_tier(CL_SLOT *cl);
+static void apply_tier(CL_SLOT *cl);
+
+void set_adaptive_quality(int enable_f)
+{
+  s_adapt_f = enable_f;
+}
+
+void adapt_init_client(CL_SLOT *cl)
+{
+  cl->adapt_tier = -1;
+  cl->bandwidth = -1;
+  cl->rtt = -1;
+  cl->update_bytes = 0;
+  cl->fence_id = 0;
+  cl->enable_fence = 0;
+  cl->fence_announced = 0;
+  cl->fence_pending = 0;
+}
+
+/*
+ * Should be called when the client lists the Fence pseudo-encoding.
+ * The first time, if adaptation is enabled, a Fence with the request
+ * flag and the flags we support is sent, some clients wait for it
+ * before using fences.
+ */
+
+void adapt_enable_fence(CL_SLOT *cl)
+{
+  CARD8 msg[9];
+
+  cl->enable_fence = 1;
+  if (!s_adapt_f || cl->fence_announced)
+    return;
+
+  msg[0] = 248;                 /* Fence */
+  msg[1] = msg[2] = msg[3] = 0;
+  buf_put_CARD32(&msg[4], RFB_FENCE_REQUEST | RFB_FENCE_BLOCK_BEFORE |
+                 RFB_FENCE_BLOCK_AFTER);
+  msg[8] = 0;
+  aio_write(NULL, msg, sizeof(msg));
+
+  cl->fence_announced = 1;
+}
+
+/*
+ * Should be called after the client has set compress_level and
+ * jpeg_quality. These values become the limits for adaptation.
+ */
+
+void adapt_set_bounds(CL_SLOT *cl)
+{
+  cl->max_compress_level = cl->compress_level;
+  cl->max_jpeg_quality = cl->jpeg_quality;
+  apply_tier(cl);
+}
+
+/*
+ * Should be called after an update of the specified size has been
+ * queued for sending.
+ */
+
+void adapt_update_queued(CL_SLOT *cl, size_t bytes)
+{
+  cl->update_start = aio_get_time();
+  cl->update_bytes = bytes;
+}
+
+/*
+ * Should be called when all the update data has been sent, with
+ * cur_slot pointing to the client.
+ */
+
+void adapt_update_sent(CL_SLOT *cl)
+{
+  unsigned long msec;
+  long tcp_bandwidth, tcp_rtt;
+
+  if (!s_adapt_f || cl->update_bytes == 0)
+    return;
+
+  if (cl->enable_fence) {
+    /* Let the client tell us when it gets the data */
+    if (!cl->fence_pending)
+      send_fence_request(cl);
+  } else {
+    msec = aio_get_time() - cl->update_start;
+    tcp_bandwidth = get_tcp_bandwidth(cl, &tcp_rtt);
+    if (tcp_rtt >= 0)
+      add_rtt_sample(cl, tcp_rtt);
+    if (msec >= ADAPT_MIN_DRAIN_MSEC || tcp_bandwidth < 0) {
+      add_bandwidth_sample(cl, cl->update_bytes, msec);
+    } else if (cl->update_bytes >= ADAPT_MIN_SAMPLE_BYTES) {
+      add_bandwidth_sample(cl, (size_t)tcp_bandwidth, 1000);
+    }
+    choose_tier(cl);
+  }
+
+  cl->update_bytes = 0;
+}
+
+/*
+ * Should be called on a Fence message without the request flag.
+ */
+
+void adapt_fence_response(CL_SLOT *cl, CARD8 *data, int len)
+{
+  unsigned long now;
+
+  /* Response to the fence sent by adapt_enable_fence() */
+  if (len == 0)
+    return;
+
+  if (!cl->fence_pending || len != 4 ||
+      buf_get_CARD32(data) != cl->fence_id) {
+    log_write(LL_DEBUG, "Ignoring unexpected fence response from %s",
+              cl->s.name);
+    return;
+  }
+
+  cl->fence_pending = 0;
+  aio_cancel_timer(&cl->fence_timer);
+  now = aio_get_time();
+  add_rtt_sample(cl, (long)(now - cl->fence_sent));
+  add_bandwidth_sample(cl, cl->fence_update_bytes,
+                       now - cl->fence_update_start);
+  choose_tier(cl);
+}
+
+/*
+ * The client responds after it has processed all the data sent
+ * before the fence.
+ */
+
+static void send_fence_request(CL_SLOT *cl)
+{
+  CARD8 msg[13];
+
+  msg[0] = 248;                 /* Fence */
+  msg[1] = msg[2] = msg[3] = 0;
+  buf_put_CARD32(&msg[4], RFB_FENCE_REQUEST | RFB_FENCE_BLOCK_BEFORE);
+  msg[8] = 4;
+  buf_put_CARD32(&msg[9], ++cl->fence_id);
+  aio_write(NULL, msg, sizeof(msg));
+
+  cl->fence_pending = 1;
+  cl->fence_sent = aio_get_time();
+  cl->fence_update_start = cl->update_start;
+  cl->fence_update_bytes = cl->update_bytes;
+  aio_set_timer(&cl->fence_timer, tf_fence_timeout,
+                ADAPT_FENCE_TIMEOUT_MSEC);
+}
+
+/*
+ * The client has not responded to the fence, maybe it only pretends
+ * to support fences. Stop waiting and use the TCP_INFO estimate.
+ */
+
+static void tf_fence_timeout(void)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+  long tcp_bandwidth, tcp_rtt;
+
+  log_write(LL_DETAIL, "No fence response from %s, using TCP_INFO",
+            cur_slot->name);
+  cl->fence_pending = 0;
+  cl->enable_fence = 0;
+
+  tcp_bandwidth = get_tcp_bandwidth(cl, &tcp_rtt);
+  if (tcp_rtt >= 0)
+    add_rtt_sample(cl, tcp_rtt);
+  if (tcp_bandwidth >= 0)
+    add_bandwidth_sample(cl, (size_t)tcp_bandwidth, 1000);
+  choose_tier(cl);
+}
+
+static void add_bandwidth_sample(CL_SLOT *cl, size_t bytes,
+                                 unsigned long msec)
+{
+  long sample;
+
+  if (bytes < ADAPT_MIN_SAMPLE_BYTES)
+    return;
+
+  if (msec == 0)
+    msec = 1;
+  sample = (long)((double)bytes * 1000.0 / msec);
+
+  if (cl->bandwidth < 0) {
+    cl->bandwidth = sample;
+  } else {
+    cl->bandwidth += (sample - cl->bandwidth) / 4;
+  }
+}
+
+static void add_rtt_sample(CL_SLOT *cl, long msec)
+{
+  if (cl->rtt < 0) {
+    cl->rtt = msec;
+  } else {
+    cl->rtt += (msec - cl->rtt) / 4;
+  }
+}
+
+/*
+ * Estimate the rate the kernel sends data at as congestion window
+ * divided by smoothed RTT. Returns -1 if not available.
+ */
+
+static long get_tcp_bandwidth(CL_SLOT *cl, long *rtt_ptr)
+{
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  *rtt_ptr = -1;
+  if (getsockopt(cl->s.fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+      info.tcpi_rtt == 0)
+    return -1;
+
+  *rtt_ptr = (long)(info.tcpi_rtt / 1000);
+  return (long)((double)info.tcpi_snd_cwnd * info.tcpi_snd_mss *
+                1000000.0 / info.tcpi_rtt);
+#else
+  *rtt_ptr = -1;
+  return -1;
+#endif
+}
+
+/*
+ * Switching to a faster class requires a margin of 25% to avoid
+ * switching back and forth on small changes in throughput.
+ */
+
+static void choose_tier(CL_SLOT *cl)
+{
+  int tier;
+
+  if (cl->bandwidth < 0)
+    return;
+
+  for (tier = ADAPT_NUM_TIERS - 1; tier > 0; tier--) {
+    if (tier <= cl->adapt_tier) {
+      if (cl->bandwidth >= s_tiers[tier].min_bandwidth)
+        break;
+    } else {
+      if (cl->bandwidth >= s_tiers[tier].min_bandwidth / 4 * 5)
+        break;
+    }
+  }
+  if (tier > 0 && cl->rtt > ADAPT_HIGH_RTT_MSEC)
+    tier--;
+
+  if (tier != cl->adapt_tier) {
+    cl->adapt_tier = tier;
+    apply_tier(cl);
+    log_write(LL_DETAIL, "Client %s: %ld bytes/s, RTT %ld ms, "
+              "using compression level %d, JPEG quality %d",
+              cl->s.name, cl->bandwidth, cl->rtt,
+              cl->compress_level, cl->jpeg_quality);
+  }
+}
+
+static void apply_tier(CL_SLOT *cl)
+{
+  const ADAPT_TIER *t;
+
+  cl->compress_level = cl->max_compress_level;
+  cl->jpeg_quality = cl->max_jpeg_quality;
+  if (!s_adapt_f || cl->adapt_tier < 0)
+    return;
+
+  t = &s_tiers[cl->adapt_tier];
+  if (cl->compress_level > t->compress_level)
+    cl->compress_level = t->compress_level;
+  if (t->jpeg_quality < 0) {
+    cl->jpeg_quality = -1;
+  } else if (cl->jpeg_quality > t->jpeg_quality) {
+    cl->jpeg_quality = t->jpeg_quality;
+  }
+}
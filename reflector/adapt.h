@@ -0,0 +1,28 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Adaptive encoding quality for each client
+ */
+
+#ifndef _REFLIB_ADAPT_H
+#define _REFLIB_ADAPT_H
+
+void set_adaptive_quality(int enable_f);
+void adapt_init_client(CL_SLOT *cl);
+void adapt_set_bounds(CL_SLOT *cl);
+void adapt_enable_fence(CL_SLOT *cl);
+void adapt_update_queued(CL_SLOT *cl, size_t bytes);
+void adapt_update_sent(CL_SLOT *cl);
+void adapt_fence_response(CL_SLOT *cl, CARD8 *data, int len);
+
+#endif /* _REFLIB_ADAPT_H */
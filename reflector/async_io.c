@@ -14,6 +14,8 @@
  * Asynchronous file/socket I/O
  */
 
+#define _GNU_SOURCE             /* for accept4() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,55 +28,193 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+
+#include <sys/uio.h>
+
+#ifdef USE_ZEROCOPY
+#include <netinet/ip.h>
+#include <linux/errqueue.h>
+#define AIO_ZEROCOPY_MINSIZE  65536
+#endif
+
+/* Pointer to the data of an output block */
+#define BLOCK_DATA(block)                                       \
+  ((block)->shared != NULL ?                                    \
+   (block)->shared->data + (block)->shared_offset : (block)->data)
+
+/* Max number of blocks to pass to writev(2) at once */
+#define AIO_IOV_MAXSIZE  64
+
+/* Size of per-slot receive buffers */
+#define AIO_RECVBUF_SIZE  16384
+
+/* Queue of pending connections of listening sockets, large enough for
+   hundreds of clients connecting at once */
+#define AIO_LISTEN_BACKLOG  SOMAXCONN
 
-#ifdef USE_POLL
+/* Max number of connections to accept at once in level-triggered modes
+   (with epoll, all pending connections are accepted) */
+#define AIO_ACCEPT_BATCH  64
+
+/* The io_uring engine falls back to epoll if io_uring is not available */
+#if defined(USE_IO_URING) && !defined(USE_EPOLL)
+#define USE_EPOLL
+#endif
+
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#define EPOLL_MAXEVENTS  256
+#elif defined(USE_POLL)
 #include <sys/poll.h>
 #define FD_ARRAY_MAXSIZE  10000
 #endif
 
+#ifdef USE_IO_URING
+#include <stdint.h>
+#include <poll.h>
+#include "uring.h"
+#define URING_ENTRIES     256
+#define URING_CQ_ENTRIES  4096
+#define URING_NUM_BUFS    128
+/* Request types, stored in the low bits of user_data with slot pointer */
+#define URING_OP_RECV     1
+#define URING_OP_SEND     2
+#define URING_OP_ACCEPT   3
+#define URING_OP_POLL     4
+#define URING_OP_MASK     7
+#define URING_ACTIVE      s_uring_f
+#else
+#define URING_ACTIVE      0
+#endif
+
 #include "async_io.h"
 
+/* Size classes of output blocks kept in free lists, see aio_new_block().
+   Larger blocks are allocated and freed with malloc() and free(). */
+#define AIO_NUM_POOLS       6
+#define AIO_POOL_MIN_SHIFT  6   /* 64 bytes of data in the smallest class */
+#define AIO_POOL_STEP_SHIFT 2   /* Each next class is 4 times larger      */
+/* Maximum total data size of free blocks kept in each free list */
+#define AIO_POOL_MAX_BYTES  262144
+
+/* Number of ticks (milliseconds) in the timer wheel, a power of two.
+   Timers set for a longer period stay in the wheel for several turns. */
+#define AIO_TIMER_WHEEL_SIZE  1024
+#define AIO_TIMER_WHEEL_MASK  (AIO_TIMER_WHEEL_SIZE - 1)
+
+/* Maximum time to wait for I/O, in milliseconds */
+#define AIO_MAX_WAIT  1000
+
 /*
  * Global variables
  */
 
-AIO_SLOT *cur_slot;
+AIO_THREAD_LOCAL AIO_SLOT *cur_slot;
 
 /*
  * Static variables
  */
 
-struct in_addr s_bind_address;
-
-#ifdef USE_POLL
-static struct pollfd s_fd_array[FD_ARRAY_MAXSIZE];
-static unsigned int s_fd_array_size;
+/* Shared by all event loops, so aio_init() does not reset these */
+struct in_addr s_bind_address = { INADDR_ANY };
+static size_t s_queue_limit = 0;
+static int s_queue_limit_type = 0;
+static volatile size_t s_queued_total = 0;
+
+/* Each event loop (thread) has its own set of slots */
+#if defined(USE_EPOLL)
+static AIO_THREAD_LOCAL int s_epoll_fd = -1;
+static AIO_THREAD_LOCAL struct epoll_event s_events[EPOLL_MAXEVENTS];
+static AIO_THREAD_LOCAL AIO_SLOT *s_first_outpending;
+static AIO_THREAD_LOCAL AIO_SLOT *s_last_outpending;
+#ifdef USE_IO_URING
+static AIO_THREAD_LOCAL int s_uring_f;  /* 1 if io_uring is used, not epoll */
+static AIO_THREAD_LOCAL URING s_ring;
+static AIO_THREAD_LOCAL int s_uring_no_multishot;
+static AIO_THREAD_LOCAL int s_uring_zombies;
+#endif
+#elif defined(USE_POLL)
+static AIO_THREAD_LOCAL struct pollfd s_fd_array[FD_ARRAY_MAXSIZE];
+static AIO_THREAD_LOCAL unsigned int s_fd_array_size;
 #else
-static fd_set s_fdset_read;
-static fd_set s_fdset_write;
-static int s_max_fd;
+static AIO_THREAD_LOCAL fd_set s_fdset_read;
+static AIO_THREAD_LOCAL fd_set s_fdset_write;
+static AIO_THREAD_LOCAL int s_max_fd;
 #endif
 
-static AIO_FUNCPTR s_idle_func;
-static AIO_SLOT *s_first_slot;
-static AIO_SLOT *s_last_slot;
+static AIO_THREAD_LOCAL AIO_FUNCPTR s_idle_func;
+static AIO_THREAD_LOCAL AIO_SLOT *s_first_slot;
+static AIO_THREAD_LOCAL AIO_SLOT *s_last_slot;
+static AIO_THREAD_LOCAL AIO_SLOT *s_type_first[AIO_MAX_SLOT_TYPES];
+static AIO_THREAD_LOCAL AIO_SLOT *s_type_last[AIO_MAX_SLOT_TYPES];
+
+static AIO_THREAD_LOCAL volatile int s_sig_func_set;
+static AIO_THREAD_LOCAL AIO_FUNCPTR s_sig_func[10];
 
-static volatile int s_sig_func_set;
-static AIO_FUNCPTR s_sig_func[10];
+static AIO_THREAD_LOCAL int s_close_f;
+static AIO_THREAD_LOCAL int s_slots_closed;
 
-static int s_close_f;
+/* Free lists of output blocks, linked with the next field */
+static AIO_THREAD_LOCAL AIO_BLOCK *s_pool_free[AIO_NUM_POOLS];
+static AIO_THREAD_LOCAL int s_pool_num_free[AIO_NUM_POOLS];
+static AIO_THREAD_LOCAL AIO_BLOCK_STATS s_block_stats;
+
+/* Timer wheel, a list of timers for each tick */
+static AIO_THREAD_LOCAL AIO_TIMER *s_timer_wheel[AIO_TIMER_WHEEL_SIZE];
+static AIO_THREAD_LOCAL int s_num_timers;
+static AIO_THREAD_LOCAL unsigned long s_timer_tick; /* Last tick processed */
+static AIO_THREAD_LOCAL unsigned long s_timer_next; /* No timer expires    */
+                                                    /*   before this time  */
 
 /*
  * Prototypes for static functions
  */
 
 static AIO_SLOT *aio_new_slot(int fd, char *name, size_t slot_size);
-static void aio_process_input(AIO_SLOT *slot);
-static void aio_process_output(AIO_SLOT *slot);
+static void aio_enqueue_block(AIO_FUNCPTR fn, AIO_BLOCK *block);
+static void aio_account_queued(AIO_BLOCK *block);
+static void aio_account_dequeued(AIO_BLOCK *block);
+static void aio_free_block(AIO_BLOCK *block);
+static void aio_link_type(AIO_SLOT *slot);
+static void aio_unlink_type(AIO_SLOT *slot);
+static int aio_process_input(AIO_SLOT *slot);
+static int aio_process_output(AIO_SLOT *slot);
+static int aio_dequeue_sent(AIO_SLOT *slot, size_t bytes);
+#ifdef USE_ZEROCOPY
+static int aio_send_zerocopy(AIO_SLOT *slot, struct iovec *iov);
+static void aio_reap_zerocopy(AIO_SLOT *slot);
+#endif
+#if defined(USE_EPOLL) || defined(USE_POLL)
+static int aio_fatal_error(AIO_SLOT *slot);
+#endif
+#ifdef USE_EPOLL
+static void aio_add_outpending(AIO_SLOT *slot);
+static void aio_remove_outpending(AIO_SLOT *slot);
+static void aio_flush_outpending(void);
+#endif
+#ifdef USE_IO_URING
+static int aio_uring_init(void);
+static void aio_uring_mainloop(void);
+static void aio_uring_reap(void);
+static void aio_uring_complete(__u64 user_data, int res, unsigned flags);
+static void aio_uring_received(AIO_SLOT *slot, int res, unsigned flags);
+static void aio_uring_accepted(AIO_SLOT *slot, int res);
+static void aio_uring_add_slot(AIO_SLOT *slot);
+static void aio_uring_start_io(AIO_SLOT *slot);
+static void aio_uring_send(AIO_SLOT *slot);
+static void aio_uring_cancel(AIO_SLOT *slot);
+#endif
 static void aio_process_func_list(void);
+static void aio_check_queue_limit(void);
 static void aio_accept_connection(AIO_SLOT *slot);
+static void aio_add_accepted(AIO_SLOT *slot, int fd,
+                             struct sockaddr_in *addr);
 static void aio_process_closed(void);
+static int aio_get_timeout(void);
+static void aio_run_timers(void);
 static void aio_destroy_slot(AIO_SLOT *slot, int fatal);
+static void aio_free_slot(AIO_SLOT *slot);
 
 static void sh_interrupt(int signo);
 
@@ -86,14 +226,31 @@ static void sh_interrupt(int signo);
 /*
  * Initialize I/O sybsystem. This function should be called prior to
  * any other function herein and should NOT be called from within
- * event loop, from callback functions.
+ * event loop, from callback functions. Returns 0 on error (errno is
+ * set), 1 on success.
  */
 
-void aio_init(void)
+int aio_init(void)
 {
   int i;
 
-#ifdef USE_POLL
+#if defined(USE_EPOLL)
+#ifdef USE_IO_URING
+  if (!s_uring_f && s_epoll_fd < 0)
+    s_uring_f = aio_uring_init();
+  if (!s_uring_f && s_epoll_fd < 0)
+    s_epoll_fd = epoll_create(EPOLL_MAXEVENTS);
+  if (!s_uring_f && s_epoll_fd < 0)
+    return 0;
+#else
+  if (s_epoll_fd < 0)
+    s_epoll_fd = epoll_create(EPOLL_MAXEVENTS);
+  if (s_epoll_fd < 0)
+    return 0;
+#endif
+  s_first_outpending = NULL;
+  s_last_outpending = NULL;
+#elif defined(USE_POLL)
   s_fd_array_size = 0;
 #else
   FD_ZERO(&s_fdset_read);
@@ -103,13 +260,23 @@ void aio_init(void)
   s_idle_func = NULL;
   s_first_slot = NULL;
   s_last_slot = NULL;
+  for (i = 0; i < AIO_MAX_SLOT_TYPES; i++) {
+    s_type_first[i] = NULL;
+    s_type_last[i] = NULL;
+  }
   s_close_f = 0;
+  s_slots_closed = 0;
+
+  for (i = 0; i < AIO_TIMER_WHEEL_SIZE; i++)
+    s_timer_wheel[i] = NULL;
+  s_num_timers = 0;
+  s_timer_tick = aio_get_time();
 
   s_sig_func_set = 0;
   for (i = 0; i < 10; i++)
     s_sig_func[i] = NULL;
 
-  s_bind_address.s_addr = htonl(INADDR_ANY);
+  return 1;
 }
 
 /*
@@ -165,25 +332,62 @@ int aio_add_slot(int fd, char *name, AIO_FUNCPTR initfunc, size_t slot_size)
 int aio_listen(int port, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
                size_t slot_size)
 {
-  AIO_SLOT *slot, *saved_slot;
   int listen_fd;
-  struct sockaddr_in listen_addr;
-  int optval = 1;
 
   errno = 0;
 
   /* initfunc is optional but acceptfunc should be provided. */
   if (acceptfunc == NULL)
     return 0;
-  
-  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  listen_fd = aio_listen_socket(port, 0);
   if (listen_fd < 0)
     return 0;
 
+  if (!aio_add_listening(listen_fd, initfunc, acceptfunc, slot_size)) {
+    close(listen_fd);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Create non-blocking listening socket, return its descriptor, or -1
+ * on error. If reuseport_f is set, several sockets may listen on the
+ * same port, and the kernel would distribute new connections between
+ * them (see SO_REUSEPORT in socket(7)). That's how each event loop
+ * may accept connections on its own.
+ */
+
+int aio_listen_socket(int port, int reuseport_f)
+{
+  int listen_fd;
+  struct sockaddr_in listen_addr;
+  int optval = 1;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    return -1;
+
   if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
                  &optval, sizeof(int)) != 0) {
     close(listen_fd);
-    return 0;
+    return -1;
+  }
+
+  if (reuseport_f) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+                   &optval, sizeof(int)) != 0) {
+      close(listen_fd);
+      return -1;
+    }
+#else
+    close(listen_fd);
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
   }
 
   listen_addr.sin_family = AF_INET;
@@ -193,12 +397,26 @@ int aio_listen(int port, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
   if ( bind(listen_fd, (struct sockaddr *)&listen_addr,
             sizeof(listen_addr)) != 0 ||
        fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0 ||
-       listen(listen_fd, 5) != 0 ) {
+       listen(listen_fd, AIO_LISTEN_BACKLOG) != 0 ) {
     close(listen_fd);
-    return 0;
+    return -1;
   }
 
-  slot = aio_new_slot(listen_fd, "[listening slot]", sizeof(AIO_SLOT));
+  return listen_fd;
+}
+
+/*
+ * Create a listening slot for a socket made by aio_listen_socket(),
+ * possibly in another thread. Arguments are the same as in
+ * aio_listen(). The socket is closed with the slot.
+ */
+
+int aio_add_listening(int fd, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
+                      size_t slot_size)
+{
+  AIO_SLOT *slot, *saved_slot;
+
+  slot = aio_new_slot(fd, "[listening slot]", sizeof(AIO_SLOT));
   if (slot == NULL)
     return 0;
 
@@ -216,6 +434,21 @@ int aio_listen(int port, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
   return 1;
 }
 
+/*
+ * Change the type of a slot. Slots are kept in separate lists for
+ * each type, so the type should be set with this function rather
+ * than assigned directly, otherwise aio_walk_slots() would not find
+ * the slot. Types should be in the range of 0..AIO_MAX_SLOT_TYPES-1,
+ * new slots have type 0.
+ */
+
+void aio_set_slot_type(AIO_SLOT *slot, int type)
+{
+  aio_unlink_type(slot);
+  slot->type = type;
+  aio_link_type(slot);
+}
+
 /*
  * Iterate over a list of connection slots with specified type.
  * Returns number of matching slots.
@@ -226,9 +459,12 @@ int aio_walk_slots(AIO_FUNCPTR fn, int type)
   AIO_SLOT *slot, *next_slot;
   int count = 0;
 
-  slot = s_first_slot;
+  if (type < 0 || type >= AIO_MAX_SLOT_TYPES)
+    return 0;
+
+  slot = s_type_first[type];
   while (slot != NULL && !s_close_f) {
-    next_slot = slot->next;
+    next_slot = slot->type_next;
     if (slot->type == type && !slot->close_f) {
       (*fn)(slot);
       count++;
@@ -277,13 +513,14 @@ void aio_close(int fatal_f)
 void aio_close_other(AIO_SLOT *slot, int fatal_f)
 {
   slot->close_f = 1;
+  s_slots_closed = 1;
 
   if (fatal_f) {
     s_close_f = 1;
   } else if (slot->listening_f) {
     close(slot->fd);
     slot->fd_closed_f = 1;
-#ifndef USE_POLL
+#if !defined(USE_EPOLL) && !defined(USE_POLL)
     FD_CLR(slot->fd, &s_fdset_read);
     if (slot->fd == s_max_fd) {
       /* NOTE: Better way is to find _existing_ max fd */
@@ -293,19 +530,119 @@ void aio_close_other(AIO_SLOT *slot, int fatal_f)
   }
 }
 
+/*
+ * Remove cur_slot from this event loop without closing its
+ * descriptor, so it could be passed to aio_add_slot() in another
+ * event loop. Like aio_close(), the slot is destroyed later, at the
+ * end of main loop cycle, and the close hook is called. Returns the
+ * descriptor.
+ */
+
+int aio_detach(void)
+{
+  cur_slot->detach_f = 1;
+  aio_close_other(cur_slot, 0);
+
+  return cur_slot->fd;
+}
+
 /*
  * Main event loop. It watches for possibility to perform I/O
  * operations on descriptors and dispatches results to custom
  * callback functions.
  *
- * Here are two versions, one uses poll(2) syscall, another uses
- * select(2) instead. Note that select(2) is more portable while
- * poll(2) is less limited.
+ * Here are three versions, using epoll(7), poll(2) or select(2)
+ * syscalls. Note that select(2) is more portable while poll(2) is
+ * less limited. epoll(7) is Linux-specific, but its cost does not
+ * depend on the total number of slots, only ready slots are visited.
+ * With USE_IO_URING, the epoll version passes control to the io_uring
+ * engine if it could be set up, see aio_uring_mainloop().
  */
 
-/* FIXME: Implement configurable network timeout. */
+/* FIXME: Implement configurable network timeout (see aio_set_timer()). */
+
+#if defined(USE_EPOLL)
+
+void aio_mainloop(void)
+{
+  AIO_SLOT *slot, *next_slot;
+  int i, num_events;
+
+#ifdef USE_IO_URING
+  if (s_uring_f) {
+    aio_uring_mainloop();
+    return;
+  }
+#endif
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, sh_interrupt);
+  signal(SIGINT, sh_interrupt);
+
+  if (s_sig_func_set)
+    aio_process_func_list();
+
+  while (!s_close_f) {
+    /* Send data queued since the last cycle */
+    while (s_first_outpending != NULL && !s_close_f) {
+      aio_flush_outpending();
+      aio_process_closed();
+    }
+    if (s_close_f)
+      break;
+
+    num_events = epoll_wait(s_epoll_fd, s_events, EPOLL_MAXEVENTS,
+                            aio_get_timeout());
+    if (num_events > 0) {
+      for (i = 0; i < num_events && !s_close_f; i++) {
+        slot = (AIO_SLOT *)s_events[i].data.ptr;
+        if (slot->close_f)
+          continue;
+        if ( (s_events[i].events & EPOLLHUP) ||
+             ((s_events[i].events & EPOLLERR) && aio_fatal_error(slot)) ) {
+          slot->errio_f = 1;
+          slot->close_f = 1;
+          s_slots_closed = 1;
+          continue;
+        }
+        /* Edge-triggered mode: process I/O until it would block */
+        if (s_events[i].events & EPOLLOUT) {
+          while (slot->outqueue != NULL && aio_process_output(slot))
+            ;
+        }
+        if ((s_events[i].events & EPOLLIN) && !slot->close_f) {
+          if (slot->listening_f)
+            aio_accept_connection(slot);
+          else {
+            while (aio_process_input(slot))
+              ;
+          }
+        }
+      }
+      aio_run_timers();
+      aio_check_queue_limit();
+      aio_process_closed();
+      if (s_sig_func_set && !s_close_f)
+        aio_process_func_list();
+    } else {
+      aio_run_timers();
+      aio_process_closed();
+      if (s_sig_func_set)
+        aio_process_func_list();
+      else if (s_idle_func != NULL)
+        (*s_idle_func)();       /* Do something in idle periods */
+    }
+  }
+  /* Close all slots and exit */
+  slot = s_first_slot;
+  while(slot != NULL) {
+    next_slot = slot->next;
+    aio_destroy_slot(slot, 1);
+    slot = next_slot;
+  }
+}
 
-#ifdef USE_POLL
+#elif defined(USE_POLL)
 
 void aio_mainloop(void)
 {
@@ -319,13 +656,16 @@ void aio_mainloop(void)
     aio_process_func_list();
 
   while (!s_close_f) {
-    if (poll(s_fd_array, s_fd_array_size, 1000) > 0) {
+    if (poll(s_fd_array, s_fd_array_size, aio_get_timeout()) > 0) {
       slot = s_first_slot;
       while (slot != NULL && !s_close_f) {
         next_slot = slot->next;
-        if (s_fd_array[slot->idx].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        if ( (s_fd_array[slot->idx].revents & (POLLHUP | POLLNVAL)) ||
+             ((s_fd_array[slot->idx].revents & POLLERR) &&
+              aio_fatal_error(slot)) ) {
           slot->errio_f = 1;
           slot->close_f = 1;
+          s_slots_closed = 1;
         } else {
           if (s_fd_array[slot->idx].revents & POLLOUT)
             aio_process_output(slot);
@@ -338,10 +678,14 @@ void aio_mainloop(void)
         }
         slot = next_slot;
       }
+      aio_run_timers();
+      aio_check_queue_limit();
       aio_process_closed();
       if (s_sig_func_set && !s_close_f)
         aio_process_func_list();
     } else {
+      aio_run_timers();
+      aio_process_closed();
       if (s_sig_func_set)
         aio_process_func_list();
       else if (s_idle_func != NULL)
@@ -364,6 +708,7 @@ void aio_mainloop(void)
   fd_set fdset_r, fdset_w;
   struct timeval timeout;
   AIO_SLOT *slot, *next_slot;
+  int msec;
 
   signal(SIGPIPE, SIG_IGN);
   signal(SIGTERM, sh_interrupt);
@@ -375,8 +720,9 @@ void aio_mainloop(void)
   while (!s_close_f) {
     memcpy(&fdset_r, &s_fdset_read, sizeof(fd_set));
     memcpy(&fdset_w, &s_fdset_write, sizeof(fd_set));
-    timeout.tv_sec = 1;         /* One second timeout */
-    timeout.tv_usec = 0;
+    msec = aio_get_timeout();
+    timeout.tv_sec = msec / 1000;
+    timeout.tv_usec = (msec % 1000) * 1000;
     if (select(s_max_fd + 1, &fdset_r, &fdset_w, NULL, &timeout) > 0) {
       slot = s_first_slot;
       while (slot != NULL && !s_close_f) {
@@ -391,10 +737,14 @@ void aio_mainloop(void)
         }
         slot = next_slot;
       }
+      aio_run_timers();
+      aio_check_queue_limit();
       aio_process_closed();
       if (s_sig_func_set && !s_close_f)
         aio_process_func_list();
     } else {
+      aio_run_timers();
+      aio_process_closed();
       if (s_sig_func_set)
         aio_process_func_list();
       else if (s_idle_func != NULL)
@@ -410,7 +760,7 @@ void aio_mainloop(void)
   }
 }
 
-#endif /* USE_POLL */
+#endif /* USE_EPOLL, USE_POLL */
 
 void aio_setread(AIO_FUNCPTR fn, void *inbuf, int bytes_to_read)
 {
@@ -435,6 +785,7 @@ void aio_setread(AIO_FUNCPTR fn, void *inbuf, int bytes_to_read)
         cur_slot->alloc_f = 1;
       } else {
         cur_slot->close_f = 1;
+        s_slots_closed = 1;
       }
     }
   }
@@ -447,9 +798,8 @@ void aio_write(AIO_FUNCPTR fn, void *outbuf, int bytes_to_write)
   AIO_BLOCK *block;
 
   /* FIXME: Join small blocks together? */
-  /* FIXME: Support small static buffer as in reading? */
 
-  block = malloc(sizeof(AIO_BLOCK) + bytes_to_write);
+  block = aio_new_block(bytes_to_write);
   if (block != NULL) {
     block->data_size = bytes_to_write;
     memcpy(block->data, outbuf, bytes_to_write);
@@ -460,197 +810,1377 @@ void aio_write(AIO_FUNCPTR fn, void *outbuf, int bytes_to_write)
 void aio_write_nocopy(AIO_FUNCPTR fn, AIO_BLOCK *block)
 {
   if (block != NULL) {
-    /* By the way, fn may be NULL */
-    block->func = fn;
-
-    if (cur_slot->outqueue == NULL) {
-      /* Output queue was empty */
-      cur_slot->outqueue = block;
-      cur_slot->bytes_written = 0;
-#ifdef USE_POLL
-      s_fd_array[cur_slot->idx].events |= POLLOUT;
-#else
-      FD_SET(cur_slot->fd, &s_fdset_write);
-#endif
-    } else {
-      /* Output queue was not empty */
-      cur_slot->outqueue_last->next = block;
-    }
-
-    cur_slot->outqueue_last = block;
-    block->next = NULL;
+    block->shared = NULL;
+    aio_enqueue_block(fn, block);
   }
 }
 
-void aio_setclose(AIO_FUNCPTR closefunc)
+/*
+ * Queue shared data for sending. The data is not copied, a reference
+ * is added instead, so the same data may be queued for many slots.
+ * The caller should release its own reference with aio_shared_unref()
+ * when it's not needed any more.
+ */
+
+void aio_write_shared(AIO_FUNCPTR fn, AIO_SHARED *shared)
 {
-  cur_slot->closefunc = closefunc;
+  aio_write_shared_part(fn, shared, 0, shared->data_size);
 }
 
-/***************************
- * Static functions follow
+/*
+ * Same as aio_write_shared(), but queue only data_size bytes starting
+ * at the offset specified.
  */
 
-AIO_SLOT *aio_new_slot(int fd, char *name, size_t slot_size)
+void aio_write_shared_part(AIO_FUNCPTR fn, AIO_SHARED *shared,
+                           size_t offset, size_t data_size)
 {
-  size_t size;
-  AIO_SLOT *slot;
+  AIO_BLOCK *block;
 
-  /* Allocate memory make sure all fields are zeroed (very important). */
-  size = (slot_size > sizeof(AIO_SLOT)) ? slot_size : sizeof(AIO_SLOT);
-  slot = calloc(1, size);
+  block = aio_new_block(0);
+  if (block != NULL) {
+    aio_shared_ref(shared);
+    block->shared = shared;
+    block->shared_offset = offset;
+    block->data_size = data_size;
+    aio_enqueue_block(fn, block);
+  }
+}
 
-  if (slot) {
-    slot->fd = fd;
-    if (name != NULL) {
-      slot->name = strdup(name);
-    } else {
-      slot->name = strdup("[unknown]");
-    }
+/*
+ * Allocate a block to be queued with aio_write_nocopy(), with room
+ * for data_size bytes of data. The caller should set data_size field.
+ * Small blocks are taken from per-thread free lists of a few size
+ * classes, to avoid calling malloc() for every rectangle or header.
+ */
 
-    if (s_last_slot == NULL) {
-      /* This is the first slot */
-      s_first_slot = slot;
-      slot->prev = NULL;
-    } else {
-      /* Other slots exist */
-      s_last_slot->next = slot;
-      slot->prev = s_last_slot;
-    }
-    s_last_slot = slot;
+AIO_BLOCK *aio_new_block(size_t data_size)
+{
+  AIO_BLOCK *block;
+  size_t class_size;
+  int pool;
 
-    /* Put fd into non-blocking mode */
-    /* FIXME: check return value? */
-    fcntl(fd, F_SETFL, O_NONBLOCK);
+  s_block_stats.allocs++;
 
-#ifdef USE_POLL
-    /* FIXME: do something better if s_fd_array_size exceeds max size? */
-    if (s_fd_array_size < FD_ARRAY_MAXSIZE) {
-      slot->idx = s_fd_array_size++;
-      s_fd_array[slot->idx].fd = fd;
-      s_fd_array[slot->idx].events = POLLIN;
-      s_fd_array[slot->idx].revents = 0;
-    }
-#else
-    FD_SET(fd, &s_fdset_read);
-    if (fd > s_max_fd)
-      s_max_fd = fd;
-#endif
+  class_size = (size_t)1 << AIO_POOL_MIN_SHIFT;
+  for (pool = 0; pool < AIO_NUM_POOLS; pool++) {
+    if (data_size <= class_size)
+      break;
+    class_size <<= AIO_POOL_STEP_SHIFT;
   }
-  return slot;
-}
 
-static void aio_process_input(AIO_SLOT *slot)
-{
-  int bytes = 0;
+  if (pool == AIO_NUM_POOLS) {
+    pool = -1;
+    class_size = data_size;
+  } else if (s_pool_free[pool] != NULL) {
+    block = s_pool_free[pool];
+    s_pool_free[pool] = block->next;
+    s_pool_num_free[pool]--;
+    return block;
+  }
 
-  /* FIXME: Do not read anything if readfunc is not set?
-     Or maybe skip everything we're receiving?
-     Or better destroy the slot? -- I think yes. */
+  s_block_stats.allocs_malloc++;
+  block = malloc(sizeof(AIO_BLOCK) + class_size);
+  if (block != NULL)
+    block->pool = pool;
 
-  if (!slot->close_f) {
-    errno = 0;
-    if (slot->bytes_to_read - slot->bytes_ready > 0) {
-      bytes = read(slot->fd, slot->readbuf + slot->bytes_ready,
-                   slot->bytes_to_read - slot->bytes_ready);
-    }
-    if (bytes > 0 || slot->bytes_to_read == 0) {
-      slot->bytes_ready += bytes;
-      if (slot->bytes_ready == slot->bytes_to_read) {
-        cur_slot = slot;
-        (*slot->readfunc)();
-      }
-    } else if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
-      slot->close_f = 1;
-      slot->errio_f = 1;
-      slot->errread_f = 1;
-      slot->io_errno = errno;
-    }
-  }
+  return block;
 }
 
-static void aio_process_output(AIO_SLOT *slot)
+/*
+ * Release a block allocated with aio_new_block() which has not been
+ * queued. Blocks may be released by a thread other than the one that
+ * allocated them, then they move to free lists of that thread.
+ */
+
+void aio_release_block(AIO_BLOCK *block)
 {
-  int bytes = 0;
-  AIO_BLOCK *next;
+  int pool = block->pool;
 
-  /* FIXME: Maybe write all blocks in a loop. */
+  s_block_stats.frees++;
 
-  if (!slot->close_f) {
-    errno = 0;
-    if (slot->outqueue->data_size - slot->bytes_written > 0) {
-      bytes = write(slot->fd, slot->outqueue->data + slot->bytes_written,
-                    slot->outqueue->data_size - slot->bytes_written);
-    }
-    if (bytes > 0 || slot->outqueue->data_size == 0) {
-      slot->bytes_written += bytes;
-      if (slot->bytes_written == slot->outqueue->data_size) {
-        /* Block sent, call hook function if set */
-        if (slot->outqueue->func != NULL) {
-          cur_slot = slot;
-          (*slot->outqueue->func)();
-        }
-        next = slot->outqueue->next;
-        if (next != NULL) {
-          /* There are other blocks to send */
-          free(slot->outqueue);
-          slot->outqueue = next;
-          slot->bytes_written = 0;
-        } else {
-          /* Last block sent */
-          free(slot->outqueue);
-          slot->outqueue = NULL;
-#ifdef USE_POLL
-          s_fd_array[slot->idx].events &= (short)~POLLOUT;
-#else
-          FD_CLR(slot->fd, &s_fdset_write);
-#endif
-        }
-      }
-    } else if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
-      slot->close_f = 1;
-      slot->errio_f = 1;
-      slot->errwrite_f = 1;
-      slot->io_errno = errno;
-    }
+  if ( pool >= 0 &&
+       s_pool_num_free[pool] < (AIO_POOL_MAX_BYTES >>
+                                (AIO_POOL_MIN_SHIFT +
+                                 pool * AIO_POOL_STEP_SHIFT)) ) {
+    block->next = s_pool_free[pool];
+    s_pool_free[pool] = block;
+    s_pool_num_free[pool]++;
+  } else {
+    s_block_stats.frees_free++;
+    free(block);
   }
 }
 
-static void aio_process_func_list(void)
+/*
+ * Free all blocks kept in free lists of this thread, e.g. before the
+ * thread exits.
+ */
+
+void aio_free_block_pools(void)
 {
-  int i;
+  AIO_BLOCK *block;
+  int pool;
 
-  s_sig_func_set = 0;
-  for (i = 0; i < 10; i++) {
-    if (s_sig_func[i] != NULL) {
-      (*s_sig_func[i])();
-      s_sig_func[i] = NULL;
+  for (pool = 0; pool < AIO_NUM_POOLS; pool++) {
+    while (s_pool_free[pool] != NULL) {
+      block = s_pool_free[pool];
+      s_pool_free[pool] = block->next;
+      free(block);
     }
+    s_pool_num_free[pool] = 0;
   }
-
-  aio_process_closed();
 }
 
-static void aio_accept_connection(AIO_SLOT *slot)
+/*
+ * Get block allocation counters of this thread, they show how many
+ * malloc() and free() calls have been avoided.
+ */
+
+void aio_get_block_stats(AIO_BLOCK_STATS *stats)
 {
-  struct sockaddr_in client_addr;
-  unsigned int len;
-  int fd;
-  AIO_SLOT *new_slot, *saved_slot;
+  *stats = s_block_stats;
+}
 
-  if (!slot->close_f) {
-    len = sizeof(client_addr);
-    fd = accept(slot->fd, (struct sockaddr *) &client_addr, &len);
-    if (fd < 0)
-      return;
+/*
+ * Allocate shared data buffer, with one reference owned by the caller.
+ */
 
-    new_slot = aio_new_slot(fd, inet_ntoa(client_addr.sin_addr),
-                            slot->bytes_to_read);
+AIO_SHARED *aio_shared_new(size_t data_size)
+{
+  AIO_SHARED *shared;
 
-    saved_slot = cur_slot;
-    cur_slot = new_slot;
-    (*slot->readfunc)();
-    cur_slot = saved_slot;
+  shared = malloc(sizeof(AIO_SHARED) + data_size);
+  if (shared != NULL) {
+    shared->refcount = 1;
+    shared->queued_count = 0;
+    shared->data_size = data_size;
+  }
+  return shared;
+}
+
+/*
+ * Add a reference to shared data, or release one. The data is freed
+ * when the last reference is released.
+ */
+
+void aio_shared_ref(AIO_SHARED *shared)
+{
+  __sync_fetch_and_add(&shared->refcount, 1);
+}
+
+void aio_shared_unref(AIO_SHARED *shared)
+{
+  if (shared != NULL && __sync_sub_and_fetch(&shared->refcount, 1) == 0)
+    free(shared);
+}
+
+void aio_setclose(AIO_FUNCPTR closefunc)
+{
+  cur_slot->closefunc = closefunc;
+}
+
+/*
+ * Limit the total size of data queued for sending, in all event
+ * loops. If the limit is exceeded, slots of the specified type with
+ * the largest output queues are closed, with errqueue_f flag set.
+ * Slots of other types are never closed. Zero means no limit.
+ * Should be called before starting event loops.
+ */
+
+void aio_set_queue_limit(size_t max_bytes, int type)
+{
+  s_queue_limit = max_bytes;
+  s_queue_limit_type = type;
+}
+
+size_t aio_get_queued_total(void)
+{
+  return s_queued_total;
+}
+
+/*
+ * Current time in milliseconds, from a monotonic clock. Only
+ * differences between such values make sense.
+ */
+
+unsigned long aio_get_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Set a timer to call fn in msec milliseconds, in the context of the
+ * current slot (cur_slot may be NULL if the timer does not belong to
+ * any slot). A timer that is already set is moved to the new time.
+ * Timers of a slot are cancelled when the slot is closed. Timers work
+ * in the event loop of the thread which sets them.
+ */
+
+void aio_set_timer(AIO_TIMER *timer, AIO_FUNCPTR fn, unsigned int msec)
+{
+  AIO_TIMER **bucket;
+
+  if (timer->armed_f)
+    aio_cancel_timer(timer);
+
+  /* Ticks up to s_timer_tick have been processed already */
+  timer->expires = aio_get_time() + msec;
+  if ((long)(timer->expires - s_timer_tick) <= 0)
+    timer->expires = s_timer_tick + 1;
+  timer->func = fn;
+  timer->armed_f = 1;
+
+  bucket = &s_timer_wheel[timer->expires & AIO_TIMER_WHEEL_MASK];
+  timer->prev = NULL;
+  timer->next = *bucket;
+  if (*bucket != NULL)
+    (*bucket)->prev = timer;
+  *bucket = timer;
+
+  timer->slot = cur_slot;
+  if (cur_slot != NULL) {
+    timer->slot_prev = NULL;
+    timer->slot_next = cur_slot->timers;
+    if (cur_slot->timers != NULL)
+      cur_slot->timers->slot_prev = timer;
+    cur_slot->timers = timer;
+  }
+
+  if (s_num_timers++ == 0 || (long)(timer->expires - s_timer_next) < 0)
+    s_timer_next = timer->expires;
+}
+
+void aio_cancel_timer(AIO_TIMER *timer)
+{
+  if (!timer->armed_f)
+    return;
+
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    s_timer_wheel[timer->expires & AIO_TIMER_WHEEL_MASK] = timer->next;
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+
+  if (timer->slot != NULL) {
+    if (timer->slot_prev != NULL)
+      timer->slot_prev->slot_next = timer->slot_next;
+    else
+      timer->slot->timers = timer->slot_next;
+    if (timer->slot_next != NULL)
+      timer->slot_next->slot_prev = timer->slot_prev;
+  }
+
+  timer->armed_f = 0;
+  s_num_timers--;
+}
+
+/***************************
+ * Static functions follow
+ */
+
+/*
+ * Time to wait for I/O, in milliseconds, so that the next timer would
+ * not be late. s_timer_next is updated on setting timers, but not on
+ * cancelling, so it may be too early. Then we look for the first
+ * non-empty tick of the wheel.
+ */
+
+static int aio_get_timeout(void)
+{
+  AIO_TIMER *timer;
+  unsigned long now, tick;
+  int i;
+
+  if (s_num_timers == 0)
+    return AIO_MAX_WAIT;
+
+  now = aio_get_time();
+  if ((long)(s_timer_next - now) <= 0) {
+    s_timer_next = now + AIO_MAX_WAIT;
+    tick = s_timer_tick + 1;
+    for (i = 0; i < AIO_TIMER_WHEEL_SIZE; i++, tick++) {
+      if ((long)(tick - s_timer_next) >= 0)
+        break;
+      timer = s_timer_wheel[tick & AIO_TIMER_WHEEL_MASK];
+      for ( ; timer != NULL; timer = timer->next) {
+        if ((long)(timer->expires - tick) <= 0)
+          break;
+      }
+      if (timer != NULL) {
+        s_timer_next = tick;
+        break;
+      }
+    }
+  }
+
+  if ((long)(s_timer_next - now) <= 0)
+    return 0;
+  if ((long)(s_timer_next - now) > AIO_MAX_WAIT)
+    return AIO_MAX_WAIT;
+  return (int)(s_timer_next - now);
+}
+
+/*
+ * Call functions of expired timers, advancing the wheel up to the
+ * current time. A timer is cancelled before its function is called,
+ * so it may be set again from there.
+ */
+
+static void aio_run_timers(void)
+{
+  AIO_TIMER *timer;
+  unsigned long now;
+
+  now = aio_get_time();
+  if (s_num_timers == 0) {
+    s_timer_tick = now;
+    return;
+  }
+
+  /* Each tick of the wheel is visited once, even after a long delay */
+  if ((long)(now - s_timer_tick) > AIO_TIMER_WHEEL_SIZE)
+    s_timer_tick = now - AIO_TIMER_WHEEL_SIZE;
+
+  while ((long)(now - s_timer_tick) > 0 && !s_close_f) {
+    s_timer_tick++;
+    timer = s_timer_wheel[s_timer_tick & AIO_TIMER_WHEEL_MASK];
+    while (timer != NULL && !s_close_f) {
+      if ((long)(timer->expires - s_timer_tick) > 0) {
+        timer = timer->next;    /* Expires on one of next turns */
+        continue;
+      }
+      aio_cancel_timer(timer);
+      if (timer->slot == NULL || !timer->slot->close_f) {
+        cur_slot = timer->slot;
+        (*timer->func)();
+      }
+      /* Other timers might be changed as well, start over */
+      timer = s_timer_wheel[s_timer_tick & AIO_TIMER_WHEEL_MASK];
+    }
+  }
+}
+
+static void aio_enqueue_block(AIO_FUNCPTR fn, AIO_BLOCK *block)
+{
+  /* By the way, fn may be NULL */
+  block->func = fn;
+  block->zc_f = 0;
+
+  cur_slot->bytes_queued += block->data_size;
+  if (cur_slot->bytes_queued > cur_slot->bytes_queued_max)
+    cur_slot->bytes_queued_max = cur_slot->bytes_queued;
+  aio_account_queued(block);
+
+  if (cur_slot->outqueue == NULL) {
+    /* Output queue was empty */
+    cur_slot->outqueue = block;
+    cur_slot->bytes_written = 0;
+#if defined(USE_EPOLL)
+    aio_add_outpending(cur_slot);
+#elif defined(USE_POLL)
+    s_fd_array[cur_slot->idx].events |= POLLOUT;
+#else
+    FD_SET(cur_slot->fd, &s_fdset_write);
+#endif
+  } else {
+    /* Output queue was not empty */
+    cur_slot->outqueue_last->next = block;
+  }
+
+  cur_slot->outqueue_last = block;
+  block->next = NULL;
+}
+
+/*
+ * Account the memory of a block added to or removed from an output
+ * queue, see aio_set_queue_limit(). Shared data is counted only once
+ * however many slots it has been queued to.
+ */
+
+static void aio_account_queued(AIO_BLOCK *block)
+{
+  if (block->shared == NULL) {
+    __sync_fetch_and_add(&s_queued_total, block->data_size);
+  } else if (__sync_add_and_fetch(&block->shared->queued_count, 1) == 1) {
+    __sync_fetch_and_add(&s_queued_total, block->shared->data_size);
+  }
+}
+
+static void aio_account_dequeued(AIO_BLOCK *block)
+{
+  if (block->shared == NULL) {
+    __sync_fetch_and_sub(&s_queued_total, block->data_size);
+  } else if (__sync_sub_and_fetch(&block->shared->queued_count, 1) == 0) {
+    __sync_fetch_and_sub(&s_queued_total, block->shared->data_size);
+  }
+}
+
+static void aio_free_block(AIO_BLOCK *block)
+{
+  if (block->shared != NULL)
+    aio_shared_unref(block->shared);
+  aio_release_block(block);
+}
+
+AIO_SLOT *aio_new_slot(int fd, char *name, size_t slot_size)
+{
+  size_t size;
+  AIO_SLOT *slot;
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+#endif
+
+  /* Allocate memory make sure all fields are zeroed (very important). */
+  size = (slot_size > sizeof(AIO_SLOT)) ? slot_size : sizeof(AIO_SLOT);
+  slot = calloc(1, size);
+
+#ifdef USE_EPOLL
+  /* Register the descriptor once, in edge-triggered mode */
+  if (slot && !URING_ACTIVE) {
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = slot;
+    if (epoll_ctl(s_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      free(slot);
+      slot = NULL;
+    }
+  }
+#endif
+
+  if (slot) {
+    slot->fd = fd;
+    if (name != NULL) {
+      slot->name = strdup(name);
+    } else {
+      slot->name = strdup("[unknown]");
+    }
+
+    if (s_last_slot == NULL) {
+      /* This is the first slot */
+      s_first_slot = slot;
+      slot->prev = NULL;
+    } else {
+      /* Other slots exist */
+      s_last_slot->next = slot;
+      slot->prev = s_last_slot;
+    }
+    s_last_slot = slot;
+
+    /* Initially, the slot has type 0 */
+    aio_link_type(slot);
+
+    /* Put fd into non-blocking mode */
+    /* FIXME: check return value? */
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+#if defined(USE_EPOLL)
+    /* Already registered, or requests will be queued to io_uring */
+#ifdef USE_IO_URING
+    if (s_uring_f)
+      aio_uring_add_slot(slot);
+#endif
+#elif defined(USE_POLL)
+    /* FIXME: do something better if s_fd_array_size exceeds max size? */
+    if (s_fd_array_size < FD_ARRAY_MAXSIZE) {
+      slot->idx = s_fd_array_size++;
+      s_fd_array[slot->idx].fd = fd;
+      s_fd_array[slot->idx].events = POLLIN;
+      s_fd_array[slot->idx].revents = 0;
+    }
+#else
+    FD_SET(fd, &s_fdset_read);
+    if (fd > s_max_fd)
+      s_max_fd = fd;
+#endif
+  }
+  return slot;
+}
+
+/*
+ * Read data from a slot and pass it to readfunc. One readv(2) call
+ * receives data both into the buffer set with aio_setread() and into
+ * the receive buffer of the slot, so reading small protocol fields
+ * does not cost a syscall each. Then readfunc is called repeatedly
+ * while there is enough data in the receive buffer. Returns 1 if the
+ * socket might have more data to read, 0 otherwise.
+ */
+
+static int aio_process_input(AIO_SLOT *slot)
+{
+  struct iovec iov[2];
+  size_t bytes_needed, bytes_buffered;
+  ssize_t bytes;
+  int read_f = 0, more_f = 0;
+
+  /* FIXME: Do not read anything if readfunc is not set?
+     Or maybe skip everything we're receiving?
+     Or better destroy the slot? -- I think yes. */
+
+  while (!slot->close_f && !s_close_f) {
+    /* Take data from the receive buffer first */
+    bytes_needed = slot->bytes_to_read - slot->bytes_ready;
+    bytes_buffered = slot->recv_end - slot->recv_pos;
+    if (bytes_needed > 0 && bytes_buffered > 0) {
+      if (bytes_buffered > bytes_needed)
+        bytes_buffered = bytes_needed;
+      memcpy(slot->readbuf + slot->bytes_ready,
+             slot->recvbuf + slot->recv_pos, bytes_buffered);
+      slot->recv_pos += bytes_buffered;
+      slot->bytes_ready += bytes_buffered;
+      bytes_needed -= bytes_buffered;
+    }
+
+    if (bytes_needed == 0) {
+      cur_slot = slot;
+      (*slot->readfunc)();
+      continue;
+    }
+
+    /* The receive buffer is empty now. Read once per call. */
+    if (read_f)
+      return more_f;
+    read_f = 1;
+
+    if (slot->recvbuf == NULL) {
+      slot->recvbuf = malloc(AIO_RECVBUF_SIZE);
+      if (slot->recvbuf == NULL) {
+        slot->close_f = 1;
+        slot->errio_f = 1;
+        s_slots_closed = 1;
+        return 0;
+      }
+    }
+    slot->recv_pos = 0;
+    slot->recv_end = 0;
+
+    iov[0].iov_base = slot->readbuf + slot->bytes_ready;
+    iov[0].iov_len = bytes_needed;
+    iov[1].iov_base = slot->recvbuf;
+    iov[1].iov_len = AIO_RECVBUF_SIZE;
+
+    errno = 0;
+    bytes = readv(slot->fd, iov, 2);
+    if (bytes > 0) {
+      if ((size_t)bytes > bytes_needed) {
+        slot->bytes_ready += bytes_needed;
+        slot->recv_end = (size_t)bytes - bytes_needed;
+      } else {
+        slot->bytes_ready += (size_t)bytes;
+      }
+      /* Unless all the buffers have been filled, there is no more
+         data for now (with epoll, we'll be notified on new data) */
+      more_f = ((size_t)bytes == bytes_needed + AIO_RECVBUF_SIZE);
+    } else {
+      if (bytes == 0 || errno != EAGAIN) {
+        slot->close_f = 1;
+        slot->errio_f = 1;
+        slot->errread_f = 1;
+        slot->io_errno = errno;
+        s_slots_closed = 1;
+      }
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Write data from the output queue of a slot. As many queued blocks
+ * as possible are passed to a single writev(2) call, hook functions
+ * of the blocks sent are called in order. Returns 1 if all the data
+ * passed to the system has been written and the queue is still not
+ * empty, 0 otherwise.
+ */
+
+static int aio_process_output(AIO_SLOT *slot)
+{
+  struct iovec iov[AIO_IOV_MAXSIZE];
+  int iovcnt = 0;
+  int bytes = 0;
+  size_t bytes_total = 0;
+  size_t offset;
+  AIO_BLOCK *block;
+
+  if (slot->close_f)
+    return 0;
+
+  /* Gather data from the blocks queued */
+  offset = slot->bytes_written;
+  for (block = slot->outqueue; block != NULL; block = block->next) {
+    if (block->data_size > offset) {
+      if (iovcnt == AIO_IOV_MAXSIZE)
+        break;
+#ifdef USE_ZEROCOPY
+      /* Large blocks are sent separately, see aio_send_zerocopy() */
+      if ( iovcnt != 0 &&
+           block->data_size - offset >= AIO_ZEROCOPY_MINSIZE )
+        break;
+#endif
+      iov[iovcnt].iov_base = BLOCK_DATA(block) + offset;
+      iov[iovcnt].iov_len = block->data_size - offset;
+      bytes_total += iov[iovcnt].iov_len;
+      iovcnt++;
+    }
+    offset = 0;
+  }
+
+  errno = 0;
+  if (bytes_total != 0) {
+#ifdef USE_ZEROCOPY
+    if (iov[0].iov_len >= AIO_ZEROCOPY_MINSIZE) {
+      bytes = aio_send_zerocopy(slot, iov);
+      bytes_total = iov[0].iov_len;
+    } else
+#endif
+      bytes = writev(slot->fd, iov, iovcnt);
+    if (bytes <= 0) {
+      if (bytes == 0 || errno != EAGAIN) {
+        slot->close_f = 1;
+        slot->errio_f = 1;
+        slot->errwrite_f = 1;
+        slot->io_errno = errno;
+        s_slots_closed = 1;
+      }
+      return 0;
+    }
+  }
+
+  if (!aio_dequeue_sent(slot, (size_t)bytes))
+    return 0;
+
+  if (slot->outqueue == NULL) {
+    /* Last block sent */
+#if defined(USE_EPOLL)
+    /* Nothing to do, EPOLLOUT is always watched */
+#elif defined(USE_POLL)
+    s_fd_array[slot->idx].events &= (short)~POLLOUT;
+#else
+    FD_CLR(slot->fd, &s_fdset_write);
+#endif
+  }
+
+#ifdef USE_ZEROCOPY
+  if (slot->zc_queue != NULL)
+    aio_reap_zerocopy(slot);
+#endif
+
+  return (slot->outqueue != NULL && (size_t)bytes == bytes_total);
+}
+
+/*
+ * Remove blocks sent from the output queue of a slot and call their
+ * hook functions. Returns 0 if the slot has been closed meanwhile.
+ */
+
+static int aio_dequeue_sent(AIO_SLOT *slot, size_t bytes)
+{
+  AIO_BLOCK *block;
+  size_t bytes_left;
+
+  bytes_left = bytes;
+  while (slot->outqueue != NULL) {
+    block = slot->outqueue;
+    if (block->data_size - slot->bytes_written > bytes_left) {
+      slot->bytes_written += bytes_left;
+      break;
+    }
+    bytes_left -= block->data_size - slot->bytes_written;
+
+    slot->bytes_queued -= block->data_size;
+    aio_account_dequeued(block);
+
+    /* Block sent, call hook function if set */
+    if (block->func != NULL) {
+      cur_slot = slot;
+      (*block->func)();
+    }
+    slot->outqueue = block->next;
+    slot->bytes_written = 0;
+#ifdef USE_ZEROCOPY
+    if (block->zc_f) {
+      /* Keep the block until the kernel is done with its data */
+      block->next = NULL;
+      if (slot->zc_queue == NULL)
+        slot->zc_queue = block;
+      else
+        slot->zc_queue_last->next = block;
+      slot->zc_queue_last = block;
+    } else
+#endif
+      aio_free_block(block);
+
+    if (slot->close_f)
+      return 0;
+  }
+
+  return 1;
+}
+
+#ifdef USE_ZEROCOPY
+
+/*
+ * Send the first part of the output queue with MSG_ZEROCOPY flag, so
+ * the kernel would not copy the data. Blocks sent this way are kept
+ * in slot->zc_queue until completion is reported by the kernel via
+ * the error queue of the socket, see aio_reap_zerocopy().
+ */
+
+static int aio_send_zerocopy(AIO_SLOT *slot, struct iovec *iov)
+{
+  struct msghdr msg;
+  int optval = 1;
+  int bytes;
+
+  if (!slot->zc_tried_f) {
+    slot->zc_tried_f = 1;
+    if (setsockopt(slot->fd, SOL_SOCKET, SO_ZEROCOPY,
+                   &optval, sizeof(int)) == 0)
+      slot->zc_f = 1;
+  }
+  if (!slot->zc_f)
+    return writev(slot->fd, iov, 1);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+
+  bytes = sendmsg(slot->fd, &msg, MSG_ZEROCOPY);
+  if (bytes > 0) {
+    /* Each successful call is assigned the next sequence number */
+    slot->outqueue->zc_f = 1;
+    slot->outqueue->zc_id = slot->zc_next_id++;
+  } else if (bytes < 0 && errno == ENOBUFS) {
+    /* Out of locked memory, send a copy */
+    bytes = writev(slot->fd, iov, 1);
+  }
+  return bytes;
+}
+
+/*
+ * Read zero-copy completion notifications from the error queue of
+ * a socket, free blocks which are not used by the kernel any more.
+ */
+
+static void aio_reap_zerocopy(AIO_SLOT *slot)
+{
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  char control[128];
+  AIO_BLOCK *block;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(slot->fd, &msg, MSG_ERRQUEUE) < 0)
+      break;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      /* Notifications cover ranges of ids, ee_data is the last one */
+      while ( slot->zc_queue != NULL &&
+              (int)(slot->zc_queue->zc_id - serr->ee_data) <= 0 ) {
+        block = slot->zc_queue;
+        slot->zc_queue = block->next;
+        aio_free_block(block);
+      }
+    }
+  }
+}
+
+#endif /* USE_ZEROCOPY */
+
+#if defined(USE_EPOLL) || defined(USE_POLL)
+
+/*
+ * Check if an error condition reported for a slot is fatal. With
+ * MSG_ZEROCOPY, errors are also reported when there are completion
+ * notifications in the error queue.
+ */
+
+static int aio_fatal_error(AIO_SLOT *slot)
+{
+#ifdef USE_ZEROCOPY
+  int err = 0;
+  socklen_t len = sizeof(int);
+
+  if (slot->zc_f) {
+    aio_reap_zerocopy(slot);
+    if (getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+        err == 0)
+      return 0;
+  }
+#endif
+  return 1;
+}
+
+#endif /* USE_EPOLL || USE_POLL */
+
+#ifdef USE_EPOLL
+
+/*
+ * In edge-triggered mode, EPOLLOUT is not reported again for a socket
+ * that stays writable, so slots with new data in their output queues
+ * are kept in a list and their data is written before waiting for
+ * events.
+ */
+
+static void aio_add_outpending(AIO_SLOT *slot)
+{
+  if (!slot->outpending_f) {
+    slot->outpending_f = 1;
+    slot->out_next = NULL;
+    slot->out_prev = s_last_outpending;
+    if (s_last_outpending == NULL)
+      s_first_outpending = slot;
+    else
+      s_last_outpending->out_next = slot;
+    s_last_outpending = slot;
+  }
+}
+
+static void aio_remove_outpending(AIO_SLOT *slot)
+{
+  if (!slot->outpending_f)
+    return;
+
+  if (slot->out_prev == NULL)
+    s_first_outpending = slot->out_next;
+  else
+    slot->out_prev->out_next = slot->out_next;
+  if (slot->out_next == NULL)
+    s_last_outpending = slot->out_prev;
+  else
+    slot->out_next->out_prev = slot->out_prev;
+
+  slot->outpending_f = 0;
+}
+
+static void aio_flush_outpending(void)
+{
+  AIO_SLOT *slot;
+
+  while (s_first_outpending != NULL && !s_close_f) {
+    slot = s_first_outpending;
+    s_first_outpending = slot->out_next;
+    if (s_first_outpending == NULL)
+      s_last_outpending = NULL;
+    else
+      s_first_outpending->out_prev = NULL;
+    slot->outpending_f = 0;
+
+#ifdef USE_IO_URING
+    if (s_uring_f) {
+      aio_uring_start_io(slot);
+      continue;
+    }
+#endif
+    while (slot->outqueue != NULL && aio_process_output(slot))
+      ;
+  }
+}
+
+#endif /* USE_EPOLL */
+
+#ifdef USE_IO_URING
+
+/*
+ * io_uring engine. Instead of waiting until descriptors are ready,
+ * requests are queued to the kernel: a multishot accept for each
+ * listening slot, a multishot receive into provided buffers for each
+ * socket and a chain of linked sends for the output queue of each
+ * slot. Many requests are submitted and many completions are reaped
+ * with a single system call. Completions are dispatched to the same
+ * callback functions as with epoll. Slots that are not sockets (e.g.
+ * pipes) are polled and read with readv(2), see aio_process_input().
+ *
+ * Requests are queued in aio_flush_outpending(), for slots in the
+ * list of slots with data to write. New slots and slots which need
+ * their read requests re-armed are put to that list as well.
+ */
+
+static int aio_uring_init(void)
+{
+  if (!uring_init(&s_ring, URING_ENTRIES, URING_CQ_ENTRIES))
+    return 0;
+
+  /* Provided buffer rings require Linux 5.19 */
+  if (!uring_setup_buffers(&s_ring, URING_NUM_BUFS, AIO_RECVBUF_SIZE)) {
+    uring_exit(&s_ring);
+    return 0;
+  }
+
+  s_uring_no_multishot = 0;
+  s_uring_zombies = 0;
+  return 1;
+}
+
+static void aio_uring_mainloop(void)
+{
+  AIO_SLOT *slot, *next_slot;
+  int i;
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, sh_interrupt);
+  signal(SIGINT, sh_interrupt);
+
+  if (s_sig_func_set)
+    aio_process_func_list();
+
+  while (!s_close_f) {
+    /* Queue requests for slots with new data to write etc. */
+    while (s_first_outpending != NULL && !s_close_f) {
+      aio_flush_outpending();
+      aio_process_closed();
+    }
+    if (s_close_f)
+      break;
+
+    if (uring_wait(&s_ring, aio_get_timeout())) {
+      aio_uring_reap();
+      aio_run_timers();
+      aio_check_queue_limit();
+      aio_process_closed();
+      if (s_sig_func_set && !s_close_f)
+        aio_process_func_list();
+    } else {
+      aio_run_timers();
+      aio_process_closed();
+      if (s_sig_func_set)
+        aio_process_func_list();
+      else if (s_idle_func != NULL)
+        (*s_idle_func)();       /* Do something in idle periods */
+    }
+  }
+  /* Close all slots, wait until requests in flight are cancelled */
+  slot = s_first_slot;
+  while(slot != NULL) {
+    next_slot = slot->next;
+    aio_destroy_slot(slot, 1);
+    slot = next_slot;
+  }
+  for (i = 0; i < 100 && s_uring_zombies != 0; i++) {
+    if (uring_wait(&s_ring, 10))
+      aio_uring_reap();
+  }
+}
+
+static void aio_uring_reap(void)
+{
+  struct io_uring_cqe *cqe;
+  __u64 user_data;
+  int res;
+  unsigned flags;
+
+  while ((cqe = uring_peek_cqe(&s_ring)) != NULL) {
+    user_data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+    uring_cqe_seen(&s_ring);
+    aio_uring_complete(user_data, res, flags);
+  }
+}
+
+static void aio_uring_complete(__u64 user_data, int res, unsigned flags)
+{
+  AIO_SLOT *slot;
+  int op;
+
+  slot = (AIO_SLOT *)(uintptr_t)(user_data & ~(__u64)URING_OP_MASK);
+  op = (int)(user_data & URING_OP_MASK);
+  if (slot == NULL)
+    return;                     /* Cancel requests */
+
+  /* Multishot requests are finished if there is no IORING_CQE_F_MORE */
+  if (!(flags & IORING_CQE_F_MORE)) {
+    slot->ur_ops--;
+    if (op == URING_OP_SEND)
+      slot->ur_sends--;
+    else
+      slot->ur_armed_f = 0;
+  }
+
+  if (slot->ur_zombie_f || slot->close_f || s_close_f) {
+    if (op == URING_OP_RECV && (flags & IORING_CQE_F_BUFFER))
+      uring_put_buffer(&s_ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    else if (op == URING_OP_ACCEPT && res >= 0)
+      close(res);
+    if (slot->ur_zombie_f && slot->ur_ops == 0) {
+      s_uring_zombies--;
+      aio_free_slot(slot);
+    }
+    return;
+  }
+
+  switch (op) {
+  case URING_OP_RECV:
+    aio_uring_received(slot, res, flags);
+    break;
+  case URING_OP_SEND:
+    if (res >= 0) {
+      aio_dequeue_sent(slot, (size_t)res);
+    } else if (res != -ECANCELED) {
+      slot->close_f = 1;
+      slot->errio_f = 1;
+      slot->errwrite_f = 1;
+      slot->io_errno = -res;
+      s_slots_closed = 1;
+    }
+    /* After a short send, the rest of the chain is cancelled */
+    break;
+  case URING_OP_ACCEPT:
+    aio_uring_accepted(slot, res);
+    break;
+  case URING_OP_POLL:
+    if (res > 0) {
+      while (aio_process_input(slot))
+        ;
+    } else {
+      slot->close_f = 1;
+      slot->errio_f = 1;
+      slot->io_errno = -res;
+      s_slots_closed = 1;
+    }
+    break;
+  }
+
+  /* Re-arm finished read requests, send data queued meanwhile */
+  if ( !slot->close_f &&
+       (!slot->ur_armed_f ||
+        (slot->ur_sends == 0 && slot->outqueue != NULL)) )
+    aio_add_outpending(slot);
+}
+
+/*
+ * Pass data received into a provided buffer to readfunc, like
+ * aio_process_input() does with data from the receive buffer.
+ */
+
+static void aio_uring_received(AIO_SLOT *slot, int res, unsigned flags)
+{
+  unsigned char *data;
+  size_t bytes_left, bytes;
+  int bid;
+
+  if (res > 0) {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    data = uring_get_buffer(&s_ring, bid);
+    bytes_left = (size_t)res;
+    while (!slot->close_f && !s_close_f) {
+      bytes = slot->bytes_to_read - slot->bytes_ready;
+      if (bytes > bytes_left)
+        bytes = bytes_left;
+      memcpy(slot->readbuf + slot->bytes_ready, data, bytes);
+      slot->bytes_ready += bytes;
+      data += bytes;
+      bytes_left -= bytes;
+      if (slot->bytes_ready != slot->bytes_to_read)
+        break;
+      cur_slot = slot;
+      (*slot->readfunc)();
+    }
+    uring_put_buffer(&s_ring, bid);
+  } else if (res == -ENOBUFS) {
+    /* Out of buffers, the request will be re-armed */
+  } else if (res == -EINVAL && !s_uring_no_multishot) {
+    /* Multishot receive requires Linux 6.0 */
+    s_uring_no_multishot = 1;
+  } else {
+    slot->close_f = 1;
+    slot->errio_f = 1;
+    slot->errread_f = 1;
+    slot->io_errno = -res;
+    s_slots_closed = 1;
+  }
+}
+
+static void aio_uring_accepted(AIO_SLOT *slot, int res)
+{
+  struct sockaddr_in client_addr;
+  socklen_t len;
+
+  /* Errors are ignored, as with accept(2) in aio_accept_connection() */
+  if (res < 0)
+    return;
+
+  len = sizeof(client_addr);
+  memset(&client_addr, 0, sizeof(client_addr));
+  getpeername(res, (struct sockaddr *)&client_addr, &len);
+  aio_add_accepted(slot, res, &client_addr);
+}
+
+/*
+ * Prepare a new slot. Requests are not queued until the end of the
+ * cycle, so that a slot could be detached by the accept function
+ * before anything is read from it.
+ */
+
+static void aio_uring_add_slot(AIO_SLOT *slot)
+{
+  int optval;
+  socklen_t len = sizeof(int);
+
+  if (getsockopt(slot->fd, SOL_SOCKET, SO_TYPE, &optval, &len) != 0)
+    slot->ur_poll_f = 1;
+
+  aio_add_outpending(slot);
+}
+
+/*
+ * Queue a read (or accept) request if not queued yet, and sends for
+ * the output queue if there are no sends in flight.
+ */
+
+static void aio_uring_start_io(AIO_SLOT *slot)
+{
+  struct io_uring_sqe *sqe;
+
+  if (slot->close_f)
+    return;
+
+  if (!slot->ur_armed_f) {
+    if (uring_sq_space(&s_ring) == 0)
+      uring_submit(&s_ring);
+    sqe = uring_get_sqe(&s_ring);
+    if (sqe == NULL) {
+      slot->close_f = 1;
+      slot->errio_f = 1;
+      s_slots_closed = 1;
+      return;
+    }
+    sqe->fd = slot->fd;
+    if (slot->listening_f) {
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = (uintptr_t)slot | URING_OP_ACCEPT;
+    } else if (slot->ur_poll_f) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = (uintptr_t)slot | URING_OP_POLL;
+    } else {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BGID;
+      if (!s_uring_no_multishot)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->user_data = (uintptr_t)slot | URING_OP_RECV;
+    }
+    slot->ur_armed_f = 1;
+    slot->ur_ops++;
+  }
+
+  if (slot->ur_sends == 0 && slot->outqueue != NULL)
+    aio_uring_send(slot);
+}
+
+/*
+ * Queue a chain of linked sends, one for each block of the output
+ * queue. Linked requests are executed in order, and MSG_WAITALL makes
+ * each send complete only when all its data has been sent. If a send
+ * is short anyway (e.g. on error), the rest of the chain is cancelled
+ * and queued again after all its completions have arrived.
+ */
+
+static void aio_uring_send(AIO_SLOT *slot)
+{
+  struct io_uring_sqe *sqe;
+  AIO_BLOCK *block;
+  size_t offset;
+  int num_blocks = 0;
+  int i;
+
+  for (block = slot->outqueue; block != NULL; block = block->next) {
+    if (++num_blocks == AIO_IOV_MAXSIZE)
+      break;
+  }
+
+  /* A chain should not be split between submissions */
+  if (uring_sq_space(&s_ring) < (unsigned)num_blocks)
+    uring_submit(&s_ring);
+  if (uring_sq_space(&s_ring) < (unsigned)num_blocks) {
+    slot->close_f = 1;
+    slot->errio_f = 1;
+    s_slots_closed = 1;
+    return;
+  }
+
+  offset = slot->bytes_written;
+  block = slot->outqueue;
+  for (i = 0; i < num_blocks; i++) {
+    sqe = uring_get_sqe(&s_ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = slot->fd;
+    sqe->addr = (uintptr_t)(BLOCK_DATA(block) + offset);
+    sqe->len = block->data_size - offset;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    if (i != num_blocks - 1) {
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->msg_flags |= MSG_MORE;
+    }
+    sqe->user_data = (uintptr_t)slot | URING_OP_SEND;
+    offset = 0;
+    block = block->next;
+  }
+  slot->ur_sends = num_blocks;
+  slot->ur_ops += num_blocks;
+}
+
+/*
+ * Cancel all requests of a destroyed slot. The slot is freed after
+ * the last completion, see aio_uring_complete().
+ */
+
+/* FIXME: Data received by a cancelled request of a detached slot is
+   lost. Currently, slots are detached before any request is queued. */
+
+static void aio_uring_cancel(AIO_SLOT *slot)
+{
+  struct io_uring_sqe *sqe;
+  int ops[2];
+  int i, num_ops = 0;
+
+  if (slot->ur_armed_f) {
+    if (slot->listening_f)
+      ops[num_ops++] = URING_OP_ACCEPT;
+    else if (slot->ur_poll_f)
+      ops[num_ops++] = URING_OP_POLL;
+    else
+      ops[num_ops++] = URING_OP_RECV;
+  }
+  if (slot->ur_sends != 0)
+    ops[num_ops++] = URING_OP_SEND;
+
+  for (i = 0; i < num_ops; i++) {
+    if (uring_sq_space(&s_ring) == 0)
+      uring_submit(&s_ring);
+    sqe = uring_get_sqe(&s_ring);
+    if (sqe == NULL)
+      break;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)slot | ops[i];
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  }
+
+  slot->ur_zombie_f = 1;
+  s_uring_zombies++;
+}
+
+#endif /* USE_IO_URING */
+
+static void aio_process_func_list(void)
+{
+  int i;
+
+  s_sig_func_set = 0;
+  for (i = 0; i < 10; i++) {
+    if (s_sig_func[i] != NULL) {
+      (*s_sig_func[i])();
+      s_sig_func[i] = NULL;
+    }
+  }
+
+  aio_process_closed();
+}
+
+/*
+ * Accept new connection(s) on a listening slot. In edge-triggered
+ * epoll mode, accept all pending connections, otherwise up to
+ * AIO_ACCEPT_BATCH connections.
+ */
+
+static void aio_accept_connection(AIO_SLOT *slot)
+{
+  struct sockaddr_in client_addr;
+  socklen_t len;
+  int fd;
+#ifndef USE_EPOLL
+  int num_accepted = 0;
+#endif
+
+  while (!slot->close_f && !s_close_f) {
+    len = sizeof(client_addr);
+#ifdef SOCK_NONBLOCK
+    fd = accept4(slot->fd, (struct sockaddr *)&client_addr, &len,
+                 SOCK_NONBLOCK);
+#else
+    fd = accept(slot->fd, (struct sockaddr *)&client_addr, &len);
+#endif
+    if (fd < 0) {
+      /* A connection reset while queued should not stop accepting */
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+
+    aio_add_accepted(slot, fd, &client_addr);
+
+#ifndef USE_EPOLL
+    if (++num_accepted >= AIO_ACCEPT_BATCH)
+      break;
+#endif
+  }
+}
+
+/*
+ * Create a slot for a connection accepted on a listening slot, call
+ * the accept function of the listening slot.
+ */
+
+static void aio_add_accepted(AIO_SLOT *slot, int fd,
+                             struct sockaddr_in *addr)
+{
+  AIO_SLOT *new_slot, *saved_slot;
+  char name[INET_ADDRSTRLEN];
+
+  /* inet_ntoa() is not reentrant, event loops may run in parallel */
+  if (inet_ntop(AF_INET, &addr->sin_addr, name, sizeof(name)) == NULL)
+    strcpy(name, "[unknown]");
+
+  new_slot = aio_new_slot(fd, name, slot->bytes_to_read);
+  if (new_slot == NULL) {
+    close(fd);
+    return;
+  }
+
+  saved_slot = cur_slot;
+  cur_slot = new_slot;
+  (*slot->readfunc)();
+  cur_slot = saved_slot;
+}
+
+/*
+ * If output queues in all event loops take more memory than allowed,
+ * close the slot with the largest output queue among the slots of
+ * the type passed to aio_set_queue_limit() in this event loop.
+ */
+
+static void aio_check_queue_limit(void)
+{
+  AIO_SLOT *slot, *worst_slot = NULL;
+
+  if (s_queue_limit == 0 || s_queued_total <= s_queue_limit)
+    return;
+
+  for (slot = s_type_first[s_queue_limit_type]; slot != NULL;
+       slot = slot->type_next) {
+    if ( !slot->close_f && slot->bytes_queued != 0 &&
+         (worst_slot == NULL ||
+          slot->bytes_queued > worst_slot->bytes_queued) )
+      worst_slot = slot;
+  }
+  if (worst_slot != NULL) {
+    worst_slot->errqueue_f = 1;
+    aio_close_other(worst_slot, 0);
   }
 }
 
@@ -658,6 +2188,11 @@ static void aio_process_closed(void)
 {
   AIO_SLOT *slot, *next_slot;
 
+  /* Do not walk the list if no slot has been closed */
+  if (!s_slots_closed)
+    return;
+  s_slots_closed = 0;
+
   slot = s_first_slot;
   while (slot != NULL && !s_close_f) {
     next_slot = slot->next;
@@ -677,8 +2212,7 @@ static void aio_process_closed(void)
 
 static void aio_destroy_slot(AIO_SLOT *slot, int fatal)
 {
-  AIO_BLOCK *block, *next_block;
-#ifdef USE_POLL
+#if defined(USE_POLL) && !defined(USE_EPOLL)
   AIO_SLOT *h_slot;
 #endif
 
@@ -688,6 +2222,9 @@ static void aio_destroy_slot(AIO_SLOT *slot, int fatal)
     (*slot->closefunc)();
   }
 
+  while (slot->timers != NULL)
+    aio_cancel_timer(slot->timers);
+
   if (!fatal) {
     /* Remove from the slot list */
     if (slot->prev == NULL)
@@ -698,9 +2235,15 @@ static void aio_destroy_slot(AIO_SLOT *slot, int fatal)
       s_last_slot = slot->prev;
     else
       slot->next->prev = slot->prev;
+    aio_unlink_type(slot);
 
     /* Remove references to descriptor */
-#ifdef USE_POLL
+#if defined(USE_EPOLL)
+    /* Closing the descriptor removes it from the epoll set */
+    if (slot->detach_f && !URING_ACTIVE)
+      epoll_ctl(s_epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL);
+    aio_remove_outpending(slot);
+#elif defined(USE_POLL)
     if (s_fd_array_size - 1 > slot->idx) {
       memmove(&s_fd_array[slot->idx],
               &s_fd_array[slot->idx + 1],
@@ -721,24 +2264,91 @@ static void aio_destroy_slot(AIO_SLOT *slot, int fatal)
 #endif
   }
 
+#ifdef USE_IO_URING
+  /* The kernel may still use slot memory, free it on completion */
+  if (slot->ur_ops != 0) {
+    aio_uring_cancel(slot);
+    return;
+  }
+#endif
+
+  aio_free_slot(slot);
+}
+
+/*
+ * Free the memory of a destroyed slot, close its descriptor.
+ */
+
+static void aio_free_slot(AIO_SLOT *slot)
+{
+  AIO_BLOCK *block, *next_block;
+
   /* Free all memory in slave structures */
   block = slot->outqueue;
   while (block != NULL) {
     next_block = block->next;
-    free(block);
+    aio_account_dequeued(block);
+    aio_free_block(block);
+    block = next_block;
+  }
+  block = slot->zc_queue;
+  while (block != NULL) {
+    next_block = block->next;
+    aio_free_block(block);
     block = next_block;
   }
   free(slot->name);
   if (slot->alloc_f)
     free(slot->readbuf);
+  if (slot->recvbuf != NULL)
+    free(slot->recvbuf);
 
   /* Close the file and free the slot itself */
-  if (!slot->fd_closed_f)
+  if (!slot->fd_closed_f && !slot->detach_f)
     close(slot->fd);
 
   free(slot);
 }
 
+/*
+ * Maintain the lists of slots of each type, see aio_set_slot_type().
+ */
+
+static void aio_link_type(AIO_SLOT *slot)
+{
+  int type = slot->type;
+
+  if (type < 0 || type >= AIO_MAX_SLOT_TYPES)
+    return;
+
+  slot->type_next = NULL;
+  slot->type_prev = s_type_last[type];
+  if (s_type_last[type] == NULL)
+    s_type_first[type] = slot;
+  else
+    s_type_last[type]->type_next = slot;
+  s_type_last[type] = slot;
+}
+
+static void aio_unlink_type(AIO_SLOT *slot)
+{
+  int type = slot->type;
+
+  if (type < 0 || type >= AIO_MAX_SLOT_TYPES)
+    return;
+
+  if (slot->type_prev == NULL)
+    s_type_first[type] = slot->type_next;
+  else
+    slot->type_prev->type_next = slot->type_next;
+  if (slot->type_next == NULL)
+    s_type_last[type] = slot->type_prev;
+  else
+    slot->type_next->type_prev = slot->type_prev;
+  slot->type_next = NULL;
+  slot->type_prev = NULL;
+}
+
 /*
  * Signal handler catching SIGTERM and SIGINT signals
  */
@@ -21,23 +21,67 @@
  * Data types
  */
 
+/* Storage class for the data private to each event loop. Several
+   event loops may run in separate threads, see workers.c. */
+#define AIO_THREAD_LOCAL  __thread
+
+/* Slot types should be less than this value to be kept in lists */
+#define AIO_MAX_SLOT_TYPES  8
+
 /* Just a pointer to function returning void */
 typedef void (*AIO_FUNCPTR)();
 
+/* Reference-counted data which may be queued for sending to many
+   slots at once, see aio_write_shared(). Should not be modified after
+   it has been queued. */
+typedef struct _AIO_SHARED {
+  int refcount;                 /* Number of references, changed atomically */
+  int queued_count;             /* Number of queued blocks, changed same way */
+  size_t data_size;             /* Data size in this block                 */
+  unsigned char data[1];        /* Beginning of the data buffer            */
+} AIO_SHARED;
+
 /* This structure is used as a part of output queue */
 typedef struct _AIO_BLOCK {
   struct _AIO_BLOCK *next;      /* Next block or NULL for the last block   */
   AIO_FUNCPTR func;             /* A function to call after sending block  */
+  AIO_SHARED *shared;           /* Data to send instead of data[], or NULL */
+  size_t shared_offset;         /* Offset of the data in shared->data[]    */
   size_t data_size;             /* Data size in this block                 */
+  int zc_f;                     /* 1 if sent with MSG_ZEROCOPY             */
+  unsigned int zc_id;           /* Zero-copy sequence number, if zc_f      */
+  int pool;                     /* Size class, see aio_new_block(), or -1  */
   unsigned char data[1];        /* Beginning of the data buffer            */
 } AIO_BLOCK;
 
+/* Output block allocation counters, see aio_get_block_stats() */
+typedef struct _AIO_BLOCK_STATS {
+  long allocs;                  /* Blocks allocated by aio_new_block()     */
+  long allocs_malloc;           /*   of them, allocated with malloc()      */
+  long frees;                   /* Blocks released by aio_release_block()  */
+  long frees_free;              /*   of them, released with free()         */
+} AIO_BLOCK_STATS;
+
+/* Timer, see aio_set_timer(). Usually a part of a larger structure,
+   should be zeroed before first use. */
+typedef struct _AIO_TIMER {
+  struct _AIO_TIMER *next;      /* To make a list of timers expiring at    */
+  struct _AIO_TIMER *prev;      /*   the same tick of the timer wheel      */
+  struct _AIO_TIMER *slot_next; /* To make a list of timers of the slot    */
+  struct _AIO_TIMER *slot_prev;
+  struct _AIO_SLOT *slot;       /* Slot to make current, or NULL           */
+  AIO_FUNCPTR func;             /* Function to call on expiration          */
+  unsigned long expires;        /* Expiration time, see aio_get_time()     */
+  int armed_f;                  /* 1 if the timer is set                   */
+} AIO_TIMER;
+
 /* This structure holds the data associated with a file/socket */
 typedef struct _AIO_SLOT {
   int type;                     /* To be used by the application to mark   */
                                 /*   certain type of file/socket           */
   int fd;                       /* File/socket descriptor                  */
   int idx;                      /* Index in the array of pollfd structures */
+                                /*   (not used with epoll)                 */
   char *name;                   /* Allocated string containing slot name   */
                                 /*   (currently, IP address for sockets)   */
 
@@ -52,12 +96,23 @@ typedef struct _AIO_SLOT {
                                 /*   this is a lostening slot              */
   size_t bytes_ready;           /* Bytes ready in the input buffer         */
   unsigned char buf256[256];    /* Built-in input buffer                   */
+  unsigned char *recvbuf;       /* Receive buffer, data read in advance,   */
+                                /*   allocated on first read               */
+  size_t recv_pos;              /* Offset of the first unprocessed byte    */
+  size_t recv_end;              /* Offset after the last byte received     */
 
   AIO_BLOCK *outqueue;          /* First block of the output queue or NULL */
   AIO_BLOCK *outqueue_last;     /* Last block of the output queue or NULL  */
   size_t bytes_written;         /* Number of bytes written from that block */
+  size_t bytes_queued;          /* Total size of data in the output queue  */
+  size_t bytes_queued_max;      /* Maximum value of bytes_queued so far    */
+  AIO_BLOCK *zc_queue;          /* Blocks sent with MSG_ZEROCOPY, waiting  */
+  AIO_BLOCK *zc_queue_last;     /*   for completion notifications          */
+  unsigned int zc_next_id;      /* Next zero-copy sequence number          */
 
   AIO_FUNCPTR closefunc;        /* To be called before close, may be NULL  */
+  AIO_TIMER *timers;            /* Timers set for this slot, cancelled     */
+                                /*   automatically when it's destroyed     */
 
   unsigned listening_f :1;      /* 1 if this slot is listening one         */
   unsigned alloc_f     :1;      /* 1 if buffer has to be freed with free() */
@@ -66,11 +121,30 @@ typedef struct _AIO_SLOT {
   unsigned errio_f     :1;      /* 1 if there was an I/O problem           */
   unsigned errread_f   :1;      /* 1 if there was a problem reading data   */
   unsigned errwrite_f  :1;      /* 1 if there was a problem writing data   */
+  unsigned errqueue_f  :1;      /* 1 if closed because too much data was   */
+                                /*   queued, see aio_set_queue_limit()     */
+  unsigned zc_tried_f  :1;      /* 1 if SO_ZEROCOPY has been tried         */
+  unsigned zc_f        :1;      /* 1 if SO_ZEROCOPY is enabled             */
+  unsigned outpending_f:1;      /* 1 if the slot is in the list of slots   */
+                                /*   with new data to write (epoll only)   */
+  unsigned detach_f    :1;      /* 1 if fd should be left open on destroy  */
+  unsigned ur_armed_f  :1;      /* 1 if a read request is queued to        */
+                                /*   io_uring (io_uring only)              */
+  unsigned ur_poll_f   :1;      /* 1 if not a socket, poll and read(2) it  */
+  unsigned ur_zombie_f :1;      /* 1 if destroyed, but requests are still  */
+                                /*   in flight (io_uring only)             */
 
   int io_errno;                 /* Error code if errread_f or errwrite_f   */
 
+  int ur_ops;                   /* Number of io_uring requests in flight   */
+  int ur_sends;                 /* Number of send requests in flight       */
+
   struct _AIO_SLOT *next;       /* To make a list of AIO_SLOT structures   */
   struct _AIO_SLOT *prev;       /* To make a list of AIO_SLOT structures   */
+  struct _AIO_SLOT *type_next;  /* To make a list of slots of the same     */
+  struct _AIO_SLOT *type_prev;  /*   type, see aio_set_slot_type()         */
+  struct _AIO_SLOT *out_next;   /* To make a list of slots with new data   */
+  struct _AIO_SLOT *out_prev;   /*   to write, see aio_add_outpending()    */
 
 } AIO_SLOT;
 
@@ -78,25 +152,45 @@ typedef struct _AIO_SLOT {
  * Global variables
  */
 
-extern AIO_SLOT *cur_slot;
+extern AIO_THREAD_LOCAL AIO_SLOT *cur_slot;
 
 /*
  * Public functions
  */
 
-void aio_init(void);
+int aio_init(void);
 int aio_set_bind_address(char *bind_ip);
 int aio_add_slot(int fd, char *name, AIO_FUNCPTR initfunc, size_t slot_size);
 int aio_listen(int port, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
                size_t slot_size);
+int aio_listen_socket(int port, int reuseport_f);
+int aio_add_listening(int fd, AIO_FUNCPTR initfunc, AIO_FUNCPTR acceptfunc,
+                      size_t slot_size);
+void aio_set_slot_type(AIO_SLOT *slot, int type);
 int aio_walk_slots(AIO_FUNCPTR fn, int type);
 void aio_call_func(AIO_FUNCPTR fn, int fn_type);
 void aio_close(int fatal_f);
 void aio_close_other(AIO_SLOT *slot, int fatal_f);
+int aio_detach(void);
 void aio_mainloop(void);
 void aio_setread(AIO_FUNCPTR fn, void *inbuf, int bytes_to_read);
 void aio_write(AIO_FUNCPTR fn, void *outbuf, int bytes_to_write);
 void aio_write_nocopy(AIO_FUNCPTR fn, AIO_BLOCK *block);
+void aio_write_shared(AIO_FUNCPTR fn, AIO_SHARED *shared);
+void aio_write_shared_part(AIO_FUNCPTR fn, AIO_SHARED *shared,
+                           size_t offset, size_t data_size);
+AIO_BLOCK *aio_new_block(size_t data_size);
+void aio_release_block(AIO_BLOCK *block);
+void aio_free_block_pools(void);
+void aio_get_block_stats(AIO_BLOCK_STATS *stats);
+AIO_SHARED *aio_shared_new(size_t data_size);
+void aio_shared_ref(AIO_SHARED *shared);
+void aio_shared_unref(AIO_SHARED *shared);
 void aio_setclose(AIO_FUNCPTR closefunc);
+unsigned long aio_get_time(void);
+void aio_set_timer(AIO_TIMER *timer, AIO_FUNCPTR fn, unsigned int msec);
+void aio_cancel_timer(AIO_TIMER *timer);
+void aio_set_queue_limit(size_t max_bytes, int type);
+size_t aio_get_queued_total(void);
 
 #endif /* _REFLIB_ASYNC_IO_H */
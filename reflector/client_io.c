@@ -28,9 +28,15 @@
 #include "translate.h"
 #include "client_io.h"
 #include "encode.h"
+#include "workers.h"
+#include "adapt.h"
 
 static unsigned char *s_password;
 static unsigned char *s_password_ro;
+static size_t s_queue_high_water;
+
+/* LastRect marker, the same for all clients served by this thread */
+static AIO_THREAD_LOCAL AIO_SHARED *s_lastrect_msg = NULL;
 
 /*
  * Prototypes for static functions
@@ -49,16 +55,23 @@ static void rf_client_encodings_hdr(void);
 static void rf_client_encodings_data(void);
 static void rf_client_updatereq(void);
 static void wf_client_update_finished(void);
+static void wf_client_queue_drained(void);
 static void rf_client_keyevent(void);
 static void rf_client_ptrevent(void);
 static void rf_client_cuttext_hdr(void);
 static void rf_client_cuttext_data(void);
+static void rf_client_fence_hdr(void);
+static void rf_client_fence_data(void);
 
 static void set_trans_func(CL_SLOT *cl);
+static int add_copy_rect(CL_SLOT *cl, FB_RECT *rect, RegionPtr add_region);
+static void drop_copy_entries(CL_SLOT *cl);
 static void send_newfbsize(void);
 static void send_cursorshape(void);
 static void send_pointerpos(void);
 static void send_update(void);
+static int check_queue_full(void);
+static void process_fence(CARD32 flags, CARD8 *data, int len);
 
 /*
  * Implementation
@@ -70,6 +83,16 @@ void set_client_passwords(unsigned char *password, unsigned char *password_ro)
   s_password_ro = password_ro;
 }
 
+/*
+ * Stop encoding data for clients with more than high_water bytes in
+ * their output queues, see check_queue_full(). Zero means no limit.
+ */
+
+void set_client_queue_limit(size_t high_water)
+{
+  s_queue_high_water = high_water;
+}
+
 void af_client_accept(void)
 {
   CL_SLOT *cl = (CL_SLOT *)cur_slot;
@@ -77,13 +100,19 @@ void af_client_accept(void)
 
   /* FIXME: Function naming is bad (client_accept_hook?). */
 
-  cur_slot->type = TYPE_CL_SLOT;
+  /* With worker threads, the connection is served by one of them */
+  if (workers_add_client())
+    return;
+
+  aio_set_slot_type(cur_slot, TYPE_CL_SLOT);
   cl->connected = 0;
   cl->trans_table = NULL;
+  adapt_init_client(cl);
   aio_setclose(cf_client);
 
   for (i = 0; i < 4; i++)
     cl->zs_active[i] = 0;
+  cl->zs_zrle_active = 0;
 
   log_write(LL_MSG, "Accepted connection from %s", cur_slot->name);
 
@@ -110,14 +139,24 @@ static void cf_client(void)
     } else {
       log_write(LL_WARN, "Error sending to %s", cur_slot->name);
     }
+  } else if (cur_slot->errqueue_f) {
+    log_write(LL_WARN, "Too much data queued for client %s (%lu bytes)",
+              cur_slot->name, (unsigned long)cur_slot->bytes_queued);
   } else if (cur_slot->errio_f) {
     log_write(LL_WARN, "I/O error, client %s", cur_slot->name);
   }
   log_write(LL_MSG, "Closing client connection %s", cur_slot->name);
+  log_write(LL_DETAIL, "Output queue for %s was up to %lu bytes",
+            cur_slot->name, (unsigned long)cur_slot->bytes_queued_max);
 
   /* Free region structures. */
   REGION_UNINIT(&cl->pending_region);
-  REGION_UNINIT(&cl->copy_region);
+  for (i = 0; i < MAX_COPY_ENTRIES; i++)
+    REGION_UNINIT(&cl->copies[i].region);
+
+  /* Release cache of encoded tiles. */
+  release_tile_cache(cl->tile_cache);
+  cl->tile_cache = NULL;
 
   /* Free zlib streams.
      FIXME: Maybe put cleanup function in encoder. */
@@ -125,10 +164,15 @@ static void cf_client(void)
     if (cl->zs_active[i])
       deflateEnd(&cl->zs_struct[i]);
   }
+  if (cl->zs_zrle_active)
+    deflateEnd(&cl->zs_zrle);
 
   /* Free dynamically allocated memory. */
   if (cl->trans_table != NULL)
     free(cl->trans_table);
+  aio_shared_unref(cl->pending_cuttext);
+
+  workers_client_closed();
 }
 
 static void rf_client_ver(void)
@@ -207,6 +251,7 @@ static void rf_client_initmsg(void)
 {
   CL_SLOT *cl = (CL_SLOT *)cur_slot;
   unsigned char msg_server_init[24];
+  int i;
 
   if (cur_slot->readbuf[0] == 0) {
     log_write(LL_WARN, "Non-shared session requested by %s", cur_slot->name);
@@ -214,6 +259,7 @@ static void rf_client_initmsg(void)
   }
 
   /* Save initial desktop geometry for this client */
+  fb_lock_read();
   cl->fb_width = g_screen_info.width;
   cl->fb_height = g_screen_info.height;
   cl->enable_newfbsize = 0;
@@ -225,12 +271,13 @@ static void rf_client_initmsg(void)
   buf_put_CARD32(msg_server_init + 20, g_screen_info.name_length);
   aio_write(NULL, msg_server_init, 24);
   aio_write(NULL, g_screen_info.name, g_screen_info.name_length);
+  fb_unlock_read();
   aio_setread(rf_client_msg, NULL, 1);
 
   /* Set up initial pixel format and encoders' parameters */
   memcpy(&cl->format, &g_screen_info.pixformat, sizeof(RFB_PIXEL_FORMAT));
   cl->trans_func = transfunc_null;
-  cl->bgr233_f = 0;
+  cl->tile_cache = get_tile_cache(&cl->format);
   cl->compress_level = 6;       /* default compression level */
   cl->jpeg_quality = -1;        /* disable JPEG by default */
 
@@ -238,7 +285,9 @@ static void rf_client_initmsg(void)
   cl->update_requested = 0;
   cl->update_in_progress = 0;
   REGION_INIT(&cl->pending_region, NullBox, 16);
-  REGION_INIT(&cl->copy_region, NullBox, 8);
+  for (i = 0; i < MAX_COPY_ENTRIES; i++)
+    REGION_INIT(&cl->copies[i].region, NullBox, 8);
+  cl->num_copies = 0;
   cl->newfbsize_pending = 0;
 
   /* We are connected. */
@@ -272,6 +321,9 @@ static void rf_client_msg(void)
   case 6:                       /* ClientCutText */
     aio_setread(rf_client_cuttext_hdr, NULL, 7);
     break;
+  case 248:                     /* Fence */
+    aio_setread(rf_client_fence_hdr, NULL, 8);
+    break;
   default:
     log_write(LL_ERROR, "Unknown client message type %d from %s",
               msg_id, cur_slot->name);
@@ -332,6 +384,7 @@ static void rf_client_encodings_data(void)
   cl->jpeg_quality = -1;
   cl->enable_lastrect = 0;
   cl->enable_newfbsize = 0;
+  cl->enable_fence = 0;
   for (i = 1; i < NUM_ENCODINGS; i++)
     cl->enc_enable[i] = 0;
 
@@ -341,7 +394,8 @@ static void rf_client_encodings_data(void)
     if (!preferred_enc_set) {
       if ( enc == RFB_ENCODING_RAW ||
            enc == RFB_ENCODING_HEXTILE ||
-           enc == RFB_ENCODING_TIGHT ) {
+           enc == RFB_ENCODING_TIGHT ||
+           enc == RFB_ENCODING_ZRLE ) {
         cl->enc_prefer = enc;
         preferred_enc_set = 1;
       }
@@ -386,17 +440,19 @@ static void rf_client_encodings_data(void)
 	cl->pointerpos_pending = 1;
       log_write(LL_DETAIL, "Client %s supports Pointer Position updates.",
 		cur_slot->name);
+    } else if (enc == RFB_ENCODING_FENCE) {
+      adapt_enable_fence(cl);
+      log_write(LL_DETAIL, "Client %s supports Fence messages",
+                cur_slot->name);
     }
   }
   if (cl->compress_level < 0)
     cl->compress_level = 6;     /* default compression level */
+  adapt_set_bounds(cl);
 
   /* CopyRect was pending but the client does not want it any more. */
-  if (!cl->enc_enable[RFB_ENCODING_COPYRECT] &&
-      REGION_NOTEMPTY(&cl->copy_region)) {
-    REGION_UNION(&cl->pending_region, &cl->pending_region, &cl->copy_region);
-    REGION_EMPTY(&cl->copy_region);
-  }
+  if (!cl->enc_enable[RFB_ENCODING_COPYRECT])
+    drop_copy_entries(cl);
 
   log_write(LL_DEBUG, "Encoding list set by %s", cur_slot->name);
   if (cl->enc_prefer == RFB_ENCODING_RAW) {
@@ -408,6 +464,9 @@ static void rf_client_encodings_data(void)
   } else if (cl->enc_prefer == RFB_ENCODING_HEXTILE) {
     log_write(LL_DETAIL, "Using Hextile encoding for client %s",
               cur_slot->name);
+  } else if (cl->enc_prefer == RFB_ENCODING_ZRLE) {
+    log_write(LL_DETAIL, "Using ZRLE encoding for client %s",
+              cur_slot->name);
   }
   aio_setread(rf_client_msg, NULL, 1);
 }
@@ -442,9 +501,8 @@ static void rf_client_updatereq(void)
     if (!cl->newfbsize_pending) {
       REGION_INIT(&tmp_region, &rect, 1);
       REGION_UNION(&cl->pending_region, &cl->pending_region, &tmp_region);
-      REGION_UNION(&cl->pending_region, &cl->pending_region, &cl->copy_region);
-      REGION_EMPTY(&cl->copy_region);
       REGION_UNINIT(&tmp_region);
+      drop_copy_entries(cl);
     }
   } else {
     log_write(LL_DEBUG, "Received framebuffer update request from %s",
@@ -455,7 +513,7 @@ static void rf_client_updatereq(void)
       (cl->newfbsize_pending ||
        cl->pointerpos_pending ||
        REGION_NOTEMPTY(&cl->pending_region) ||
-       REGION_NOTEMPTY(&cl->copy_region))) {
+       cl->num_copies != 0)) {
     send_update();
   }
 
@@ -469,12 +527,42 @@ static void wf_client_update_finished(void)
   log_write(LL_DEBUG, "Finished sending framebuffer update to %s",
             cur_slot->name);
 
+  adapt_update_sent(cl);
+
   cl->update_in_progress = 0;
   if (cl->update_requested &&
       (cl->newfbsize_pending ||
        cl->pointerpos_pending ||
        REGION_NOTEMPTY(&cl->pending_region) ||
-       REGION_NOTEMPTY(&cl->copy_region))) {
+       cl->num_copies != 0)) {
+    send_update();
+  }
+}
+
+/*
+ * Called when all the data queued before the client has been found
+ * slow is sent, see check_queue_full().
+ */
+
+static void wf_client_queue_drained(void)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+  AIO_SHARED *msg;
+
+  log_write(LL_DEBUG, "Output queue drained for %s", cur_slot->name);
+
+  cl->queue_full = 0;
+  if (cl->pending_cuttext != NULL) {
+    msg = cl->pending_cuttext;
+    cl->pending_cuttext = NULL;
+    aio_write_shared(NULL, msg);
+    aio_shared_unref(msg);
+  }
+  if (!cl->update_in_progress && cl->update_requested &&
+      (cl->newfbsize_pending ||
+       cl->pointerpos_pending ||
+       REGION_NOTEMPTY(&cl->pending_region) ||
+       cl->num_copies != 0)) {
     send_update();
   }
 }
@@ -540,6 +628,36 @@ static void rf_client_cuttext_data(void)
   aio_setread(rf_client_msg, NULL, 1);
 }
 
+static void rf_client_fence_hdr(void)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+  int len;
+
+  cl->fence_flags = buf_get_CARD32(&cur_slot->readbuf[3]);
+  len = (int)cur_slot->readbuf[7];
+  if (len > RFB_FENCE_MAX_PAYLOAD) {
+    log_write(LL_ERROR, "Fence message too long from %s", cur_slot->name);
+    aio_close(0);
+    return;
+  }
+
+  if (len == 0) {
+    process_fence(cl->fence_flags, NULL, 0);
+    aio_setread(rf_client_msg, NULL, 1);
+  } else {
+    cl->temp_count = (CARD16)len;
+    aio_setread(rf_client_fence_data, NULL, len);
+  }
+}
+
+static void rf_client_fence_data(void)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+
+  process_fence(cl->fence_flags, cur_slot->readbuf, (int)cl->temp_count);
+  aio_setread(rf_client_msg, NULL, 1);
+}
+
 /*
  * Functions called from host_io.c
  */
@@ -550,7 +668,6 @@ void fn_client_add_rect(AIO_SLOT *slot, FB_RECT *rect)
   RegionRec add_region;
   BoxRec add_rect;
   int stored;
-  int dx, dy;
 
   if (!cl->connected || cl->newfbsize_pending)
     return;
@@ -562,8 +679,8 @@ void fn_client_add_rect(AIO_SLOT *slot, FB_RECT *rect)
   if (g_screen_info.width != cl->fb_width ||
       g_screen_info.height != cl->fb_height) {
     cl->newfbsize_pending = 1;
+    drop_copy_entries(cl);
     REGION_EMPTY(&cl->pending_region);
-    REGION_EMPTY(&cl->copy_region);
     return;
   }
 
@@ -573,31 +690,83 @@ void fn_client_add_rect(AIO_SLOT *slot, FB_RECT *rect)
   add_rect.y2 = add_rect.y1 + rect->h;
   REGION_INIT(&add_region, &add_rect, 4);
 
-  /* FIXME: Currently, CopyRect is stored in copy_region only if there
-     were no other non-CopyRect updates pending for this client.
-     Normally, that's ok, because VNC servers send CopyRect rectangles
-     before non-CopyRect ones, but of course more elegant and
-     efficient handling could be possible to implement here. */
   stored = 0;
   if (rect->enc == RFB_ENCODING_COPYRECT &&
-      cl->enc_enable[RFB_ENCODING_COPYRECT] &&
-      !REGION_NOTEMPTY(&cl->pending_region)) {
-    dx = rect->x - rect->src_x;
-    dy = rect->y - rect->src_y;
-    if (!REGION_NOTEMPTY(&cl->copy_region) ||
-        (dx == cl->copy_dx && dy == cl->copy_dy)) {
-      REGION_UNION(&cl->copy_region, &cl->copy_region, &add_region);
-      cl->copy_dx = dx;
-      cl->copy_dy = dy;
-      stored = 1;
-    }
-  }
+      cl->enc_enable[RFB_ENCODING_COPYRECT])
+    stored = add_copy_rect(cl, rect, &add_region);
   if (!stored)
     REGION_UNION(&cl->pending_region, &cl->pending_region, &add_region);
 
   REGION_UNINIT(&add_region);
 }
 
+/*
+ * Store a CopyRect in copy entries. That is possible only if the
+ * client has valid pixels in its source area, i.e. if the source does
+ * not touch pending updates or destinations of previous CopyRects.
+ * Entries are sent first, in the order they were stored, except for
+ * areas covered by pending_region, which are then sent as normal
+ * rectangles. Returns 0 if the CopyRect should be sent as pixels.
+ */
+
+static int add_copy_rect(CL_SLOT *cl, FB_RECT *rect, RegionPtr add_region)
+{
+  COPY_ENTRY *entry;
+  BoxRec src_rect;
+  int dx, dy, i;
+
+  src_rect.x1 = rect->src_x;
+  src_rect.y1 = rect->src_y;
+  src_rect.x2 = src_rect.x1 + rect->w;
+  src_rect.y2 = src_rect.y1 + rect->h;
+  if (RECT_IN_REGION(&cl->pending_region, &src_rect) != rgnOUT)
+    return 0;
+  for (i = 0; i < cl->num_copies; i++) {
+    if (RECT_IN_REGION(&cl->copies[i].region, &src_rect) != rgnOUT)
+      return 0;
+  }
+
+  /* Extend the last entry if the offset is the same */
+  dx = rect->x - rect->src_x;
+  dy = rect->y - rect->src_y;
+  if ( cl->num_copies != 0 &&
+       cl->copies[cl->num_copies - 1].dx == dx &&
+       cl->copies[cl->num_copies - 1].dy == dy ) {
+    entry = &cl->copies[cl->num_copies - 1];
+  } else if (cl->num_copies < MAX_COPY_ENTRIES) {
+    entry = &cl->copies[cl->num_copies++];
+    entry->dx = dx;
+    entry->dy = dy;
+  } else {
+    return 0;
+  }
+
+  /* Earlier copies to the same area would be overwritten anyway */
+  for (i = 0; i < cl->num_copies; i++) {
+    if (&cl->copies[i] != entry)
+      REGION_SUBTRACT(&cl->copies[i].region, &cl->copies[i].region,
+                      add_region);
+  }
+  REGION_UNION(&entry->region, &entry->region, add_region);
+  return 1;
+}
+
+/*
+ * Send areas of all copy entries as normal rectangles.
+ */
+
+static void drop_copy_entries(CL_SLOT *cl)
+{
+  int i;
+
+  for (i = 0; i < cl->num_copies; i++) {
+    REGION_UNION(&cl->pending_region, &cl->pending_region,
+                 &cl->copies[i].region);
+    REGION_EMPTY(&cl->copies[i].region);
+  }
+  cl->num_copies = 0;
+}
+
 void fn_client_send_rects(AIO_SLOT *slot)
 {
   CL_SLOT *cl = (CL_SLOT *)slot;
@@ -607,29 +776,52 @@ void fn_client_send_rects(AIO_SLOT *slot)
       (cl->newfbsize_pending ||
        cl->pointerpos_pending ||
        REGION_NOTEMPTY(&cl->pending_region) ||
-       REGION_NOTEMPTY(&cl->copy_region))) {
+       cl->num_copies != 0)) {
     cur_slot = slot;
     send_update();
     cur_slot = saved_slot;
   }
 }
 
-void fn_client_send_cuttext(AIO_SLOT *slot, CARD8 *text, size_t len)
+/*
+ * Prepare ServerCutText message to be passed to fn_client_send_cuttext()
+ * for each client. The same data is queued for all clients, so the
+ * caller should release it with aio_shared_unref() afterwards.
+ */
+
+AIO_SHARED *client_cuttext_msg(CARD8 *text, size_t len)
+{
+  AIO_SHARED *msg;
+
+  msg = aio_shared_new(8 + len);
+  if (msg != NULL) {
+    msg->data[0] = 3;
+    msg->data[1] = msg->data[2] = msg->data[3] = 0;
+    buf_put_CARD32(&msg->data[4], (CARD32)len);
+    if (len)
+      memcpy(&msg->data[8], text, len);
+  }
+  return msg;
+}
+
+void fn_client_send_cuttext(AIO_SLOT *slot, AIO_SHARED *msg)
 {
   CL_SLOT *cl = (CL_SLOT *)slot;
   AIO_SLOT *saved_slot = cur_slot;
-  CARD8 svr_cuttext_hdr[8] = {
-    3, 0, 0, 0, 0, 0, 0, 0
-  };
 
   if (cl->connected) {
     cur_slot = slot;
 
-    log_write(LL_DEBUG, "Sending ServerCutText message to %s", cur_slot->name);
-    buf_put_CARD32(&svr_cuttext_hdr[4], (CARD32)len);
-    aio_write(NULL, svr_cuttext_hdr, 8);
-    if (len)
-      aio_write(NULL, text, len);
+    if (check_queue_full()) {
+      /* Only the latest text will be sent */
+      aio_shared_ref(msg);
+      aio_shared_unref(cl->pending_cuttext);
+      cl->pending_cuttext = msg;
+    } else {
+      log_write(LL_DEBUG, "Sending ServerCutText message to %s",
+                cur_slot->name);
+      aio_write_shared(NULL, msg);
+    }
 
     cur_slot = saved_slot;
   }
@@ -647,6 +839,16 @@ void fn_client_send_pointerpos(AIO_SLOT *slot)
   cl->pointerpos_pending = 1;
 }
 
+void fn_client_report_queue(AIO_SLOT *slot)
+{
+  CL_SLOT *cl = (CL_SLOT *)slot;
+
+  log_write(LL_MSG, "Output queue for %s: %lu bytes (up to %lu)%s",
+            slot->name, (unsigned long)slot->bytes_queued,
+            (unsigned long)slot->bytes_queued_max,
+            cl->queue_full ? ", waiting for the client" : "");
+}
+
 /*
  * Non-callback functions
  */
@@ -659,7 +861,8 @@ static void set_trans_func(CL_SLOT *cl)
     cl->trans_func = transfunc_null;
   }
 
-  cl->bgr233_f = 0;
+  release_tile_cache(cl->tile_cache);
+  cl->tile_cache = get_tile_cache(&cl->format);
 
   if ( cl->format.bits_pixel != g_screen_info.pixformat.bits_pixel ||
        cl->format.color_depth != g_screen_info.pixformat.color_depth ||
@@ -677,12 +880,6 @@ static void set_trans_func(CL_SLOT *cl)
     switch(cl->format.bits_pixel) {
     case 8:
       cl->trans_func = transfunc8;
-      if ( cl->format.r_max == 7 && cl->format.g_max == 7 &&
-           cl->format.b_max == 3 && cl->format.r_shift == 0 &&
-           cl->format.g_shift == 3 && cl->format.b_shift == 6 &&
-           cl->format.true_color != 0 ) {
-        cl->bgr233_f = 1;
-      }
       break;
     case 16:
       cl->trans_func = transfunc16;
@@ -730,36 +927,25 @@ static void send_newfbsize(void)
 void send_cursorshape(void)
 {
   CL_SLOT *cl = (CL_SLOT *)cur_slot;
-  CARD8 rect_hdr_col[12 + sz_rfbXCursorColors];
-  CARD8 *bmps;
-  CARD32 hdr_size = 12, size;
-  FB_RECT *rect;
+  AIO_SHARED *msg;
 
   cl->newcursor_pending = 0;
   if (!cl->connected) {
     return;
   }
 
-  /* assemble header and cursor data */
-  rect = crsr_get_rect();
-  bmps = crsr_get_bmps();
-  put_rect_header(rect_hdr_col, rect);
+  /* rect header and cursor data, shared by all clients */
+  msg = crsr_get_shape_msg();
+  if (msg == NULL)
+    return;
+
   if (crsr_get_type() == RFB_ENCODING_RICHCURSOR) {
     log_write(LL_DEBUG, "Sending RichCursor update to %s", cur_slot->name);
-    size = rect->w * rect->h * (g_screen_info.pixformat.bits_pixel / 8);
-    size += ((rect->w + 7) / 8) * rect->h;
-  } else if (crsr_get_type() == RFB_ENCODING_XCURSOR) {
-    log_write(LL_DEBUG, "Sending XCursor update to %s", cur_slot->name);
-    size = ((rect->w + 7) / 8) * rect->h * 2;
-    hdr_size += sz_rfbXCursorColors;
-    memcpy(rect_hdr_col + 12, crsr_get_col(), sz_rfbXCursorColors);
   } else {
-    return;
+    log_write(LL_DEBUG, "Sending XCursor update to %s", cur_slot->name);
   }
-
-  /* write rect header and cursor data */
-  aio_write(NULL, rect_hdr_col, hdr_size);
-  aio_write(NULL, bmps, size);
+  aio_write_shared(NULL, msg);
+  aio_shared_unref(msg);
 }
 
 void send_pointerpos(void)
@@ -784,17 +970,26 @@ static void send_update(void)
 {
   CL_SLOT *cl = (CL_SLOT *)cur_slot;
   BoxRec fb_rect;
-  RegionRec fb_region, clip_region, outer_region;
+  RegionRec fb_region, clip_region, src_clip_region, outer_region;
+  COPY_ENTRY *entry;
   CARD8 msg_hdr[4] = {
     0, 0, 0, 1
   };
-  CARD8 rect_hdr[12];
   FB_RECT rect;
   AIO_BLOCK *block;
   AIO_FUNCPTR fn = NULL;
-  int num_copy_rects, num_penging_rects, num_all_rects;
+  int num_copy_rects, num_prev_rects = 0, num_penging_rects, num_all_rects;
   int raw_bytes = 0, hextile_bytes = 0;
-  int i, idx, rev_order;
+  int i, j, idx;
+  size_t bytes_queued;
+
+  /* Changes accumulate in pending_region until the client catches up */
+  if (check_queue_full())
+    return;
+  bytes_queued = cur_slot->bytes_queued;
+
+  /* The framebuffer may be shared with other threads, see workers.c */
+  fb_lock_read();
 
   /* Process framebuffer size change. */
   if (cl->newfbsize_pending) {
@@ -810,34 +1005,50 @@ static void send_update(void)
     fb_rect.x2 = cl->fb_width;
     fb_rect.y2 = cl->fb_height;
     REGION_INIT(&fb_region, &fb_rect, 1);
+    drop_copy_entries(cl);
     REGION_COPY(&cl->pending_region, &fb_region);
     REGION_UNINIT(&fb_region);
-    REGION_EMPTY(&cl->copy_region);
     /* If NewFBSize is supported by the client, send only NewFBSize
        pseudo-rectangle, pixel data will be sent in the next update. */
     if (cl->enable_newfbsize) {
+      fb_unlock_read();
       send_newfbsize();
       return;
     }
   } else {
     /* Exclude CopyRect areas covered by pending_region. */
-    REGION_SUBTRACT(&cl->copy_region, &cl->copy_region, &cl->pending_region);
+    for (j = 0; j < cl->num_copies; j++) {
+      REGION_SUBTRACT(&cl->copies[j].region, &cl->copies[j].region,
+                      &cl->pending_region);
+    }
   }
 
-  /* Clip regions to the rectangle requested by the client. */
+  /* Clip regions to the rectangle requested by the client. Sources of
+     copies never touch destinations of other copies, so their areas
+     may be sent as pixels instead, independently. */
   REGION_INIT(&clip_region, &cl->update_rect, 1);
   REGION_INTERSECT(&cl->pending_region, &cl->pending_region, &clip_region);
-  if (REGION_NOTEMPTY(&cl->copy_region)) {
-    REGION_INTERSECT(&cl->copy_region, &cl->copy_region, &clip_region);
+  num_copy_rects = 0;
+  for (j = 0; j < cl->num_copies; j++) {
+    entry = &cl->copies[j];
+    if (!REGION_NOTEMPTY(&entry->region))
+      continue;
+    REGION_INTERSECT(&entry->region, &entry->region, &clip_region);
 
     REGION_INIT(&outer_region, NullBox, 8);
-    REGION_COPY(&outer_region, &cl->copy_region);
-    REGION_TRANSLATE(&clip_region, cl->copy_dx, cl->copy_dy);
-    REGION_INTERSECT(&cl->copy_region, &cl->copy_region, &clip_region);
-    REGION_SUBTRACT(&outer_region, &outer_region, &cl->copy_region);
+    REGION_COPY(&outer_region, &entry->region);
+    REGION_INIT(&src_clip_region, &cl->update_rect, 1);
+    REGION_TRANSLATE(&src_clip_region, entry->dx, entry->dy);
+    REGION_INTERSECT(&entry->region, &entry->region, &src_clip_region);
+    REGION_SUBTRACT(&outer_region, &outer_region, &entry->region);
     REGION_UNION(&cl->pending_region, &cl->pending_region, &outer_region);
+    REGION_UNINIT(&src_clip_region);
     REGION_UNINIT(&outer_region);
+
+    num_copy_rects += REGION_NUM_RECTS(&entry->region);
   }
+  if (num_copy_rects == 0)
+    cl->num_copies = 0;
   REGION_UNINIT(&clip_region);
 
   /* Reduce the number of rectangles if possible. */
@@ -849,14 +1060,15 @@ static void send_update(void)
 
   /* Compute the number of rectangles in regions. */
   num_penging_rects = REGION_NUM_RECTS(&cl->pending_region);
-  num_copy_rects = REGION_NUM_RECTS(&cl->copy_region);
   num_all_rects = num_penging_rects + num_copy_rects;
   if (cl->newcursor_pending)
       num_all_rects++;
   if (cl->pointerpos_pending)
       num_all_rects++;
-  if (num_all_rects == 0)
+  if (num_all_rects == 0) {
+    fb_unlock_read();
     return;
+  }
 
   log_write(LL_DEBUG, "Sending framebuffer update (min %d rects) to %s",
             num_all_rects, cur_slot->name);
@@ -871,18 +1083,21 @@ static void send_update(void)
   }
   aio_write(NULL, msg_hdr, 4);
 
-  /* Determine the order in which CopyRect rectangles should be sent. */
-  rev_order = (cl->copy_dy > 0 || (cl->copy_dy == 0 && cl->copy_dx > 0));
-
-  /* For each CopyRect rectangle: */
-  for (i = 0; i < num_copy_rects; i++) {
-    idx = (rev_order) ? num_copy_rects - i - 1 : i;
-    rect.x = REGION_RECTS(&cl->copy_region)[idx].x1;
-    rect.y = REGION_RECTS(&cl->copy_region)[idx].y1;
-    rect.w = REGION_RECTS(&cl->copy_region)[idx].x2 - rect.x;
-    rect.h = REGION_RECTS(&cl->copy_region)[idx].y2 - rect.y;
-    rect.src_x = rect.x - cl->copy_dx;
-    rect.src_y = rect.y - cl->copy_dy;
+  /* For each CopyRect rectangle, in the order of copying: */
+  for (i = 0, j = 0; i < num_copy_rects; i++) {
+    while (i - num_prev_rects == REGION_NUM_RECTS(&cl->copies[j].region)) {
+      num_prev_rects = i;
+      j++;
+    }
+    entry = &cl->copies[j];
+    idx = region_copy_index(&entry->region, i - num_prev_rects,
+                            entry->dx, entry->dy);
+    rect.x = REGION_RECTS(&entry->region)[idx].x1;
+    rect.y = REGION_RECTS(&entry->region)[idx].y1;
+    rect.w = REGION_RECTS(&entry->region)[idx].x2 - rect.x;
+    rect.h = REGION_RECTS(&entry->region)[idx].y2 - rect.y;
+    rect.src_x = rect.x - entry->dx;
+    rect.src_y = rect.y - entry->dy;
     rect.enc = RFB_ENCODING_COPYRECT;
     log_write(LL_DEBUG, "Sending CopyRect rectangle %dx%d at %d,%d to %s",
               (int)rect.w, (int)rect.h, (int)rect.x, (int)rect.y,
@@ -920,6 +1135,10 @@ static void send_update(void)
       rect.enc = RFB_ENCODING_TIGHT;
       rfb_encode_tight(cl, &rect);
       continue;                 /* Important! */
+    } else if (cl->enc_prefer == RFB_ENCODING_ZRLE) {
+      /* Use ZRLE encoding */
+      rect.enc = RFB_ENCODING_ZRLE;
+      block = rfb_encode_zrle_block(cl, &rect);
     } else if ( cl->enc_prefer != RFB_ENCODING_RAW &&
                 cl->enc_enable[RFB_ENCODING_HEXTILE] ) {
       /* Use Hextile encoding */
@@ -930,8 +1149,12 @@ static void send_update(void)
         raw_bytes += rect.w * rect.h * (cl->format.bits_pixel / 8);
       }
     } else {
-      /* Use Raw encoding */
+      /* Use Raw encoding, without copying pixels if possible */
       rect.enc = RFB_ENCODING_RAW;
+      if ( rfb_encode_raw_nocopy(cl, &rect,
+                                 (i == num_penging_rects - 1) ?
+                                 wf_client_update_finished : NULL) )
+        continue;
       block = rfb_encode_raw_block(cl, &rect);
     }
 
@@ -948,7 +1171,11 @@ static void send_update(void)
   }
 
   REGION_EMPTY(&cl->pending_region);
-  REGION_EMPTY(&cl->copy_region);
+  for (j = 0; j < cl->num_copies; j++)
+    REGION_EMPTY(&cl->copies[j].region);
+  cl->num_copies = 0;
+
+  fb_unlock_read();
 
   /* cursor update */
   if (cl->newcursor_pending) 
@@ -960,14 +1187,73 @@ static void send_update(void)
 
   /* Send LastRect marker. */
   if (cl->enc_prefer == RFB_ENCODING_TIGHT && cl->enable_lastrect) {
-    rect.x = rect.y = rect.w = rect.h = 0;
-    rect.enc = RFB_ENCODING_LASTRECT;
-    put_rect_header(rect_hdr, &rect);
-    aio_write(wf_client_update_finished, rect_hdr, 12);
+    if (s_lastrect_msg == NULL) {
+      s_lastrect_msg = aio_shared_new(12);
+      if (s_lastrect_msg != NULL) {
+        rect.x = rect.y = rect.w = rect.h = 0;
+        rect.enc = RFB_ENCODING_LASTRECT;
+        put_rect_header(s_lastrect_msg->data, &rect);
+      }
+    }
+    if (s_lastrect_msg != NULL)
+      aio_write_shared(wf_client_update_finished, s_lastrect_msg);
   }
+  adapt_update_queued(cl, cur_slot->bytes_queued - bytes_queued);
 
   /* Something has been queued for sending. */
   cl->update_in_progress = 1;
   cl->update_requested = 0;
 }
 
+/*
+ * Respond to a fence requested by the client, or pass the response
+ * to our own fence to adapt.c. Messages are processed in order, so
+ * only BlockBefore and BlockAfter flags are supported.
+ */
+
+static void process_fence(CARD32 flags, CARD8 *data, int len)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+  CARD8 msg[9 + RFB_FENCE_MAX_PAYLOAD];
+
+  if (!(flags & RFB_FENCE_REQUEST)) {
+    adapt_fence_response(cl, data, len);
+    return;
+  }
+
+  log_write(LL_DEBUG, "Responding to fence from %s", cur_slot->name);
+
+  flags &= (RFB_FENCE_BLOCK_BEFORE | RFB_FENCE_BLOCK_AFTER);
+  msg[0] = 248;                 /* Fence */
+  msg[1] = msg[2] = msg[3] = 0;
+  buf_put_CARD32(&msg[4], flags);
+  msg[8] = (CARD8)len;
+  if (len != 0)
+    memcpy(&msg[9], data, len);
+  aio_write(NULL, msg, 9 + len);
+}
+
+/*
+ * Check if the client is too slow to receive the data queued already.
+ * If so, mark an end of the data with an empty block, the client is
+ * considered ready for more data after that block has been sent, see
+ * wf_client_queue_drained().
+ */
+
+static int check_queue_full(void)
+{
+  CL_SLOT *cl = (CL_SLOT *)cur_slot;
+
+  if (cl->queue_full)
+    return 1;
+
+  if (s_queue_high_water == 0 || cur_slot->bytes_queued <= s_queue_high_water)
+    return 0;
+
+  log_write(LL_DETAIL, "Client %s is slow, %lu bytes queued",
+            cur_slot->name, (unsigned long)cur_slot->bytes_queued);
+
+  cl->queue_full = 1;
+  aio_write(wf_client_queue_drained, "", 0);
+  return 1;
+}
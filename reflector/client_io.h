@@ -21,7 +21,16 @@
 
 #define TYPE_CL_SLOT    1
 
-#define NUM_ENCODINGS  10
+#define NUM_ENCODINGS  17
+
+/* Maximum number of CopyRect offsets pending for a client */
+#define MAX_COPY_ENTRIES  8
+
+/* Destination area of CopyRects with the same offset */
+typedef struct _COPY_ENTRY {
+  RegionRec region;
+  int dx, dy;
+} COPY_ENTRY;
 
 /* Extension to AIO_SLOT structure to hold client state */
 typedef struct _CL_SLOT {
@@ -35,8 +44,8 @@ typedef struct _CL_SLOT {
   TRANSFUNC_PTR trans_func;
 
   RegionRec pending_region;
-  RegionRec copy_region;
-  int copy_dx, copy_dy;
+  COPY_ENTRY copies[MAX_COPY_ENTRIES]; /* In the order of copying         */
+  int num_copies;
 
   CARD16 temp_count;
   unsigned char auth_challenge[16];
@@ -44,12 +53,28 @@ typedef struct _CL_SLOT {
   unsigned char enc_enable[NUM_ENCODINGS];
   int compress_level;
   int jpeg_quality;
+  int max_compress_level;       /* As requested by the client, the values */
+  int max_jpeg_quality;         /*   above may be lower, see adapt.c      */
+  int adapt_tier;               /* Connection speed class, or -1          */
+  long bandwidth;               /* Throughput estimate, bytes/s, or -1    */
+  long rtt;                     /* Round-trip time estimate, ms, or -1    */
+  unsigned long update_start;   /* aio_get_time() when update was queued  */
+  size_t update_bytes;          /* Size of the update being sent          */
+  unsigned long fence_sent;     /* aio_get_time() when fence was queued   */
+  unsigned long fence_update_start; /* The update measured with the fence */
+  size_t fence_update_bytes;
+  CARD32 fence_id;
+  AIO_TIMER fence_timer;        /* Waiting for the fence response         */
+  CARD32 fence_flags;           /* Flags of the Fence message being read  */
   z_stream zs_struct[4];
   int zs_active[4];
   int zs_level[4];
+  z_stream zs_zrle;             /* Persistent zlib stream for ZRLE        */
+  int zs_zrle_active;
+  int zs_zrle_level;
   size_t cut_len;
   BoxRec update_rect;
-  unsigned int bgr233_f           :1;
+  struct _TILE_CACHE *tile_cache; /* Hextile cache for this pixel format */
   unsigned int readonly           :1;
   unsigned int connected          :1;
   unsigned int update_requested   :1;
@@ -59,17 +84,25 @@ typedef struct _CL_SLOT {
   unsigned int newfbsize_pending  :1;
   unsigned int newcursor_pending  :1;
   unsigned int pointerpos_pending :1;
+  unsigned int queue_full         :1;
+  unsigned int enable_fence       :1;
+  unsigned int fence_announced    :1;
+  unsigned int fence_pending      :1;
+  AIO_SHARED *pending_cuttext;  /* Text to send after the queue drains */
 } CL_SLOT;
 
 void set_client_passwords(unsigned char *password, unsigned char *password_ro);
+void set_client_queue_limit(size_t high_water);
 void af_client_accept(void);
 
 /* Functions called from host_io.c */
 void fn_client_add_rect(AIO_SLOT *slot, FB_RECT *rect);
 void fn_client_send_rects(AIO_SLOT *slot);
-void fn_client_send_cuttext(AIO_SLOT *slot, CARD8 *text, size_t len);
+AIO_SHARED *client_cuttext_msg(CARD8 *text, size_t len);
+void fn_client_send_cuttext(AIO_SLOT *slot, AIO_SHARED *msg);
 void fn_client_send_xcursor(AIO_SLOT *slot);
 void fn_client_send_pointerpos(AIO_SLOT *slot);
+void fn_client_report_queue(AIO_SLOT *slot);
 
 /* External functions for cursor updates */
 extern FB_RECT *crsr_get_rect(void);
@@ -78,5 +111,6 @@ extern CARD8 *crsr_get_col(void);
 extern CARD8 *crsr_get_bmps(void);
 extern int crsr_get_type(void);
 extern int crsr_has_pos_rect(void);
+extern AIO_SHARED *crsr_get_shape_msg(void);
 
 #endif /* _REFLIB_CLIENT_IO_H */
@@ -28,18 +28,22 @@
 #include "host_io.h"
 #include "translate.h"
 #include "client_io.h"
+#include "workers.h"
 
 #define FUNC_CL_DISCONNECT   0
 #define FUNC_HOST_RECONNECT  1
+#define FUNC_REPORT_QUEUES   2
 
 static void sh_disconnect_clients(int signo);
 static void sh_reconnect_noclose(int signo);
 static void sh_reconnect_close(int signo);
 static void sh_toggle_log_level(int signo);
+static void sh_report_queues(int signo);
 
 static void safe_disconnect_clients(void);
 static void safe_reconnect_noclose(void);
 static void safe_reconnect_close(void);
+static void safe_report_queues(void);
 
 static void fn_close(AIO_SLOT *slot);
 static void fn_stop_listening(AIO_SLOT *slot);
@@ -55,6 +59,7 @@ void set_control_signals(void)
   signal(SIGUSR1, sh_reconnect_noclose);
   signal(SIGUSR2, sh_reconnect_close);
   signal(SIGWINCH, sh_toggle_log_level);
+  signal(SIGURG, sh_report_queues);
 }
 
 /*
@@ -79,6 +84,12 @@ static void sh_reconnect_close(int signo)
   signal(signo, sh_reconnect_close);
 }
 
+static void sh_report_queues(int signo)
+{
+  aio_call_func(safe_report_queues, FUNC_REPORT_QUEUES);
+  signal(signo, sh_report_queues);
+}
+
 /*
  * sh_toggle_log_level() is called when the application handles
  * the SIGWINCH signal (see set_control_signals() above).
@@ -117,6 +128,19 @@ static void safe_disconnect_clients(void)
 {
   log_write(LL_WARN, "Caught SIGHUP signal, disconnecting all clients");
   aio_walk_slots(fn_close, TYPE_CL_SLOT);
+  workers_post(WMSG_CLOSE_CLIENTS, NULL, NULL);
+}
+
+/*
+ * Logging current output queue depth of each client on SIGURG
+ */
+
+static void safe_report_queues(void)
+{
+  log_write(LL_MSG, "Caught SIGURG signal, %lu bytes queued in total",
+            (unsigned long)aio_get_queued_total());
+  aio_walk_slots(fn_client_report_queue, TYPE_CL_SLOT);
+  workers_post(WMSG_REPORT_QUEUES, NULL, NULL);
 }
 
 /*
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <zlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "rfblib.h"
 #include "logging.h"
@@ -25,7 +26,9 @@
 #include "translate.h"
 #include "client_io.h"
 #include "host_io.h"
+#include "encode.h"
 #include "reflector.h"
+#include "workers.h"
 
 
 static void rf_host_xcursor_color(void);
@@ -46,6 +49,10 @@ static CARD16 s_curs_y = 0;
 static int s_type = 0;
 static int s_read_size = 0;
 static int s_has_pos = 0;
+static AIO_SHARED *s_shape_msg = NULL;
+static pthread_mutex_t s_shape_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static AIO_SHARED *build_shape_msg(void);
 
 
 /*
@@ -133,11 +140,58 @@ int crsr_get_type(void)
   return s_type;
 }
 
+/*
+ * Get cursor shape update (rect header and cursor data) ready to be
+ * queued with aio_write_shared(). It's prepared once for each new
+ * cursor shape and shared by all clients. This function may be called
+ * from worker threads, it returns a new reference which should be
+ * released by the caller with aio_shared_unref().
+ */
+AIO_SHARED *crsr_get_shape_msg(void)
+{
+  AIO_SHARED *msg;
+
+  pthread_mutex_lock(&s_shape_mutex);
+  msg = s_shape_msg;
+  if (msg != NULL)
+    aio_shared_ref(msg);
+  pthread_mutex_unlock(&s_shape_mutex);
+
+  return msg;
+}
+
 
 /*
  * Private functions
  */
 
+static AIO_SHARED *build_shape_msg(void)
+{
+  AIO_SHARED *msg;
+  CARD32 hdr_size = 12, size;
+
+  if (s_type == RFB_ENCODING_RICHCURSOR) {
+    size = s_curs_rect.w * s_curs_rect.h *
+      (g_screen_info.pixformat.bits_pixel / 8);
+    size += ((s_curs_rect.w + 7) / 8) * s_curs_rect.h;
+  } else if (s_type == RFB_ENCODING_XCURSOR) {
+    size = ((s_curs_rect.w + 7) / 8) * s_curs_rect.h * 2;
+    hdr_size += sz_rfbXCursorColors;
+  } else {
+    return NULL;
+  }
+
+  msg = aio_shared_new(hdr_size + size);
+  if (msg != NULL) {
+    put_rect_header(msg->data, &s_curs_rect);
+    if (hdr_size > 12)
+      memcpy(&msg->data[12], s_xcursor_colors, sz_rfbXCursorColors);
+    if (size)
+      memcpy(&msg->data[hdr_size], s_bmps, size);
+  }
+  return msg;
+}
+
 static void rf_host_xcursor_color(void)
 {
   CARD32 size;
@@ -194,7 +248,17 @@ static void rf_host_richcursor_bmps(void)
 /***********************************/
 static void rf_host_cursor(void)
 {
+  AIO_SHARED *old_msg;
+
+  /* Cursor shape changed, prepare the update for all clients */
+  pthread_mutex_lock(&s_shape_mutex);
+  old_msg = s_shape_msg;
+  s_shape_msg = build_shape_msg();
+  pthread_mutex_unlock(&s_shape_mutex);
+  aio_shared_unref(old_msg);
+
   aio_walk_slots(fn_client_send_xcursor, TYPE_CL_SLOT);
+  workers_post(WMSG_CURSOR, NULL, NULL);
 }
 
 /***********************************/
@@ -203,5 +267,6 @@ static void rf_host_cursor(void)
 static void rf_host_pointerpos(void)
 {
   aio_walk_slots(fn_client_send_pointerpos, TYPE_CL_SLOT);
+  workers_post(WMSG_POINTERPOS, NULL, NULL);
 }
 
@@ -18,8 +18,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <setjmp.h>
 #include <sys/types.h>
 #include <zlib.h>
+#include <jpeglib.h>
 
 #include "rfblib.h"
 #include "reflector.h"
@@ -41,6 +43,18 @@ static int s_filter_id;
 static int s_num_colors;
 static CARD32 s_palette[256];
 static int s_compressed_size, s_uncompressed_size;
+static int s_jpeg_f;
+
+/* JPEG decompressor is created on first use and reused afterwards */
+static struct jpeg_decompress_struct s_jpeg_dinfo;
+static struct jpeg_error_mgr s_jpeg_err;
+static struct jpeg_source_mgr s_jpeg_src;
+static jmp_buf s_jpeg_jmpbuf;
+static int s_jpeg_created = 0;
+#ifndef JCS_EXTENSIONS
+static CARD8 *s_jpeg_row_buf = NULL;
+static int s_jpeg_row_buf_width = 0;
+#endif
 
 static void rf_host_tight_compctl(void);
 static void rf_host_tight_fill(void);
@@ -57,6 +71,15 @@ static void rf_host_tight_compressed(void);
 static void tight_draw_truecolor_data(CARD8 *src);
 static void tight_draw_indexed_data(CARD8 *src);
 static void tight_draw_gradient_data(CARD8 *src);
+static int tight_draw_jpeg_data(CARD8 *src, int size);
+
+static j_decompress_ptr get_jpeg_decompressor(int width);
+static void tight_jpeg_init_source(j_decompress_ptr dinfo);
+static boolean tight_jpeg_fill_input_buffer(j_decompress_ptr dinfo);
+static void tight_jpeg_skip_input_data(j_decompress_ptr dinfo, long num_bytes);
+static void tight_jpeg_term_source(j_decompress_ptr dinfo);
+static void tight_jpeg_error_exit(j_common_ptr cinfo);
+static void tight_jpeg_output_message(j_common_ptr cinfo);
 
 void reset_tight_streams(void)
 {
@@ -111,13 +134,13 @@ static void rf_host_tight_compctl(void)
   }
   comp_ctl &= 0xF0;             /* clear bits 3..0 */
 
+  s_jpeg_f = 0;
   if (comp_ctl == RFB_TIGHT_FILL) {
     aio_setread(rf_host_tight_fill, NULL, 3);
   }
   else if (comp_ctl == RFB_TIGHT_JPEG) {
-    log_write(LL_ERROR, "JPEG is not supported on host connections");
-    aio_close(0);
-    return;
+    s_jpeg_f = 1;
+    aio_setread(rf_host_tight_len1, NULL, 1);
   }
   else if (comp_ctl > RFB_TIGHT_MAX_SUBENCODING) {
     log_write(LL_ERROR, "Invalid sub-encoding in Tight-encoded data");
@@ -262,6 +285,15 @@ static void rf_host_tight_compressed(void)
 
   fbs_spool_data(cur_slot->readbuf, s_compressed_size);
 
+  if (s_jpeg_f) {
+    if (!tight_draw_jpeg_data(cur_slot->readbuf, s_compressed_size)) {
+      aio_close(0);
+      return;
+    }
+    fbupdate_rect_done();
+    return;
+  }
+
   /* Initialize compression stream if needed */
 
   zs = &s_zstream[s_stream_id];
@@ -436,3 +468,177 @@ static void tight_draw_gradient_data(CARD8 *src)
   }
 }
 
+
+/*
+ * Decode JPEG image and draw it on the framebuffer. Returns 0 on
+ * errors.
+ */
+
+static int tight_draw_jpeg_data(CARD8 *src, int size)
+{
+  j_decompress_ptr dinfo;
+  JSAMPROW row_ptr[1];
+  CARD32 *fb_ptr;
+  int x;
+#ifndef JCS_EXTENSIONS
+  CARD8 *read_ptr;
+#endif
+
+  dinfo = get_jpeg_decompressor(s_rect.w);
+  if (dinfo == NULL) {
+    log_write(LL_ERROR, "Error allocating memory in Tight decoder");
+    return 0;
+  }
+
+  if (setjmp(s_jpeg_jmpbuf)) {
+    jpeg_abort_decompress(dinfo);
+    return 0;
+  }
+
+  s_jpeg_src.next_input_byte = src;
+  s_jpeg_src.bytes_in_buffer = size;
+
+  jpeg_read_header(dinfo, TRUE);
+  if (dinfo->image_width != s_rect.w || dinfo->image_height != s_rect.h) {
+    log_write(LL_ERROR, "JPEG image size does not match the rectangle");
+    jpeg_abort_decompress(dinfo);
+    return 0;
+  }
+
+#ifdef JCS_EXTENSIONS
+  /* Framebuffer pixels are 0x00RRGGBB in host byte order. */
+  dinfo->out_color_space = is_big_endian() ? JCS_EXT_XRGB : JCS_EXT_BGRX;
+#else
+  dinfo->out_color_space = JCS_RGB;
+#endif
+
+  jpeg_start_decompress(dinfo);
+
+  fb_ptr = &g_framebuffer[s_rect.y * (int)g_fb_width + s_rect.x];
+  while (dinfo->output_scanline < dinfo->output_height) {
+#ifdef JCS_EXTENSIONS
+    /* Decode directly into the framebuffer, then clear the X bytes */
+    row_ptr[0] = (JSAMPROW)fb_ptr;
+    jpeg_read_scanlines(dinfo, row_ptr, 1);
+    for (x = 0; x < s_rect.w; x++)
+      fb_ptr[x] &= 0xFFFFFF;
+#else
+    row_ptr[0] = s_jpeg_row_buf;
+    jpeg_read_scanlines(dinfo, row_ptr, 1);
+    read_ptr = s_jpeg_row_buf;
+    for (x = 0; x < s_rect.w; x++) {
+      fb_ptr[x] = read_ptr[0] << 16 | read_ptr[1] << 8 | read_ptr[2];
+      read_ptr += 3;
+    }
+#endif
+    fb_ptr += g_fb_width;
+  }
+
+  jpeg_finish_decompress(dinfo);
+  return 1;
+}
+
+/*
+ * Get the decompressor, creating it on first use. Without
+ * libjpeg-turbo, rows are decoded into a buffer large enough for
+ * width pixels.
+ */
+
+static j_decompress_ptr get_jpeg_decompressor(int width)
+{
+  j_decompress_ptr dinfo = &s_jpeg_dinfo;
+
+#ifndef JCS_EXTENSIONS
+  CARD8 *row_buf;
+
+  if (width > s_jpeg_row_buf_width) {
+    row_buf = realloc(s_jpeg_row_buf, width * 3);
+    if (row_buf == NULL)
+      return NULL;
+    s_jpeg_row_buf = row_buf;
+    s_jpeg_row_buf_width = width;
+  }
+#else
+  (void)width;
+#endif
+
+  if (s_jpeg_created)
+    return dinfo;
+
+  dinfo->err = jpeg_std_error(&s_jpeg_err);
+  s_jpeg_err.error_exit = tight_jpeg_error_exit;
+  s_jpeg_err.output_message = tight_jpeg_output_message;
+  jpeg_create_decompress(dinfo);
+  s_jpeg_created = 1;
+
+  s_jpeg_src.init_source = tight_jpeg_init_source;
+  s_jpeg_src.fill_input_buffer = tight_jpeg_fill_input_buffer;
+  s_jpeg_src.skip_input_data = tight_jpeg_skip_input_data;
+  s_jpeg_src.resync_to_restart = jpeg_resync_to_restart;
+  s_jpeg_src.term_source = tight_jpeg_term_source;
+  dinfo->src = &s_jpeg_src;
+
+  return dinfo;
+}
+
+/*
+ * Source manager implementation for JPEG library, the whole image is
+ * in memory.
+ */
+
+static void tight_jpeg_init_source(j_decompress_ptr dinfo)
+{
+  (void)dinfo;                  /* Nothing to do */
+}
+
+static boolean tight_jpeg_fill_input_buffer(j_decompress_ptr dinfo)
+{
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+  (void)dinfo;
+
+  /* Data is truncated, insert a fake EOI marker */
+  s_jpeg_src.next_input_byte = eoi;
+  s_jpeg_src.bytes_in_buffer = sizeof(eoi);
+  return TRUE;
+}
+
+static void tight_jpeg_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+  (void)dinfo;
+
+  if (num_bytes > (long)s_jpeg_src.bytes_in_buffer) {
+    s_jpeg_src.next_input_byte += s_jpeg_src.bytes_in_buffer;
+    s_jpeg_src.bytes_in_buffer = 0;
+  } else if (num_bytes > 0) {
+    s_jpeg_src.next_input_byte += num_bytes;
+    s_jpeg_src.bytes_in_buffer -= num_bytes;
+  }
+}
+
+static void tight_jpeg_term_source(j_decompress_ptr dinfo)
+{
+  (void)dinfo;                  /* Nothing to do */
+}
+
+/*
+ * Error handling for JPEG library: log the message and return to
+ * tight_draw_jpeg_data() instead of exiting.
+ */
+
+static void tight_jpeg_error_exit(j_common_ptr cinfo)
+{
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message)(cinfo, msg);
+  log_write(LL_ERROR, "JPEG decoder: %s", msg);
+  longjmp(s_jpeg_jmpbuf, 1);
+}
+
+static void tight_jpeg_output_message(j_common_ptr cinfo)
+{
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message)(cinfo, msg);
+  log_write(LL_WARN, "JPEG decoder: %s", msg);
+}
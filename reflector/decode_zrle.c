@@ -0,0 +1,394 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Decoding Zlib and ZRLE-encoded rectangles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "rfblib.h"
+#include "reflector.h"
+#include "async_io.h"
+#include "logging.h"
+#include "host_io.h"
+
+#define ZRLE_TILE_SIZE  64
+
+/*
+ * File-local data.
+ */
+
+static FB_RECT s_rect;
+static z_stream s_zstream[FBS_NUM_STREAMS];
+static int s_zstream_active[FBS_NUM_STREAMS];
+static int s_compressed_size;
+
+/* Decompressed data of the current rectangle */
+static CARD8 *s_buf = NULL;
+static size_t s_buf_size = 0;
+
+static void rf_host_zlib_len(void);
+static void rf_host_zlib_data(void);
+static void rf_host_zrle_len(void);
+static void rf_host_zrle_data(void);
+
+static int inflate_data(int stream_id, size_t max_size, size_t *size_ptr);
+static int zrle_draw_tile(CARD8 **src_ptr, CARD8 *src_end, FB_RECT *t);
+
+void reset_zlib_streams(void)
+{
+  int stream_id;
+
+  for (stream_id = 0; stream_id < FBS_NUM_STREAMS; stream_id++) {
+    if (s_zstream_active[stream_id]) {
+      if (inflateEnd(&s_zstream[stream_id]) != Z_OK) {
+        if (s_zstream[stream_id].msg != NULL) {
+          log_write(LL_WARN, "inflateEnd() failed: %s",
+                    s_zstream[stream_id].msg);
+        } else {
+          log_write(LL_WARN, "inflateEnd() failed");
+        }
+      }
+      s_zstream_active[stream_id] = 0;
+    }
+  }
+}
+
+/*
+ * Zlib encoding: raw pixels compressed with zlib.
+ */
+
+void setread_decode_zlib(FB_RECT *r)
+{
+  s_rect = *r;
+  aio_setread(rf_host_zlib_len, NULL, sizeof(CARD32));
+}
+
+static void rf_host_zlib_len(void)
+{
+  s_compressed_size = (int)buf_get_CARD32(cur_slot->readbuf);
+  if (s_compressed_size <= 0) {
+    log_write(LL_ERROR, "Invalid data length in Zlib-encoded rectangle");
+    aio_close(0);
+    return;
+  }
+  aio_setread(rf_host_zlib_data, NULL, s_compressed_size);
+}
+
+static void rf_host_zlib_data(void)
+{
+  CARD32 *fb_ptr;
+  CARD8 *src;
+  size_t row_size, size;
+  int y;
+
+  row_size = s_rect.w * sizeof(CARD32);
+  if (!inflate_data(FBS_STREAM_ZLIB, s_rect.h * row_size, &size))
+    return;
+  if (size != s_rect.h * row_size) {
+    log_write(LL_ERROR, "Not enough data in Zlib-encoded rectangle");
+    aio_close(0);
+    return;
+  }
+
+  fbs_spool_zlib_data(FBS_STREAM_ZLIB, s_buf, size);
+
+  fb_ptr = &g_framebuffer[s_rect.y * (int)g_fb_width + s_rect.x];
+  src = s_buf;
+  for (y = 0; y < s_rect.h; y++) {
+    memcpy(fb_ptr, src, row_size);
+    src += row_size;
+    fb_ptr += g_fb_width;
+  }
+
+  fbupdate_rect_done();
+}
+
+/*
+ * ZRLE encoding: 64x64 tiles encoded with palettes and RLE, all
+ * compressed with zlib.
+ */
+
+void setread_decode_zrle(FB_RECT *r)
+{
+  s_rect = *r;
+  aio_setread(rf_host_zrle_len, NULL, sizeof(CARD32));
+}
+
+static void rf_host_zrle_len(void)
+{
+  s_compressed_size = (int)buf_get_CARD32(cur_slot->readbuf);
+  if (s_compressed_size <= 0) {
+    log_write(LL_ERROR, "Invalid data length in ZRLE-encoded rectangle");
+    aio_close(0);
+    return;
+  }
+  aio_setread(rf_host_zrle_data, NULL, s_compressed_size);
+}
+
+static void rf_host_zrle_data(void)
+{
+  FB_RECT tile;
+  CARD8 *src, *src_end;
+  int num_tiles, rx1, ry1;
+  size_t max_size, size;
+
+  /* Any valid tile fits in its palette and four bytes per pixel */
+  num_tiles = ((s_rect.w + ZRLE_TILE_SIZE - 1) / ZRLE_TILE_SIZE) *
+    ((s_rect.h + ZRLE_TILE_SIZE - 1) / ZRLE_TILE_SIZE);
+  max_size = (size_t)num_tiles * (1 + 127 * 3) + s_rect.w * s_rect.h * 4;
+  if (!inflate_data(FBS_STREAM_ZRLE, max_size, &size))
+    return;
+
+  fbs_spool_zlib_data(FBS_STREAM_ZRLE, s_buf, size);
+
+  src = s_buf;
+  src_end = s_buf + size;
+  rx1 = s_rect.x + s_rect.w;
+  ry1 = s_rect.y + s_rect.h;
+
+  tile.h = ZRLE_TILE_SIZE;
+  for (tile.y = s_rect.y; tile.y < ry1; tile.y += ZRLE_TILE_SIZE) {
+    if (ry1 - tile.y < ZRLE_TILE_SIZE)
+      tile.h = ry1 - tile.y;
+    tile.w = ZRLE_TILE_SIZE;
+    for (tile.x = s_rect.x; tile.x < rx1; tile.x += ZRLE_TILE_SIZE) {
+      if (rx1 - tile.x < ZRLE_TILE_SIZE)
+        tile.w = rx1 - tile.x;
+      if (!zrle_draw_tile(&src, src_end, &tile)) {
+        log_write(LL_ERROR, "Invalid ZRLE-encoded data");
+        aio_close(0);
+        return;
+      }
+    }
+  }
+
+  if (src != src_end)
+    log_write(LL_WARN, "Extra data in ZRLE-encoded rectangle");
+
+  fbupdate_rect_done();
+}
+
+/*
+ * Decompress the data read into s_buf. At most max_size bytes are
+ * expected, the actual size is stored in *size_ptr. Returns 0 after
+ * closing the connection on errors.
+ */
+
+static int inflate_data(int stream_id, size_t max_size, size_t *size_ptr)
+{
+  z_streamp zs;
+  int err;
+
+  /* Initialize compression stream if needed */
+
+  zs = &s_zstream[stream_id];
+  if (!s_zstream_active[stream_id]) {
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+    zs->next_in = Z_NULL;
+    zs->avail_in = 0;
+    err = inflateInit(zs);
+    if (err != Z_OK) {
+      if (zs->msg != NULL) {
+        log_write(LL_ERROR, "inflateInit() failed: %s", zs->msg);
+      } else {
+        log_write(LL_ERROR, "inflateInit() failed");
+      }
+      aio_close(0);
+      return 0;
+    }
+    s_zstream_active[stream_id] = 1;
+  }
+
+  /* Make sure the buffer is large enough */
+
+  if (max_size > s_buf_size) {
+    free(s_buf);
+    s_buf = malloc(max_size);
+    if (s_buf == NULL) {
+      s_buf_size = 0;
+      log_write(LL_ERROR, "Error allocating memory in Zlib decoder");
+      aio_close(0);
+      return 0;
+    }
+    s_buf_size = max_size;
+  }
+
+  /* Decompress the data */
+
+  zs->next_in = cur_slot->readbuf;
+  zs->avail_in = s_compressed_size;
+  zs->next_out = s_buf;
+  zs->avail_out = max_size;
+
+  err = inflate(zs, Z_SYNC_FLUSH);
+  if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+    if (zs->msg != NULL) {
+      log_write(LL_ERROR, "inflate() failed: %s", zs->msg);
+    } else {
+      log_write(LL_ERROR, "inflate() failed: %d", err);
+    }
+    aio_close(0);
+    return 0;
+  }
+  if (zs->avail_in != 0) {
+    log_write(LL_ERROR, "Too much data in compressed rectangle");
+    aio_close(0);
+    return 0;
+  }
+
+  *size_ptr = max_size - zs->avail_out;
+  return 1;
+}
+
+/*
+ * Compressed pixels contain three bytes of 32-bit pixels, see the
+ * pixel format in init_screen_info().
+ */
+
+#define GET_CPIXEL(p)                                   \
+  (g_screen_info.pixformat.big_endian ?                 \
+   (CARD32)(p)[0] << 16 | (CARD32)(p)[1] << 8 | (p)[2] : \
+   (CARD32)(p)[2] << 16 | (CARD32)(p)[1] << 8 | (p)[0])
+
+/* Read a run length, return 0 if it does not fit the data */
+#define GET_RUN_LENGTH(src, src_end, len)               \
+{                                                       \
+  len = 1;                                              \
+  do {                                                  \
+    if (src >= src_end)                                 \
+      return 0;                                         \
+    len += *src;                                        \
+  } while (*src++ == 255);                              \
+}
+
+/*
+ * Draw one ZRLE tile on the framebuffer, advancing *src_ptr. Returns
+ * 0 if the data is invalid.
+ */
+
+static int zrle_draw_tile(CARD8 **src_ptr, CARD8 *src_end, FB_RECT *t)
+{
+  CARD32 palette[127];
+  CARD32 *fb_ptr, color;
+  CARD8 *src = *src_ptr;
+  int subenc, num_colors, bits, mask, shift;
+  int num_pixels, pos, len, x, y, i;
+
+  if (src >= src_end)
+    return 0;
+  subenc = *src++;
+  fb_ptr = &g_framebuffer[t->y * (int)g_fb_width + t->x];
+  num_pixels = t->w * t->h;
+
+  if (subenc == 0) {
+    /* Raw pixels */
+    if (src_end - src < num_pixels * 3)
+      return 0;
+    for (y = 0; y < t->h; y++) {
+      for (x = 0; x < t->w; x++) {
+        fb_ptr[x] = GET_CPIXEL(src);
+        src += 3;
+      }
+      fb_ptr += g_fb_width;
+    }
+    *src_ptr = src;
+    return 1;
+  }
+
+  if (subenc == 1) {
+    /* Solid tile */
+    if (src_end - src < 3)
+      return 0;
+    fill_fb_rect(t, GET_CPIXEL(src));
+    *src_ptr = src + 3;
+    return 1;
+  }
+
+  if ((subenc >= 17 && subenc <= 127) || subenc == 129)
+    return 0;
+
+  /* Read the palette if any */
+  num_colors = (subenc & 0x80) ? subenc - 128 : subenc;
+  if (src_end - src < num_colors * 3)
+    return 0;
+  for (i = 0; i < num_colors; i++) {
+    palette[i] = GET_CPIXEL(src);
+    src += 3;
+  }
+
+  if (subenc <= 16) {
+    /* Packed palette indices, rows are padded to byte boundary */
+    bits = (num_colors <= 2) ? 1 : (num_colors <= 4) ? 2 : 4;
+    mask = (1 << bits) - 1;
+    if (src_end - src < t->h * ((t->w * bits + 7) / 8))
+      return 0;
+    for (y = 0; y < t->h; y++) {
+      shift = 8;
+      for (x = 0; x < t->w; x++) {
+        shift -= bits;
+        i = *src >> shift & mask;
+        if (i >= num_colors)
+          return 0;
+        fb_ptr[x] = palette[i];
+        if (shift == 0) {
+          src++;
+          shift = 8;
+        }
+      }
+      if (shift != 8)
+        src++;
+      fb_ptr += g_fb_width;
+    }
+    *src_ptr = src;
+    return 1;
+  }
+
+  /* Runs may span several rows of the tile */
+  pos = 0;
+  while (pos < num_pixels) {
+    if (subenc == 128) {
+      if (src_end - src < 3)
+        return 0;
+      color = GET_CPIXEL(src);
+      src += 3;
+      GET_RUN_LENGTH(src, src_end, len);
+    } else {
+      if (src >= src_end)
+        return 0;
+      i = *src & 0x7F;
+      if (i >= num_colors)
+        return 0;
+      color = palette[i];
+      if (*src++ & 0x80) {
+        GET_RUN_LENGTH(src, src_end, len);
+      } else {
+        len = 1;
+      }
+    }
+    if (len > num_pixels - pos)
+      return 0;
+    for (i = 0; i < len; i++, pos++) {
+      fb_ptr[(pos / t->w) * (int)g_fb_width + pos % t->w] = color;
+    }
+  }
+
+  *src_ptr = src;
+  return 1;
+}
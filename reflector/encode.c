@@ -21,11 +21,13 @@
 #include <zlib.h>
 
 #include "rfblib.h"
+#include "logging.h"
 #include "reflector.h"
 #include "async_io.h"
 #include "translate.h"
 #include "client_io.h"
 #include "encode.h"
+#include "scan.h"
 
 /* This structure describes cached data for a properly-aligned 16x16 tile. */
 /* NOTE: If hextile_datasize is not 0 then valid_f should be non-zero too, */
@@ -33,14 +35,41 @@
 typedef struct _TILE_HINTS {
   CARD8 valid_f;                /* At least meta-data available if not 0   */
   CARD8 num_colors;             /* Meta-data: number of colors (1, 2 or 0) */
-  CARD8 bg;                     /* Meta-data: background color             */
-  CARD8 fg;                     /* Meta-data: foreground color             */
   CARD16 hextile_datasize;      /* Hextile-encoded data available if not 0 */
+  CARD32 bg;                    /* Meta-data: background color             */
+  CARD32 fg;                    /* Meta-data: foreground color             */
 } TILE_HINTS;
 
-/* Cache for the encoded data */
-static TILE_HINTS *s_hints8 = NULL;
-static CARD8 *s_cache8 = NULL;
+/* Cache for the encoded data. There is one cache for each pixel format
+   used by clients of this thread, see get_tile_cache(). */
+struct _TILE_CACHE {
+  struct _TILE_CACHE *next;
+  RFB_PIXEL_FORMAT format;      /* Pixel format of the encoded data        */
+  int refcount;                 /* Number of clients using this cache      */
+  TILE_HINTS *hints;            /* Allocated on first use, or NULL         */
+  CARD8 *data;                  /* Encoded data, tile_datasize per tile    */
+  int tile_datasize;
+  CARD16 fb_width, fb_height;   /* Framebuffer size the data is valid for  */
+};
+
+static AIO_THREAD_LOCAL TILE_CACHE *s_tile_caches = NULL;
+
+/* Scratch buffer for Hextile-encoded data, reused for all rectangles */
+static AIO_THREAD_LOCAL CARD8 *s_hextile_buf = NULL;
+static AIO_THREAD_LOCAL size_t s_hextile_buf_size;
+
+/* Snapshot of the framebuffer for zero-copy Raw encoding, see
+   rfb_encode_raw_nocopy(). Bands of SNAP_BAND_ROWS rows are copied on
+   demand, and dropped (not modified) when their rows are changed, so
+   the data already queued for sending stays intact. */
+#define SNAP_BAND_ROWS  16
+static AIO_THREAD_LOCAL AIO_SHARED **s_snap_bands = NULL;
+static AIO_THREAD_LOCAL int s_snap_num_bands;
+static AIO_THREAD_LOCAL CARD16 s_snap_fb_width, s_snap_fb_height;
+
+/* Rows shorter than that are copied anyway (unless the rectangle is
+   as wide as the framebuffer), it's cheaper than extra iovecs */
+#define NOCOPY_MIN_ROW_SIZE  1024
 
 /* Two-color palette */
 typedef struct _PALETTE2 {
@@ -49,51 +78,168 @@ typedef struct _PALETTE2 {
   CARD32 fg;
 } PALETTE2;
 
+/* Scratch buffer for ZRLE data before compression */
+static AIO_THREAD_LOCAL CARD8 *s_zrle_buf = NULL;
+static AIO_THREAD_LOCAL size_t s_zrle_buf_size;
+
+#define ZRLE_TILE_SIZE    64
+#define ZRLE_MAX_PALETTE  127
+#define ZRLE_HASH_BITS    8
+
+/* Palette of a ZRLE tile, with a hash table to find colors */
+typedef struct _ZRLE_PALETTE {
+  int num_colors;
+  CARD32 colors[ZRLE_MAX_PALETTE];
+  CARD8 slots[1 << ZRLE_HASH_BITS]; /* Color index + 1, or 0 if empty    */
+} ZRLE_PALETTE;
+
 /********************************************************************/
 /*                   Maintaining cache structures                   */
 /********************************************************************/
 
-static int s_cache_size;
+/* Worker threads have their own caches which are (re)allocated on
+   demand, after the framebuffer has been reallocated by the host
+   thread. */
+
+static int check_tile_cache(TILE_CACHE *cache);
+static void free_tile_cache_data(TILE_CACHE *cache);
+static void free_snapshot(void);
 
-/* FIXME: Allocate cache on demand? */
-/* FIXME: Bad function naming. */
+/*
+ * Find the cache for the pixel format, or create one if this is the
+ * first client using that format. Each call should be paired with
+ * release_tile_cache(). Memory for the encoded data is allocated on
+ * first use. Returns NULL if the format cannot be cached.
+ */
 
-int allocate_enc_cache(void)
+TILE_CACHE *get_tile_cache(RFB_PIXEL_FORMAT *format)
 {
-  int tiles_x, tiles_y;
+  TILE_CACHE *cache;
 
-  free_enc_cache();
+  /* Translation of colormapped pixels may change */
+  if (!format->true_color)
+    return NULL;
 
-  tiles_x = (int)g_fb_width / 16;
-  tiles_y = (int)g_fb_height / 16;
-  s_hints8 = calloc(tiles_x * tiles_y, sizeof(TILE_HINTS));
-  if (s_hints8 == NULL) {
-    return 0;
+  for (cache = s_tile_caches; cache != NULL; cache = cache->next) {
+    if (same_pixel_format(&cache->format, format)) {
+      cache->refcount++;
+      return cache;
+    }
   }
-  s_cache_size = tiles_x * tiles_y * sizeof(TILE_HINTS);
 
-  s_cache8 = malloc(tiles_x * tiles_y * HEXTILE_MAX_TILE_DATASIZE);
-  if (s_cache8 == NULL) {
-    free(s_hints8);
-    s_hints8 = NULL;
+  cache = calloc(1, sizeof(TILE_CACHE));
+  if (cache == NULL)
+    return NULL;
+
+  memcpy(&cache->format, format, sizeof(RFB_PIXEL_FORMAT));
+  cache->refcount = 1;
+  cache->tile_datasize =
+    HEXTILE_MAX_TILE_DATASIZE * (format->bits_pixel / 8);
+  cache->next = s_tile_caches;
+  s_tile_caches = cache;
+
+  return cache;
+}
+
+void release_tile_cache(TILE_CACHE *cache)
+{
+  TILE_CACHE **prev_ptr;
+
+  if (cache == NULL || --cache->refcount > 0)
+    return;
+
+  for (prev_ptr = &s_tile_caches; *prev_ptr != NULL;
+       prev_ptr = &(*prev_ptr)->next) {
+    if (*prev_ptr == cache) {
+      *prev_ptr = cache->next;
+      break;
+    }
+  }
+  free_tile_cache_data(cache);
+  free(cache);
+}
+
+static int check_tile_cache(TILE_CACHE *cache)
+{
+  int num_tiles;
+
+  if (cache->hints != NULL && cache->fb_width == g_fb_width &&
+      cache->fb_height == g_fb_height)
+    return 1;
+
+  free_tile_cache_data(cache);
+
+  num_tiles = ((int)g_fb_width / 16) * ((int)g_fb_height / 16);
+  cache->hints = calloc(num_tiles, sizeof(TILE_HINTS));
+  if (cache->hints == NULL)
+    return 0;
+
+  cache->data = malloc(num_tiles * cache->tile_datasize);
+  if (cache->data == NULL) {
+    free(cache->hints);
+    cache->hints = NULL;
     return 0;
   }
-  s_cache_size += tiles_x * tiles_y * HEXTILE_MAX_TILE_DATASIZE;
+  cache->fb_width = g_fb_width;
+  cache->fb_height = g_fb_height;
+
+  log_write(LL_DETAIL, "Allocated cache for encoded data (%d bpp), %d bytes",
+            (int)cache->format.bits_pixel,
+            num_tiles * (int)(sizeof(TILE_HINTS) + cache->tile_datasize));
 
   return 1;
 }
 
-int sizeof_enc_cache(void)
+static void free_tile_cache_data(TILE_CACHE *cache)
+{
+  if (cache->hints != NULL) {
+    free(cache->hints);
+    cache->hints = NULL;
+  }
+  if (cache->data != NULL) {
+    free(cache->data);
+    cache->data = NULL;
+  }
+  cache->fb_width = cache->fb_height = 0;
+}
+
+int same_pixel_format(RFB_PIXEL_FORMAT *f1, RFB_PIXEL_FORMAT *f2)
 {
-  return s_cache_size;
+  return (f1->bits_pixel == f2->bits_pixel &&
+          f1->color_depth == f2->color_depth &&
+          f1->big_endian == f2->big_endian &&
+          (f1->true_color != 0) == (f2->true_color != 0) &&
+          f1->r_max == f2->r_max && f1->g_max == f2->g_max &&
+          f1->b_max == f2->b_max && f1->r_shift == f2->r_shift &&
+          f1->g_shift == f2->g_shift && f1->b_shift == f2->b_shift);
 }
 
+/*
+ * Mark changed tiles as invalid in all caches of this thread, drop
+ * other data encoded from the changed area.
+ */
+
 void invalidate_enc_cache(FB_RECT *r)
 {
+  TILE_CACHE *cache;
   int tiles_in_row;
   int tile_x0, tile_y0, tile_x1, tile_y1;
   int x, y;
 
+  /* Drop shared Tight data for the changed area */
+  invalidate_tight_cache(r);
+
+  /* Drop changed bands of the snapshot, they are copied again on use */
+  if ( s_snap_bands != NULL && s_snap_fb_width == g_fb_width &&
+       s_snap_fb_height == g_fb_height ) {
+    for (y = r->y / SNAP_BAND_ROWS;
+         y <= (r->y + r->h - 1) / SNAP_BAND_ROWS && y < s_snap_num_bands;
+         y++) {
+      aio_shared_unref(s_snap_bands[y]);
+      s_snap_bands[y] = NULL;
+    }
+  }
+
   tiles_in_row = (int)g_fb_width / 16;
 
   tile_x0 = r->x / 16;
@@ -105,22 +251,42 @@ void invalidate_enc_cache(FB_RECT *r)
   if (tile_y1 >= (int)g_fb_height / 16)
     tile_y1 = (int)g_fb_height / 16 - 1;
 
-  for (y = tile_y0; y <= tile_y1; y++)
-    for (x = tile_x0; x <= tile_x1; x++)
-      s_hints8[y * tiles_in_row + x].valid_f = 0;
+  for (cache = s_tile_caches; cache != NULL; cache = cache->next) {
+    /* Cache of a wrong size would be cleared on reallocation anyway */
+    if (cache->hints == NULL || cache->fb_width != g_fb_width ||
+        cache->fb_height != g_fb_height)
+      continue;
+
+    for (y = tile_y0; y <= tile_y1; y++)
+      for (x = tile_x0; x <= tile_x1; x++)
+        cache->hints[y * tiles_in_row + x].valid_f = 0;
+  }
 }
 
+/*
+ * Free memory of all caches of this thread. The caches themselves
+ * are freed with release_tile_cache() by their clients.
+ */
+
 void free_enc_cache(void)
 {
-  if (s_hints8 != NULL) {
-    free(s_hints8);
-    s_hints8 = NULL;
+  TILE_CACHE *cache;
+
+  for (cache = s_tile_caches; cache != NULL; cache = cache->next)
+    free_tile_cache_data(cache);
+
+  if (s_hextile_buf != NULL) {
+    free(s_hextile_buf);
+    s_hextile_buf = NULL;
   }
-  if (s_cache8 != NULL) {
-    free(s_cache8);
-    s_cache8 = NULL;
+  s_hextile_buf_size = 0;
+  if (s_zrle_buf != NULL) {
+    free(s_zrle_buf);
+    s_zrle_buf = NULL;
   }
-  s_cache_size = 0;
+  s_zrle_buf_size = 0;
+  free_snapshot();
+  free_tight_cache();
 }
 
 /********************************************************************/
@@ -135,8 +301,7 @@ AIO_BLOCK *rfb_encode_raw_block(CL_SLOT *cl, FB_RECT *r)
 {
   AIO_BLOCK *block;
 
-  block = malloc(sizeof(AIO_BLOCK) + 12 +
-                 r->w * r->h * (cl->format.bits_pixel / 8));
+  block = aio_new_block(12 + r->w * r->h * (cl->format.bits_pixel / 8));
   if (block) {
     put_rect_header(block->data, r);
     (*cl->trans_func)(&block->data[12], r, cl->trans_table);
@@ -146,6 +311,104 @@ AIO_BLOCK *rfb_encode_raw_block(CL_SLOT *cl, FB_RECT *r)
   return block;
 }
 
+/*
+ * Zero-copy Raw encoder, for clients using the pixel format of the
+ * framebuffer. Instead of copying pixels into a new block, it queues
+ * references to rows of the framebuffer snapshot. A band of the
+ * snapshot is copied from the framebuffer only once after each
+ * change, and then shared by all clients served by this thread.
+ * Returns 0 if the rectangle should be encoded with
+ * rfb_encode_raw_block() instead, 1 if all the data has been queued,
+ * calling fn after it has been sent.
+ */
+
+int rfb_encode_raw_nocopy(CL_SLOT *cl, FB_RECT *r, AIO_FUNCPTR fn)
+{
+  CARD8 rect_hdr[12];
+  AIO_SHARED *band;
+  AIO_FUNCPTR band_fn = NULL;
+  size_t row_size;
+  int band_idx, band_y1, y;
+
+  if ( cl->trans_func != transfunc_null || cl->format.bits_pixel != 32 ||
+       g_screen_info.pixformat.bits_pixel != 32 )
+    return 0;
+
+  row_size = r->w * sizeof(CARD32);
+  if (row_size < NOCOPY_MIN_ROW_SIZE && r->w != g_fb_width)
+    return 0;
+
+  if ( s_snap_bands == NULL || s_snap_fb_width != g_fb_width ||
+       s_snap_fb_height != g_fb_height ) {
+    free_snapshot();
+    s_snap_num_bands = ((int)g_fb_height + SNAP_BAND_ROWS - 1) /
+      SNAP_BAND_ROWS;
+    s_snap_bands = calloc(s_snap_num_bands, sizeof(AIO_SHARED *));
+    if (s_snap_bands == NULL)
+      return 0;
+    s_snap_fb_width = g_fb_width;
+    s_snap_fb_height = g_fb_height;
+  }
+
+  /* Copy missing bands first, so that nothing is queued on failure */
+  for (band_idx = r->y / SNAP_BAND_ROWS;
+       band_idx <= (r->y + r->h - 1) / SNAP_BAND_ROWS; band_idx++) {
+    if (s_snap_bands[band_idx] == NULL) {
+      y = band_idx * SNAP_BAND_ROWS;
+      band_y1 = y + SNAP_BAND_ROWS;
+      if (band_y1 > (int)g_fb_height)
+        band_y1 = (int)g_fb_height;
+      band = aio_shared_new((band_y1 - y) * g_fb_width * sizeof(CARD32));
+      if (band == NULL)
+        return 0;
+      memcpy(band->data, &g_framebuffer[y * (int)g_fb_width],
+             band->data_size);
+      s_snap_bands[band_idx] = band;
+    }
+  }
+
+  put_rect_header(rect_hdr, r);
+  aio_write(NULL, rect_hdr, 12);
+
+  for (y = r->y; y < r->y + r->h; y = band_y1) {
+    band_idx = y / SNAP_BAND_ROWS;
+    band = s_snap_bands[band_idx];
+    band_y1 = (band_idx + 1) * SNAP_BAND_ROWS;
+    if (band_y1 >= r->y + r->h) {
+      band_y1 = r->y + r->h;
+      band_fn = fn;
+    }
+    if (r->w == g_fb_width) {
+      /* Rows are contiguous */
+      aio_write_shared_part(band_fn, band,
+                            (y - band_idx * SNAP_BAND_ROWS) * row_size,
+                            (band_y1 - y) * row_size);
+    } else {
+      for ( ; y < band_y1; y++) {
+        aio_write_shared_part((y == band_y1 - 1) ? band_fn : NULL, band,
+                              ((y - band_idx * SNAP_BAND_ROWS) *
+                               (int)g_fb_width + r->x) * sizeof(CARD32),
+                              row_size);
+      }
+    }
+  }
+
+  return 1;
+}
+
+static void free_snapshot(void)
+{
+  int i;
+
+  if (s_snap_bands != NULL) {
+    for (i = 0; i < s_snap_num_bands; i++)
+      aio_shared_unref(s_snap_bands[i]);
+    free(s_snap_bands);
+    s_snap_bands = NULL;
+  }
+  s_snap_num_bands = 0;
+}
+
 /*
  * CopyRect "encoder" :-)
  */
@@ -154,7 +417,7 @@ AIO_BLOCK *rfb_encode_copyrect_block(CL_SLOT *cl, FB_RECT *r)
 {
   AIO_BLOCK *block;
 
-  block = malloc(sizeof(AIO_BLOCK) + 12 + 4);
+  block = aio_new_block(12 + 4);
   if (block) {
     put_rect_header(block->data, r);
     buf_put_CARD16(&block->data[12], r->src_x);
@@ -186,7 +449,9 @@ int put_rect_header(CARD8 *buf, FB_RECT *r)
 /********************************************************************/
 
 /* Medium-level functions */
-static int encode_tile_using_cache(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
+static int encode_tile_cached8(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
+static int encode_tile_cached16(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
+static int encode_tile_cached32(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
 static int encode_tile8(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
 static int encode_tile16(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
 static int encode_tile32(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r);
@@ -206,8 +471,8 @@ static void analyze_rect16(CARD16 *buf, PALETTE2 *pal, FB_RECT *r);
 static void analyze_rect32(CARD32 *buf, PALETTE2 *pal, FB_RECT *r);
 
 /* Variables to keep background color of previous tile */
-static CARD32 prev_bg;
-static int prev_bg_set;
+static AIO_THREAD_LOCAL CARD32 prev_bg;
+static AIO_THREAD_LOCAL int prev_bg_set;
 
 /********************************************************************/
 /*                Hextile encoder: High-level stuff                 */
@@ -223,28 +488,36 @@ AIO_BLOCK *rfb_encode_hextile_block(CL_SLOT *cl, FB_RECT *r)
 {
   AIO_BLOCK *block;
   int num_tiles;
-  int aligned_f;
+  int cache_f;
   int rx1, ry1;
   FB_RECT tile_r;
   CARD8 *data_ptr;
+  size_t max_size, data_size;
 
   /* Calculate number of tiles per this rectangle */
   num_tiles = ((r->w + 15) / 16) * ((r->h + 15) / 16);
 
-  /* Check if tiles are aligned on 16-pixel boundary */
-  aligned_f = (r->x & 0x0F) == 0 && (r->y & 0x0F) == 0;
-
-  /* Allocate a memory block of maximum possible size */
-  block = malloc(sizeof(AIO_BLOCK) + 12 +
-                 r->w * r->h * (cl->format.bits_pixel / 8) +
-                 num_tiles);
-  if (block == NULL)
-    return NULL;
+  /* Check if tiles are aligned on 16-pixel boundary, and thus may be
+     cached (in the cache for the client's pixel format) */
+  cache_f = (r->x & 0x0F) == 0 && (r->y & 0x0F) == 0 &&
+    cl->tile_cache != NULL && check_tile_cache(cl->tile_cache);
+
+  /* Make sure the scratch buffer is of maximum possible size */
+  max_size = 12 + r->w * r->h * (cl->format.bits_pixel / 8) + num_tiles;
+  if (max_size > s_hextile_buf_size) {
+    free(s_hextile_buf);
+    s_hextile_buf = malloc(max_size);
+    if (s_hextile_buf == NULL) {
+      s_hextile_buf_size = 0;
+      return NULL;
+    }
+    s_hextile_buf_size = max_size;
+  }
 
-  put_rect_header(block->data, r);
+  put_rect_header(s_hextile_buf, r);
 
   prev_bg_set = 0;
-  data_ptr = (CARD8 *)&block->data[12];
+  data_ptr = &s_hextile_buf[12];
   rx1 = r->x + r->w;
   ry1 = r->y + r->h;
   tile_r.h = 16;
@@ -257,13 +530,25 @@ AIO_BLOCK *rfb_encode_hextile_block(CL_SLOT *cl, FB_RECT *r)
       if (rx1 - tile_r.x < 16)
         tile_r.w = rx1 - tile_r.x;
 
+      /* To cache or not to cache? */
+      if (cache_f && tile_r.w == 16 && tile_r.h == 16) {
+        switch (cl->format.bits_pixel) {
+        case 8:
+          data_ptr += encode_tile_cached8(data_ptr, cl, &tile_r);
+          break;
+        case 16:
+          data_ptr += encode_tile_cached16(data_ptr, cl, &tile_r);
+          break;
+        case 32:
+          data_ptr += encode_tile_cached32(data_ptr, cl, &tile_r);
+          break;
+        }
+        continue;
+      }
+
       switch (cl->format.bits_pixel) {
       case 8:
-        /* 8-bit color: to cache or not to cache? */
-        if (aligned_f && cl->bgr233_f && tile_r.w == 16 && tile_r.h == 16)
-          data_ptr += encode_tile_using_cache(data_ptr, cl, &tile_r);
-        else
-          data_ptr += encode_tile8(data_ptr, cl, &tile_r);
+        data_ptr += encode_tile8(data_ptr, cl, &tile_r);
         break;
       case 16:
         data_ptr += encode_tile16(data_ptr, cl, &tile_r);
@@ -275,11 +560,17 @@ AIO_BLOCK *rfb_encode_hextile_block(CL_SLOT *cl, FB_RECT *r)
     }
   }
 
-  block->data_size = data_ptr - (CARD8 *)block->data;
-  return realloc(block, sizeof(AIO_BLOCK) + block->data_size);
+  /* Copy encoded data into a block of exact size */
+  data_size = data_ptr - s_hextile_buf;
+  block = aio_new_block(data_size);
+  if (block != NULL) {
+    memcpy(block->data, s_hextile_buf, data_size);
+    block->data_size = data_size;
+  }
+  return block;
 }
 
-static long s_cache_hits, s_cache_misses;
+static AIO_THREAD_LOCAL long s_cache_hits, s_cache_misses;
 void get_hextile_caching_stats(long *hits, long *misses)
 {
   *hits = s_cache_hits; *misses = s_cache_misses;
@@ -290,100 +581,105 @@ void get_hextile_caching_stats(long *hits, long *misses)
 /********************************************************************/
 
 /*
- * Encode properly-aligned 16x16 tile in BGR233 pixel format, using
- * data from cache if available, or saving encoded data in cache
- * otherwise.
+ * Encode properly-aligned 16x16 tile, using data from the cache for
+ * the client's pixel format if available, or saving encoded data in
+ * that cache otherwise. Cached data always includes the background
+ * color, it's omitted on sending if the previous tile had the same.
  */
 
-static int encode_tile_using_cache(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r)
-{
-  int tiles_in_row, tile_ord;
-  TILE_HINTS *hints;
-  CARD8 *cache;
-  CARD8 *dst = dst_buf;
-  CARD8 tile_buf[256];
-  PALETTE2 pal;
-  int dst_bytes;
-
-  tiles_in_row = (int)g_fb_width / 16;
-  tile_ord = (r->y / 16) * tiles_in_row + (r->x / 16);
-  hints = &s_hints8[tile_ord];
-  cache = &s_cache8[tile_ord * HEXTILE_MAX_TILE_DATASIZE];
-
-  if (hints->valid_f && hints->hextile_datasize != 0) {
-
-    /* Cache hit! */
-    s_cache_hits++;
-
-    if (cache[0] & RFB_HEXTILE_RAW) {
-      /* Raw sub-encoding: copy cached data, forget previous background. */
-      memcpy(dst, cache, hints->hextile_datasize);
-      dst += hints->hextile_datasize;
-      prev_bg_set = 0;
-    } else {
-      if (prev_bg != hints->bg || !prev_bg_set) {
-        /* Just copy cached data. */
-        memcpy(dst, cache, hints->hextile_datasize);
-        dst += hints->hextile_datasize;
-      } else {
-        /* The same background color as in the previous tile: do not copy
-           second byte from the cache, clear RFB_HEXTILE_BG_SPECIFIED. */
-        *dst++ = (cache[0] & ~RFB_HEXTILE_BG_SPECIFIED);
-        memcpy(dst, &cache[2], hints->hextile_datasize);
-        dst += (hints->hextile_datasize - 2);
-      }
-      /* Remember previous background color. */
-      prev_bg = hints->bg;
-      prev_bg_set = 1;
-    }
-    dst_bytes = dst - dst_buf;
-
-  } else {                      /* Cache miss */
-
-    s_cache_misses++;
-
-    /* Step 1: Encode tile. */
-    (*cl->trans_func)(tile_buf, r, cl->trans_table);
-    if (hints->valid_f) {
-      /* Here we can save one analyze_rect8() call. */
-      pal.num_colors = (int)hints->num_colors;
-      pal.bg = (CARD32)hints->bg;
-      pal.fg = (CARD32)hints->fg;
-    } else {
-      analyze_rect8(tile_buf, &pal, r);
-    }
-    dst_bytes = encode_tile_ht8(dst_buf, tile_buf, &pal, r);
-    if (dst_bytes < 0)
-      dst_bytes = encode_tile_raw8(dst_buf, cl, r);
-
-    /* Step 2: Save meta-data in the cache. */
-    hints->num_colors = (CARD8)pal.num_colors;
-    hints->bg = (CARD8)pal.bg;
-    hints->fg = (CARD8)pal.fg;
-    hints->valid_f = 1;
-
-    /* Step 3: Save encoded data in the cache. */
-    if (dst_buf[0] & RFB_HEXTILE_RAW) {
-      memcpy(cache, dst_buf, dst_bytes);
-      hints->hextile_datasize = dst_bytes;
-    } else {
-      if (dst_buf[0] & RFB_HEXTILE_BG_SPECIFIED) {
-        memcpy(cache, dst_buf, dst_bytes);
-        hints->hextile_datasize = dst_bytes;
-      } else {
-        /* Insert background color into the cached data. */
-        cache[0] = (dst_buf[0] | RFB_HEXTILE_BG_SPECIFIED);
-        cache[1] = (CARD8)pal.bg;
-        memcpy(&cache[2], &dst_buf[1], dst_bytes - 1);
-        hints->hextile_datasize = dst_bytes + 1;
-      }
-    }
-
-  }
-
-  return dst_bytes;
+#define DEFINE_ENCODE_TILE_CACHED(bpp)                                      \
+                                                                            \
+static int encode_tile_cached##bpp(CARD8 *dst_buf, CL_SLOT *cl, FB_RECT *r) \
+{                                                                           \
+  int tiles_in_row, tile_ord;                                               \
+  TILE_HINTS *hints;                                                        \
+  CARD8 *cache;                                                             \
+  CARD8 *dst = dst_buf;                                                     \
+  CARD##bpp tile_buf[256];                                                  \
+  CARD##bpp bg_color;                                                       \
+  PALETTE2 pal;                                                             \
+  int dst_bytes;                                                            \
+                                                                            \
+  tiles_in_row = (int)g_fb_width / 16;                                      \
+  tile_ord = (r->y / 16) * tiles_in_row + (r->x / 16);                      \
+  hints = &cl->tile_cache->hints[tile_ord];                                 \
+  cache = &cl->tile_cache->data[tile_ord * cl->tile_cache->tile_datasize];  \
+                                                                            \
+  if (hints->valid_f && hints->hextile_datasize != 0) {                     \
+                                                                            \
+    /* Cache hit! */                                                        \
+    s_cache_hits++;                                                         \
+                                                                            \
+    if (cache[0] & RFB_HEXTILE_RAW) {                                       \
+      /* Raw sub-encoding: copy cached data, forget previous background. */ \
+      memcpy(dst, cache, hints->hextile_datasize);                          \
+      dst += hints->hextile_datasize;                                       \
+      prev_bg_set = 0;                                                      \
+    } else {                                                                \
+      if (prev_bg != hints->bg || !prev_bg_set) {                           \
+        /* Just copy cached data. */                                        \
+        memcpy(dst, cache, hints->hextile_datasize);                        \
+        dst += hints->hextile_datasize;                                     \
+      } else {                                                              \
+        /* The same background color as in the previous tile: do not copy  \
+           the color from the cache, clear RFB_HEXTILE_BG_SPECIFIED. */     \
+        *dst++ = (cache[0] & ~RFB_HEXTILE_BG_SPECIFIED);                    \
+        memcpy(dst, &cache[1 + sizeof(CARD##bpp)],                          \
+               hints->hextile_datasize - 1 - sizeof(CARD##bpp));            \
+        dst += hints->hextile_datasize - 1 - sizeof(CARD##bpp);             \
+      }                                                                     \
+      /* Remember previous background color. */                             \
+      prev_bg = hints->bg;                                                  \
+      prev_bg_set = 1;                                                      \
+    }                                                                       \
+    dst_bytes = dst - dst_buf;                                              \
+                                                                            \
+  } else {                      /* Cache miss */                            \
+                                                                            \
+    s_cache_misses++;                                                       \
+                                                                            \
+    /* Step 1: Encode tile. */                                              \
+    (*cl->trans_func)(tile_buf, r, cl->trans_table);                        \
+    if (hints->valid_f) {                                                   \
+      /* Here we can save one analyze_rect() call. */                       \
+      pal.num_colors = (int)hints->num_colors;                              \
+      pal.bg = hints->bg;                                                   \
+      pal.fg = hints->fg;                                                   \
+    } else {                                                                \
+      analyze_rect##bpp(tile_buf, &pal, r);                                 \
+    }                                                                       \
+    dst_bytes = encode_tile_ht##bpp(dst_buf, tile_buf, &pal, r);            \
+    if (dst_bytes < 0)                                                      \
+      dst_bytes = encode_tile_raw##bpp(dst_buf, cl, r);                     \
+                                                                            \
+    /* Step 2: Save meta-data in the cache. */                              \
+    hints->num_colors = (CARD8)pal.num_colors;                              \
+    hints->bg = pal.bg;                                                     \
+    hints->fg = pal.fg;                                                     \
+    hints->valid_f = 1;                                                     \
+                                                                            \
+    /* Step 3: Save encoded data in the cache. */                           \
+    if (dst_buf[0] & (RFB_HEXTILE_RAW | RFB_HEXTILE_BG_SPECIFIED)) {        \
+      memcpy(cache, dst_buf, dst_bytes);                                    \
+      hints->hextile_datasize = dst_bytes;                                  \
+    } else {                                                                \
+      /* Insert background color into the cached data. */                   \
+      cache[0] = (dst_buf[0] | RFB_HEXTILE_BG_SPECIFIED);                   \
+      bg_color = (CARD##bpp)pal.bg;                                         \
+      BUF_PUT_PIXEL##bpp(&cache[1], bg_color);                              \
+      memcpy(&cache[1 + sizeof(CARD##bpp)], &dst_buf[1], dst_bytes - 1);    \
+      hints->hextile_datasize = dst_bytes + sizeof(CARD##bpp);              \
+    }                                                                       \
+                                                                            \
+  }                                                                         \
+                                                                            \
+  return dst_bytes;                                                         \
 }
 
+DEFINE_ENCODE_TILE_CACHED(8)
+DEFINE_ENCODE_TILE_CACHED(16)
+DEFINE_ENCODE_TILE_CACHED(32)
+
 /*
  * Analyze and encode a tile.
  */
@@ -578,28 +874,23 @@ DEFINE_ENCODE_TILE_RAW(32)
 static void analyze_rect##bpp(CARD##bpp *buf, PALETTE2 *pal, FB_RECT *r) \
 {                                                                        \
   CARD##bpp c0, c1;                                                      \
-  int i, n0, n1;                                                         \
+  int i, n, n0, n1;                                                      \
   int num_pixels = r->w * r->h;                                          \
                                                                          \
   c0 = buf[0];                                                           \
-  for (i = 1; i < num_pixels && buf[i] == c0; i++);                      \
+  i = scan_solid##bpp(buf, num_pixels, c0);                              \
   if (i == num_pixels) {                                                 \
     pal->bg = (CARD32)c0;                                                \
     pal->num_colors = 1;        /* Solid-color rectangle */              \
     return;                                                              \
   }                                                                      \
                                                                          \
-  n0 = i;                                                                \
-  c1 = buf[i];                                                           \
-  n1 = 0;                                                                \
-  for (i++; i < num_pixels; i++) {                                       \
-    if (buf[i] == c0) {                                                  \
-      n0++;                                                              \
-    } else if (buf[i] == c1) {                                           \
-      n1++;                                                              \
-    } else                                                               \
-      break;                                                             \
-  }                                                                      \
+  /* The first pixel of color c1 is not counted in n1 */                 \
+  c1 = buf[i++];                                                         \
+  n = scan_two_colors##bpp(&buf[i], num_pixels - i, c0, c1, &n0);        \
+  n1 = n - n0;                                                           \
+  n0 += i - 1;                                                           \
+  i += n;                                                                \
   if (i == num_pixels) {                                                 \
     /* Background color is one that occupies more pixels */              \
     if (n0 > n1) {                                                       \
@@ -617,3 +908,369 @@ DEFINE_ANALYZE_RECT(8)
 DEFINE_ANALYZE_RECT(16)
 DEFINE_ANALYZE_RECT(32)
 
+/********************************************************************/
+/*                          ZRLE encoder                            */
+/********************************************************************/
+
+static int zrle_cpixel_size(RFB_PIXEL_FORMAT *fmt, int *offset_ptr);
+static int zrle_palette_index(ZRLE_PALETTE *pal, CARD32 color);
+static CARD8 *zrle_put_run_length(CARD8 *dst, int run);
+static CARD8 *encode_zrle_tile8(CARD8 *dst, CARD8 *buf, FB_RECT *r,
+                                int cp_size, int cp_offset);
+static CARD8 *encode_zrle_tile16(CARD8 *dst, CARD16 *buf, FB_RECT *r,
+                                 int cp_size, int cp_offset);
+static CARD8 *encode_zrle_tile32(CARD8 *dst, CARD32 *buf, FB_RECT *r,
+                                 int cp_size, int cp_offset);
+
+/*
+ * Rectangles are split into 64x64 tiles, and each tile is encoded
+ * with the cheapest of raw, solid, packed palette, plain RLE and
+ * palette RLE subencodings. Encoded tiles of a rectangle are
+ * compressed with the zlib stream of the client, which persists
+ * during the whole connection.
+ */
+
+AIO_BLOCK *rfb_encode_zrle_block(CL_SLOT *cl, FB_RECT *r)
+{
+  CARD32 tile_buf[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+  AIO_BLOCK *block, *new_block;
+  z_streamp pz = &cl->zs_zrle;
+  int cp_size, cp_offset;
+  int err;
+  int num_tiles;
+  int rx1, ry1;
+  FB_RECT tile_r;
+  CARD8 *data_ptr;
+  size_t max_size, data_size, block_size, out_size;
+
+  cp_size = zrle_cpixel_size(&cl->format, &cp_offset);
+
+  /* Raw subencoding is the worst case for any tile */
+  num_tiles = ((r->w + ZRLE_TILE_SIZE - 1) / ZRLE_TILE_SIZE) *
+    ((r->h + ZRLE_TILE_SIZE - 1) / ZRLE_TILE_SIZE);
+  max_size = r->w * r->h * cp_size + num_tiles;
+  if (max_size > s_zrle_buf_size) {
+    free(s_zrle_buf);
+    s_zrle_buf = malloc(max_size);
+    if (s_zrle_buf == NULL) {
+      s_zrle_buf_size = 0;
+      return NULL;
+    }
+    s_zrle_buf_size = max_size;
+  }
+
+  data_ptr = s_zrle_buf;
+  rx1 = r->x + r->w;
+  ry1 = r->y + r->h;
+  tile_r.h = ZRLE_TILE_SIZE;
+
+  for (tile_r.y = r->y; tile_r.y < ry1; tile_r.y += ZRLE_TILE_SIZE) {
+    if (ry1 - tile_r.y < ZRLE_TILE_SIZE)
+      tile_r.h = ry1 - tile_r.y;
+    tile_r.w = ZRLE_TILE_SIZE;
+    for (tile_r.x = r->x; tile_r.x < rx1; tile_r.x += ZRLE_TILE_SIZE) {
+      if (rx1 - tile_r.x < ZRLE_TILE_SIZE)
+        tile_r.w = rx1 - tile_r.x;
+
+      (*cl->trans_func)(tile_buf, &tile_r, cl->trans_table);
+      switch (cl->format.bits_pixel) {
+      case 8:
+        data_ptr = encode_zrle_tile8(data_ptr, (CARD8 *)tile_buf,
+                                     &tile_r, cp_size, cp_offset);
+        break;
+      case 16:
+        data_ptr = encode_zrle_tile16(data_ptr, (CARD16 *)tile_buf,
+                                      &tile_r, cp_size, cp_offset);
+        break;
+      case 32:
+        data_ptr = encode_zrle_tile32(data_ptr, tile_buf,
+                                      &tile_r, cp_size, cp_offset);
+        break;
+      }
+    }
+  }
+  data_size = data_ptr - s_zrle_buf;
+
+  /* Initialize compression stream if needed */
+  if (!cl->zs_zrle_active) {
+    pz->zalloc = Z_NULL;
+    pz->zfree = Z_NULL;
+    pz->opaque = Z_NULL;
+    if (deflateInit(pz, cl->compress_level) != Z_OK) {
+      log_write(LL_ERROR, "ZRLE compression initialization error");
+      aio_close(0);
+      return NULL;
+    }
+    cl->zs_zrle_active = 1;
+    cl->zs_zrle_level = cl->compress_level;
+  }
+
+  /* Leave room for the rectangle header, data length and flush
+     markers. deflateBound() does not count the latter, so the block
+     is replaced with a larger one if the output does not fit. */
+  block_size = 16 + deflateBound(pz, data_size) + 16;
+  block = aio_new_block(block_size);
+  if (block == NULL) {
+    aio_close(0);
+    return NULL;
+  }
+  out_size = 0;
+
+  pz->next_out = (Bytef *)&block->data[16];
+  pz->avail_out = block_size - 16;
+
+  /* deflateParams() may write a block boundary to the output buffer.
+     On Z_BUF_ERROR parameters are not changed, try again next time. */
+  err = Z_OK;
+  if (cl->compress_level != cl->zs_zrle_level) {
+    pz->avail_in = 0;
+    err = deflateParams(pz, cl->compress_level, Z_DEFAULT_STRATEGY);
+    if (err == Z_OK)
+      cl->zs_zrle_level = cl->compress_level;
+    else if (err == Z_BUF_ERROR)
+      err = Z_OK;
+  }
+
+  pz->next_in = (Bytef *)s_zrle_buf;
+  pz->avail_in = data_size;
+  while (err == Z_OK) {
+    err = deflate(pz, Z_SYNC_FLUSH);
+    out_size = block_size - 16 - pz->avail_out;
+    if (err == Z_BUF_ERROR && pz->avail_in == 0) {
+      err = Z_OK;               /* Nothing left to flush */
+      break;
+    }
+    if (err != Z_OK || pz->avail_out != 0)
+      break;
+
+    new_block = aio_new_block(block_size * 2);
+    if (new_block == NULL) {
+      err = Z_MEM_ERROR;
+      break;
+    }
+    memcpy(new_block->data, block->data, 16 + out_size);
+    aio_release_block(block);
+    block = new_block;
+    block_size *= 2;
+    pz->next_out = (Bytef *)&block->data[16 + out_size];
+    pz->avail_out = block_size - 16 - out_size;
+  }
+
+  /* The client would not be able to decompress further data if some
+     of the compressed data has been lost, so close the connection */
+  if (err != Z_OK || pz->avail_in != 0) {
+    log_write(LL_ERROR, "ZRLE compression error, closing connection to %s",
+              cur_slot->name);
+    aio_release_block(block);
+    aio_close(0);
+    return NULL;
+  }
+
+  put_rect_header(block->data, r);
+  buf_put_CARD32(&block->data[12], (CARD32)out_size);
+  block->data_size = 16 + out_size;
+  return block;
+}
+
+/*
+ * Get the size of a compressed pixel (CPIXEL) in the pixel format.
+ * 32-bit true color pixels with all color bits in three bytes are
+ * sent as these three bytes, *offset_ptr is set to the offset of
+ * those bytes in the translated pixel.
+ */
+
+static int zrle_cpixel_size(RFB_PIXEL_FORMAT *fmt, int *offset_ptr)
+{
+  CARD32 mask;
+
+  *offset_ptr = 0;
+  if (fmt->bits_pixel != 32 || !fmt->true_color || fmt->color_depth > 24)
+    return fmt->bits_pixel / 8;
+
+  mask = ((CARD32)fmt->r_max << fmt->r_shift |
+          (CARD32)fmt->g_max << fmt->g_shift |
+          (CARD32)fmt->b_max << fmt->b_shift);
+  if ((mask & 0xFF000000) == 0) {
+    *offset_ptr = (fmt->big_endian) ? 1 : 0;
+    return 3;
+  }
+  if ((mask & 0x000000FF) == 0) {
+    *offset_ptr = (fmt->big_endian) ? 0 : 1;
+    return 3;
+  }
+  return 4;
+}
+
+/*
+ * Find the color in the palette, adding it if not found. Returns its
+ * index, or -1 if the palette is full.
+ */
+
+static int zrle_palette_index(ZRLE_PALETTE *pal, CARD32 color)
+{
+  unsigned int h;
+  int idx;
+
+  h = (color * 2654435761U) >> (32 - ZRLE_HASH_BITS);
+  while ((idx = pal->slots[h]) != 0) {
+    if (pal->colors[idx - 1] == color)
+      return idx - 1;
+    h = (h + 1) & ((1 << ZRLE_HASH_BITS) - 1);
+  }
+
+  if (pal->num_colors == ZRLE_MAX_PALETTE)
+    return -1;
+  pal->colors[pal->num_colors++] = color;
+  pal->slots[h] = (CARD8)pal->num_colors;
+  return pal->num_colors - 1;
+}
+
+/* Run lengths are sent as a number of 255s followed by the remainder */
+static CARD8 *zrle_put_run_length(CARD8 *dst, int run)
+{
+  run--;
+  while (run >= 255) {
+    *dst++ = 255;
+    run -= 255;
+  }
+  *dst++ = (CARD8)run;
+  return dst;
+}
+
+/*
+ * Encode a tile of pixels in the client pixel format, return a
+ * pointer to the byte following the encoded data. Runs of equal
+ * pixels may span several rows.
+ */
+
+#define DEFINE_ENCODE_ZRLE_TILE(bpp)                                        \
+                                                                            \
+static CARD8 *encode_zrle_tile##bpp(CARD8 *dst, CARD##bpp *buf,             \
+                                    FB_RECT *r, int cp_size,                \
+                                    int cp_offset)                          \
+{                                                                           \
+  ZRLE_PALETTE pal;                                                         \
+  CARD##bpp c;                                                              \
+  int num_pixels = r->w * r->h;                                             \
+  int palette_f = 1;                                                        \
+  int num_runs = 0, single_runs = 0, run_bytes = 0;                         \
+  int bits, x, y, i, run, idx, byte, nbits;                                 \
+  size_t raw_size, best_size, size;                                         \
+  int best_subenc;                                                          \
+                                                                            \
+  /* Count runs and collect the palette */                                  \
+  pal.num_colors = 0;                                                       \
+  memset(pal.slots, 0, sizeof(pal.slots));                                  \
+  for (i = 0; i < num_pixels; i += run) {                                   \
+    c = buf[i];                                                             \
+    run = scan_solid##bpp(&buf[i], num_pixels - i, c);                      \
+    num_runs++;                                                             \
+    if (run == 1)                                                           \
+      single_runs++;                                                        \
+    run_bytes += (run - 1) / 255 + 1;                                       \
+    if (palette_f && zrle_palette_index(&pal, (CARD32)c) < 0)               \
+      palette_f = 0;                                                        \
+  }                                                                         \
+                                                                            \
+  if (palette_f && pal.num_colors == 1) {                                   \
+    *dst++ = 1;                                                             \
+    memcpy(dst, (CARD8 *)&buf[0] + cp_offset, cp_size);                     \
+    return dst + cp_size;                                                   \
+  }                                                                         \
+                                                                            \
+  /* Choose the subencoding producing the least data */                     \
+  raw_size = (size_t)num_pixels * cp_size;                                  \
+  best_subenc = 0;                                                          \
+  best_size = raw_size;                                                     \
+  size = (size_t)num_runs * cp_size + run_bytes;                            \
+  if (size < best_size) {                                                   \
+    best_subenc = 128;                                                      \
+    best_size = size;                                                       \
+  }                                                                         \
+  bits = 0;                                                                 \
+  if (palette_f) {                                                          \
+    size = (size_t)pal.num_colors * cp_size + num_runs +                    \
+      (run_bytes - single_runs);                                            \
+    if (size < best_size) {                                                 \
+      best_subenc = 128 + pal.num_colors;                                   \
+      best_size = size;                                                     \
+    }                                                                       \
+    if (pal.num_colors <= 16) {                                             \
+      bits = (pal.num_colors <= 2) ? 1 : (pal.num_colors <= 4) ? 2 : 4;     \
+      size = (size_t)pal.num_colors * cp_size +                             \
+        (size_t)r->h * ((r->w * bits + 7) / 8);                             \
+      if (size < best_size) {                                               \
+        best_subenc = pal.num_colors;                                       \
+        best_size = size;                                                   \
+      }                                                                     \
+    }                                                                       \
+  }                                                                         \
+                                                                            \
+  *dst++ = (CARD8)best_subenc;                                              \
+                                                                            \
+  if (best_subenc == 0) {                                                   \
+    if (cp_size == sizeof(CARD##bpp)) {                                     \
+      memcpy(dst, buf, raw_size);                                           \
+      return dst + raw_size;                                                \
+    }                                                                       \
+    for (i = 0; i < num_pixels; i++) {                                      \
+      memcpy(dst, (CARD8 *)&buf[i] + cp_offset, cp_size);                   \
+      dst += cp_size;                                                       \
+    }                                                                       \
+    return dst;                                                             \
+  }                                                                         \
+                                                                            \
+  if (best_subenc == 128) {                                                 \
+    for (i = 0; i < num_pixels; i += run) {                                 \
+      c = buf[i];                                                           \
+      run = scan_solid##bpp(&buf[i], num_pixels - i, c);                    \
+      memcpy(dst, (CARD8 *)&c + cp_offset, cp_size);                        \
+      dst = zrle_put_run_length(dst + cp_size, run);                        \
+    }                                                                       \
+    return dst;                                                             \
+  }                                                                         \
+                                                                            \
+  /* Palette subencodings */                                                \
+  for (i = 0; i < pal.num_colors; i++) {                                    \
+    c = (CARD##bpp)pal.colors[i];                                           \
+    memcpy(dst, (CARD8 *)&c + cp_offset, cp_size);                          \
+    dst += cp_size;                                                         \
+  }                                                                         \
+                                                                            \
+  if (best_subenc > 128) {                                                  \
+    for (i = 0; i < num_pixels; i += run) {                                 \
+      c = buf[i];                                                           \
+      run = scan_solid##bpp(&buf[i], num_pixels - i, c);                    \
+      idx = zrle_palette_index(&pal, (CARD32)c);                            \
+      if (run == 1) {                                                       \
+        *dst++ = (CARD8)idx;                                                \
+      } else {                                                              \
+        *dst++ = (CARD8)(idx | 128);                                        \
+        dst = zrle_put_run_length(dst, run);                                \
+      }                                                                     \
+    }                                                                       \
+    return dst;                                                             \
+  }                                                                         \
+                                                                            \
+  for (y = 0; y < r->h; y++) {                                              \
+    byte = 0;                                                               \
+    nbits = 0;                                                              \
+    for (x = 0; x < r->w; x++) {                                            \
+      idx = zrle_palette_index(&pal, (CARD32)buf[y * r->w + x]);            \
+      byte = byte << bits | idx;                                            \
+      nbits += bits;                                                        \
+      if (nbits == 8) {                                                     \
+        *dst++ = (CARD8)byte;                                               \
+        byte = 0;                                                           \
+        nbits = 0;                                                          \
+      }                                                                     \
+    }                                                                       \
+    if (nbits != 0)                                                         \
+      *dst++ = (CARD8)(byte << (8 - nbits));                                \
+  }                                                                         \
+  return dst;                                                               \
+}
+
+DEFINE_ENCODE_ZRLE_TILE(8)
+DEFINE_ENCODE_ZRLE_TILE(16)
+DEFINE_ENCODE_ZRLE_TILE(32)
@@ -17,7 +17,7 @@
 #ifndef _REFLIB_ENCODE_H
 #define _REFLIB_ENCODE_H
 
-/* Max size of hextile-encoded data per one 16x16 tile */
+/* Max size of hextile-encoded data per one 16x16 tile, per byte of pixel */
 /* FIXME: Bad name? */
 #define HEXTILE_MAX_TILE_DATASIZE  260
 
@@ -41,8 +41,11 @@
 
 /* encode.c */
 
-int allocate_enc_cache(void);
-int sizeof_enc_cache(void);
+typedef struct _TILE_CACHE TILE_CACHE;
+
+TILE_CACHE *get_tile_cache(RFB_PIXEL_FORMAT *format);
+void release_tile_cache(TILE_CACHE *cache);
+int same_pixel_format(RFB_PIXEL_FORMAT *f1, RFB_PIXEL_FORMAT *f2);
 void invalidate_enc_cache(FB_RECT *r);
 void free_enc_cache(void);
 
@@ -50,11 +53,17 @@ int put_rect_header(CARD8 *buf, FB_RECT *r);
 void get_hextile_caching_stats(long *hits, long *misses);
 
 AIO_BLOCK *rfb_encode_raw_block(CL_SLOT *cl, FB_RECT *r);
+int rfb_encode_raw_nocopy(CL_SLOT *cl, FB_RECT *r, AIO_FUNCPTR fn);
 AIO_BLOCK *rfb_encode_copyrect_block(CL_SLOT *cl, FB_RECT *r);
 AIO_BLOCK *rfb_encode_hextile_block(CL_SLOT *cl, FB_RECT *r);
+AIO_BLOCK *rfb_encode_zrle_block(CL_SLOT *cl, FB_RECT *r);
 
 /* encode-tight.c */
 
+void set_tight_sharing(int enable_f);
+void invalidate_tight_cache(FB_RECT *r);
+void free_tight_cache(void);
+
 int rfb_encode_tight(CL_SLOT *cl, FB_RECT *r);
 
 #endif /* _REFLIB_ENCODE_H */
@@ -28,14 +28,17 @@
 #include "translate.h"
 #include "client_io.h"
 #include "encode.h"
+#include "pool.h"
+#include "scan.h"
 
 /* These parameters may be adjusted. */
 #define MIN_SPLIT_RECT_SIZE     4096
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/* This variable is set on every encode_tight_block() call. */
-static int usePixelFormat24;
+/* Rectangles at least that large are encoded in parallel if there is
+   a pool of encoding threads, see pool.c. */
+#define MIN_PARALLEL_RECT_SIZE 65536
 
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9). Last
@@ -69,9 +72,6 @@ static TIGHT_CONF tightConf[10] = {
   { 65536, 2048,  32,  8192, 9, 9, 9, 6, 200, 500,  96, 80,   200,   500 }
 };
 
-static int compressLevel;
-static int qualityLevel;
-
 /* Stuff dealing with palettes. */
 
 typedef struct COLOR_LIST_s {
@@ -91,17 +91,112 @@ typedef struct PALETTE_s {
   COLOR_LIST list[256];
 } PALETTE;
 
-static int paletteNumColors, paletteMaxColors;
-static CARD32 monoBackground, monoForeground;
-static PALETTE palette;
-
-/* Pointers to dynamically-allocated buffers. */
-
-static int tightBeforeBufSize = 0;
-static CARD8 *tightBeforeBuf = NULL;
-
-static int tightAfterBufSize = 0;
-static CARD8 *tightAfterBuf = NULL;
+/* Encoded data is collected in such buffers instead of queueing for
+   sending, in shared or parallel encoding. */
+
+typedef struct OUTPUT_BUF_s {
+  CARD8 *data;
+  size_t len, size;
+  int error;
+} OUTPUT_BUF;
+
+/* Encoder state. All the functions below operate on a context, so
+   that several rectangles can be encoded at once in different threads.
+   Each thread has its own contexts, see GetContext(). */
+
+typedef struct TIGHT_CTX_s {
+  /* Set on every rfb_encode_tight() call. */
+  int usePixelFormat24;
+  int compressLevel;
+  int qualityLevel;
+
+  /* Palette of the current subrectangle. */
+  int paletteNumColors, paletteMaxColors;
+  CARD32 monoBackground, monoForeground;
+  PALETTE palette;
+
+  /* Pointers to dynamically-allocated buffers. */
+  int tightBeforeBufSize;
+  CARD8 *tightBeforeBuf;
+  int tightAfterBufSize;
+  CARD8 *tightAfterBuf;
+
+  /* Where to put the data, NULL to queue it for sending. */
+  OUTPUT_BUF *out;
+  OUTPUT_BUF capture;
+
+  /* If collectJobs is set, subrectangles are saved as jobs for
+     parallel encoding instead of encoding them. */
+  int collectJobs;
+  struct TIGHT_JOB_s *jobs;
+  int numJobs, maxJobs;
+
+  /* Set while encoding data which should not depend on the state of
+     per-client zlib streams, the streams below are used instead. */
+  int statelessZlib;
+  z_stream zs[4];
+  int zsActive[4];
+  int zsLevel[4];
+
+  /* JPEG compression stuff. The compressor is created on first use
+     and kept for the lifetime of the context. */
+  struct jpeg_compress_struct jpegCinfo;
+  struct jpeg_error_mgr jpegErrorMgr;
+  int jpegCreated;
+  int jpegQuality;
+  CARD8 *jpegRowBuf;
+  int jpegRowBufWidth;
+  struct jpeg_destination_mgr jpegDstManager;
+  int jpegError;
+  int jpegDstDataLen;
+} TIGHT_CTX;
+
+/* Subrectangle to encode in parallel with others, see EncodeJob(). */
+
+typedef struct TIGHT_JOB_s {
+  CL_SLOT *cl;                  /* Read-only in EncodeJob()                */
+  int usePixelFormat24;
+  int compressLevel;
+  int qualityLevel;
+  FB_RECT rect;
+  int solid;                    /* Non-zero for a solid-color area         */
+  int success;
+  OUTPUT_BUF out;               /* Encoded data                            */
+} TIGHT_JOB;
+
+/* Contexts of this thread: one for rfb_encode_tight() calls, and one
+   for jobs of any thread, run in this thread by the pool. */
+static AIO_THREAD_LOCAL TIGHT_CTX *threadCtx = NULL;
+static AIO_THREAD_LOCAL TIGHT_CTX *jobCtx = NULL;
+
+/* Shared encoding. If enabled, rectangles are encoded once for all
+   clients of a thread with the same pixel format, compression level
+   and JPEG quality. Encoded data does not depend on the state of
+   per-client zlib streams: each rectangle is compressed with a fresh
+   stream, and the client is told to reset its stream. The data is
+   kept until the area is changed, see invalidate_tight_cache(). */
+
+#define SHARED_HASH_SIZE        256
+#define SHARED_MAX_RECTS       1024
+#define SHARED_MAX_BYTES    4194304
+
+typedef struct SHARED_RECT_s {
+  struct SHARED_RECT_s *next;       /* Next in the list, oldest first     */
+  struct SHARED_RECT_s *hashNext;   /* Next in the hash bucket            */
+  RFB_PIXEL_FORMAT format;
+  int compressLevel, qualityLevel;
+  FB_RECT rect;
+  AIO_SHARED *data;
+} SHARED_RECT;
+
+static int shareEncoding = 0;
+
+static AIO_THREAD_LOCAL SHARED_RECT *sharedRects = NULL;
+static AIO_THREAD_LOCAL SHARED_RECT *sharedRectsTail = NULL;
+static AIO_THREAD_LOCAL SHARED_RECT *sharedHash[SHARED_HASH_SIZE];
+static AIO_THREAD_LOCAL int sharedNumRects = 0;
+static AIO_THREAD_LOCAL size_t sharedNumBytes = 0;
+static AIO_THREAD_LOCAL CARD16 sharedFbWidth, sharedFbHeight;
 
 /* Prototypes for static functions. */
 
@@ -110,45 +205,69 @@ static void ExtendSolidArea   (FB_RECT *r, CARD32 colorValue, FB_RECT *result);
 static int  CheckSolidTile    (FB_RECT *r, CARD32 *colorPtr,
                                int needSameColor);
 
-static int  SendRectSimple    (CL_SLOT *cl, FB_RECT *r);
-static int  SendSubrect       (CL_SLOT *cl, FB_RECT *r);
-static void SendTightHeader   (FB_RECT *r);
-
-static void SendSolidRect     (CL_SLOT *cl);
-static int  SendMonoRect      (CL_SLOT *cl, int w, int h);
-static int  SendIndexedRect   (CL_SLOT *cl, int w, int h);
-static int  SendFullColorRect (CL_SLOT *cl, int w, int h);
-
-static int  CompressData(CL_SLOT *cl, int streamId, int dataLen,
-                         int zlibLevel, int zlibStrategy);
-static void SendCompressedData(int compressedLen);
-
-static void FillPalette8(int count);
-static void FillPalette16(int count);
-static void FillPalette32(int count);
-
-static void PaletteReset(void);
-static int  PaletteInsert(CARD32 rgb, int numPixels, int bpp);
+static TIGHT_CTX *GetContext  (TIGHT_CTX **ctxPtr);
+static void FreeContext       (TIGHT_CTX **ctxPtr);
+static void SetParameters     (TIGHT_CTX *ctx, CL_SLOT *cl);
+static int  CheckBuffers      (TIGHT_CTX *ctx, CL_SLOT *cl);
+static void DropClientStreams (CL_SLOT *cl);
+
+static int  SendRectParallel  (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static int  AddJob            (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r,
+                               int solid);
+static void EncodeJob         (void *arg);
+
+static int  SendRectTight     (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static int  SendRectSimple    (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static int  SendSubrect       (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static int  SendSolidSubrect  (TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static void SendTightHeader   (TIGHT_CTX *ctx, FB_RECT *r);
+static void OutputData        (TIGHT_CTX *ctx, void *data, int len);
+
+static void SendSolidRect     (TIGHT_CTX *ctx, CL_SLOT *cl);
+static int  SendMonoRect      (TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h);
+static int  SendIndexedRect   (TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h);
+static int  SendFullColorRect (TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h);
+
+static int  ResetStreamBits(TIGHT_CTX *ctx, CL_SLOT *cl, int streamId);
+static int  CompressData(TIGHT_CTX *ctx, CL_SLOT *cl, int streamId,
+                         int dataLen, int zlibLevel, int zlibStrategy);
+static void SendCompressedData(TIGHT_CTX *ctx, int compressedLen);
+
+static void FillPalette8(TIGHT_CTX *ctx, int count);
+static void FillPalette16(TIGHT_CTX *ctx, int count);
+static void FillPalette32(TIGHT_CTX *ctx, int count);
+
+static void PaletteReset(TIGHT_CTX *ctx);
+static int  PaletteInsert(TIGHT_CTX *ctx, CARD32 rgb, int numPixels, int bpp);
 
 static void Pack24(CARD8 *buf, int count);
 
-static void EncodeIndexedRect16(CARD8 *buf, int count);
-static void EncodeIndexedRect32(CARD8 *buf, int count);
+static void EncodeIndexedRect16(TIGHT_CTX *ctx, CARD8 *buf, int count);
+static void EncodeIndexedRect32(TIGHT_CTX *ctx, CARD8 *buf, int count);
 
-static void EncodeMonoRect8(CARD8 *buf, int w, int h);
-static void EncodeMonoRect16(CARD8 *buf, int w, int h);
-static void EncodeMonoRect32(CARD8 *buf, int w, int h);
+static void EncodeMonoRect8(TIGHT_CTX *ctx, CARD8 *buf, int w, int h);
+static void EncodeMonoRect16(TIGHT_CTX *ctx, CARD8 *buf, int w, int h);
+static void EncodeMonoRect32(TIGHT_CTX *ctx, CARD8 *buf, int w, int h);
 
-static int DetectSmoothImage(RFB_PIXEL_FORMAT *fmt, FB_RECT *r);
+static int DetectSmoothImage(TIGHT_CTX *ctx, RFB_PIXEL_FORMAT *fmt,
+                             FB_RECT *r);
 static unsigned long DetectSmoothImage24(RFB_PIXEL_FORMAT *fmt, FB_RECT *r);
 
-static int SendJpegRect(FB_RECT *r, int quality);
+static int SendJpegRect(TIGHT_CTX *ctx, FB_RECT *r, int quality);
+static j_compress_ptr GetJpegCompressor(TIGHT_CTX *ctx, int width);
+#ifndef JCS_EXTENSIONS
 static void PrepareRowForJpeg(CARD8 *dst, int x, int y, int count);
+#endif
 
 static void JpegInitDestination(j_compress_ptr cinfo);
 static boolean JpegEmptyOutputBuffer(j_compress_ptr cinfo);
 static void JpegTermDestination(j_compress_ptr cinfo);
-static void JpegSetDstManager(j_compress_ptr cinfo);
+static void JpegSetDstManager(TIGHT_CTX *ctx, j_compress_ptr cinfo);
+
+static SHARED_RECT *FindSharedRect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r);
+static int  AddSharedRect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r,
+                          AIO_SHARED *data);
+static void RemoveSharedRect(SHARED_RECT *prev, SHARED_RECT *sr);
 
 /*
  * Tight encoding implementation.
@@ -178,44 +297,308 @@ num_rects_tight(CL_SLOT *cl, FB_RECT *r)
   }
 }
 
+/*
+ * Enable or disable shared encoding, should be called before any
+ * clients are connected.
+ */
+
+void
+set_tight_sharing(int enable_f)
+{
+  shareEncoding = enable_f;
+}
+
 int
 rfb_encode_tight(CL_SLOT *cl, FB_RECT *r)
 {
-  int nMaxRows;
-  CARD32 colorValue;
-  FB_RECT rtile, rbest, rtemp;
-  int t;
+  TIGHT_CTX *ctx;
+  SHARED_RECT *sr;
+  AIO_SHARED *data;
+  FB_RECT key;
+  int share, parallel;
+  int success;
+
+  ctx = GetContext(&threadCtx);
+  if (ctx == NULL)
+    return 0;
+
+  SetParameters(ctx, cl);
+
+  /* Translation of colormapped pixels may change */
+  share = (shareEncoding && cl->format.true_color);
+  parallel = (pool_num_threads() != 0 && cl->enable_lastrect &&
+              r->w * r->h >= MIN_PARALLEL_RECT_SIZE);
+
+  if (!share && !parallel)
+    return SendRectTight(ctx, cl, r);
+
+  /* Data shared with other clients, or encoded in parallel, should not
+     depend on per-client zlib streams. */
+  DropClientStreams(cl);
 
-  compressLevel = cl->compress_level;
-  qualityLevel = cl->jpeg_quality;
+  if (share) {
+    /* Maybe other clients have received the same data already. */
+    sr = FindSharedRect(ctx, cl, r);
+    if (sr != NULL) {
+      aio_write_shared(NULL, sr->data);
+      return 1;
+    }
+
+    /* Collect encoded data instead of sending it. */
+    key = *r;
+    ctx->capture.len = 0;
+    ctx->capture.error = 0;
+    ctx->out = &ctx->capture;
+  }
+
+  ctx->statelessZlib = 1;
+  if (parallel) {
+    success = SendRectParallel(ctx, cl, r);
+  } else {
+    success = SendRectTight(ctx, cl, r);
+  }
+  ctx->statelessZlib = 0;
+  ctx->out = NULL;
+
+  if (!share)
+    return success;
+
+  if (ctx->capture.error || (data = aio_shared_new(ctx->capture.len)) == NULL)
+    return 0;
+  memcpy(data->data, ctx->capture.data, ctx->capture.len);
+  aio_write_shared(NULL, data);
+
+  /* On success, the reference is kept in the list of shared rects. */
+  if (!success || !AddSharedRect(ctx, cl, &key, data))
+    aio_shared_unref(data);
+
+  return success;
+}
+
+/*
+ * Get a context of this thread, allocating it on first use.
+ */
+
+static TIGHT_CTX *
+GetContext(TIGHT_CTX **ctxPtr)
+{
+  if (*ctxPtr == NULL)
+    *ctxPtr = calloc(1, sizeof(TIGHT_CTX));
+
+  return *ctxPtr;
+}
+
+static void
+FreeContext(TIGHT_CTX **ctxPtr)
+{
+  TIGHT_CTX *ctx = *ctxPtr;
+  int i;
+
+  if (ctx == NULL)
+    return;
+
+  for (i = 0; i < 4; i++) {
+    if (ctx->zsActive[i])
+      deflateEnd(&ctx->zs[i]);
+  }
+  if (ctx->jpegCreated)
+    jpeg_destroy_compress(&ctx->jpegCinfo);
+  free(ctx->jpegRowBuf);
+  for (i = 0; i < ctx->maxJobs; i++)
+    free(ctx->jobs[i].out.data);
+  free(ctx->jobs);
+  free(ctx->capture.data);
+  free(ctx->tightBeforeBuf);
+  free(ctx->tightAfterBuf);
+  free(ctx);
+
+  *ctxPtr = NULL;
+}
+
+static void
+SetParameters(TIGHT_CTX *ctx, CL_SLOT *cl)
+{
+  ctx->compressLevel = cl->compress_level;
+  ctx->qualityLevel = cl->jpeg_quality;
 
   if (cl->format.color_depth == 24 && cl->format.r_max == 0xFF &&
       cl->format.g_max == 0xFF && cl->format.b_max == 0xFF) {
-    usePixelFormat24 = 1;
+    ctx->usePixelFormat24 = 1;
+  } else {
+    ctx->usePixelFormat24 = 0;
+  }
+}
+
+/*
+ * Make sure the buffers are large enough for any subrectangle.
+ */
+
+static int
+CheckBuffers(TIGHT_CTX *ctx, CL_SLOT *cl)
+{
+  int maxBeforeSize, maxAfterSize;
+  CARD8 *newBuf;
+
+  maxBeforeSize = tightConf[ctx->compressLevel].maxRectSize *
+    (cl->format.bits_pixel / 8);
+  maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
+
+  if (ctx->tightBeforeBufSize < maxBeforeSize) {
+    newBuf = realloc(ctx->tightBeforeBuf, maxBeforeSize);
+    if (newBuf == NULL)
+      return 0;
+    ctx->tightBeforeBuf = newBuf;
+    ctx->tightBeforeBufSize = maxBeforeSize;
+  }
+
+  if (ctx->tightAfterBufSize < maxAfterSize) {
+    newBuf = realloc(ctx->tightAfterBuf, maxAfterSize);
+    if (newBuf == NULL)
+      return 0;
+    ctx->tightAfterBuf = newBuf;
+    ctx->tightAfterBufSize = maxAfterSize;
+  }
+
+  return 1;
+}
+
+/*
+ * Forget zlib streams of the client. The client resets its streams on
+ * receiving data compressed with fresh streams, and so should we, see
+ * ResetStreamBits().
+ */
+
+static void
+DropClientStreams(CL_SLOT *cl)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (cl->zs_active[i]) {
+      deflateEnd(&cl->zs_struct[i]);
+      cl->zs_active[i] = 0;
+    }
+  }
+}
+
+/*
+ * Parallel encoding. The rectangle is split as usual, but instead of
+ * encoding subrectangles one by one, they are saved as jobs and
+ * encoded by the pool of threads. Each subrectangle is compressed with
+ * fresh zlib streams, so the jobs do not depend on each other. Then
+ * the data is sent in the original order.
+ */
+
+static int
+SendRectParallel(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
+{
+  TIGHT_JOB *job;
+  int i, success;
+
+  ctx->collectJobs = 1;
+  ctx->numJobs = 0;
+  success = SendRectTight(ctx, cl, r);
+  ctx->collectJobs = 0;
+
+  if (!success)
+    return 0;
+
+  pool_run(EncodeJob, ctx->jobs, sizeof(TIGHT_JOB), ctx->numJobs);
+
+  for (i = 0; i < ctx->numJobs; i++) {
+    job = &ctx->jobs[i];
+    if (!job->success || job->out.error)
+      return 0;
+    OutputData(ctx, job->out.data, (int)job->out.len);
+  }
+
+  return 1;
+}
+
+static int
+AddJob(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r, int solid)
+{
+  TIGHT_JOB *newJobs, *job;
+  int newMax;
+
+  if (ctx->numJobs == ctx->maxJobs) {
+    newMax = (ctx->maxJobs != 0) ? ctx->maxJobs * 2 : 32;
+    newJobs = realloc(ctx->jobs, newMax * sizeof(TIGHT_JOB));
+    if (newJobs == NULL)
+      return 0;
+    memset(&newJobs[ctx->maxJobs], 0,
+           (newMax - ctx->maxJobs) * sizeof(TIGHT_JOB));
+    ctx->jobs = newJobs;
+    ctx->maxJobs = newMax;
+  }
+
+  job = &ctx->jobs[ctx->numJobs++];
+  job->cl = cl;
+  job->usePixelFormat24 = ctx->usePixelFormat24;
+  job->compressLevel = ctx->compressLevel;
+  job->qualityLevel = ctx->qualityLevel;
+  job->rect = *r;
+  job->solid = solid;
+  return 1;
+}
+
+/*
+ * Encode one subrectangle, called by the pool in any thread.
+ */
+
+static void
+EncodeJob(void *arg)
+{
+  TIGHT_JOB *job = (TIGHT_JOB *)arg;
+  TIGHT_CTX *ctx;
+
+  job->success = 0;
+  job->out.len = 0;
+  job->out.error = 0;
+
+  ctx = GetContext(&jobCtx);
+  if (ctx == NULL)
+    return;
+
+  ctx->usePixelFormat24 = job->usePixelFormat24;
+  ctx->compressLevel = job->compressLevel;
+  ctx->qualityLevel = job->qualityLevel;
+  if (!CheckBuffers(ctx, job->cl))
+    return;
+
+  ctx->statelessZlib = 1;
+  ctx->out = &job->out;
+  if (job->solid) {
+    job->success = SendSolidSubrect(ctx, job->cl, &job->rect);
   } else {
-    usePixelFormat24 = 0;
+    job->success = SendSubrect(ctx, job->cl, &job->rect);
   }
+  ctx->out = NULL;
+}
+
+static int
+SendRectTight(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
+{
+  int nMaxRows;
+  CARD32 colorValue;
+  FB_RECT rtile, rbest, rtemp;
+  int t;
 
   if (!cl->enable_lastrect || r->w * r->h < MIN_SPLIT_RECT_SIZE)
-    return SendRectSimple(cl, r);
+    return SendRectSimple(ctx, cl, r);
 
   /* Make sure we can write at least one pixel into tightBeforeBuf. */
 
-  if (tightBeforeBufSize < 4) {
-    tightBeforeBufSize = 4;
-    if (tightBeforeBuf == NULL)
-      tightBeforeBuf = malloc(tightBeforeBufSize);
-    else
-      tightBeforeBuf = realloc(tightBeforeBuf, tightBeforeBufSize);
-  }
+  if (!CheckBuffers(ctx, cl))
+    return 0;
 
   /* Calculate maximum number of rows in one non-solid rectangle. */
 
   {
     int maxRectSize, maxRectWidth, nMaxWidth;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[ctx->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[ctx->compressLevel].maxRectWidth;
     nMaxWidth = (r->w > maxRectWidth) ? maxRectWidth : r->w;
     nMaxRows = maxRectSize / nMaxWidth;
   }
@@ -230,7 +613,7 @@ rfb_encode_tight(CL_SLOT *cl, FB_RECT *r)
     if (rtile.y - r->y >= nMaxRows) {
       t = r->h - nMaxRows;
       r->h = nMaxRows;
-      if (!SendRectSimple(cl, r))
+      if (!SendRectSimple(ctx, cl, r))
         return 0;
       r->y += nMaxRows;
       r->h = t;
@@ -268,36 +651,28 @@ rfb_encode_tight(CL_SLOT *cl, FB_RECT *r)
         /* Send rectangles at top and left to solid-color area. */
 
         SET_RECT(&rtemp, r->x, r->y, r->w, rbest.y - r->y);
-        if (rbest.y != r->y && !SendRectSimple(cl, &rtemp))
+        if (rbest.y != r->y && !SendRectSimple(ctx, cl, &rtemp))
           return 0;
         SET_RECT(&rtemp, r->x, rbest.y, rbest.x - r->x, rbest.h);
-        if (rbest.x != r->x && !rfb_encode_tight(cl, &rtemp))
+        if (rbest.x != r->x && !SendRectTight(ctx, cl, &rtemp))
           return 0;
 
         /* Send solid-color rectangle. */
 
-        SendTightHeader(&rbest);
-
-        SET_RECT(&rtemp, rbest.x, rbest.y, 1, 1);
-        if (usePixelFormat24) {
-          transfunc_null(tightBeforeBuf, &rtemp, NULL);
-        } else {
-          (*cl->trans_func)(tightBeforeBuf, &rtemp, cl->trans_table);
-        }
-
-        SendSolidRect(cl);
+        if (!SendSolidSubrect(ctx, cl, &rbest))
+          return 0;
 
         /* Send remaining rectangles (at right and bottom). */
 
         SET_RECT(&rtemp, rbest.x + rbest.w, rbest.y,
                  r->w - (rbest.x - r->x) - rbest.w, rbest.h);
         if (rbest.x + rbest.w != r->x + r->w &&
-            !rfb_encode_tight(cl, &rtemp))
+            !SendRectTight(ctx, cl, &rtemp))
           return 0;
         SET_RECT(&rtemp, r->x, rbest.y + rbest.h,
                  r->w, r->h - (rbest.y - r->y) - rbest.h);
         if (rbest.y + rbest.h != r->y + r->h &&
-            !rfb_encode_tight(cl, &rtemp))
+            !SendRectTight(ctx, cl, &rtemp))
           return 0;
 
         /* Return after all recursive calls are done. */
@@ -311,7 +686,7 @@ rfb_encode_tight(CL_SLOT *cl, FB_RECT *r)
 
   /* No suitable solid-color rectangles found. */
 
-  return SendRectSimple(cl, r);
+  return SendRectSimple(ctx, cl, r);
 }
 
 static void
@@ -412,7 +787,7 @@ CheckSolidTile(FB_RECT *r, CARD32 *colorPtr, int needSameColor)
 {
   CARD32 *fb_ptr;
   CARD32 colorValue;
-  int dx, dy;
+  int dy;
 
   fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
 
@@ -420,15 +795,9 @@ CheckSolidTile(FB_RECT *r, CARD32 *colorPtr, int needSameColor)
   if (needSameColor && colorValue != *colorPtr)
     return 0;
 
-  /* Check the first row. */
-  for (dx = 0; dx < r->w; dx++) {
-    if (colorValue != fb_ptr[dx])
-      return 0;
-  }
-
-  /* Check other rows -- memcmp() does it faster. */
-  for (dy = 1; dy < r->h; dy++) {
-    if (memcmp(fb_ptr, &fb_ptr[dy * g_fb_width], r->w * sizeof(CARD32)) != 0)
+  /* Compare each row with the color, stop at the first mismatch. */
+  for (dy = 0; dy < r->h; dy++) {
+    if (scan_solid32(&fb_ptr[dy * g_fb_width], r->w, colorValue) != r->w)
       return 0;
   }
 
@@ -437,36 +806,16 @@ CheckSolidTile(FB_RECT *r, CARD32 *colorPtr, int needSameColor)
 }
 
 static int
-SendRectSimple(CL_SLOT *cl, FB_RECT *r)
+SendRectSimple(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
 {
-  int maxBeforeSize, maxAfterSize;
   int maxRectSize, maxRectWidth;
   int subrectMaxWidth, subrectMaxHeight;
   FB_RECT sr;
 
-  maxRectSize = tightConf[compressLevel].maxRectSize;
-  maxRectWidth = tightConf[compressLevel].maxRectWidth;
-
-  maxBeforeSize = maxRectSize * (cl->format.bits_pixel / 8);
-  maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
-
-  if (tightBeforeBufSize < maxBeforeSize) {
-    tightBeforeBufSize = maxBeforeSize;
-    if (tightBeforeBuf == NULL)
-      tightBeforeBuf = malloc(tightBeforeBufSize);
-    else
-      tightBeforeBuf = realloc(tightBeforeBuf, tightBeforeBufSize);
-  }
-
-  if (tightAfterBufSize < maxAfterSize) {
-    tightAfterBufSize = maxAfterSize;
-    if (tightAfterBuf == NULL)
-      tightAfterBuf = malloc(tightAfterBufSize);
-    else
-      tightAfterBuf = realloc(tightAfterBuf, tightAfterBufSize);
-  }
+  maxRectSize = tightConf[ctx->compressLevel].maxRectSize;
+  maxRectWidth = tightConf[ctx->compressLevel].maxRectWidth;
 
-  if (tightBeforeBuf == NULL || tightAfterBuf == NULL)
+  if (!CheckBuffers(ctx, cl))
     return 0;
 
   if (r->w > maxRectWidth || r->w * r->h > maxRectSize) {
@@ -479,88 +828,144 @@ SendRectSimple(CL_SLOT *cl, FB_RECT *r)
           maxRectWidth : r->x + r->w - sr.x;
         sr.h = (sr.y - r->y + subrectMaxHeight < r->h) ?
           subrectMaxHeight : r->y + r->h - sr.y;
-        if (!SendSubrect(cl, &sr))
+        if (!SendSubrect(ctx, cl, &sr))
           return 0;
       }
     }
   } else {
-    if (!SendSubrect(cl, r))
+    if (!SendSubrect(ctx, cl, r))
       return 0;
   }
 
   return 1;
 }
 
-static int SendSubrect(CL_SLOT *cl, FB_RECT *r)
+static int SendSubrect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
 {
   int success = 0;
 
-  SendTightHeader(r);
+  if (ctx->collectJobs)
+    return AddJob(ctx, cl, r, 0);
+
+  SendTightHeader(ctx, r);
 
   /* Translate pixel data into the client's format
      (don't translate when the client requests 24-bit colors). */
-  if (usePixelFormat24) {
-    transfunc_null(tightBeforeBuf, r, NULL);
+  if (ctx->usePixelFormat24) {
+    transfunc_null(ctx->tightBeforeBuf, r, NULL);
   } else {
-    (*cl->trans_func)(tightBeforeBuf, r, cl->trans_table);
+    (*cl->trans_func)(ctx->tightBeforeBuf, r, cl->trans_table);
   }
 
-  paletteMaxColors =
-    r->w * r->h / tightConf[compressLevel].idxMaxColorsDivisor;
-  if ( paletteMaxColors < 2 &&
-       r->w * r->h >= tightConf[compressLevel].monoMinRectSize ) {
-    paletteMaxColors = 2;
+  ctx->paletteMaxColors =
+    r->w * r->h / tightConf[ctx->compressLevel].idxMaxColorsDivisor;
+  if ( ctx->paletteMaxColors < 2 &&
+       r->w * r->h >= tightConf[ctx->compressLevel].monoMinRectSize ) {
+    ctx->paletteMaxColors = 2;
   }
   switch (cl->format.bits_pixel) {
   case 8:
-    FillPalette8(r->w * r->h);
+    FillPalette8(ctx, r->w * r->h);
     break;
   case 16:
-    FillPalette16(r->w * r->h);
+    FillPalette16(ctx, r->w * r->h);
     break;
   default:
-    FillPalette32(r->w * r->h);
+    FillPalette32(ctx, r->w * r->h);
   }
 
-  switch (paletteNumColors) {
+  switch (ctx->paletteNumColors) {
   case 0:
     /* Truecolor image */
-    if (qualityLevel != -1 && DetectSmoothImage(&cl->format, r)) {
-      success = SendJpegRect(r, tightConf[qualityLevel].jpegQuality);
+    if (ctx->qualityLevel != -1 && DetectSmoothImage(ctx, &cl->format, r)) {
+      success = SendJpegRect(ctx, r, tightConf[ctx->qualityLevel].jpegQuality);
     } else {
-      success = SendFullColorRect(cl, r->w, r->h);
+      success = SendFullColorRect(ctx, cl, r->w, r->h);
     }
     break;
   case 1:
     /* Solid rectangle */
-    SendSolidRect(cl);
+    SendSolidRect(ctx, cl);
     success = 1;
     break;
   case 2:
     /* Two-color rectangle */
-    success = SendMonoRect(cl, r->w, r->h);
+    success = SendMonoRect(ctx, cl, r->w, r->h);
     break;
   default:
     /* Up to 256 different colors */
-    if ( paletteNumColors > 96 &&
-         qualityLevel != -1 && qualityLevel <= 3 &&
-         DetectSmoothImage(&cl->format, r) ) {
-      success = SendJpegRect(r, tightConf[qualityLevel].jpegQuality);
+    if ( ctx->paletteNumColors > 96 &&
+         ctx->qualityLevel != -1 && ctx->qualityLevel <= 3 &&
+         DetectSmoothImage(ctx, &cl->format, r) ) {
+      success = SendJpegRect(ctx, r, tightConf[ctx->qualityLevel].jpegQuality);
     } else {
-      success = SendIndexedRect(cl, r->w, r->h);
+      success = SendIndexedRect(ctx, cl, r->w, r->h);
     }
   }
   return success;
 }
 
+static int
+SendSolidSubrect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
+{
+  FB_RECT rtemp;
+
+  if (ctx->collectJobs)
+    return AddJob(ctx, cl, r, 1);
+
+  SendTightHeader(ctx, r);
+
+  SET_RECT(&rtemp, r->x, r->y, 1, 1);
+  if (ctx->usePixelFormat24) {
+    transfunc_null(ctx->tightBeforeBuf, &rtemp, NULL);
+  } else {
+    (*cl->trans_func)(ctx->tightBeforeBuf, &rtemp, cl->trans_table);
+  }
+
+  SendSolidRect(ctx, cl);
+  return 1;
+}
+
 static void
-SendTightHeader(FB_RECT *r)
+SendTightHeader(TIGHT_CTX *ctx, FB_RECT *r)
 {
   CARD8 rect_hdr[12];
 
   r->enc = RFB_ENCODING_TIGHT;
   put_rect_header(rect_hdr, r);
-  aio_write(NULL, rect_hdr, sizeof(rect_hdr));
+  OutputData(ctx, rect_hdr, sizeof(rect_hdr));
+}
+
+/*
+ * Queue data for sending, or append it to ctx->out if set.
+ */
+
+static void
+OutputData(TIGHT_CTX *ctx, void *data, int len)
+{
+  OUTPUT_BUF *out = ctx->out;
+  CARD8 *newBuf;
+  size_t newSize;
+
+  if (out == NULL) {
+    aio_write(NULL, data, len);
+    return;
+  }
+
+  if (out->len + len > out->size) {
+    newSize = (out->size != 0) ? out->size : 4096;
+    while (newSize < out->len + len)
+      newSize *= 2;
+    newBuf = realloc(out->data, newSize);
+    if (newBuf == NULL) {
+      out->error = 1;
+      return;
+    }
+    out->data = newBuf;
+    out->size = newSize;
+  }
+  memcpy(&out->data[out->len], data, len);
+  out->len += len;
 }
 
 /*
@@ -568,25 +973,25 @@ SendTightHeader(FB_RECT *r)
  */
 
 static void
-SendSolidRect(CL_SLOT *cl)
+SendSolidRect(TIGHT_CTX *ctx, CL_SLOT *cl)
 {
   CARD8 buf[5];
   int len;
 
-  if (usePixelFormat24) {
-    Pack24(tightBeforeBuf, 1);
+  if (ctx->usePixelFormat24) {
+    Pack24(ctx->tightBeforeBuf, 1);
     len = 3;
   } else {
     len = cl->format.bits_pixel / 8;
   }
 
   buf[0] = RFB_TIGHT_FILL;
-  memcpy(&buf[1], tightBeforeBuf, len);
-  aio_write(NULL, buf, 1 + len);
+  memcpy(&buf[1], ctx->tightBeforeBuf, len);
+  OutputData(ctx, buf, 1 + len);
 }
 
 static int
-SendMonoRect(CL_SLOT *cl, int w, int h)
+SendMonoRect(TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h)
 {
   CARD8 buf[11];
   int streamId = 1;
@@ -596,7 +1001,8 @@ SendMonoRect(CL_SLOT *cl, int w, int h)
   dataLen = (w + 7) / 8;
   dataLen *= h;
 
-  buf[0] = RFB_TIGHT_EXPLICIT_FILTER | (streamId << 4);
+  buf[0] = RFB_TIGHT_EXPLICIT_FILTER | (streamId << 4) |
+    ResetStreamBits(ctx, cl, streamId);
   buf[1] = RFB_TIGHT_FILTER_PALETTE;
   buf[2] = 1;                   /* number of colors - 1 */
 
@@ -604,132 +1010,158 @@ SendMonoRect(CL_SLOT *cl, int w, int h)
   switch (cl->format.bits_pixel) {
 
   case 32:
-    EncodeMonoRect32((CARD8 *)tightBeforeBuf, w, h);
+    EncodeMonoRect32(ctx, (CARD8 *)ctx->tightBeforeBuf, w, h);
 
-    ((CARD32 *)tightAfterBuf)[0] = monoBackground;
-    ((CARD32 *)tightAfterBuf)[1] = monoForeground;
-    if (usePixelFormat24) {
-      Pack24(tightAfterBuf, 2);
+    ((CARD32 *)ctx->tightAfterBuf)[0] = ctx->monoBackground;
+    ((CARD32 *)ctx->tightAfterBuf)[1] = ctx->monoForeground;
+    if (ctx->usePixelFormat24) {
+      Pack24(ctx->tightAfterBuf, 2);
       paletteLen = 6;
     } else
       paletteLen = 8;
 
-    memcpy(&buf[3], tightAfterBuf, paletteLen);
-    aio_write(NULL, buf, 3 + paletteLen);
+    memcpy(&buf[3], ctx->tightAfterBuf, paletteLen);
+    OutputData(ctx, buf, 3 + paletteLen);
     break;
 
   case 16:
-    EncodeMonoRect16((CARD8 *)tightBeforeBuf, w, h);
+    EncodeMonoRect16(ctx, (CARD8 *)ctx->tightBeforeBuf, w, h);
 
-    ((CARD16 *)tightAfterBuf)[0] = (CARD16)monoBackground;
-    ((CARD16 *)tightAfterBuf)[1] = (CARD16)monoForeground;
+    ((CARD16 *)ctx->tightAfterBuf)[0] = (CARD16)ctx->monoBackground;
+    ((CARD16 *)ctx->tightAfterBuf)[1] = (CARD16)ctx->monoForeground;
 
-    memcpy(&buf[3], tightAfterBuf, 4);
-    aio_write(NULL, buf, 7);
+    memcpy(&buf[3], ctx->tightAfterBuf, 4);
+    OutputData(ctx, buf, 7);
     break;
 
   default:
-    EncodeMonoRect8((CARD8 *)tightBeforeBuf, w, h);
+    EncodeMonoRect8(ctx, (CARD8 *)ctx->tightBeforeBuf, w, h);
 
-    buf[3] = (CARD8)monoBackground;
-    buf[4] = (CARD8)monoForeground;
-    aio_write(NULL, buf, 5);
+    buf[3] = (CARD8)ctx->monoBackground;
+    buf[4] = (CARD8)ctx->monoForeground;
+    OutputData(ctx, buf, 5);
   }
 
-  return CompressData(cl, streamId, dataLen,
-                      tightConf[compressLevel].monoZlibLevel,
+  return CompressData(ctx, cl, streamId, dataLen,
+                      tightConf[ctx->compressLevel].monoZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
 static int
-SendIndexedRect(CL_SLOT *cl, int w, int h)
+SendIndexedRect(TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h)
 {
   char buf[3 + 256*4];
   int streamId = 2;
   int i, entryLen;
 
-  buf[0] = RFB_TIGHT_EXPLICIT_FILTER | (streamId << 4);
+  buf[0] = RFB_TIGHT_EXPLICIT_FILTER | (streamId << 4) |
+    ResetStreamBits(ctx, cl, streamId);
   buf[1] = RFB_TIGHT_FILTER_PALETTE;
-  buf[2] = (CARD8)(paletteNumColors - 1);
+  buf[2] = (CARD8)(ctx->paletteNumColors - 1);
 
   /* Prepare palette, convert image. */
   switch (cl->format.bits_pixel) {
 
   case 32:
-    EncodeIndexedRect32((CARD8 *)tightBeforeBuf, w * h);
+    EncodeIndexedRect32(ctx, (CARD8 *)ctx->tightBeforeBuf, w * h);
 
-    for (i = 0; i < paletteNumColors; i++) {
-      ((CARD32 *)tightAfterBuf)[i] =
-        palette.entry[i].listNode->rgb;
+    for (i = 0; i < ctx->paletteNumColors; i++) {
+      ((CARD32 *)ctx->tightAfterBuf)[i] =
+        ctx->palette.entry[i].listNode->rgb;
     }
-    if (usePixelFormat24) {
-      Pack24(tightAfterBuf, paletteNumColors);
+    if (ctx->usePixelFormat24) {
+      Pack24(ctx->tightAfterBuf, ctx->paletteNumColors);
       entryLen = 3;
     } else
       entryLen = 4;
 
-    memcpy(&buf[3], tightAfterBuf, paletteNumColors * entryLen);
-    aio_write(NULL, buf, 3 + paletteNumColors * entryLen);
+    memcpy(&buf[3], ctx->tightAfterBuf, ctx->paletteNumColors * entryLen);
+    OutputData(ctx, buf, 3 + ctx->paletteNumColors * entryLen);
     break;
 
   case 16:
-    EncodeIndexedRect16((CARD8 *)tightBeforeBuf, w * h);
+    EncodeIndexedRect16(ctx, (CARD8 *)ctx->tightBeforeBuf, w * h);
 
-    for (i = 0; i < paletteNumColors; i++) {
-      ((CARD16 *)tightAfterBuf)[i] =
-        (CARD16)palette.entry[i].listNode->rgb;
+    for (i = 0; i < ctx->paletteNumColors; i++) {
+      ((CARD16 *)ctx->tightAfterBuf)[i] =
+        (CARD16)ctx->palette.entry[i].listNode->rgb;
     }
 
-    memcpy(&buf[3], tightAfterBuf, paletteNumColors * 2);
-    aio_write(NULL, buf, 3 + paletteNumColors * 2);
+    memcpy(&buf[3], ctx->tightAfterBuf, ctx->paletteNumColors * 2);
+    OutputData(ctx, buf, 3 + ctx->paletteNumColors * 2);
     break;
 
   default:
     return 0;                   /* should never happen */
   }
 
-  return CompressData(cl, streamId, w * h,
-                      tightConf[compressLevel].idxZlibLevel,
+  return CompressData(ctx, cl, streamId, w * h,
+                      tightConf[ctx->compressLevel].idxZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
 static int
-SendFullColorRect(CL_SLOT *cl, int w, int h)
+SendFullColorRect(TIGHT_CTX *ctx, CL_SLOT *cl, int w, int h)
 {
   CARD8 buf[1];
   int streamId = 0;
   int len;
 
-  buf[0] = 0;                   /* stream id = 0, no flushing, no filter */
-  aio_write(NULL, buf, 1);
+  /* stream id = 0, no filter */
+  buf[0] = (CARD8)ResetStreamBits(ctx, cl, streamId);
+  OutputData(ctx, buf, 1);
 
-  if (usePixelFormat24) {
-    Pack24(tightBeforeBuf, w * h);
+  if (ctx->usePixelFormat24) {
+    Pack24(ctx->tightBeforeBuf, w * h);
     len = 3;
   } else
     len = cl->format.bits_pixel / 8;
 
-  return CompressData(cl, streamId, w * h * len,
-                      tightConf[compressLevel].rawZlibLevel,
+  return CompressData(ctx, cl, streamId, w * h * len,
+                      tightConf[ctx->compressLevel].rawZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
+/*
+ * Get the bits of compression control byte telling the client to
+ * reset its zlib stream. That's needed if we start a new stream.
+ */
+
 static int
-CompressData(CL_SLOT *cl, int streamId, int dataLen,
+ResetStreamBits(TIGHT_CTX *ctx, CL_SLOT *cl, int streamId)
+{
+  if (ctx->statelessZlib || !cl->zs_active[streamId])
+    return 1 << streamId;
+
+  return 0;
+}
+
+static int
+CompressData(TIGHT_CTX *ctx, CL_SLOT *cl, int streamId, int dataLen,
              int zlibLevel, int zlibStrategy)
 {
   z_streamp pz;
+  int *pActive, *pLevel;
   int err;
 
+  if (ctx->statelessZlib) {
+    /* Client's streams have been dropped, see DropClientStreams(). */
+    pz = &ctx->zs[streamId];
+    pActive = &ctx->zsActive[streamId];
+    pLevel = &ctx->zsLevel[streamId];
+  } else {
+    pz = &cl->zs_struct[streamId];
+    pActive = &cl->zs_active[streamId];
+    pLevel = &cl->zs_level[streamId];
+  }
+
   if (dataLen < RFB_TIGHT_MIN_TO_COMPRESS) {
-    aio_write(NULL, tightBeforeBuf, dataLen);
+    OutputData(ctx, ctx->tightBeforeBuf, dataLen);
     return 1;
   }
 
-  pz = &cl->zs_struct[streamId];
-
   /* Initialize compression stream if needed. */
-  if (!cl->zs_active[streamId]) {
+  if (!*pActive) {
     pz->zalloc = Z_NULL;
     pz->zfree = Z_NULL;
     pz->opaque = Z_NULL;
@@ -739,22 +1171,26 @@ CompressData(CL_SLOT *cl, int streamId, int dataLen,
     if (err != Z_OK)
       return 0;
 
-    cl->zs_active[streamId] = 1;
-    cl->zs_level[streamId] = zlibLevel;
+    *pActive = 1;
+    *pLevel = zlibLevel;
+  } else if (ctx->statelessZlib) {
+    /* Shared data should not depend on previous rectangles. */
+    if (deflateReset (pz) != Z_OK)
+      return 0;
   }
 
   /* Prepare buffer pointers. */
-  pz->next_in = (Bytef *)tightBeforeBuf;
+  pz->next_in = (Bytef *)ctx->tightBeforeBuf;
   pz->avail_in = dataLen;
-  pz->next_out = (Bytef *)tightAfterBuf;
-  pz->avail_out = tightAfterBufSize;
+  pz->next_out = (Bytef *)ctx->tightAfterBuf;
+  pz->avail_out = ctx->tightAfterBufSize;
 
   /* Change compression parameters if needed. */
-  if (zlibLevel != cl->zs_level[streamId]) {
+  if (zlibLevel != *pLevel) {
     if (deflateParams (pz, zlibLevel, zlibStrategy) != Z_OK) {
       return 0;
     }
-    cl->zs_level[streamId] = zlibLevel;
+    *pLevel = zlibLevel;
   }
 
   /* Actual compression. */
@@ -763,11 +1199,11 @@ CompressData(CL_SLOT *cl, int streamId, int dataLen,
     return 0;
   }
 
-  SendCompressedData(tightAfterBufSize - pz->avail_out);
+  SendCompressedData(ctx, ctx->tightAfterBufSize - pz->avail_out);
   return 1;
 }
 
-static void SendCompressedData(int compressedLen)
+static void SendCompressedData(TIGHT_CTX *ctx, int compressedLen)
 {
   CARD8 buf[3];
   int len_bytes = 0;
@@ -781,8 +1217,8 @@ static void SendCompressedData(int compressedLen)
       buf[len_bytes++] = compressedLen >> 14 & 0xFF;
     }
   }
-  aio_write(NULL, buf, len_bytes);
-  aio_write(NULL, tightAfterBuf, compressedLen);
+  OutputData(ctx, buf, len_bytes);
+  OutputData(ctx, ctx->tightAfterBuf, compressedLen);
 }
 
 /*
@@ -790,22 +1226,22 @@ static void SendCompressedData(int compressedLen)
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(TIGHT_CTX *ctx, int count)
 {
-    CARD8 *data = (CARD8 *)tightBeforeBuf;
+    CARD8 *data = (CARD8 *)ctx->tightBeforeBuf;
     CARD8 c0, c1;
     int i, n0, n1;
 
-    paletteNumColors = 0;
+    ctx->paletteNumColors = 0;
 
     c0 = data[0];
     for (i = 1; i < count && data[i] == c0; i++);
     if (i == count) {
-        paletteNumColors = 1;
+        ctx->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (ctx->paletteMaxColors < 2)
         return;
 
     n0 = i;
@@ -821,34 +1257,34 @@ FillPalette8(int count)
     }
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (CARD32)c0;
-            monoForeground = (CARD32)c1;
+            ctx->monoBackground = (CARD32)c0;
+            ctx->monoForeground = (CARD32)c1;
         } else {
-            monoBackground = (CARD32)c1;
-            monoForeground = (CARD32)c0;
+            ctx->monoBackground = (CARD32)c1;
+            ctx->monoForeground = (CARD32)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        ctx->paletteNumColors = 2;   /* Two colors */
     }
 }
 
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count)                                             \
+FillPalette##bpp(TIGHT_CTX *ctx, int count)                             \
 {                                                                       \
-    CARD##bpp *data = (CARD##bpp *)tightBeforeBuf;                      \
+    CARD##bpp *data = (CARD##bpp *)ctx->tightBeforeBuf;                 \
     CARD##bpp c0, c1, ci;                                               \
     int i, n0, n1, ni;                                                  \
                                                                         \
     c0 = data[0];                                                       \
     for (i = 1; i < count && data[i] == c0; i++);                       \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ctx->paletteNumColors = 1;   /* Solid rectangle */              \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ctx->paletteMaxColors < 2) {                                    \
+        ctx->paletteNumColors = 0; /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -866,32 +1302,32 @@ FillPalette##bpp(int count)                                             \
     }                                                                   \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (CARD32)c0;                                \
-            monoForeground = (CARD32)c1;                                \
+            ctx->monoBackground = (CARD32)c0;                           \
+            ctx->monoForeground = (CARD32)c1;                           \
         } else {                                                        \
-            monoBackground = (CARD32)c1;                                \
-            monoForeground = (CARD32)c0;                                \
+            ctx->monoBackground = (CARD32)c1;                           \
+            ctx->monoForeground = (CARD32)c0;                           \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ctx->paletteNumColors = 2;   /* Two colors */                   \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (CARD32)n0, bpp);                                \
-    PaletteInsert (c1, (CARD32)n1, bpp);                                \
+    PaletteReset(ctx);                                                  \
+    PaletteInsert (ctx, c0, (CARD32)n0, bpp);                           \
+    PaletteInsert (ctx, c1, (CARD32)n1, bpp);                           \
                                                                         \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
         if (data[i] == ci) {                                            \
             ni++;                                                       \
         } else {                                                        \
-            if (!PaletteInsert (ci, (CARD32)ni, bpp))                   \
+            if (!PaletteInsert (ctx, ci, (CARD32)ni, bpp))              \
                 return;                                                 \
             ci = data[i];                                               \
             ni = 1;                                                     \
         }                                                               \
     }                                                                   \
-    PaletteInsert (ci, (CARD32)ni, bpp);                                \
+    PaletteInsert (ctx, ci, (CARD32)ni, bpp);                           \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -906,73 +1342,75 @@ DEFINE_FILL_PALETTE_FUNCTION(32)
 #define HASH_FUNC32(rgb) ((int)((((rgb) >> 16) + ((rgb) >> 8)) & 0xFF))
 
 static void
-PaletteReset(void)
+PaletteReset(TIGHT_CTX *ctx)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    ctx->paletteNumColors = 0;
+    memset(ctx->palette.hash, 0, 256 * sizeof(COLOR_LIST *));
 }
 
 static int
-PaletteInsert(CARD32 rgb, int numPixels, int bpp)
+PaletteInsert(TIGHT_CTX *ctx, CARD32 rgb, int numPixels, int bpp)
 {
+    PALETTE *palette = &ctx->palette;
     COLOR_LIST *pnode;
     COLOR_LIST *prev_pnode = NULL;
     int hash_key, idx, new_idx, count;
 
     hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
 
-    pnode = palette.hash[hash_key];
+    pnode = palette->hash[hash_key];
 
     while (pnode != NULL) {
         if (pnode->rgb == rgb) {
             /* Such palette entry already exists. */
             new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
+            count = palette->entry[idx].numPixels + numPixels;
+            if (new_idx && palette->entry[new_idx-1].numPixels < count) {
                 do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
+                    palette->entry[new_idx] = palette->entry[new_idx-1];
+                    palette->entry[new_idx].listNode->idx = new_idx;
                     new_idx--;
                 }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
+                while (new_idx && palette->entry[new_idx-1].numPixels < count);
+                palette->entry[new_idx].listNode = pnode;
                 pnode->idx = new_idx;
             }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            palette->entry[new_idx].numPixels = count;
+            return ctx->paletteNumColors;
         }
         prev_pnode = pnode;
         pnode = pnode->next;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if ( ctx->paletteNumColors == 256 ||
+         ctx->paletteNumColors == ctx->paletteMaxColors ) {
+        ctx->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = ctx->paletteNumColors;
+          idx > 0 && palette->entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        palette->entry[idx] = palette->entry[idx-1];
+        palette->entry[idx].listNode->idx = idx;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
+    pnode = &palette->list[ctx->paletteNumColors];
     if (prev_pnode != NULL) {
         prev_pnode->next = pnode;
     } else {
-        palette.hash[hash_key] = pnode;
+        palette->hash[hash_key] = pnode;
     }
     pnode->next = NULL;
     pnode->idx = idx;
     pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
+    palette->entry[idx].listNode = pnode;
+    palette->entry[idx].numPixels = numPixels;
 
-    return (++paletteNumColors);
+    return (++ctx->paletteNumColors);
 }
 
 
@@ -1004,7 +1442,7 @@ static void Pack24(CARD8 *buf, int count)
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(CARD8 *buf, int count)                           \
+EncodeIndexedRect##bpp(TIGHT_CTX *ctx, CARD8 *buf, int count)           \
 {                                                                       \
     COLOR_LIST *pnode;                                                  \
     CARD##bpp *src;                                                     \
@@ -1018,7 +1456,7 @@ EncodeIndexedRect##bpp(CARD8 *buf, int count)                           \
         while (count && *src == rgb) {                                  \
             rep++, src++, count--;                                      \
         }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
+        pnode = ctx->palette.hash[HASH_FUNC##bpp(rgb)];                 \
         while (pnode != NULL) {                                         \
             if ((CARD##bpp)pnode->rgb == rgb) {                         \
                 *buf++ = (CARD8)pnode->idx;                             \
@@ -1039,7 +1477,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(CARD8 *buf, int w, int h)                           \
+EncodeMonoRect##bpp(TIGHT_CTX *ctx, CARD8 *buf, int w, int h)           \
 {                                                                       \
     CARD##bpp *ptr;                                                     \
     CARD##bpp bg;                                                       \
@@ -1048,7 +1486,7 @@ EncodeMonoRect##bpp(CARD8 *buf, int w, int h)                           \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (CARD##bpp *) buf;                                            \
-    bg = (CARD##bpp) monoBackground;                                    \
+    bg = (CARD##bpp) ctx->monoBackground;                               \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1104,18 +1542,18 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 #define DETECT_MIN_HEIGHT      8
 
 static int
-DetectSmoothImage (RFB_PIXEL_FORMAT *fmt, FB_RECT *r)
+DetectSmoothImage (TIGHT_CTX *ctx, RFB_PIXEL_FORMAT *fmt, FB_RECT *r)
 {
   unsigned long avgError;
 
-  if ( qualityLevel == -1 || fmt->bits_pixel == 8 ||
+  if ( ctx->qualityLevel == -1 || fmt->bits_pixel == 8 ||
        r->w < DETECT_MIN_WIDTH || r->h < DETECT_MIN_HEIGHT ||
        r->w * r->h < JPEG_MIN_RECT_SIZE ) {
     return 0;
   }
 
   avgError = DetectSmoothImage24(fmt, r);
-  return (avgError < tightConf[qualityLevel].jpegThreshold24);
+  return (avgError < tightConf[ctx->qualityLevel].jpegThreshold24);
 }
 
 static unsigned long
@@ -1177,63 +1615,104 @@ DetectSmoothImage24 (RFB_PIXEL_FORMAT *fmt, FB_RECT *r)
  * JPEG compression stuff.
  */
 
-static struct jpeg_destination_mgr jpegDstManager;
-static int jpegError;
-static int jpegDstDataLen;
+/* JPEG quality values up to this one use faster, less accurate DCT. */
+#define JPEG_FAST_DCT_MAX_QUALITY  60
 
 static int
-SendJpegRect(FB_RECT *r, int quality)
+SendJpegRect(TIGHT_CTX *ctx, FB_RECT *r, int quality)
 {
   CARD8 buf[1];
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  CARD8 *srcBuf;
+  j_compress_ptr cinfo;
   JSAMPROW rowPointer[1];
   int dy;
 
-  srcBuf = (CARD8 *)malloc(r->w * 3);
-  if (srcBuf == NULL)
+  cinfo = GetJpegCompressor(ctx, r->w);
+  if (cinfo == NULL)
     return 0;
 
-  rowPointer[0] = srcBuf;
+  cinfo->image_width = r->w;
+  cinfo->image_height = r->h;
+  if (quality != ctx->jpegQuality) {
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->dct_method = (quality <= JPEG_FAST_DCT_MAX_QUALITY) ?
+      JDCT_IFAST : JDCT_ISLOW;
+    ctx->jpegQuality = quality;
+  }
 
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
+  jpeg_start_compress(cinfo, TRUE);
+
+  for (dy = 0; dy < r->h; dy++) {
+#ifdef JCS_EXTENSIONS
+    rowPointer[0] = (JSAMPROW)&g_framebuffer[(r->y + dy) * g_fb_width + r->x];
+#else
+    PrepareRowForJpeg(ctx->jpegRowBuf, r->x, r->y + dy, r->w);
+    rowPointer[0] = ctx->jpegRowBuf;
+#endif
+    jpeg_write_scanlines(cinfo, rowPointer, 1);
+    if (ctx->jpegError)
+      break;
+  }
+
+  if (ctx->jpegError) {
+    jpeg_abort_compress(cinfo);
+    return 0;
+  }
+  jpeg_finish_compress(cinfo);
 
-  cinfo.image_width = r->w;
-  cinfo.image_height = r->h;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
+  buf[0] = RFB_TIGHT_JPEG;
+  OutputData(ctx, buf, 1);
+  SendCompressedData(ctx, ctx->jpegDstDataLen);
+  return 1;
+}
 
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, quality, TRUE);
+/*
+ * Get the compressor of a context, creating it on first use. With
+ * libjpeg-turbo, it reads framebuffer rows directly, otherwise rows
+ * are converted to RGB in a buffer large enough for width pixels.
+ */
 
-  JpegSetDstManager (&cinfo);
+static j_compress_ptr
+GetJpegCompressor(TIGHT_CTX *ctx, int width)
+{
+  j_compress_ptr cinfo = &ctx->jpegCinfo;
 
-  jpeg_start_compress(&cinfo, TRUE);
+#ifndef JCS_EXTENSIONS
+  CARD8 *rowBuf;
 
-  for (dy = 0; dy < r->h; dy++) {
-    PrepareRowForJpeg(srcBuf, r->x, r->y + dy, r->w);
-    jpeg_write_scanlines(&cinfo, rowPointer, 1);
-    if (jpegError)
-      break;
+  if (width > ctx->jpegRowBufWidth) {
+    rowBuf = realloc(ctx->jpegRowBuf, width * 3);
+    if (rowBuf == NULL)
+      return NULL;
+    ctx->jpegRowBuf = rowBuf;
+    ctx->jpegRowBufWidth = width;
   }
+#endif
 
-  if (!jpegError)
-    jpeg_finish_compress(&cinfo);
+  if (ctx->jpegCreated)
+    return cinfo;
 
-  jpeg_destroy_compress(&cinfo);
-  free(srcBuf);
+  cinfo->err = jpeg_std_error(&ctx->jpegErrorMgr);
+  jpeg_create_compress(cinfo);
+  ctx->jpegCreated = 1;
 
-  if (jpegError)
-    return 0;
+#ifdef JCS_EXTENSIONS
+  /* Framebuffer pixels are 0x00RRGGBB in host byte order. */
+  cinfo->input_components = 4;
+  cinfo->in_color_space = is_big_endian() ? JCS_EXT_XRGB : JCS_EXT_BGRX;
+#else
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;
+#endif
 
-  buf[0] = RFB_TIGHT_JPEG;
-  aio_write(NULL, buf, 1);
-  SendCompressedData(jpegDstDataLen);
-  return 1;
+  jpeg_set_defaults(cinfo);
+  ctx->jpegQuality = -1;
+
+  JpegSetDstManager(ctx, cinfo);
+  return cinfo;
 }
 
+#ifndef JCS_EXTENSIONS
+
 static void
 PrepareRowForJpeg(CARD8 *dst, int x, int y, int count)
 {
@@ -1250,6 +1729,8 @@ PrepareRowForJpeg(CARD8 *dst, int x, int y, int count)
   }
 }
 
+#endif /* JCS_EXTENSIONS */
+
 /*
  * Destination manager implementation for JPEG library.
  */
@@ -1257,17 +1738,21 @@ PrepareRowForJpeg(CARD8 *dst, int x, int y, int count)
 static void
 JpegInitDestination(j_compress_ptr cinfo)
 {
-  jpegError = FALSE;
-  jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-  jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+  TIGHT_CTX *ctx = (TIGHT_CTX *)cinfo->client_data;
+
+  ctx->jpegError = FALSE;
+  ctx->jpegDstManager.next_output_byte = (JOCTET *)ctx->tightAfterBuf;
+  ctx->jpegDstManager.free_in_buffer = (size_t)ctx->tightAfterBufSize;
 }
 
 static boolean
 JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 {
-  jpegError = TRUE;
-  jpegDstManager.next_output_byte = (JOCTET *)tightAfterBuf;
-  jpegDstManager.free_in_buffer = (size_t)tightAfterBufSize;
+  TIGHT_CTX *ctx = (TIGHT_CTX *)cinfo->client_data;
+
+  ctx->jpegError = TRUE;
+  ctx->jpegDstManager.next_output_byte = (JOCTET *)ctx->tightAfterBuf;
+  ctx->jpegDstManager.free_in_buffer = (size_t)ctx->tightAfterBufSize;
 
   return TRUE;
 }
@@ -1275,15 +1760,160 @@ JpegEmptyOutputBuffer(j_compress_ptr cinfo)
 static void
 JpegTermDestination(j_compress_ptr cinfo)
 {
-  jpegDstDataLen = tightAfterBufSize - jpegDstManager.free_in_buffer;
+  TIGHT_CTX *ctx = (TIGHT_CTX *)cinfo->client_data;
+
+  ctx->jpegDstDataLen =
+    ctx->tightAfterBufSize - ctx->jpegDstManager.free_in_buffer;
 }
 
 static void
-JpegSetDstManager(j_compress_ptr cinfo)
+JpegSetDstManager(TIGHT_CTX *ctx, j_compress_ptr cinfo)
+{
+  ctx->jpegDstManager.init_destination = JpegInitDestination;
+  ctx->jpegDstManager.empty_output_buffer = JpegEmptyOutputBuffer;
+  ctx->jpegDstManager.term_destination = JpegTermDestination;
+  cinfo->dest = &ctx->jpegDstManager;
+  cinfo->client_data = ctx;
+}
+
+
+/*
+ * Shared encoding: lists of encoded rectangles.
+ */
+
+#define SHARED_HASH(r) \
+  ((int)(((r)->x * 7 + (r)->y * 31 + (r)->w * 127 + (r)->h) & \
+         (SHARED_HASH_SIZE - 1)))
+
+static SHARED_RECT *
+FindSharedRect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r)
 {
-  jpegDstManager.init_destination = JpegInitDestination;
-  jpegDstManager.empty_output_buffer = JpegEmptyOutputBuffer;
-  jpegDstManager.term_destination = JpegTermDestination;
-  cinfo->dest = &jpegDstManager;
+  SHARED_RECT *sr;
+
+  if (sharedFbWidth != g_fb_width || sharedFbHeight != g_fb_height)
+    return NULL;
+
+  for (sr = sharedHash[SHARED_HASH(r)]; sr != NULL; sr = sr->hashNext) {
+    if ( sr->rect.x == r->x && sr->rect.y == r->y &&
+         sr->rect.w == r->w && sr->rect.h == r->h &&
+         sr->compressLevel == ctx->compressLevel &&
+         sr->qualityLevel == ctx->qualityLevel &&
+         same_pixel_format(&sr->format, &cl->format) ) {
+      return sr;
+    }
+  }
+  return NULL;
 }
 
+static int
+AddSharedRect(TIGHT_CTX *ctx, CL_SLOT *cl, FB_RECT *r, AIO_SHARED *data)
+{
+  SHARED_RECT *sr;
+  int bucket;
+
+  if (data->data_size > SHARED_MAX_BYTES / 4)
+    return 0;
+
+  /* Data for another framebuffer geometry is useless. */
+  if (sharedFbWidth != g_fb_width || sharedFbHeight != g_fb_height) {
+    while (sharedRects != NULL)
+      RemoveSharedRect(NULL, sharedRects);
+    sharedFbWidth = g_fb_width;
+    sharedFbHeight = g_fb_height;
+  }
+
+  /* Forget the oldest rectangles to make room. */
+  while ( sharedRects != NULL &&
+          (sharedNumRects >= SHARED_MAX_RECTS ||
+           sharedNumBytes + data->data_size > SHARED_MAX_BYTES) ) {
+    RemoveSharedRect(NULL, sharedRects);
+  }
+
+  sr = malloc(sizeof(SHARED_RECT));
+  if (sr == NULL)
+    return 0;
+
+  memcpy(&sr->format, &cl->format, sizeof(RFB_PIXEL_FORMAT));
+  sr->compressLevel = ctx->compressLevel;
+  sr->qualityLevel = ctx->qualityLevel;
+  sr->rect = *r;
+  sr->data = data;
+
+  bucket = SHARED_HASH(r);
+  sr->hashNext = sharedHash[bucket];
+  sharedHash[bucket] = sr;
+
+  sr->next = NULL;
+  if (sharedRectsTail != NULL)
+    sharedRectsTail->next = sr;
+  else
+    sharedRects = sr;
+  sharedRectsTail = sr;
+
+  sharedNumRects++;
+  sharedNumBytes += data->data_size;
+  return 1;
+}
+
+/*
+ * Remove an element from the list and free it. prev should point to
+ * the previous element, or be NULL for the first one.
+ */
+
+static void
+RemoveSharedRect(SHARED_RECT *prev, SHARED_RECT *sr)
+{
+  SHARED_RECT **hashPtr;
+
+  for (hashPtr = &sharedHash[SHARED_HASH(&sr->rect)]; *hashPtr != sr;
+       hashPtr = &(*hashPtr)->hashNext);
+  *hashPtr = sr->hashNext;
+
+  if (prev != NULL)
+    prev->next = sr->next;
+  else
+    sharedRects = sr->next;
+  if (sharedRectsTail == sr)
+    sharedRectsTail = prev;
+
+  sharedNumRects--;
+  sharedNumBytes -= sr->data->data_size;
+  aio_shared_unref(sr->data);
+  free(sr);
+}
+
+/*
+ * Forget shared data for rectangles intersecting with the changed
+ * area of the framebuffer.
+ */
+
+void
+invalidate_tight_cache(FB_RECT *r)
+{
+  SHARED_RECT *sr, *prev, *next;
+
+  prev = NULL;
+  for (sr = sharedRects; sr != NULL; sr = next) {
+    next = sr->next;
+    if ( sr->rect.x < r->x + r->w && r->x < sr->rect.x + sr->rect.w &&
+         sr->rect.y < r->y + r->h && r->y < sr->rect.y + sr->rect.h ) {
+      RemoveSharedRect(prev, sr);
+    } else {
+      prev = sr;
+    }
+  }
+}
+
+/*
+ * Free all data of this thread used for Tight encoding.
+ */
+
+void
+free_tight_cache(void)
+{
+  while (sharedRects != NULL)
+    RemoveSharedRect(NULL, sharedRects);
+
+  FreeContext(&threadCtx);
+  FreeContext(&jobCtx);
+}
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <zlib.h>
 
 #include "rfblib.h"
 #include "reflector.h"
@@ -34,6 +35,14 @@ static struct timezone s_fbs_timezone;
 static CARD16 s_fbs_fb_width, s_fbs_fb_height;
 static long s_spool_size = 0;
 
+/* Zlib-based encodings are compressed again for saving, so that zlib
+   streams continue across joined sessions, see fbs_spool_zlib_data() */
+static z_stream s_fbs_zs[FBS_NUM_STREAMS];
+static int s_fbs_zs_active[FBS_NUM_STREAMS];
+
+static int fbs_spool_reserve(size_t len);
+static void fbs_reset_streams(void);
+
 void fbs_set_prefix(char *fbs_prefix, int join_sessions)
 {
   s_fbs_prefix = fbs_prefix;
@@ -80,6 +89,9 @@ void fbs_open_file(CARD16 fb_width, CARD16 fb_height)
 
   if (!s_join_sessions || s_fbs_idx == 1) {
 
+    /* Players will start decompression from scratch */
+    fbs_reset_streams();
+
     /* Open the file */
     s_fbs_fp = fopen(fname, "w");
     if (s_fbs_fp == NULL) {
@@ -206,33 +218,62 @@ void fbs_spool_byte(CARD8 b)
 
 void fbs_spool_data(void *buf, size_t len)
 {
-  size_t used;
-  if (s_fbs_fp != NULL) {
-
-    /* realloc spool buffer if necessary */
-    used = s_fbs_buffer_ptr - s_fbs_buffer; 
-    if (used + len > s_spool_size) {
-      log_write(LL_DETAIL, "Spool isn't large enough, reallocing");
-      s_fbs_buffer = realloc(s_fbs_buffer,  s_spool_size * 2);
-      if (s_fbs_buffer == NULL) {
-	log_write(LL_WARN, "Memory allocation error, closing FBS file");
-	fclose(s_fbs_fp);
-	s_fbs_fp = NULL;
-	return;
-      } else {
-	s_spool_size *= 2;
-	log_write(LL_DETAIL, "Allocated buffer to cache FBS data, %d bytes",
-	         s_spool_size);
-	s_fbs_buffer_ptr = s_fbs_buffer + used;
-      }
-    }
-
+  if (s_fbs_fp != NULL && fbs_spool_reserve(len)) {
     /* copy data to spool */
     memcpy(s_fbs_buffer_ptr, buf, len);
     s_fbs_buffer_ptr += len;
   }
 }
 
+/*
+ * Spool decompressed data of a Zlib or ZRLE rectangle, compressing it
+ * with our own zlib stream and prepending the length. Compressed data
+ * from the host cannot be saved as is, since host streams restart on
+ * each connection while the streams of a player continue in joined
+ * sessions.
+ */
+
+void fbs_spool_zlib_data(int stream_id, void *buf, size_t len)
+{
+  z_streamp zs = &s_fbs_zs[stream_id];
+  size_t max_size, size;
+
+  if (s_fbs_fp == NULL)
+    return;
+
+  if (!s_fbs_zs_active[stream_id]) {
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+    if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      log_write(LL_WARN, "Compression error, closing FBS file");
+      fbs_close_file();
+      return;
+    }
+    s_fbs_zs_active[stream_id] = 1;
+  }
+
+  /* Leave room for the length and the flush marker */
+  max_size = deflateBound(zs, len) + 16;
+  if (!fbs_spool_reserve(4 + max_size))
+    return;
+
+  zs->next_in = buf;
+  zs->avail_in = len;
+  zs->next_out = s_fbs_buffer_ptr + 4;
+  zs->avail_out = max_size;
+  if ( deflate(zs, Z_SYNC_FLUSH) != Z_OK ||
+       zs->avail_in != 0 || zs->avail_out == 0 ) {
+    log_write(LL_WARN, "Compression error, closing FBS file");
+    fbs_close_file();
+    return;
+  }
+
+  size = max_size - zs->avail_out;
+  buf_put_CARD32(s_fbs_buffer_ptr, (CARD32)size);
+  s_fbs_buffer_ptr += 4 + size;
+}
+
 void fbs_flush_data(void)
 {
   if (s_fbs_fp != NULL) {
@@ -241,6 +282,51 @@ void fbs_flush_data(void)
   }
 }
 
+/*
+ * Make sure the spool buffer has room for len more bytes. Returns 0
+ * after closing the file on errors.
+ */
+
+static int fbs_spool_reserve(size_t len)
+{
+  size_t used;
+  long new_size;
+
+  /* realloc spool buffer if necessary */
+  used = s_fbs_buffer_ptr - s_fbs_buffer;
+  if (used + len <= s_spool_size)
+    return 1;
+
+  log_write(LL_DETAIL, "Spool isn't large enough, reallocing");
+  new_size = s_spool_size * 2;
+  while (used + len > new_size)
+    new_size *= 2;
+  s_fbs_buffer = realloc(s_fbs_buffer, new_size);
+  if (s_fbs_buffer == NULL) {
+    log_write(LL_WARN, "Memory allocation error, closing FBS file");
+    fclose(s_fbs_fp);
+    s_fbs_fp = NULL;
+    return 0;
+  }
+  s_spool_size = new_size;
+  log_write(LL_DETAIL, "Allocated buffer to cache FBS data, %ld bytes",
+            s_spool_size);
+  s_fbs_buffer_ptr = s_fbs_buffer + used;
+  return 1;
+}
+
+static void fbs_reset_streams(void)
+{
+  int stream_id;
+
+  for (stream_id = 0; stream_id < FBS_NUM_STREAMS; stream_id++) {
+    if (s_fbs_zs_active[stream_id]) {
+      deflateEnd(&s_fbs_zs[stream_id]);
+      s_fbs_zs_active[stream_id] = 0;
+    }
+  }
+}
+
 void fbs_close_file(void)
 {
   if (s_fbs_fp != NULL) {
@@ -35,6 +35,9 @@
 #include "client_io.h"
 #include "encode.h"
 #include "host_connect.h"
+#include "workers.h"
+#include "tile_hash.h"
+#include "motion.h"
 
 static int parse_host_info(void);
 static void host_init_hook(void);
@@ -51,9 +54,10 @@ static void rf_host_set_formats(void);
 
 static int s_request_copyrect;
 static int s_convert_copyrect;
-static int s_request_tight;
+static CARD32 s_prefer_enc;
 static int s_request_cursor;
 static int s_tight_level;
+static int s_jpeg_quality;
 
 static char *s_host_info_file;
 static int s_cl_listen_port;
@@ -63,17 +67,20 @@ static int s_host_port;
 static unsigned char s_host_password[9];
 
 /*
- * Set preferred encoding (Hextile or Tight) and compression level
- * for the Tight encoding.
+ * Set preferred encoding (Hextile, Tight, ZRLE or Zlib), compression
+ * level and JPEG quality level for the Tight encoding. Negative levels
+ * are not requested, JPEG is not allowed unless the quality is set.
  */
 
 void set_host_encodings(int request_copyrect, int convert_copyrect,
-                        int request_tight, int tight_level, int request_cursor)
+                        CARD32 prefer_enc, int tight_level, int jpeg_quality,
+                        int request_cursor)
 {
   s_request_copyrect = request_copyrect;
   s_convert_copyrect = convert_copyrect;
-  s_request_tight = request_tight;
+  s_prefer_enc = prefer_enc;
   s_tight_level = tight_level;
+  s_jpeg_quality = jpeg_quality;
   s_request_cursor = request_cursor;
 }
 
@@ -217,14 +224,14 @@ static int parse_host_info(void)
 
 static void host_init_hook(void)
 {
-  cur_slot->type = TYPE_HOST_CONNECTING_SLOT;
+  aio_set_slot_type(cur_slot, TYPE_HOST_CONNECTING_SLOT);
   aio_setclose(host_close_hook);
   aio_setread(rf_host_ver, NULL, 12);
 }
 
 static void host_listen_init_hook(void)
 {
-  cur_slot->type = TYPE_HOST_LISTENING_SLOT;
+  aio_set_slot_type(cur_slot, TYPE_HOST_LISTENING_SLOT);
 }
 
 static void host_accept_hook(void)
@@ -366,7 +373,7 @@ static void rf_host_initmsg(void)
   aio_setread(rf_host_set_formats, NULL, hs->temp_len);
 }
 
-#define MAX_ENCODINGS 10
+#define MAX_ENCODINGS 11
 
 static void rf_host_set_formats(void)
 {
@@ -388,13 +395,17 @@ static void rf_host_set_formats(void)
 
   new_name = malloc((size_t)hs->temp_len + 1);
   if (new_name != NULL) {
+    memcpy(new_name, cur_slot->readbuf, hs->temp_len);
+    new_name[hs->temp_len] = '\0';
+
+    /* Worker threads may be sending the name to new clients */
+    fb_lock_write();
     if (g_screen_info.name != NULL)
       free(g_screen_info.name);
 
     g_screen_info.name = new_name;
     g_screen_info.name_length = hs->temp_len;
-    memcpy(g_screen_info.name, cur_slot->readbuf, hs->temp_len);
-    g_screen_info.name[hs->temp_len] = '\0';
+    fb_unlock_write();
   }
 
   log_write(LL_DETAIL, "Setting up pixel format");
@@ -404,12 +415,21 @@ static void rf_host_set_formats(void)
   log_write(LL_DEBUG, "Sending SetPixelFormat message");
   aio_write(NULL, setpixfmt_msg, sizeof(setpixfmt_msg));
 
-  if (s_request_tight) {
+  switch (s_prefer_enc) {
+  case RFB_ENCODING_TIGHT:
     log_write(LL_DETAIL, "Preferring Tight encoding");
-    buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4],  RFB_ENCODING_TIGHT);
-  } else {
+    break;
+  case RFB_ENCODING_ZRLE:
+    log_write(LL_DETAIL, "Preferring ZRLE encoding");
+    break;
+  case RFB_ENCODING_ZLIB:
+    log_write(LL_DETAIL, "Preferring Zlib encoding");
+    break;
+  default:
     log_write(LL_DETAIL, "Preferring Hextile encoding");
   }
+  if (s_prefer_enc != RFB_ENCODING_HEXTILE)
+    buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4], s_prefer_enc);
 
   buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4], RFB_ENCODING_HEXTILE);
   buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4], RFB_ENCODING_RAW);
@@ -422,13 +442,18 @@ static void rf_host_set_formats(void)
     log_write(LL_DETAIL, "Not requesting CopyRect encoding");
   }
 
-  if (s_request_tight) {
+  if (s_prefer_enc == RFB_ENCODING_TIGHT) {
     buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4], RFB_ENCODING_LASTRECT);
     if (s_tight_level >= 0 && s_tight_level <= 9) {
       log_write(LL_DETAIL, "Requesting compression level %d", s_tight_level);
       buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4],
                          RFB_ENCODING_COMPESSLEVEL0 + (CARD32)s_tight_level);
     }
+    if (s_jpeg_quality >= 0 && s_jpeg_quality <= 9) {
+      log_write(LL_DETAIL, "Requesting JPEG quality level %d", s_jpeg_quality);
+      buf_putsafe_CARD32(&setenc_msg[4 + num_enc++ * 4],
+                         RFB_ENCODING_QUALITYLEVEL0 + (CARD32)s_jpeg_quality);
+    }
   }
 
   if (s_request_cursor) {
@@ -454,7 +479,7 @@ static void rf_host_set_formats(void)
 
   /* If there was no local framebuffer yet, start listening for client
      connections, assuming we are mostly ready to serve clients. */
-  if (g_framebuffer == NULL) {
+  if (g_framebuffer == NULL && !workers_listen(s_cl_listen_port)) {
     if (!aio_listen(s_cl_listen_port, NULL, af_client_accept,
                     sizeof(CL_SLOT))) {
       log_write(LL_ERROR, "Error creating listening socket: %s",
@@ -509,16 +534,9 @@ int alloc_framebuffer(int w, int h)
   log_write(LL_DETAIL, "(Re)allocated framebuffer, %d bytes",
             fb_size * sizeof(CARD32));
 
-  /* Note: If the cache is already allocated, allocate_enc_cache()
-     function frees the cache memory first. */
-  if (!allocate_enc_cache()) {
-    free(g_framebuffer);
-    g_framebuffer = NULL;
-    log_write(LL_ERROR, "Error allocating cache for encoded data");
-    return 0;
-  }
-  log_write(LL_DETAIL, "(Re)allocated cache for encoded data, %d bytes",
-            sizeof_enc_cache());
+  /* Contents of the new framebuffer are unknown */
+  tile_hash_alloc(g_fb_width, g_fb_height);
+  motion_alloc(g_fb_width, g_fb_height);
 
   return 1;
 }
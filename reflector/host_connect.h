@@ -18,7 +18,8 @@
 #define _REFLIB_HOSTCONNECT_H
 
 void set_host_encodings(int request_copyrect, int convert_copyrect,
-                        int request_tight, int tight_level, int request_cursor);
+                        CARD32 prefer_enc, int tight_level, int jpeg_quality,
+                        int request_cursor);
 int connect_to_host(char *host_info_file, int cl_listen_port);
 
 /* FIXME: Move this stuff to another file. */
@@ -30,6 +30,12 @@
 #include "host_connect.h"
 #include "host_io.h"
 #include "encode.h"
+#include "workers.h"
+#include "tile_hash.h"
+#include "motion.h"
+
+/* Pseudo-encodings do not carry pixel data */
+#define IS_PSEUDO_ENCODING(enc)  (((enc) & 0xFFFFFF00) == 0xFFFFFF00)
 
 static void host_really_activate(AIO_SLOT *slot);
 static void fn_host_pass_newfbsize(AIO_SLOT *slot);
@@ -42,6 +48,10 @@ static void rf_host_fbupdate_raw(void);
 static void rf_host_copyrect(void);
 
 static void fn_host_add_client_rect(AIO_SLOT *slot);
+static void queue_changed_rect(FB_RECT *r);
+static void queue_moved_rects(FB_RECT *copies, int num_copies,
+                              FB_RECT *changed, int num_changed);
+static void fn_host_add_changed_rect(AIO_SLOT *slot);
 
 static void rf_host_colormap_hdr(void);
 static void rf_host_colormap_data(void);
@@ -126,16 +136,19 @@ static void host_really_activate(AIO_SLOT *slot)
 {
   AIO_SLOT *saved_slot = cur_slot;
   HOST_SLOT *hs = (HOST_SLOT *)slot;
+  FB_RECT r;
 
   log_write(LL_MSG, "Activating new host connection");
-  slot->type = TYPE_HOST_ACTIVE_SLOT;
+  aio_set_slot_type(slot, TYPE_HOST_ACTIVE_SLOT);
   s_host_slot = slot;
 
   write_active_file();
   perform_action("host_activate");
 
   /* Allocate the framebuffer or extend its dimensions if necessary */
+  fb_lock_write();
   if (!alloc_framebuffer(hs->fb_width, hs->fb_height)) {
+    fb_unlock_write();
     aio_close(1);
     return;
   }
@@ -143,14 +156,16 @@ static void host_really_activate(AIO_SLOT *slot)
   /* Set default desktop geometry for new client connections */
   g_screen_info.width = hs->fb_width;
   g_screen_info.height = hs->fb_height;
+  fb_unlock_write();
 
   /* If requested, open file to save this session and write the header */
   fbs_open_file(hs->fb_width, hs->fb_height);
 
   cur_slot = slot;
 
-  /* Reset zlib streams in the Tight decoder */
+  /* Reset zlib streams in the Tight, Zlib and ZRLE decoders */
   reset_tight_streams();
+  reset_zlib_streams();
 
   /* Request initial screen contents */
   log_write(LL_DETAIL, "Requesting full framebuffer update");
@@ -159,6 +174,9 @@ static void host_really_activate(AIO_SLOT *slot)
 
   /* Notify clients about desktop geometry change */
   aio_walk_slots(fn_host_pass_newfbsize, TYPE_CL_SLOT);
+  SET_RECT(&r, 0, 0, hs->fb_width, hs->fb_height);
+  r.enc = RFB_ENCODING_NEWFBSIZE;
+  workers_post(WMSG_RECT, &r, NULL);
 
   cur_slot = saved_slot;
 }
@@ -218,6 +236,8 @@ static void rf_host_msg(void)
 static CARD16 rect_count;
 static FB_RECT cur_rect;
 static CARD16 rect_cur_row;
+static FB_RECT s_changed_rect;
+static unsigned long s_rect_epoch;
 
 static void rf_host_fbupdate_hdr(void)
 {
@@ -289,14 +309,17 @@ static void rf_host_fbupdate_recthdr(void)
   if (cur_rect.enc == RFB_ENCODING_NEWFBSIZE) {
     log_write(LL_INFO, "New host desktop geometry: %dx%d",
               (int)cur_rect.w, (int)cur_rect.h);
+    fb_lock_write();
     g_screen_info.width = hs->fb_width = cur_rect.w;
     g_screen_info.height = hs->fb_height = cur_rect.h;
 
     /* Reallocate the framebuffer if necessary */
     if (!alloc_framebuffer(hs->fb_width, hs->fb_height)) {
+      fb_unlock_write();
       aio_close(1);
       return;
     }
+    fb_unlock_write();
 
     cur_rect.x = cur_rect.y = 0; /* FIXME: */
 
@@ -321,6 +344,9 @@ static void rf_host_fbupdate_recthdr(void)
             (int)cur_rect.w, (int)cur_rect.h,
             (int)cur_rect.x, (int)cur_rect.y);
 
+  /* Worker threads should know that pixels are about to change */
+  s_rect_epoch = fb_modified();
+
   switch(cur_rect.enc) {
   case RFB_ENCODING_RAW:
     log_write(LL_DEBUG, "Receiving raw data, expecting %d byte(s)",
@@ -343,6 +369,14 @@ static void rf_host_fbupdate_recthdr(void)
     log_write(LL_DEBUG, "Receiving Tight-encoded data");
     setread_decode_tight(&cur_rect);
     break;
+  case RFB_ENCODING_ZLIB:
+    log_write(LL_DEBUG, "Receiving Zlib-encoded data");
+    setread_decode_zlib(&cur_rect);
+    break;
+  case RFB_ENCODING_ZRLE:
+    log_write(LL_DEBUG, "Receiving ZRLE-encoded data");
+    setread_decode_zrle(&cur_rect);
+    break;
   case RFB_ENCODING_XCURSOR:
     log_write(LL_DEBUG, "XCursor encoding.");
     setread_decode_xcursor(&cur_rect);
@@ -460,14 +494,51 @@ void fill_fb_rect(FB_RECT *r, CARD32 color)
 
 void fbupdate_rect_done(void)
 {
+  HOST_SLOT *hs = (HOST_SLOT *)cur_slot;
+  FB_RECT changed_rects[TILE_HASH_MAX_RECTS];
+  FB_RECT copy_rects[MOTION_MAX_RECTS];
+  int num_rects, num_copies, i;
+  int read_f;
+
   if (cur_rect.w != 0 && cur_rect.h != 0) {
     log_write(LL_DEBUG, "Received rectangle ok");
 
-    /* Cached data for this rectangle is not valid any more */
-    invalidate_enc_cache(&cur_rect);
-
-    /* Queue this rectangle for each client */
-    aio_walk_slots(fn_host_add_client_rect, TYPE_CL_SLOT);
+    if (IS_PSEUDO_ENCODING(cur_rect.enc)) {
+      queue_changed_rect(&cur_rect);
+    } else {
+      /* If the framebuffer has been read for encoding while the
+         rectangle was being decoded, clients may have got some of its
+         pixels half-drawn. */
+      read_f = fb_read_since(s_rect_epoch);
+
+      /* Look for scrolled or moved areas unless the host sends CopyRect.
+         Copies from within a rectangle read half-drawn would be wrong. */
+      if ( cur_rect.enc == RFB_ENCODING_COPYRECT || hs->convert_copyrect ||
+           read_f ) {
+        motion_detect(&cur_rect, NULL);
+        num_copies = 0;
+      } else {
+        num_copies = motion_detect(&cur_rect, copy_rects);
+      }
+
+      /* Pass only the area where pixels have changed. If clients may
+         have got half-drawn pixels, unchanged tiles included, pass the
+         whole rectangle and invalidate all the data cached for it. */
+      num_rects = tile_hash_update(&cur_rect, changed_rects);
+      if (read_f) {
+        queue_changed_rect(&cur_rect);
+      } else if (num_rects == 0) {
+        log_write(LL_DEBUG, "Pixels not changed, rectangle suppressed");
+      } else if (cur_rect.enc == RFB_ENCODING_COPYRECT) {
+        /* Parts of CopyRect may depend on each other, keep it whole */
+        queue_changed_rect(&cur_rect);
+      } else if (num_copies != 0) {
+        queue_moved_rects(copy_rects, num_copies, changed_rects, num_rects);
+      } else {
+        for (i = 0; i < num_rects; i++)
+          queue_changed_rect(&changed_rects[i]);
+      }
+    }
   }
 
   if (--rect_count) {
@@ -476,6 +547,7 @@ void fbupdate_rect_done(void)
     /* Done with the whole update */
     fbs_flush_data();
     aio_walk_slots(fn_client_send_rects, TYPE_CL_SLOT);
+    workers_post(WMSG_SEND_RECTS, NULL, NULL);
     log_write(LL_DEBUG, "Requesting incremental framebuffer update");
     request_update(1);
     aio_setread(rf_host_msg, NULL, 1);
@@ -487,6 +559,73 @@ static void fn_host_add_client_rect(AIO_SLOT *slot)
   fn_client_add_rect(slot, &cur_rect);
 }
 
+/*
+ * Invalidate cached data for a changed rectangle, and queue it for
+ * each client.
+ */
+
+static void queue_changed_rect(FB_RECT *r)
+{
+  invalidate_enc_cache(r);
+
+  s_changed_rect = *r;
+  aio_walk_slots(fn_host_add_changed_rect, TYPE_CL_SLOT);
+  workers_post(WMSG_RECT, r, NULL);
+}
+
+/*
+ * Queue CopyRect rectangles for areas found scrolled or moved, in the
+ * order they should be copied, then the rest of the changed area.
+ */
+
+static void queue_moved_rects(FB_RECT *copies, int num_copies,
+                              FB_RECT *changed, int num_changed)
+{
+  RegionRec region, tmp_region;
+  BoxRec box;
+  BoxPtr pbox;
+  FB_RECT r;
+  int i;
+
+  REGION_INIT(&region, NullBox, 16);
+  for (i = 0; i < num_changed; i++) {
+    box.x1 = changed[i].x;
+    box.y1 = changed[i].y;
+    box.x2 = changed[i].x + changed[i].w;
+    box.y2 = changed[i].y + changed[i].h;
+    REGION_INIT(&tmp_region, &box, 1);
+    REGION_UNION(&region, &region, &tmp_region);
+    REGION_UNINIT(&tmp_region);
+  }
+
+  for (i = 0; i < num_copies; i++) {
+    queue_changed_rect(&copies[i]);
+    box.x1 = copies[i].x;
+    box.y1 = copies[i].y;
+    box.x2 = copies[i].x + copies[i].w;
+    box.y2 = copies[i].y + copies[i].h;
+    REGION_INIT(&tmp_region, &box, 1);
+    REGION_SUBTRACT(&region, &region, &tmp_region);
+    REGION_UNINIT(&tmp_region);
+  }
+
+  r = cur_rect;
+  pbox = REGION_RECTS(&region);
+  for (i = 0; i < REGION_NUM_RECTS(&region); i++) {
+    r.x = (CARD16)pbox[i].x1;
+    r.y = (CARD16)pbox[i].y1;
+    r.w = (CARD16)(pbox[i].x2 - pbox[i].x1);
+    r.h = (CARD16)(pbox[i].y2 - pbox[i].y1);
+    queue_changed_rect(&r);
+  }
+  REGION_UNINIT(&region);
+}
+
+static void fn_host_add_changed_rect(AIO_SLOT *slot)
+{
+  fn_client_add_rect(slot, &s_changed_rect);
+}
+
 /*****************************************/
 /* Handling SetColourMapEntries messages */
 /*****************************************/
@@ -516,7 +655,7 @@ static void rf_host_colormap_data(void)
 
 /* FIXME: Add state variables to the AIO_SLOT structure clone. */
 static size_t cut_len;
-static CARD8 *cut_text;
+static AIO_SHARED *cut_msg;
 
 static void rf_host_cuttext_hdr(void)
 {
@@ -533,14 +672,20 @@ static void rf_host_cuttext_hdr(void)
 
 static void rf_host_cuttext_data(void)
 {
-  cut_text = cur_slot->readbuf;
-  aio_walk_slots(fn_host_pass_cuttext, TYPE_CL_SLOT);
+  /* Prepare the message once, then queue it for all clients */
+  cut_msg = client_cuttext_msg(cur_slot->readbuf, cut_len);
+  if (cut_msg != NULL) {
+    aio_walk_slots(fn_host_pass_cuttext, TYPE_CL_SLOT);
+    workers_post(WMSG_CUTTEXT, NULL, cut_msg);
+    aio_shared_unref(cut_msg);
+    cut_msg = NULL;
+  }
   aio_setread(rf_host_msg, NULL, 1);
 }
 
 static void fn_host_pass_cuttext(AIO_SLOT *slot)
 {
-  fn_client_send_cuttext(slot, cut_text, cut_len);
+  fn_client_send_cuttext(slot, cut_msg);
 }
 
 /*************************************/
@@ -553,6 +698,10 @@ void pass_msg_to_host(CARD8 *msg, size_t len)
 {
   AIO_SLOT *saved_slot = cur_slot;
 
+  /* Worker threads pass messages via the host thread */
+  if (workers_pass_to_host(msg, len, NULL, 0))
+    return;
+
   if (s_host_slot != NULL) {
     cur_slot = s_host_slot;
     aio_write(NULL, msg, len);
@@ -567,9 +716,14 @@ void pass_cuttext_to_host(CARD8 *text, size_t len)
     6, 0, 0, 0, 0, 0, 0, 0
   };
 
-  if (s_host_slot != NULL) {
-    buf_put_CARD32(&client_cuttext_hdr[4], (CARD32)len);
+  buf_put_CARD32(&client_cuttext_hdr[4], (CARD32)len);
 
+  /* Worker threads pass messages via the host thread */
+  if (workers_pass_to_host(client_cuttext_hdr, sizeof(client_cuttext_hdr),
+                           text, len))
+    return;
+
+  if (s_host_slot != NULL) {
     cur_slot = s_host_slot;
     aio_write(NULL, client_cuttext_hdr, sizeof(client_cuttext_hdr));
     aio_write(NULL, text, len);
@@ -591,7 +745,10 @@ static void reset_framebuffer(void)
   FB_RECT r;
 
   log_write(LL_DETAIL, "Clearing framebuffer and cache");
+  fb_modified();
   memset(g_framebuffer, 0, g_fb_width * g_fb_height * sizeof(CARD32));
+  tile_hash_reset();
+  motion_reset();
 
   r.x = r.y = 0;
   r.w = g_fb_width;
@@ -603,6 +760,8 @@ static void reset_framebuffer(void)
   r.w = hs->fb_width;
   r.h = hs->fb_height;
   aio_walk_slots(fn_host_add_client_rect, TYPE_CL_SLOT);
+  r.enc = RFB_ENCODING_RAW;
+  workers_post(WMSG_RECT, &r, NULL);
 }
 
 /*
@@ -50,6 +50,12 @@ extern void setread_decode_hextile(FB_RECT *r);
 extern void setread_decode_tight(FB_RECT *r);
 extern void reset_tight_streams(void);
 
+/* decode_zrle.c */
+
+extern void setread_decode_zlib(FB_RECT *r);
+extern void setread_decode_zrle(FB_RECT *r);
+extern void reset_zlib_streams(void);
+
 /* decode_cursor.c */
 
 extern void setread_decode_xcursor(FB_RECT *r);
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "logging.h"
 
@@ -29,6 +30,9 @@ static int log_stderr_level = -1;
 
 static char log_lchar[] = "@!*+-: ";
 
+/* Serializes log_write() calls made from different threads */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*******************************************************************
  *
  *  Open log file.
@@ -171,6 +175,7 @@ void log_write(int level, char *format, ...)
 {
   va_list arg_list;
   time_t now;
+  struct tm now_tm;
   char time_buf[32];
   char level_char = ' ';
 
@@ -179,12 +184,13 @@ void log_write(int level, char *format, ...)
   if ( (log_fp != NULL && level <= log_file_level) ||
        level <= log_stderr_level ) {
     now = time(NULL);
-    strftime(time_buf, 31, "%d/%m/%y %H:%M:%S", localtime(&now));
+    strftime(time_buf, 31, "%d/%m/%y %H:%M:%S", localtime_r(&now, &now_tm));
 
     if (level >= 0 && level < sizeof(log_lchar) - 1)
       level_char = log_lchar[level];
 
-    if (level <= log_file_level) {
+    pthread_mutex_lock(&log_mutex);
+    if (level <= log_file_level && log_fp != NULL) {
       fprintf(log_fp, "%s %c ", time_buf, (int)level_char);
       vfprintf(log_fp, format, arg_list);
       fprintf(log_fp, "\n");
@@ -196,6 +202,7 @@ void log_write(int level, char *format, ...)
       fprintf(stderr, "\n");
       fflush(stderr);
     }
+    pthread_mutex_unlock(&log_mutex);
   }
 
   va_end(arg_list);
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -34,6 +35,12 @@
 #include "host_io.h"
 #include "client_io.h"
 #include "encode.h"
+#include "workers.h"
+#include "pool.h"
+#include "tile_hash.h"
+#include "motion.h"
+#include "adapt.h"
+#include "scan.h"
 
 /*
  * Configuration options
@@ -52,11 +59,19 @@ static char  opt_pid_file[256];
 static char *opt_fbs_prefix;
 static int   opt_join_sessions;
 static char *opt_bind_ip;
-static int   opt_request_tight;
+static CARD32 opt_host_encoding;
 static int   opt_request_copyrect;
 static int   opt_request_cursor;
 static int   opt_convert_copyrect;
 static int   opt_tight_level;
+static int   opt_jpeg_quality;
+static int   opt_num_workers;
+static int   opt_share_tight;
+static int   opt_num_encoders;
+static int   opt_queue_high_water;
+static int   opt_queue_limit;
+static int   opt_adapt_quality;
+static int   opt_detect_motion;
 
 static unsigned char opt_client_password[9];
 static unsigned char opt_client_ro_password[9];
@@ -81,6 +96,7 @@ static int read_password_file(void);
 static int init_screen_info(void);
 static int write_pid_file(void);
 static int remove_pid_file(void);
+static void report_block_stats(time_t start_time);
 
 /*
  * Implementation
@@ -89,6 +105,11 @@ static int remove_pid_file(void);
 int main(int argc, char **argv)
 {
   long cache_hits, cache_misses;
+  long suppressed_rects, suppressed_bytes;
+  long moved_rects, moved_bytes;
+  time_t start_time;
+
+  start_time = time(NULL);
 
   /* Parse command line, exit on error */
   parse_args(argc, argv);
@@ -135,14 +156,20 @@ int main(int argc, char **argv)
   if (init_screen_info()) {
     read_password_file();
     set_host_encodings(opt_request_copyrect, opt_convert_copyrect,
-                       opt_request_tight, opt_tight_level, opt_request_cursor);
+                       opt_host_encoding, opt_tight_level, opt_jpeg_quality,
+                       opt_request_cursor);
     set_client_passwords(opt_client_password, opt_client_ro_password);
+    set_client_queue_limit((size_t)opt_queue_high_water * 1024);
+    set_tight_sharing(opt_share_tight);
+    set_adaptive_quality(opt_adapt_quality);
+    set_motion_detection(opt_detect_motion);
+    scan_init();
     fbs_set_prefix(opt_fbs_prefix, opt_join_sessions);
 
     set_active_file(opt_active_filename);
     set_actions_file(opt_actions_filename);
 
-    aio_init();
+    aio_set_queue_limit((size_t)opt_queue_limit * 1024, TYPE_CL_SLOT);
     if (opt_bind_ip != NULL) {
       if (aio_set_bind_address(opt_bind_ip)) {
         log_write(LL_INFO, "Would bind listening sockets to address %s",
@@ -154,29 +181,50 @@ int main(int argc, char **argv)
     }
 
     /* Main work */
-    if (connect_to_host(opt_host_info_file, opt_cl_listen_port)) {
+    if (!aio_init()) {
+      log_write(LL_ERROR, "Error initializing I/O: %s", strerror(errno));
+    } else if (workers_start(opt_num_workers) &&
+               pool_start(opt_num_encoders) &&
+               connect_to_host(opt_host_info_file, opt_cl_listen_port)) {
       if (write_pid_file()) {
         set_control_signals();
         aio_mainloop();
         remove_pid_file();
       }
     }
+    workers_stop();
+    pool_stop();
 
     /* Cleanup */
     if (g_framebuffer != NULL) {
       log_write(LL_DETAIL, "Freeing framebuffer and associated structures");
       free(g_framebuffer);
       free_enc_cache();
+      tile_hash_free();
+      motion_free();
     }
     if (g_screen_info.name != NULL)
       free(g_screen_info.name);
 
     get_hextile_caching_stats(&cache_hits, &cache_misses);
+    workers_add_caching_stats(&cache_hits, &cache_misses);
     if (cache_hits + cache_misses != 0) {
-      log_write(LL_INFO, "Hextile BGR233 caching efficiency: %d%%",
+      log_write(LL_INFO, "Hextile caching efficiency: %d%%",
                 (int)((cache_hits * 100 + (cache_hits + cache_misses) / 2)
                       / (cache_hits + cache_misses)));
     }
+    get_tile_hash_stats(&suppressed_rects, &suppressed_bytes);
+    if (suppressed_bytes != 0) {
+      log_write(LL_INFO, "Unchanged pixel data suppressed: %ld bytes, "
+                "%ld whole rectangle(s)", suppressed_bytes, suppressed_rects);
+    }
+    get_motion_stats(&moved_rects, &moved_bytes);
+    if (moved_rects != 0) {
+      log_write(LL_INFO, "Scrolled or moved areas sent as CopyRect: "
+                "%ld rectangle(s), %ld bytes", moved_rects, moved_bytes);
+    }
+    report_block_stats(start_time);
+    aio_free_block_pools();
   }
 
   log_write(LL_MSG, "Terminating");
@@ -210,14 +258,23 @@ static void parse_args(int argc, char **argv)
   opt_fbs_prefix = NULL;
   opt_join_sessions = 0;
   opt_bind_ip = NULL;
-  opt_request_tight = 0;
+  opt_host_encoding = RFB_ENCODING_RAW; /* Not specified */
   opt_request_copyrect = 1;
   opt_convert_copyrect = 0;
   opt_request_cursor = 1;
   opt_tight_level = -1;
+  opt_jpeg_quality = -1;
+  opt_num_workers = 0;
+  opt_share_tight = 0;
+  opt_num_encoders = 0;
+  opt_queue_high_water = -1;
+  opt_queue_limit = -1;
+  opt_adapt_quality = 0;
+  opt_detect_motion = 0;
 
   while (!err &&
-         (c = getopt(argc, argv, "hqjrRxv:f:p:a:c:g:l:i:s:b:tT:")) != -1) {
+         (c = getopt(argc, argv,
+                     "hqjrRxSADv:f:p:a:c:g:l:i:s:b:tT:e:Q:w:P:m:M:")) != -1) {
     switch (c) {
     case 'h':
       err = 1;
@@ -296,38 +353,118 @@ static void parse_args(int argc, char **argv)
         opt_bind_ip = optarg;
       break;
     case 'r':
-      if (!opt_request_copyrect || opt_convert_copyrect)
+      if (!opt_request_copyrect || opt_convert_copyrect || opt_detect_motion)
         err = 1;
       else
         opt_convert_copyrect = 1;
       break;
     case 'R':
-      if (!opt_request_copyrect || opt_convert_copyrect)
+      if (!opt_request_copyrect || opt_convert_copyrect || opt_detect_motion)
         err = 1;
       else
         opt_request_copyrect = 0;
       break;
     case 't':
-      if (opt_request_tight)
+      if (opt_host_encoding != RFB_ENCODING_RAW)
         err = 1;
       else
-        opt_request_tight = 1;
+        opt_host_encoding = RFB_ENCODING_TIGHT;
       break;
     case 'T':
-      if (opt_request_tight) {
+      if (opt_host_encoding != RFB_ENCODING_RAW) {
         err = 1;
       } else {
-        opt_request_tight = 1;
+        opt_host_encoding = RFB_ENCODING_TIGHT;
         opt_tight_level = atoi(optarg);
         if (opt_tight_level <= 0 || opt_tight_level > 9)
           err = 1;
       }
       break;
+    case 'e':
+      if (opt_host_encoding != RFB_ENCODING_RAW) {
+        err = 1;
+      } else if (strcmp(optarg, "hextile") == 0) {
+        opt_host_encoding = RFB_ENCODING_HEXTILE;
+      } else if (strcmp(optarg, "tight") == 0) {
+        opt_host_encoding = RFB_ENCODING_TIGHT;
+      } else if (strcmp(optarg, "zrle") == 0) {
+        opt_host_encoding = RFB_ENCODING_ZRLE;
+      } else if (strcmp(optarg, "zlib") == 0) {
+        opt_host_encoding = RFB_ENCODING_ZLIB;
+      } else {
+        err = 1;
+      }
+      break;
+    case 'Q':
+      if (opt_jpeg_quality != -1) {
+        err = 1;
+      } else {
+        opt_jpeg_quality = atoi(optarg);
+        if (opt_jpeg_quality < 0 || opt_jpeg_quality > 9)
+          err = 1;
+      }
+      break;
+    case 'w':
+      if (opt_num_workers)
+        err = 1;
+      else {
+        opt_num_workers = atoi(optarg);
+        if (opt_num_workers <= 0)
+          err = 1;
+      }
+      break;
+    case 'S':
+      opt_share_tight = 1;
+      break;
+    case 'A':
+      opt_adapt_quality = 1;
+      break;
+    case 'D':
+      if (!opt_request_copyrect || opt_convert_copyrect)
+        err = 1;
+      else
+        opt_detect_motion = 1;
+      break;
+    case 'P':
+      if (opt_num_encoders)
+        err = 1;
+      else {
+        opt_num_encoders = atoi(optarg);
+        if (opt_num_encoders <= 0)
+          err = 1;
+      }
+      break;
+    case 'm':
+      if (opt_queue_high_water != -1)
+        err = 1;
+      else {
+        opt_queue_high_water = atoi(optarg);
+        if (opt_queue_high_water < 0)
+          err = 1;
+      }
+      break;
+    case 'M':
+      if (opt_queue_limit != -1)
+        err = 1;
+      else {
+        opt_queue_limit = atoi(optarg);
+        if (opt_queue_limit < 0)
+          err = 1;
+      }
+      break;
     default:
       err = 1;
     }
   }
 
+  /* JPEG quality makes sense with Tight encoding only */
+  if (opt_jpeg_quality != -1) {
+    if (opt_host_encoding == RFB_ENCODING_RAW)
+      opt_host_encoding = RFB_ENCODING_TIGHT;
+    else if (opt_host_encoding != RFB_ENCODING_TIGHT)
+      err = 1;
+  }
+
   /* Print usage help on error */
   if (err || optind != argc - 1) {
     report_usage(argv[0]);
@@ -343,6 +480,12 @@ static void parse_args(int argc, char **argv)
     opt_log_filename = "reflector.log";
   if (opt_cl_listen_port == -1)
     opt_cl_listen_port = 5999;
+  if (opt_queue_high_water == -1)
+    opt_queue_high_water = 1024;
+  if (opt_queue_limit == -1)
+    opt_queue_limit = 0;
+  if (opt_host_encoding == RFB_ENCODING_RAW)
+    opt_host_encoding = RFB_ENCODING_HEXTILE;
 
   /* Append listening port number to pid filename */
   if (temp_pid_file != NULL) {
@@ -393,14 +536,39 @@ static void report_usage(char *program_name)
           " if possible\n"
           "  -T COMPR_LEVEL  - like -t, but use the specified compression"
           " level (1..9)\n"
+          "  -e ENCODING     - prefer the specified encoding for host"
+          " communications:\n"
+          "                    hextile, tight, zrle or zlib"
+          " [default: hextile]\n"
+          "  -Q QUALITY      - like -t, but allow JPEG with the specified"
+          " quality (0..9)\n"
           "  -r              - convert CopyRect updates received from host"
           " to \"normal\"\n"
           "                    rectangles, so clients will never receive"
           " CopyRects\n"
           "  -R              - disable CopyRect completely on both host"
           " and client sides\n"
+          "  -D              - detect scrolled and moved areas in updates"
+          " from host and\n"
+          "                    send them to clients as CopyRects\n"
           "  -x              - disable cursor shape and cursor position"
-          " updates\n");
+          " updates\n"
+          "  -w NUM_THREADS  - serve clients in the specified number of"
+          " worker threads\n"
+          "  -S              - encode Tight data once for all clients with"
+          " the same\n"
+          "                    pixel format and encoding parameters\n"
+          "  -A              - adapt Tight compression level and JPEG"
+          " quality to the\n"
+          "                    measured speed of each client connection\n"
+          "  -P NUM_THREADS  - encode large Tight rectangles in parallel in"
+          " the specified\n"
+          "                    number of additional threads\n"
+          "  -m KBYTES       - defer updates to clients with more data"
+          " queued [default: 1024]\n"
+          "  -M KBYTES       - disconnect the slowest clients if all data"
+          " queued exceeds\n"
+          "                    the limit [default: 0, no limit]\n");
   fprintf(stderr,
           "  -g LOG_FILE     - write logs to the specified file"
           " [default: reflector.log]\n"
@@ -577,3 +745,32 @@ static int remove_pid_file(void)
   return 1;
 }
 
+
+/*
+ * Log how many output blocks have been allocated and released, and
+ * how many malloc() and free() calls were needed for that.
+ */
+
+static void report_block_stats(time_t start_time)
+{
+  AIO_BLOCK_STATS stats;
+  long seconds;
+
+  aio_get_block_stats(&stats);
+  workers_add_block_stats(&stats);
+  if (stats.allocs == 0)
+    return;
+
+  seconds = (long)(time(NULL) - start_time);
+  if (seconds < 1)
+    seconds = 1;
+
+  log_write(LL_INFO, "Output blocks allocated: %ld (%ld/s), "
+            "with malloc(): %ld (%ld/s)",
+            stats.allocs, stats.allocs / seconds,
+            stats.allocs_malloc, stats.allocs_malloc / seconds);
+  log_write(LL_INFO, "Output blocks released: %ld (%ld/s), "
+            "with free(): %ld (%ld/s)",
+            stats.frees, stats.frees / seconds,
+            stats.frees_free, stats.frees_free / seconds);
+}
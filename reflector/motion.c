@@ -0,0 +1,760 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Detection of scrolled and moved areas
+ */
+
+/*
+ * Many hosts never send CopyRect, so when a document is scrolled or a
+ * window is dragged, clients receive all pixels of the area again. To
+ * find such areas, a hash of each 16-pixel segment of each row of the
+ * framebuffer is kept. Before the hashes are updated for a rectangle
+ * which has been just decoded, its rows are looked up among old rows
+ * of the same columns, which finds vertical scrolling. Otherwise,
+ * hashes of 16x16 blocks at every position within strips of the
+ * rectangle are looked up among hashes of old tiles around it, which
+ * finds windows moved in any direction. Large rectangles are searched
+ * in evenly spaced strips only. Hashes are polynomial, so that tile
+ * hashes are computed from hashes of row segments, and block hashes
+ * are rolled over the rectangle. Areas matching old ones at a single
+ * offset are returned as CopyRect rectangles.
+ *
+ * Where the source of a copy lies outside of the rectangle, its old
+ * pixels are still in the framebuffer and are compared with the new
+ * ones. Inside the rectangle, old pixels are gone and only 64-bit
+ * hashes are compared, so a hash collision would leave wrong pixels
+ * on clients until the area changes again. All these functions
+ * should be called from the host thread only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rfblib.h"
+#include "reflector.h"
+#include "logging.h"
+#include "region.h"
+#include "motion.h"
+
+#define MOTION_BLOCK       16   /* Width of row segments and tiles        */
+#define MOTION_MIN_ROWS    8    /* Rows to agree on scrolling distance    */
+#define MOTION_MIN_RUN     4    /* Minimum height of scrolled rectangles  */
+#define MOTION_MIN_TILES   4    /* Tiles to agree on a move vector        */
+#define MOTION_SEARCH      256  /* Maximum distance of window moves       */
+#define MOTION_SCAN_PIXELS (1 << 19) /* Pixels searched for moves      */
+#define MOTION_MAX_VOTES   1024 /* Move vectors counted at once           */
+
+#define PRIME64_1  0x9E3779B185EBCA87ULL
+#define PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3  0x165667B19E3779F9ULL
+
+/* Multipliers for pixels within a row segment and for rows */
+#define MUL_X  PRIME64_2
+#define MUL_Y  PRIME64_3
+
+/* Prefilter for tile hashes, one bit per value of the upper 16 bits */
+#define FILTER_BITS   16
+#define FILTER_WORDS  ((1 << FILTER_BITS) / 32)
+#define FILTER_INDEX(h)  ((int)((h) >> (64 - FILTER_BITS)))
+
+typedef struct _MOTION_ENTRY {
+  uint64_t hash;
+  int pos;                      /* Row or tile, -1 if empty, -2 if many  */
+} MOTION_ENTRY;
+
+typedef struct _MOTION_VOTE {
+  int dx, dy;
+  int count;                    /* Zero if the entry is empty            */
+} MOTION_VOTE;
+
+static int s_enabled = 0;
+
+/* Hashes of row segments, row by row. Zero means that the hash is
+   unknown, computed hashes are never zero. */
+static uint64_t *s_rows = NULL;
+static int s_bands;
+
+/* Buffers reused by motion_detect() */
+static uint64_t *s_new_rows = NULL;
+static size_t s_new_rows_size = 0;
+static char *s_scratch = NULL;
+static size_t s_scratch_size = 0;
+
+static long s_copy_rects = 0;
+static long s_copy_bytes = 0;
+
+static int detect_scroll(FB_RECT *r, int b1, int nb, uint64_t *new_rows,
+                         FB_RECT *copies);
+static int detect_move(FB_RECT *r, FB_RECT *copies);
+static int find_move_vector(FB_RECT *r, MOTION_ENTRY *table, int mask,
+                            CARD32 *filter, int tx1, int ty1, int ntx,
+                            int *dx, int *dy);
+
+static void *get_buffer(void *buf, size_t *buf_size, size_t size);
+static uint64_t mix_pixel(CARD32 pixel);
+static uint64_t hash_segment(int b, int y);
+static uint64_t hash_block(int x, int y);
+static int pixels_equal(FB_RECT *r, int x, int y, int w, int h,
+                        int src_x, int src_y);
+static uint64_t combine_hashes(uint64_t *hashes, int num);
+static int table_alloc_mask(int num_entries);
+static void table_insert(MOTION_ENTRY *table, int mask,
+                         uint64_t hash, int pos);
+static int table_lookup(MOTION_ENTRY *table, int mask, uint64_t hash);
+
+/*
+ * Enable or disable the detection, should be called before the
+ * framebuffer is allocated.
+ */
+
+void set_motion_detection(int enable)
+{
+  s_enabled = enable;
+}
+
+/*
+ * Allocate hashes for the framebuffer of the specified size, all of
+ * them unknown. On errors, nothing is detected.
+ */
+
+void motion_alloc(int fb_width, int fb_height)
+{
+  motion_free();
+  if (!s_enabled)
+    return;
+
+  s_bands = (fb_width + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  s_rows = calloc((size_t)s_bands * fb_height, sizeof(uint64_t));
+  if (s_rows == NULL)
+    log_write(LL_WARN, "Error allocating row hashes (ignoring)");
+}
+
+void motion_free(void)
+{
+  if (s_rows != NULL) {
+    free(s_rows);
+    s_rows = NULL;
+  }
+  free(s_new_rows);
+  s_new_rows = NULL;
+  s_new_rows_size = 0;
+  free(s_scratch);
+  s_scratch = NULL;
+  s_scratch_size = 0;
+}
+
+/*
+ * Forget all hashes, should be called when the framebuffer has been
+ * changed without calling motion_detect().
+ */
+
+void motion_reset(void)
+{
+  if (s_rows != NULL)
+    memset(s_rows, 0, (size_t)s_bands * g_fb_height * sizeof(uint64_t));
+}
+
+/*
+ * Update hashes of rows of a rectangle which has been just decoded.
+ * Unless copies is NULL, find areas of the rectangle which have been
+ * scrolled or moved, and store up to MOTION_MAX_RECTS CopyRect
+ * rectangles in the copies array, in the order they should be copied.
+ * All of them have the same offset. Returns the number of rectangles.
+ */
+
+int motion_detect(FB_RECT *r, FB_RECT *copies)
+{
+  uint64_t *new_rows;
+  int b1, nb, y, b, i;
+  int num_rects = 0;
+
+  if (s_rows == NULL)
+    return 0;
+
+  b1 = r->x / MOTION_BLOCK;
+  nb = (r->x + r->w - 1) / MOTION_BLOCK - b1 + 1;
+
+  new_rows = get_buffer(&s_new_rows, &s_new_rows_size,
+                        (size_t)r->h * nb * sizeof(uint64_t));
+  if (new_rows == NULL) {
+    /* Old hashes are not valid any more */
+    for (y = r->y; y < r->y + r->h; y++)
+      memset(&s_rows[y * s_bands + b1], 0, nb * sizeof(uint64_t));
+    return 0;
+  }
+
+  for (y = 0; y < r->h; y++) {
+    for (b = 0; b < nb; b++)
+      new_rows[y * nb + b] = hash_segment(b1 + b, r->y + y);
+  }
+
+  if (copies != NULL) {
+    num_rects = detect_scroll(r, b1, nb, new_rows, copies);
+    if (num_rects == 0)
+      num_rects = detect_move(r, copies);
+  }
+
+  for (y = 0; y < r->h; y++) {
+    memcpy(&s_rows[(r->y + y) * s_bands + b1], &new_rows[y * nb],
+           nb * sizeof(uint64_t));
+  }
+
+  for (i = 0; i < num_rects; i++) {
+    s_copy_rects++;
+    s_copy_bytes += (long)copies[i].w * copies[i].h * (long)sizeof(CARD32);
+  }
+  return num_rects;
+}
+
+/*
+ * Get the number of CopyRect rectangles found, and the number of bytes
+ * of pixel data they have replaced.
+ */
+
+void get_motion_stats(long *rects, long *bytes)
+{
+  *rects = s_copy_rects;
+  *bytes = s_copy_bytes;
+}
+
+/*
+ * Find rows of the rectangle equal to old rows at the same distance
+ * above or below, no farther than the rectangle height. The distance
+ * is the one most changed rows agree on. Only row segments entirely
+ * within the rectangle are compared, so a few columns at its sides
+ * are never scrolled.
+ */
+
+static int detect_scroll(FB_RECT *r, int b1, int nb, uint64_t *new_rows,
+                         FB_RECT *copies)
+{
+  MOTION_ENTRY *table;
+  FB_RECT *cr, tmp_rect;
+  uint64_t *new_hashes, *old_hashes, hash;
+  int *votes;
+  int ib1, ib2, x, w, src_y1, src_y2, num_src, mask;
+  int y, ys, dy, best_dy, run_start, run_changed, i;
+  int num_rects = 0;
+  char *buf;
+
+  /* Bands entirely within the rectangle */
+  ib1 = (r->x + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  if (r->x + r->w == g_fb_width)
+    ib2 = s_bands;
+  else
+    ib2 = (r->x + r->w) / MOTION_BLOCK;
+  if (ib2 - ib1 < 2 || r->h < MOTION_MIN_ROWS)
+    return 0;
+  x = ib1 * MOTION_BLOCK;
+  w = ((ib2 * MOTION_BLOCK < g_fb_width) ?
+       ib2 * MOTION_BLOCK : g_fb_width) - x;
+
+  src_y1 = r->y - r->h + 1;
+  if (src_y1 < 0)
+    src_y1 = 0;
+  src_y2 = r->y + 2 * r->h - 1;
+  if (src_y2 > g_fb_height)
+    src_y2 = g_fb_height;
+  num_src = src_y2 - src_y1;
+  mask = table_alloc_mask(num_src);
+
+  buf = get_buffer(&s_scratch, &s_scratch_size,
+                   (r->h + num_src) * sizeof(uint64_t) +
+                   (mask + 1) * sizeof(MOTION_ENTRY) +
+                   2 * r->h * sizeof(int));
+  if (buf == NULL)
+    return 0;
+  new_hashes = (uint64_t *)buf;
+  old_hashes = new_hashes + r->h;
+  table = (MOTION_ENTRY *)(old_hashes + num_src);
+  votes = (int *)(table + mask + 1);
+
+  /* Hashes of rows within these bands */
+  for (y = 0; y < r->h; y++)
+    new_hashes[y] = combine_hashes(&new_rows[y * nb + ib1 - b1], ib2 - ib1);
+  for (i = 0; i <= mask; i++)
+    table[i].pos = -1;
+  for (y = src_y1; y < src_y2; y++) {
+    hash = combine_hashes(&s_rows[y * s_bands + ib1], ib2 - ib1);
+    old_hashes[y - src_y1] = hash;
+    if (hash != 0)
+      table_insert(table, mask, hash, y);
+  }
+
+  /* Each changed row votes for the distance to its unique source */
+  memset(votes, 0, 2 * r->h * sizeof(int));
+  best_dy = 0;
+  for (y = r->y; y < r->y + r->h; y++) {
+    hash = new_hashes[y - r->y];
+    if (hash == 0 || hash == old_hashes[y - src_y1])
+      continue;
+    ys = table_lookup(table, mask, hash);
+    if (ys < 0)
+      continue;
+    dy = y - ys;
+    if (dy <= -r->h || dy >= r->h)
+      continue;
+    votes[dy + r->h]++;
+    if (best_dy == 0 || votes[dy + r->h] > votes[best_dy + r->h])
+      best_dy = dy;
+  }
+  if (best_dy == 0 || votes[best_dy + r->h] < MOTION_MIN_ROWS)
+    return 0;
+
+  /* Runs of rows matching at that distance, with some rows changed */
+  dy = best_dy;
+  run_start = -1;
+  run_changed = 0;
+  for (y = r->y; y <= r->y + r->h; y++) {
+    if (y < r->y + r->h) {
+      ys = y - dy;
+      hash = new_hashes[y - r->y];
+      if ( ys >= src_y1 && ys < src_y2 && hash != 0 &&
+           hash == old_hashes[ys - src_y1] &&
+           pixels_equal(r, x, y, w, 1, x, ys) ) {
+        if (run_start < 0) {
+          run_start = y;
+          run_changed = 0;
+        }
+        if (hash != old_hashes[y - src_y1])
+          run_changed = 1;
+        continue;
+      }
+    }
+    if ( run_start >= 0 && run_changed &&
+         y - run_start >= MOTION_MIN_RUN &&
+         num_rects < MOTION_MAX_RECTS ) {
+      cr = &copies[num_rects++];
+      *cr = *r;
+      cr->x = (CARD16)x;
+      cr->y = (CARD16)run_start;
+      cr->w = (CARD16)w;
+      cr->h = (CARD16)(y - run_start);
+      cr->src_x = (CARD16)x;
+      cr->src_y = (CARD16)(run_start - dy);
+      cr->enc = RFB_ENCODING_COPYRECT;
+    }
+    run_start = -1;
+  }
+
+  /* Rows moved down should be copied starting from the bottom */
+  if (dy > 0) {
+    for (i = 0; i < num_rects / 2; i++) {
+      tmp_rect = copies[i];
+      copies[i] = copies[num_rects - 1 - i];
+      copies[num_rects - 1 - i] = tmp_rect;
+    }
+  }
+
+  return num_rects;
+}
+
+/*
+ * Find the offset most blocks of the rectangle have moved by from old
+ * tiles around it, then the area of the rectangle matching old tiles
+ * at that offset.
+ */
+
+static int detect_move(FB_RECT *r, FB_RECT *copies)
+{
+  MOTION_ENTRY *table;
+  FB_RECT *cr;
+  CARD32 *filter;
+  uint64_t *tile_hashes, hash;
+  int tx1, ty1, tx2, ty2, ntx, nty, mask;
+  int tx, ty, x, y, dx, dy, i, j, n;
+  int num_rects = 0;
+  RegionRec copy_region, tmp_region;
+  BoxRec box;
+  BoxPtr pbox;
+  char *buf;
+
+  if (r->w < 2 * MOTION_BLOCK || r->h < 2 * MOTION_BLOCK)
+    return 0;
+
+  /* Old tiles around the rectangle, entirely within the framebuffer */
+  x = (r->x > MOTION_SEARCH) ? r->x - MOTION_SEARCH : 0;
+  tx1 = (x + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  y = (r->y > MOTION_SEARCH) ? r->y - MOTION_SEARCH : 0;
+  ty1 = (y + MOTION_BLOCK - 1) / MOTION_BLOCK;
+  x = r->x + r->w + MOTION_SEARCH;
+  tx2 = ((x < g_fb_width) ? x : g_fb_width) / MOTION_BLOCK;
+  y = r->y + r->h + MOTION_SEARCH;
+  ty2 = ((y < g_fb_height) ? y : g_fb_height) / MOTION_BLOCK;
+  ntx = tx2 - tx1;
+  nty = ty2 - ty1;
+  if (ntx <= 0 || nty <= 0)
+    return 0;
+  mask = table_alloc_mask(ntx * nty);
+
+  buf = get_buffer(&s_scratch, &s_scratch_size,
+                   ntx * nty * sizeof(uint64_t) +
+                   (mask + 1) * sizeof(MOTION_ENTRY) +
+                   FILTER_WORDS * sizeof(CARD32) +
+                   (MOTION_BLOCK + 2) * r->w * sizeof(uint64_t));
+  if (buf == NULL)
+    return 0;
+  tile_hashes = (uint64_t *)buf;
+  table = (MOTION_ENTRY *)(tile_hashes + ntx * nty);
+  filter = (CARD32 *)(table + mask + 1);
+
+  /* Hashes of old tiles, made of hashes of their row segments */
+  for (i = 0; i <= mask; i++)
+    table[i].pos = -1;
+  memset(filter, 0, FILTER_WORDS * sizeof(CARD32));
+  for (ty = ty1; ty < ty2; ty++) {
+    for (tx = tx1; tx < tx2; tx++) {
+      hash = 0;
+      for (j = 0; j < MOTION_BLOCK; j++) {
+        if (s_rows[(ty * MOTION_BLOCK + j) * s_bands + tx] == 0) {
+          hash = 0;
+          break;
+        }
+        hash = hash * MUL_Y + s_rows[(ty * MOTION_BLOCK + j) * s_bands + tx];
+      }
+      tile_hashes[(ty - ty1) * ntx + tx - tx1] = hash;
+      if (hash != 0) {
+        table_insert(table, mask, hash, (ty - ty1) * ntx + tx - tx1);
+        filter[FILTER_INDEX(hash) / 32] |= 1U << (FILTER_INDEX(hash) % 32);
+      }
+    }
+  }
+
+  if (!find_move_vector(r, table, mask, filter, tx1, ty1, ntx, &dx, &dy))
+    return 0;
+
+  /* Blocks matching old tiles at that offset */
+  REGION_INIT(&copy_region, NullBox, 16);
+  for (ty = ty1; ty < ty2; ty++) {
+    for (tx = tx1; tx < tx2; tx++) {
+      hash = tile_hashes[(ty - ty1) * ntx + tx - tx1];
+      x = tx * MOTION_BLOCK + dx;
+      y = ty * MOTION_BLOCK + dy;
+      if ( hash == 0 || x < 0 || x + MOTION_BLOCK > g_fb_width ||
+           y < 0 || y + MOTION_BLOCK > g_fb_height ||
+           x + MOTION_BLOCK <= r->x || x >= r->x + r->w ||
+           y + MOTION_BLOCK <= r->y || y >= r->y + r->h )
+        continue;
+      if (hash_block(x, y) != hash)
+        continue;
+      box.x1 = (x > r->x) ? x : r->x;
+      box.y1 = (y > r->y) ? y : r->y;
+      box.x2 = (x + MOTION_BLOCK < r->x + r->w) ?
+        x + MOTION_BLOCK : r->x + r->w;
+      box.y2 = (y + MOTION_BLOCK < r->y + r->h) ?
+        y + MOTION_BLOCK : r->y + r->h;
+      if (!pixels_equal(r, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1,
+                        box.x1 - dx, box.y1 - dy))
+        continue;
+      REGION_INIT(&tmp_region, &box, 1);
+      REGION_UNION(&copy_region, &copy_region, &tmp_region);
+      REGION_UNINIT(&tmp_region);
+    }
+  }
+
+  n = REGION_NOTEMPTY(&copy_region) ? REGION_NUM_RECTS(&copy_region) : 0;
+  for (i = 0; i < n && num_rects < MOTION_MAX_RECTS; i++) {
+    pbox = &REGION_RECTS(&copy_region)[region_copy_index(&copy_region,
+                                                         i, dx, dy)];
+    cr = &copies[num_rects++];
+    *cr = *r;
+    cr->x = (CARD16)pbox->x1;
+    cr->y = (CARD16)pbox->y1;
+    cr->w = (CARD16)(pbox->x2 - pbox->x1);
+    cr->h = (CARD16)(pbox->y2 - pbox->y1);
+    cr->src_x = (CARD16)(cr->x - dx);
+    cr->src_y = (CARD16)(cr->y - dy);
+    cr->enc = RFB_ENCODING_COPYRECT;
+  }
+  REGION_UNINIT(&copy_region);
+
+  return num_rects;
+}
+
+/*
+ * Roll hashes of 16x16 blocks over the rectangle, or over strips of
+ * it, and look them up among old tiles. Each match with
+ * a unique tile votes for the offset between the tile and the block.
+ * Returns 0 if no offset has enough votes.
+ */
+
+static int find_move_vector(FB_RECT *r, MOTION_ENTRY *table, int mask,
+                            CARD32 *filter, int tx1, int ty1, int ntx,
+                            int *dx, int *dy)
+{
+  MOTION_VOTE votes[MOTION_MAX_VOTES];
+  MOTION_VOTE *best = NULL, *v;
+  uint64_t *mixed, *acc, *ring, *ring_row;
+  uint64_t pow_x = 1, pow_y = 1, h, old;
+  CARD32 *fb_ptr;
+  int nx, num_strips, strip_rows, step, strip_y, strip_h;
+  int x, y, j, pos, vx, vy, k, probes;
+
+  for (j = 1; j < MOTION_BLOCK; j++) {
+    pow_x *= MUL_X;
+    pow_y *= MUL_Y;
+  }
+  memset(votes, 0, sizeof(votes));
+
+  nx = r->w - MOTION_BLOCK + 1;
+  mixed = (uint64_t *)(filter + FILTER_WORDS);
+  acc = mixed + r->w;
+  ring = acc + r->w;
+
+  /* Search all rows of smaller rectangles */
+  strip_rows = 2 * MOTION_BLOCK - 1;
+  num_strips = MOTION_SCAN_PIXELS / (r->w * strip_rows);
+  if (num_strips < 1)
+    num_strips = 1;
+  if (num_strips * strip_rows >= r->h) {
+    strip_rows = r->h;
+    step = r->h;
+  } else {
+    step = r->h / num_strips;
+  }
+
+  for (strip_y = r->y; strip_y + MOTION_BLOCK <= r->y + r->h;
+       strip_y += step) {
+    strip_h = r->y + r->h - strip_y;
+    if (strip_h > strip_rows)
+      strip_h = strip_rows;
+
+    for (j = 0; j < strip_h; j++) {
+      y = strip_y + j;
+      fb_ptr = &g_framebuffer[y * (int)g_fb_width + r->x];
+      for (x = 0; x < r->w; x++)
+        mixed[x] = mix_pixel(fb_ptr[x]);
+
+      /* Roll row hashes horizontally, block hashes vertically */
+      ring_row = &ring[(j % MOTION_BLOCK) * nx];
+      h = 0;
+      for (x = 0; x < MOTION_BLOCK - 1; x++)
+        h = h * MUL_X + mixed[x];
+      for (x = 0; x < nx; x++) {
+        h = h * MUL_X + mixed[x + MOTION_BLOCK - 1];
+        old = ring_row[x];
+        if (j >= MOTION_BLOCK)
+          acc[x] = (acc[x] - old * pow_y) * MUL_Y + h;
+        else if (j == 0)
+          acc[x] = h;
+        else
+          acc[x] = acc[x] * MUL_Y + h;
+        ring_row[x] = h;
+        h -= mixed[x] * pow_x;
+      }
+      if (j < MOTION_BLOCK - 1)
+        continue;
+
+      /* Blocks from row y - 15 down to row y */
+      for (x = 0; x < nx; x++) {
+        if (!(filter[FILTER_INDEX(acc[x]) / 32] &
+              1U << (FILTER_INDEX(acc[x]) % 32)))
+          continue;
+        pos = table_lookup(table, mask, acc[x]);
+        if (pos < 0)
+          continue;
+        vx = r->x + x - (tx1 + pos % ntx) * MOTION_BLOCK;
+        vy = y - (MOTION_BLOCK - 1) - (ty1 + pos / ntx) * MOTION_BLOCK;
+        if (vx == 0 && vy == 0)
+          continue;
+        k = (int)((unsigned int)(vx * 31 + vy) % MOTION_MAX_VOTES);
+        for (probes = 0; probes < MOTION_MAX_VOTES; probes++) {
+          v = &votes[k];
+          if (v->count == 0) {
+            v->dx = vx;
+            v->dy = vy;
+          }
+          if (v->dx == vx && v->dy == vy) {
+            if (++v->count > (best != NULL ? best->count : 0))
+              best = v;
+            break;
+          }
+          k = (k + 1) % MOTION_MAX_VOTES;
+        }
+      }
+    }
+  }
+
+  if (best == NULL || best->count < MOTION_MIN_TILES)
+    return 0;
+
+  *dx = best->dx;
+  *dy = best->dy;
+  return 1;
+}
+
+/*
+ * Get a buffer of at least the specified size, reallocating it if
+ * necessary. Returns NULL on errors.
+ */
+
+static void *get_buffer(void *buf, size_t *buf_size, size_t size)
+{
+  void **pbuf = (void **)buf;
+  void *new_buf;
+
+  if (size > *buf_size) {
+    new_buf = realloc(*pbuf, size);
+    if (new_buf == NULL) {
+      log_write(LL_WARN, "Error allocating memory for motion detection");
+      return NULL;
+    }
+    *pbuf = new_buf;
+    *buf_size = size;
+  }
+  return *pbuf;
+}
+
+/*
+ * Spread bits of a pixel value before it is hashed.
+ */
+
+static uint64_t mix_pixel(CARD32 pixel)
+{
+  uint64_t m;
+
+  m = ((uint64_t)pixel + PRIME64_3) * PRIME64_1;
+  return m ^ m >> 29;
+}
+
+/*
+ * Hash pixels of a row segment in band b, up to 16 pixels.
+ */
+
+static uint64_t hash_segment(int b, int y)
+{
+  CARD32 *fb_ptr;
+  uint64_t hash = 0;
+  int x, w;
+
+  w = g_fb_width - b * MOTION_BLOCK;
+  if (w > MOTION_BLOCK)
+    w = MOTION_BLOCK;
+
+  fb_ptr = &g_framebuffer[y * (int)g_fb_width + b * MOTION_BLOCK];
+  for (x = 0; x < w; x++)
+    hash = hash * MUL_X + mix_pixel(fb_ptr[x]);
+
+  return (hash != 0) ? hash : 1;
+}
+
+/*
+ * Hash a 16x16 block at any position, the same way as a tile.
+ */
+
+static uint64_t hash_block(int x, int y)
+{
+  CARD32 *fb_ptr;
+  uint64_t hash = 0, row_hash;
+  int i, j;
+
+  fb_ptr = &g_framebuffer[y * (int)g_fb_width + x];
+  for (j = 0; j < MOTION_BLOCK; j++) {
+    row_hash = 0;
+    for (i = 0; i < MOTION_BLOCK; i++)
+      row_hash = row_hash * MUL_X + mix_pixel(fb_ptr[i]);
+    hash = hash * MUL_Y + row_hash;
+    fb_ptr += g_fb_width;
+  }
+  return hash;
+}
+
+/*
+ * Compare pixels of an area with its source, if the source is outside
+ * of the rectangle r and so still has old pixels. Otherwise, only
+ * hashes can be compared, and 1 is returned.
+ */
+
+static int pixels_equal(FB_RECT *r, int x, int y, int w, int h,
+                        int src_x, int src_y)
+{
+  CARD32 *fb_ptr, *src_ptr;
+  int row;
+
+  if ( src_x < r->x + r->w && src_x + w > r->x &&
+       src_y < r->y + r->h && src_y + h > r->y )
+    return 1;
+
+  fb_ptr = &g_framebuffer[y * (int)g_fb_width + x];
+  src_ptr = &g_framebuffer[src_y * (int)g_fb_width + src_x];
+  for (row = 0; row < h; row++) {
+    if (memcmp(fb_ptr, src_ptr, w * sizeof(CARD32)) != 0)
+      return 0;
+    fb_ptr += g_fb_width;
+    src_ptr += g_fb_width;
+  }
+  return 1;
+}
+
+/*
+ * Combine hashes of neighboring row segments, zero if any of them is
+ * unknown.
+ */
+
+static uint64_t combine_hashes(uint64_t *hashes, int num)
+{
+  uint64_t hash = 0;
+  int i;
+
+  for (i = 0; i < num; i++) {
+    if (hashes[i] == 0)
+      return 0;
+    hash = hash * PRIME64_1 + hashes[i];
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+/*
+ * Open addressing hash tables of rows or tiles. Entries with the same
+ * hash are not distinguished, so they are marked as ambiguous.
+ */
+
+static int table_alloc_mask(int num_entries)
+{
+  int size = 16;
+
+  while (size < 2 * num_entries)
+    size <<= 1;
+  return size - 1;
+}
+
+static void table_insert(MOTION_ENTRY *table, int mask,
+                         uint64_t hash, int pos)
+{
+  int i = (int)(hash >> 32) & mask;
+
+  while (table[i].pos != -1) {
+    if (table[i].hash == hash) {
+      table[i].pos = -2;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  table[i].hash = hash;
+  table[i].pos = pos;
+}
+
+static int table_lookup(MOTION_ENTRY *table, int mask, uint64_t hash)
+{
+  int i = (int)(hash >> 32) & mask;
+
+  while (table[i].pos != -1) {
+    if (table[i].hash == hash)
+      return table[i].pos;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
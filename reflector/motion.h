@@ -0,0 +1,30 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Detection of scrolled and moved areas
+ */
+
+#ifndef _REFLIB_MOTION_H
+#define _REFLIB_MOTION_H
+
+/* Maximum number of rectangles returned by motion_detect() */
+#define MOTION_MAX_RECTS  32
+
+void set_motion_detection(int enable);
+void motion_alloc(int fb_width, int fb_height);
+void motion_free(void);
+void motion_reset(void);
+int motion_detect(FB_RECT *r, FB_RECT *copies);
+void get_motion_stats(long *rects, long *bytes);
+
+#endif /* _REFLIB_MOTION_H */
@@ -0,0 +1,261 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Pool of threads for parallel encoding
+ */
+
+/*
+ * Unlike worker threads (see workers.c), threads of the pool do not
+ * run event loops. An event loop thread splits its work into a batch
+ * of independent jobs and calls pool_run(), which returns when all
+ * the jobs are done. The calling thread runs jobs of its own batch as
+ * well, so it never waits idle while there are jobs in the queue.
+ * Batches from different threads are processed in FIFO order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "rfblib.h"
+#include "async_io.h"
+#include "logging.h"
+#include "reflector.h"
+#include "translate.h"
+#include "client_io.h"
+#include "encode.h"
+#include "pool.h"
+
+typedef struct _POOL_BATCH {
+  struct _POOL_BATCH *next;
+  POOL_FUNCPTR func;
+  char *jobs;                   /* Array of jobs passed to pool_run()      */
+  size_t job_size;
+  int num_jobs;
+  int next_job;                 /* Index of the first job not started yet  */
+  int num_done;                 /* Number of jobs finished                 */
+} POOL_BATCH;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_cond_done = PTHREAD_COND_INITIALIZER;
+
+/* Batches with jobs not started yet, protected with s_mutex */
+static POOL_BATCH *s_queue_head = NULL;
+static POOL_BATCH *s_queue_tail = NULL;
+static int s_stop_f = 0;
+
+static pthread_t *s_threads = NULL;
+static int s_num_threads = 0;
+
+static void *pool_thread(void *arg);
+static void *take_job(POOL_BATCH *batch);
+static void finish_job(POOL_BATCH *batch);
+
+/*
+ * Start the specified number of threads. Returns 0 on errors.
+ */
+
+int pool_start(int num_threads)
+{
+  sigset_t set, old_set;
+  int i;
+
+  if (num_threads <= 0)
+    return 1;
+
+  s_threads = calloc(num_threads, sizeof(pthread_t));
+  if (s_threads == NULL) {
+    log_write(LL_ERROR, "Error allocating memory for encoding threads");
+    return 0;
+  }
+
+  /* Signals should be delivered to the host thread only */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&s_threads[i], NULL, pool_thread, NULL) != 0)
+      break;
+    s_num_threads++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  if (s_num_threads != num_threads) {
+    log_write(LL_ERROR, "Error creating encoding thread");
+    pool_stop();
+    return 0;
+  }
+
+  log_write(LL_INFO, "Started %d encoding thread(s)", num_threads);
+  return 1;
+}
+
+/*
+ * Stop the threads and wait until they exit. Should be called after
+ * all event loops have finished.
+ */
+
+void pool_stop(void)
+{
+  int i;
+
+  if (s_threads == NULL)
+    return;
+
+  pthread_mutex_lock(&s_mutex);
+  s_stop_f = 1;
+  pthread_cond_broadcast(&s_cond_queued);
+  pthread_mutex_unlock(&s_mutex);
+
+  for (i = 0; i < s_num_threads; i++)
+    pthread_join(s_threads[i], NULL);
+  log_write(LL_DETAIL, "Stopped %d encoding thread(s)", s_num_threads);
+
+  free(s_threads);
+  s_threads = NULL;
+  s_num_threads = 0;
+  s_stop_f = 0;
+}
+
+/*
+ * Get the number of threads in the pool, 0 if there is no pool and
+ * pool_run() would do all the work in the calling thread.
+ */
+
+int pool_num_threads(void)
+{
+  return s_num_threads;
+}
+
+/*
+ * Call func for each of num_jobs elements of the jobs array, job_size
+ * bytes each, possibly in parallel. Returns after all the calls have
+ * returned. The function should not use thread-local data of the
+ * calling thread.
+ */
+
+void pool_run(POOL_FUNCPTR func, void *jobs, size_t job_size, int num_jobs)
+{
+  POOL_BATCH batch;
+  void *job;
+  int i;
+
+  if (s_num_threads == 0 || num_jobs < 2) {
+    for (i = 0; i < num_jobs; i++)
+      (*func)((char *)jobs + i * job_size);
+    return;
+  }
+
+  batch.next = NULL;
+  batch.func = func;
+  batch.jobs = jobs;
+  batch.job_size = job_size;
+  batch.num_jobs = num_jobs;
+  batch.next_job = 0;
+  batch.num_done = 0;
+
+  pthread_mutex_lock(&s_mutex);
+
+  if (s_queue_tail != NULL)
+    s_queue_tail->next = &batch;
+  else
+    s_queue_head = &batch;
+  s_queue_tail = &batch;
+  pthread_cond_broadcast(&s_cond_queued);
+
+  /* Help the pool with our own jobs */
+  while ((job = take_job(&batch)) != NULL) {
+    pthread_mutex_unlock(&s_mutex);
+    (*func)(job);
+    pthread_mutex_lock(&s_mutex);
+    finish_job(&batch);
+  }
+
+  /* Wait for the jobs still running in other threads */
+  while (batch.num_done != batch.num_jobs)
+    pthread_cond_wait(&s_cond_done, &s_mutex);
+
+  pthread_mutex_unlock(&s_mutex);
+}
+
+static void *pool_thread(void *arg)
+{
+  POOL_BATCH *batch;
+  void *job;
+
+  pthread_mutex_lock(&s_mutex);
+
+  for (;;) {
+    while (s_queue_head == NULL && !s_stop_f)
+      pthread_cond_wait(&s_cond_queued, &s_mutex);
+    if (s_stop_f)
+      break;
+
+    batch = s_queue_head;
+    job = take_job(batch);
+    pthread_mutex_unlock(&s_mutex);
+    (*batch->func)(job);
+    pthread_mutex_lock(&s_mutex);
+    finish_job(batch);
+  }
+
+  pthread_mutex_unlock(&s_mutex);
+
+  free_enc_cache();
+  return NULL;
+}
+
+/*
+ * Get the next job of a batch, removing the batch from the queue if
+ * it was the last one. Returns NULL if all the jobs have been taken.
+ * Should be called with s_mutex locked.
+ */
+
+static void *take_job(POOL_BATCH *batch)
+{
+  POOL_BATCH *prev, *b;
+  void *job;
+
+  if (batch->next_job == batch->num_jobs)
+    return NULL;
+
+  job = batch->jobs + batch->next_job * batch->job_size;
+  if (++batch->next_job == batch->num_jobs) {
+    prev = NULL;
+    for (b = s_queue_head; b != batch; b = b->next)
+      prev = b;
+    if (prev != NULL)
+      prev->next = batch->next;
+    else
+      s_queue_head = batch->next;
+    if (s_queue_tail == batch)
+      s_queue_tail = prev;
+  }
+  return job;
+}
+
+/*
+ * Should be called with s_mutex locked.
+ */
+
+static void finish_job(POOL_BATCH *batch)
+{
+  if (++batch->num_done == batch->num_jobs)
+    pthread_cond_broadcast(&s_cond_done);
+}
@@ -0,0 +1,27 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Pool of threads for parallel encoding
+ */
+
+#ifndef _REFLIB_POOL_H
+#define _REFLIB_POOL_H
+
+typedef void (*POOL_FUNCPTR)(void *job);
+
+int pool_start(int num_threads);
+void pool_stop(void);
+int pool_num_threads(void);
+void pool_run(POOL_FUNCPTR func, void *jobs, size_t job_size, int num_jobs);
+
+#endif /* _REFLIB_POOL_H */
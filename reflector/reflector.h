@@ -44,11 +44,17 @@ extern void set_control_signals(void);
 
 /* fbs_files.c */
 
+/* Zlib streams of saved sessions, see fbs_spool_zlib_data() */
+#define FBS_STREAM_ZLIB  0
+#define FBS_STREAM_ZRLE  1
+#define FBS_NUM_STREAMS  2
+
 extern void fbs_set_prefix(char *fbs_prefix, int join_sessions);
 extern void fbs_open_file(CARD16 fb_width, CARD16 fb_height);
 extern void fbs_write_data(void *buf, size_t len);
 extern void fbs_spool_byte(CARD8 b);
 extern void fbs_spool_data(void *buf, size_t len);
+extern void fbs_spool_zlib_data(int stream_id, void *buf, size_t len);
 extern void fbs_flush_data(void);
 extern void fbs_close_file(void);
 
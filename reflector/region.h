@@ -281,8 +281,9 @@ extern BoxPtr miRegionExtents(RegionPtr pReg);
 extern int miPrintRegion(RegionPtr rgn);
 #endif
 
-/* one more operation, from region_more.c of VNC Reflector */
+/* more operations, from region_more.c of VNC Reflector */
 
 void region_pack(RegionPtr pregion, int threshold);
+int region_copy_index(RegionPtr pregion, int i, int dx, int dy);
 
 #endif /* REGIONSTRUCT_H */
@@ -12,7 +12,7 @@
  *
  * $Id: region_more.c,v 1.2 2004/08/08 15:23:35 const_k Exp $
  * A routine to join neighboring rectangles in a region, to reduce the
- * total number of rectangles.
+ * total number of rectangles, and one to order rectangles for copying.
  */
 
 #include <stdio.h>
@@ -108,6 +108,37 @@ void region_pack(RegionPtr pregion, int threshold)
   REGION_UNINIT(&add_region);
 }
 
+/*
+ * Get the index of the rectangle to be copied i-th when the region is
+ * moved by (dx, dy), so that no rectangle overwrites pixels before
+ * they are copied by others. Bands go in the direction opposite to
+ * dy, and rectangles within a band in the direction opposite to dx.
+ */
+
+int region_copy_index(RegionPtr pregion, int i, int dx, int dy)
+{
+  BoxPtr rects;
+  int num_rects, idx, first, last;
+
+  num_rects = REGION_NUM_RECTS(pregion);
+  rects = REGION_RECTS(pregion);
+
+  idx = (dy > 0) ? num_rects - 1 - i : i;
+  if ((dy > 0 && dx < 0) || (dy <= 0 && dx > 0)) {
+    /* Mirror the index within its band */
+    for (first = idx; first > 0; first--) {
+      if (rects[first - 1].y1 != rects[idx].y1)
+        break;
+    }
+    for (last = idx; last < num_rects - 1; last++) {
+      if (rects[last + 1].y1 != rects[idx].y1)
+        break;
+    }
+    idx = first + last - idx;
+  }
+  return idx;
+}
+
 /*
  * Error reporting.
  */
@@ -0,0 +1,239 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Fast scanning of pixel data
+ */
+
+
+/*
+ * These functions check how many leading pixels of a buffer are of
+ * the same color, or of one of two colors, comparing whole vectors
+ * of pixels with SSE2 or AVX2 instructions where available. They stop
+ * at the first pixel that does not match, so there is no penalty for
+ * calling them on buffers with many colors.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "rfblib.h"
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef SCAN_SIMD
+
+/*
+ * Vectorized functions process the buffer in full vectors and return
+ * the index of the first pixel that does not match, or the number of
+ * pixels processed if all of them match. The rest of the buffer is
+ * checked by the caller. Comparison masks have one bit per byte, so
+ * (bpp / 8) bits per pixel.
+ */
+
+#define DEFINE_SCAN_SSE2(bpp, cmpeq, set1, type)                        \
+                                                                        \
+__attribute__((target("sse2")))                                         \
+static int scan_solid##bpp##_sse2(CARD##bpp *buf, int n,                \
+                                  CARD##bpp color)                      \
+{                                                                       \
+  __m128i color_v = set1((type)color);                                  \
+  unsigned int mask;                                                    \
+  int i;                                                                \
+                                                                        \
+  for (i = 0; i + 128 / bpp <= n; i += 128 / bpp) {                     \
+    mask = _mm_movemask_epi8(                                           \
+      cmpeq(_mm_loadu_si128((__m128i *)&buf[i]), color_v));             \
+    if (mask != 0xFFFF)                                                 \
+      return i + __builtin_ctz(~mask) / (bpp / 8);                      \
+  }                                                                     \
+  return i;                                                             \
+}                                                                       \
+                                                                        \
+__attribute__((target("sse2")))                                         \
+static int scan_two_colors##bpp##_sse2(CARD##bpp *buf, int n,           \
+                                       CARD##bpp c0, CARD##bpp c1,      \
+                                       int *n0_ptr)                     \
+{                                                                       \
+  __m128i c0_v = set1((type)c0);                                        \
+  __m128i c1_v = set1((type)c1);                                        \
+  __m128i pix;                                                          \
+  unsigned int mask0, mask;                                             \
+  int i, bits0 = 0;                                                     \
+                                                                        \
+  for (i = 0; i + 128 / bpp <= n; i += 128 / bpp) {                     \
+    pix = _mm_loadu_si128((__m128i *)&buf[i]);                          \
+    mask0 = _mm_movemask_epi8(cmpeq(pix, c0_v));                        \
+    mask = mask0 | _mm_movemask_epi8(cmpeq(pix, c1_v));                 \
+    if (mask != 0xFFFF) {                                               \
+      mask = (1U << __builtin_ctz(~mask)) - 1;                          \
+      bits0 += __builtin_popcount(mask0 & mask);                        \
+      *n0_ptr = bits0 / (bpp / 8);                                      \
+      return i + __builtin_popcount(mask) / (bpp / 8);                  \
+    }                                                                   \
+    bits0 += __builtin_popcount(mask0);                                 \
+  }                                                                     \
+  *n0_ptr = bits0 / (bpp / 8);                                          \
+  return i;                                                             \
+}
+
+#define DEFINE_SCAN_AVX2(bpp, cmpeq, set1, type)                        \
+                                                                        \
+__attribute__((target("avx2")))                                         \
+static int scan_solid##bpp##_avx2(CARD##bpp *buf, int n,                \
+                                  CARD##bpp color)                      \
+{                                                                       \
+  __m256i color_v = set1((type)color);                                  \
+  unsigned int mask;                                                    \
+  int i;                                                                \
+                                                                        \
+  for (i = 0; i + 256 / bpp <= n; i += 256 / bpp) {                     \
+    mask = (unsigned int)_mm256_movemask_epi8(                          \
+      cmpeq(_mm256_loadu_si256((__m256i *)&buf[i]), color_v));          \
+    if (mask != 0xFFFFFFFF)                                             \
+      return i + __builtin_ctz(~mask) / (bpp / 8);                      \
+  }                                                                     \
+  return i;                                                             \
+}                                                                       \
+                                                                        \
+__attribute__((target("avx2")))                                         \
+static int scan_two_colors##bpp##_avx2(CARD##bpp *buf, int n,           \
+                                       CARD##bpp c0, CARD##bpp c1,      \
+                                       int *n0_ptr)                     \
+{                                                                       \
+  __m256i c0_v = set1((type)c0);                                        \
+  __m256i c1_v = set1((type)c1);                                        \
+  __m256i pix;                                                          \
+  unsigned int mask0, mask;                                             \
+  int i, bits0 = 0;                                                     \
+                                                                        \
+  for (i = 0; i + 256 / bpp <= n; i += 256 / bpp) {                     \
+    pix = _mm256_loadu_si256((__m256i *)&buf[i]);                       \
+    mask0 = (unsigned int)_mm256_movemask_epi8(cmpeq(pix, c0_v));       \
+    mask = mask0 | (unsigned int)_mm256_movemask_epi8(cmpeq(pix, c1_v)); \
+    if (mask != 0xFFFFFFFF) {                                           \
+      mask = (1U << __builtin_ctz(~mask)) - 1;                          \
+      bits0 += __builtin_popcount(mask0 & mask);                        \
+      *n0_ptr = bits0 / (bpp / 8);                                      \
+      return i + __builtin_popcount(mask) / (bpp / 8);                  \
+    }                                                                   \
+    bits0 += __builtin_popcount(mask0);                                 \
+  }                                                                     \
+  *n0_ptr = bits0 / (bpp / 8);                                          \
+  return i;                                                             \
+}
+
+DEFINE_SCAN_SSE2(8, _mm_cmpeq_epi8, _mm_set1_epi8, char)
+DEFINE_SCAN_SSE2(16, _mm_cmpeq_epi16, _mm_set1_epi16, short)
+DEFINE_SCAN_SSE2(32, _mm_cmpeq_epi32, _mm_set1_epi32, int)
+DEFINE_SCAN_AVX2(8, _mm256_cmpeq_epi8, _mm256_set1_epi8, char)
+DEFINE_SCAN_AVX2(16, _mm256_cmpeq_epi16, _mm256_set1_epi16, short)
+DEFINE_SCAN_AVX2(32, _mm256_cmpeq_epi32, _mm256_set1_epi32, int)
+
+#endif /* SCAN_SIMD */
+
+/*
+ * Vectorized functions chosen by scan_init(), or NULL if the processor
+ * does not support any suitable instruction set.
+ */
+
+#define DEFINE_SCAN_SIMD_PTRS(bpp)                                      \
+                                                                        \
+static int (*s_scan_solid##bpp##_simd)(CARD##bpp *buf, int n,           \
+                                       CARD##bpp color);                \
+static int (*s_scan_two_colors##bpp##_simd)(CARD##bpp *buf, int n,      \
+                                            CARD##bpp c0, CARD##bpp c1, \
+                                            int *n0_ptr);
+
+DEFINE_SCAN_SIMD_PTRS(8)
+DEFINE_SCAN_SIMD_PTRS(16)
+DEFINE_SCAN_SIMD_PTRS(32)
+
+#define SET_SCAN_SIMD_PTRS(bpp, isa)                                    \
+  s_scan_solid##bpp##_simd = scan_solid##bpp##_##isa;                   \
+  s_scan_two_colors##bpp##_simd = scan_two_colors##bpp##_##isa;
+
+/*
+ * Detect the instruction sets supported by the processor. Should be
+ * called once on startup, before any threads are created. Scanning
+ * functions work without vectorization if it has not been called.
+ */
+
+void scan_init(void)
+{
+#ifdef SCAN_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    SET_SCAN_SIMD_PTRS(8, avx2)
+    SET_SCAN_SIMD_PTRS(16, avx2)
+    SET_SCAN_SIMD_PTRS(32, avx2)
+  } else if (__builtin_cpu_supports("sse2")) {
+    SET_SCAN_SIMD_PTRS(8, sse2)
+    SET_SCAN_SIMD_PTRS(16, sse2)
+    SET_SCAN_SIMD_PTRS(32, sse2)
+  }
+#endif
+}
+
+/*
+ * Return the number of leading pixels of the specified color.
+ */
+
+#define DEFINE_SCAN_SOLID(bpp)                                          \
+                                                                        \
+int scan_solid##bpp(CARD##bpp *buf, int n, CARD##bpp color)             \
+{                                                                       \
+  int i;                                                                \
+                                                                        \
+  i = 0;                                                                \
+  if (s_scan_solid##bpp##_simd != NULL)                                 \
+    i = (*s_scan_solid##bpp##_simd)(buf, n, color);                     \
+  for (; i < n && buf[i] == color; i++);                                \
+  return i;                                                             \
+}
+
+DEFINE_SCAN_SOLID(8)
+DEFINE_SCAN_SOLID(16)
+DEFINE_SCAN_SOLID(32)
+
+/*
+ * Return the number of leading pixels of either c0 or c1 color, and
+ * store the number of c0 pixels among them in *n0_ptr.
+ */
+
+#define DEFINE_SCAN_TWO_COLORS(bpp)                                     \
+                                                                        \
+int scan_two_colors##bpp(CARD##bpp *buf, int n, CARD##bpp c0,           \
+                         CARD##bpp c1, int *n0_ptr)                     \
+{                                                                       \
+  int i, n0 = 0;                                                        \
+                                                                        \
+  i = 0;                                                                \
+  if (s_scan_two_colors##bpp##_simd != NULL)                            \
+    i = (*s_scan_two_colors##bpp##_simd)(buf, n, c0, c1, &n0);          \
+  for (; i < n; i++) {                                                  \
+    if (buf[i] == c0)                                                   \
+      n0++;                                                             \
+    else if (buf[i] != c1)                                              \
+      break;                                                            \
+  }                                                                     \
+  *n0_ptr = n0;                                                         \
+  return i;                                                             \
+}
+
+DEFINE_SCAN_TWO_COLORS(8)
+DEFINE_SCAN_TWO_COLORS(16)
+DEFINE_SCAN_TWO_COLORS(32)
@@ -0,0 +1,32 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Fast scanning of pixel data
+ */
+
+#ifndef _REFLIB_SCAN_H
+#define _REFLIB_SCAN_H
+
+void scan_init(void);
+
+int scan_solid8(CARD8 *buf, int n, CARD8 color);
+int scan_solid16(CARD16 *buf, int n, CARD16 color);
+int scan_solid32(CARD32 *buf, int n, CARD32 color);
+
+int scan_two_colors8(CARD8 *buf, int n, CARD8 c0, CARD8 c1, int *n0_ptr);
+int scan_two_colors16(CARD16 *buf, int n, CARD16 c0, CARD16 c1,
+                      int *n0_ptr);
+int scan_two_colors32(CARD32 *buf, int n, CARD32 c0, CARD32 c1,
+                      int *n0_ptr);
+
+#endif /* _REFLIB_SCAN_H */
@@ -0,0 +1,283 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Hashes of framebuffer tiles
+ */
+
+
+/*
+ * Hosts often send rectangles with pixels that have not actually
+ * changed (blinking cursors, full screen refreshes, redundant damage).
+ * To detect that, a 64-bit hash of each 16x16 tile of the framebuffer
+ * is kept. After a rectangle has been decoded, hashes of the tiles it
+ * covers are recomputed. Only the tiles that have changed are passed
+ * to clients, and if none of them has, the rectangle is dropped. All
+ * these functions should be called from the host thread only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rfblib.h"
+#include "reflector.h"
+#include "logging.h"
+#include "tile_hash.h"
+
+#define TILE_SIZE  16
+
+#define PRIME64_1  0x9E3779B185EBCA87ULL
+#define PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3  0x165667B19E3779F9ULL
+
+#define ROTL64(x, r)  ((x) << (r) | (x) >> (64 - (r)))
+
+/* Hashes of tiles, row by row. Zero means that the hash is unknown,
+   computed hashes always have the lowest bit set. */
+static uint64_t *s_hashes = NULL;
+static int s_tiles_x, s_tiles_y;
+
+static long s_suppressed_rects = 0;
+static long s_suppressed_bytes = 0;
+
+static void set_tiles_rect(FB_RECT *cr, FB_RECT *r,
+                           int tx1, int ty1, int tx2, int ty2);
+static uint64_t hash_tile(int tx, int ty);
+
+/*
+ * Allocate hashes for the framebuffer of the specified size, all of
+ * them unknown. On errors, all rectangles are passed to clients.
+ */
+
+void tile_hash_alloc(int fb_width, int fb_height)
+{
+  tile_hash_free();
+
+  s_tiles_x = (fb_width + TILE_SIZE - 1) / TILE_SIZE;
+  s_tiles_y = (fb_height + TILE_SIZE - 1) / TILE_SIZE;
+  s_hashes = calloc(s_tiles_x * s_tiles_y, sizeof(uint64_t));
+  if (s_hashes == NULL)
+    log_write(LL_WARN, "Error allocating tile hashes (ignoring)");
+}
+
+void tile_hash_free(void)
+{
+  if (s_hashes != NULL) {
+    free(s_hashes);
+    s_hashes = NULL;
+  }
+}
+
+/*
+ * Forget all hashes, should be called when the framebuffer has been
+ * changed without rehashing.
+ */
+
+void tile_hash_reset(void)
+{
+  if (s_hashes != NULL)
+    memset(s_hashes, 0, s_tiles_x * s_tiles_y * sizeof(uint64_t));
+}
+
+/*
+ * Recompute hashes of all tiles intersecting with a rectangle which
+ * has been just decoded, and find the area where pixels might have
+ * changed. The area is stored in the changed array as a list of up to
+ * TILE_HASH_MAX_RECTS rectangles within r, made of horizontal runs of
+ * changed tiles merged with identical runs in the tile rows below.
+ * If more rectangles would be needed, the bounding box of changed
+ * tiles is stored instead. Returns the number of rectangles, 0 if no
+ * pixels have changed.
+ */
+
+int tile_hash_update(FB_RECT *r, FB_RECT *changed)
+{
+  uint64_t hash;
+  FB_RECT *cr;
+  int tx, ty, tx_first, tx_last, ty_first, ty_last, run_start;
+  int num_rects = 0, band_start = 0, row_start, band_ty = -2;
+  int bx1 = -1, bx2 = -1, by1 = -1, by2 = -1;
+  int overflow = 0;
+  long changed_pixels = 0;
+  int i;
+
+  if (s_hashes == NULL) {
+    changed[0] = *r;
+    return 1;
+  }
+
+  tx_first = r->x / TILE_SIZE;
+  tx_last = (r->x + r->w - 1) / TILE_SIZE;
+  ty_first = r->y / TILE_SIZE;
+  ty_last = (r->y + r->h - 1) / TILE_SIZE;
+
+  for (ty = ty_first; ty <= ty_last; ty++) {
+    row_start = num_rects;
+    run_start = -1;
+    for (tx = tx_first; tx <= tx_last + 1; tx++) {
+      if (tx <= tx_last) {
+        hash = hash_tile(tx, ty);
+        if (s_hashes[ty * s_tiles_x + tx] != hash) {
+          s_hashes[ty * s_tiles_x + tx] = hash;
+          if (run_start < 0)
+            run_start = tx;
+          continue;
+        }
+      }
+      if (run_start < 0)
+        continue;
+
+      /* Tiles from run_start to tx - 1 have changed */
+      if (by1 < 0)
+        by1 = ty;
+      by2 = ty;
+      if (bx1 < 0 || run_start < bx1)
+        bx1 = run_start;
+      if (tx - 1 > bx2)
+        bx2 = tx - 1;
+      if (num_rects == TILE_HASH_MAX_RECTS)
+        overflow = 1;
+      if (!overflow)
+        set_tiles_rect(&changed[num_rects++], r, run_start, ty, tx - 1, ty);
+      run_start = -1;
+    }
+    if (overflow || num_rects == row_start)
+      continue;
+
+    /* Extend rectangles of the previous row if runs are the same */
+    if ( band_ty == ty - 1 &&
+         num_rects - row_start == row_start - band_start ) {
+      for (i = 0; i < row_start - band_start; i++) {
+        if ( changed[band_start + i].x != changed[row_start + i].x ||
+             changed[band_start + i].w != changed[row_start + i].w )
+          break;
+      }
+      if (i == row_start - band_start) {
+        for (i = band_start; i < row_start; i++) {
+          cr = &changed[i];
+          cr->h = changed[row_start].y + changed[row_start].h - cr->y;
+        }
+        num_rects = row_start;
+        band_ty = ty;
+        continue;
+      }
+    }
+    band_start = row_start;
+    band_ty = ty;
+  }
+
+  if (overflow) {
+    set_tiles_rect(&changed[0], r, bx1, by1, bx2, by2);
+    num_rects = 1;
+  }
+
+  for (i = 0; i < num_rects; i++)
+    changed_pixels += (long)changed[i].w * changed[i].h;
+  if (num_rects == 0)
+    s_suppressed_rects++;
+  s_suppressed_bytes +=
+    ((long)r->w * r->h - changed_pixels) * (long)sizeof(CARD32);
+
+  return num_rects;
+}
+
+/*
+ * Set cr to the area of tiles from (tx1, ty1) to (tx2, ty2) inclusive,
+ * clipped to r. Other fields are copied from r.
+ */
+
+static void set_tiles_rect(FB_RECT *cr, FB_RECT *r,
+                           int tx1, int ty1, int tx2, int ty2)
+{
+  int x1, y1, x2, y2;
+
+  x1 = tx1 * TILE_SIZE;
+  y1 = ty1 * TILE_SIZE;
+  x2 = (tx2 + 1) * TILE_SIZE;
+  y2 = (ty2 + 1) * TILE_SIZE;
+  if (x1 < r->x)
+    x1 = r->x;
+  if (y1 < r->y)
+    y1 = r->y;
+  if (x2 > r->x + r->w)
+    x2 = r->x + r->w;
+  if (y2 > r->y + r->h)
+    y2 = r->y + r->h;
+
+  *cr = *r;
+  cr->x = (CARD16)x1;
+  cr->y = (CARD16)y1;
+  cr->w = (CARD16)(x2 - x1);
+  cr->h = (CARD16)(y2 - y1);
+}
+
+/*
+ * Get the number of rectangles not passed to clients at all, and the
+ * number of bytes of unchanged pixel data not passed to clients,
+ * including parts of rectangles which have been shrunk.
+ */
+
+void get_tile_hash_stats(long *rects, long *bytes)
+{
+  *rects = s_suppressed_rects;
+  *bytes = s_suppressed_bytes;
+}
+
+/*
+ * Hash pixels of a tile, two pixels per step in two interleaved
+ * lanes, with xxHash64 rounds and final mixing.
+ */
+
+static uint64_t hash_tile(int tx, int ty)
+{
+  CARD32 *fb_ptr;
+  uint64_t acc[2], data;
+  int x, y, w, h, lane = 0;
+
+  w = g_fb_width - tx * TILE_SIZE;
+  if (w > TILE_SIZE)
+    w = TILE_SIZE;
+  h = g_fb_height - ty * TILE_SIZE;
+  if (h > TILE_SIZE)
+    h = TILE_SIZE;
+
+  acc[0] = PRIME64_1 + PRIME64_2;
+  acc[1] = PRIME64_2;
+
+  fb_ptr = &g_framebuffer[ty * TILE_SIZE * g_fb_width + tx * TILE_SIZE];
+  for (y = 0; y < h; y++) {
+    for (x = 0; x + 1 < w; x += 2) {
+      data = (uint64_t)fb_ptr[x] << 32 | fb_ptr[x + 1];
+      acc[lane] += data * PRIME64_2;
+      acc[lane] = ROTL64(acc[lane], 31) * PRIME64_1;
+      lane ^= 1;
+    }
+    if (x < w) {
+      acc[lane] += (uint64_t)fb_ptr[x] * PRIME64_2;
+      acc[lane] = ROTL64(acc[lane], 31) * PRIME64_1;
+      lane ^= 1;
+    }
+    fb_ptr += g_fb_width;
+  }
+
+  data = ROTL64(acc[0], 1) + ROTL64(acc[1], 7);
+  data ^= data >> 33;
+  data *= PRIME64_2;
+  data ^= data >> 29;
+  data *= PRIME64_3;
+  data ^= data >> 32;
+
+  return data | 1;
+}
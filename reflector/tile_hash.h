@@ -0,0 +1,29 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Hashes of framebuffer tiles
+ */
+
+#ifndef _REFLIB_TILE_HASH_H
+#define _REFLIB_TILE_HASH_H
+
+/* Maximum number of rectangles returned by tile_hash_update() */
+#define TILE_HASH_MAX_RECTS  32
+
+void tile_hash_alloc(int fb_width, int fb_height);
+void tile_hash_free(void);
+void tile_hash_reset(void);
+int tile_hash_update(FB_RECT *r, FB_RECT *changed);
+void get_tile_hash_stats(long *rects, long *bytes);
+
+#endif /* _REFLIB_TILE_HASH_H */
@@ -26,6 +26,18 @@
 #include "translate.h"
 #include "client_io.h"
 
+/*
+ * Vectorized translation functions use SSE2 or AVX2 instructions on
+ * x86 processors, the instruction set is chosen at run time. They are
+ * compiled with per-function target attributes, so no special
+ * compiler flags are needed.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSLATE_SIMD
+#include <immintrin.h>
+#endif
+
 #define SWAP_PIXEL8(pixel)  (pixel)
 
 #define SWAP_PIXEL16(pixel)                     \
@@ -38,9 +50,30 @@
    ((pixel) >> 8  & 0x0000FF00) |               \
    ((pixel) >> 24 & 0x000000FF))
 
+/*
+ * Parameters for vectorized translation, stored right after the three
+ * lookup tables allocated by gen_trans_table(). Vectorized functions
+ * compute pixel values with the same integer arithmetics as used to
+ * fill in the tables, so the results are exactly the same.
+ */
+
+typedef struct _TRANS_PARAMS {
+  TRANSFUNC_PTR simd_func;      /* NULL if only tables should be used   */
+  int max[3];                   /* R, G, B maximum values               */
+  int shift[3];                 /* R, G, B shifts, see set_simd_params  */
+  int swap_f;                   /* Swap bytes of 16-bit pixels          */
+} TRANS_PARAMS;
+
+#define TRANS_PARAMS_PTR(table, bpp)                            \
+  ((TRANS_PARAMS *)((CARD##bpp *)(table) + 256 * 3))
+
+static int s_simd_max_level = TRANS_SIMD_AVX2;
+
 static void *gen_trans_table8(RFB_PIXEL_FORMAT *fmt);
 static void *gen_trans_table16(RFB_PIXEL_FORMAT *fmt);
 static void *gen_trans_table32(RFB_PIXEL_FORMAT *fmt);
+static void set_simd_params(TRANS_PARAMS *params, RFB_PIXEL_FORMAT *fmt);
+static int get_simd_level(void);
 
 void *gen_trans_table(RFB_PIXEL_FORMAT *fmt)
 {
@@ -64,7 +97,7 @@ static void *gen_trans_table##bpp(RFB_PIXEL_FORMAT *fmt)                \
   int c;                                                                \
                                                                         \
   /* Allocate space for 3 tables for 8-bit R, G, B components */        \
-  table = malloc(256 * 3 * sizeof(CARD##bpp));                          \
+  table = malloc(256 * 3 * sizeof(CARD##bpp) + sizeof(TRANS_PARAMS));   \
                                                                         \
   /* Fill in translation tables */                                      \
   if (table != NULL) {                                                  \
@@ -83,6 +116,7 @@ static void *gen_trans_table##bpp(RFB_PIXEL_FORMAT *fmt)                \
         table[512 + c] = SWAP_PIXEL##bpp(b);                            \
       }                                                                 \
     }                                                                   \
+    set_simd_params(TRANS_PARAMS_PTR(table, bpp), fmt);                 \
   }                                                                     \
                                                                         \
   return (void *)table;                                                 \
@@ -166,7 +200,9 @@ void transfunc##bpp(void *dst_buf, FB_RECT *r, void *table)     \
  * Alternative implementation of pixel translation function. This
  * function is more efficient when there are many neighbouring pixels
  * of the same color (quite common situation). Otherwise, it's a bit
- * slower than its straightforward equivalent.
+ * slower than its straightforward equivalent. If a vectorized
+ * function has been chosen for the pixel format, it is called
+ * instead.
  */
 
 #define DEFINE_TRANSFUNC_ALT(bpp)                               \
@@ -180,8 +216,14 @@ void transfunc##bpp(void *dst_buf, FB_RECT *r, void *table)     \
 /*  CARD##bpp *tbl_g = tbl_r + 256; */                          \
 /*  CARD##bpp *tbl_b = tbl_g + 256; */                          \
   CARD##bpp pixel = 0;                                          \
+  TRANS_PARAMS *params = TRANS_PARAMS_PTR(table, bpp);          \
   int x, y, w, h;                                               \
                                                                 \
+  if (params->simd_func != NULL) {                              \
+    (*params->simd_func)(dst_buf, r, table);                    \
+    return;                                                     \
+  }                                                             \
+                                                                \
   fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];            \
   w = r->w;                                                     \
   h = r->h;                                                     \
@@ -207,3 +249,398 @@ DEFINE_TRANSFUNC_ALT(8)
 DEFINE_TRANSFUNC_ALT(16)
 DEFINE_TRANSFUNC_ALT(32)
 
+
+/*
+ * Choose the best instruction set to use in translation tables
+ * generated later, TRANS_SIMD_NONE disables vectorized translation.
+ * Returns the instruction set that will actually be used, it may be
+ * less than requested if the processor does not support it.
+ */
+
+int set_trans_simd(int max_level)
+{
+  s_simd_max_level = max_level;
+  return get_simd_level();
+}
+
+static int get_simd_level(void)
+{
+  int level = TRANS_SIMD_NONE;
+
+#ifdef TRANSLATE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    level = TRANS_SIMD_AVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    level = TRANS_SIMD_SSE2;
+#endif
+
+  return (level < s_simd_max_level) ? level : s_simd_max_level;
+}
+
+#ifdef TRANSLATE_SIMD
+static void transfunc8_sse2(void *dst_buf, FB_RECT *r, void *table);
+static void transfunc16_sse2(void *dst_buf, FB_RECT *r, void *table);
+static void transfunc32_sse2(void *dst_buf, FB_RECT *r, void *table);
+static void transfunc8_avx2(void *dst_buf, FB_RECT *r, void *table);
+static void transfunc16_avx2(void *dst_buf, FB_RECT *r, void *table);
+static void transfunc32_avx2(void *dst_buf, FB_RECT *r, void *table);
+#endif
+
+/*
+ * Vectorized functions compute components in 16-bit lanes, so they
+ * can be used only if component values do not exceed 255. For 32-bit
+ * pixels, only formats with 8-bit components aligned to byte
+ * boundaries are supported. In that case, component values are equal
+ * to the source ones, and byte swapping is done by adjusting shifts.
+ */
+
+static void set_simd_params(TRANS_PARAMS *params, RFB_PIXEL_FORMAT *fmt)
+{
+  int bpp = fmt->bits_pixel;
+  int i;
+
+  params->simd_func = NULL;
+  params->max[0] = fmt->r_max;
+  params->max[1] = fmt->g_max;
+  params->max[2] = fmt->b_max;
+  params->shift[0] = fmt->r_shift;
+  params->shift[1] = fmt->g_shift;
+  params->shift[2] = fmt->b_shift;
+  params->swap_f = (bpp != 8 &&
+                    (fmt->big_endian != 0) !=
+                    (g_screen_info.pixformat.big_endian != 0));
+
+  for (i = 0; i < 3; i++) {
+    if (params->max[i] > 255 || params->shift[i] >= bpp)
+      return;
+    if (bpp == 32) {
+      if (params->max[i] != 255 || params->shift[i] % 8 != 0)
+        return;
+      if (params->swap_f)
+        params->shift[i] = 24 - params->shift[i];
+    }
+  }
+
+#ifdef TRANSLATE_SIMD
+  switch(get_simd_level()) {
+  case TRANS_SIMD_AVX2:
+    params->simd_func = (bpp == 8) ? transfunc8_avx2 :
+      (bpp == 16) ? transfunc16_avx2 : transfunc32_avx2;
+    break;
+  case TRANS_SIMD_SSE2:
+    params->simd_func = (bpp == 8) ? transfunc8_sse2 :
+      (bpp == 16) ? transfunc16_sse2 : transfunc32_sse2;
+    break;
+  }
+#endif
+}
+
+#ifdef TRANSLATE_SIMD
+
+/*
+ * Vectorized translation functions. Component values are computed as
+ * (c * max + 127) / 255, exactly as in gen_trans_table(). Division of
+ * x <= 65152 by 255 is replaced with (x + 1 + (x >> 8)) >> 8 which
+ * gives the same result and does not overflow 16-bit lanes. Pixels
+ * left at the end of each row are translated using lookup tables.
+ */
+
+#define TABLE_PIXEL(pixel, tbl)                 \
+  ((tbl)[(pixel) >> 16 & 0xFF] |                \
+   (tbl)[256 + ((pixel) >> 8 & 0xFF)] |         \
+   (tbl)[512 + ((pixel) & 0xFF)])
+
+#define DEFINE_TRANSLATE_ROW_TAIL(bpp)                                  \
+                                                                        \
+static void translate_row_tail##bpp(CARD##bpp *dst_ptr, CARD32 *fb_ptr, \
+                                    int x, int w, void *table)          \
+{                                                                       \
+  CARD##bpp *tbl = (CARD##bpp *)table;                                  \
+                                                                        \
+  for (; x < w; x++)                                                    \
+    dst_ptr[x] = TABLE_PIXEL(fb_ptr[x], tbl);                           \
+}
+
+DEFINE_TRANSLATE_ROW_TAIL(8)
+DEFINE_TRANSLATE_ROW_TAIL(16)
+DEFINE_TRANSLATE_ROW_TAIL(32)
+
+/*
+ * SSE2: 8 pixels per iteration for 8 and 16 bits per pixel, 4 pixels
+ * for 32 bits per pixel.
+ */
+
+typedef struct _SSE2_CONSTS {
+  __m128i max[3];
+  __m128i shift[3];
+} SSE2_CONSTS;
+
+__attribute__((target("sse2")))
+static void sse2_init_consts(SSE2_CONSTS *k, void *table, int bpp)
+{
+  TRANS_PARAMS *params;
+  int i;
+
+  params = (TRANS_PARAMS *)((char *)table + 256 * 3 * (bpp / 8));
+  for (i = 0; i < 3; i++) {
+    k->max[i] = _mm_set1_epi16((short)params->max[i]);
+    k->shift[i] = _mm_cvtsi32_si128(params->shift[i]);
+  }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_component(__m128i lo, __m128i hi, int src_shift,
+                                     __m128i max, __m128i shift)
+{
+  __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i x;
+
+  x = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, src_shift), mask),
+                      _mm_and_si128(_mm_srli_epi32(hi, src_shift), mask));
+  x = _mm_add_epi16(_mm_mullo_epi16(x, max), _mm_set1_epi16(127));
+  x = _mm_add_epi16(x, _mm_add_epi16(_mm_srli_epi16(x, 8),
+                                     _mm_set1_epi16(1)));
+  return _mm_sll_epi16(_mm_srli_epi16(x, 8), shift);
+}
+
+/* Translate 8 pixels into 16-bit lanes, without byte swapping */
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_translate(CARD32 *src, SSE2_CONSTS *k)
+{
+  __m128i lo, hi;
+
+  lo = _mm_loadu_si128((__m128i *)src);
+  hi = _mm_loadu_si128((__m128i *)(src + 4));
+  return _mm_or_si128(_mm_or_si128(sse2_component(lo, hi, 16, k->max[0],
+                                                  k->shift[0]),
+                                   sse2_component(lo, hi, 8, k->max[1],
+                                                  k->shift[1])),
+                      sse2_component(lo, hi, 0, k->max[2], k->shift[2]));
+}
+
+__attribute__((target("sse2")))
+static void transfunc8_sse2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD8 *dst_ptr = (CARD8 *)dst_buf;
+  SSE2_CONSTS k;
+  __m128i pix;
+  int x, y;
+
+  sse2_init_consts(&k, table, 8);
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 8 <= r->w; x += 8) {
+      pix = _mm_and_si128(sse2_translate(&fb_ptr[x], &k),
+                          _mm_set1_epi16(0xFF));
+      _mm_storel_epi64((__m128i *)&dst_ptr[x], _mm_packus_epi16(pix, pix));
+    }
+    translate_row_tail8(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+__attribute__((target("sse2")))
+static void transfunc16_sse2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD16 *dst_ptr = (CARD16 *)dst_buf;
+  SSE2_CONSTS k;
+  __m128i pix;
+  int swap_f, x, y;
+
+  sse2_init_consts(&k, table, 16);
+  swap_f = TRANS_PARAMS_PTR(table, 16)->swap_f;
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 8 <= r->w; x += 8) {
+      pix = sse2_translate(&fb_ptr[x], &k);
+      if (swap_f)
+        pix = _mm_or_si128(_mm_slli_epi16(pix, 8), _mm_srli_epi16(pix, 8));
+      _mm_storeu_si128((__m128i *)&dst_ptr[x], pix);
+    }
+    translate_row_tail16(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+__attribute__((target("sse2")))
+static void transfunc32_sse2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD32 *dst_ptr = (CARD32 *)dst_buf;
+  SSE2_CONSTS k;
+  __m128i mask, src, pix;
+  int x, y;
+
+  sse2_init_consts(&k, table, 32);
+  mask = _mm_set1_epi32(0xFF);
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 4 <= r->w; x += 4) {
+      src = _mm_loadu_si128((__m128i *)&fb_ptr[x]);
+      pix = _mm_or_si128(
+        _mm_or_si128(
+          _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(src, 16), mask),
+                        k.shift[0]),
+          _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(src, 8), mask),
+                        k.shift[1])),
+        _mm_sll_epi32(_mm_and_si128(src, mask), k.shift[2]));
+      _mm_storeu_si128((__m128i *)&dst_ptr[x], pix);
+    }
+    translate_row_tail32(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+/*
+ * AVX2: 16 pixels per iteration for 8 and 16 bits per pixel, 8 pixels
+ * for 32 bits per pixel. Packing instructions work within 128-bit
+ * halves, so 64-bit quarters are reordered before storing results.
+ */
+
+typedef struct _AVX2_CONSTS {
+  __m256i max[3];
+  __m128i shift[3];
+} AVX2_CONSTS;
+
+__attribute__((target("avx2")))
+static void avx2_init_consts(AVX2_CONSTS *k, void *table, int bpp)
+{
+  TRANS_PARAMS *params;
+  int i;
+
+  params = (TRANS_PARAMS *)((char *)table + 256 * 3 * (bpp / 8));
+  for (i = 0; i < 3; i++) {
+    k->max[i] = _mm256_set1_epi16((short)params->max[i]);
+    k->shift[i] = _mm_cvtsi32_si128(params->shift[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_component(__m256i lo, __m256i hi, int src_shift,
+                                     __m256i max, __m128i shift)
+{
+  __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i x;
+
+  x = _mm256_packs_epi32(
+    _mm256_and_si256(_mm256_srli_epi32(lo, src_shift), mask),
+    _mm256_and_si256(_mm256_srli_epi32(hi, src_shift), mask));
+  x = _mm256_add_epi16(_mm256_mullo_epi16(x, max), _mm256_set1_epi16(127));
+  x = _mm256_add_epi16(x, _mm256_add_epi16(_mm256_srli_epi16(x, 8),
+                                           _mm256_set1_epi16(1)));
+  return _mm256_sll_epi16(_mm256_srli_epi16(x, 8), shift);
+}
+
+/* Translate 16 pixels into 16-bit lanes, in order, without swapping */
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_translate(CARD32 *src, AVX2_CONSTS *k)
+{
+  __m256i lo, hi, pix;
+
+  lo = _mm256_loadu_si256((__m256i *)src);
+  hi = _mm256_loadu_si256((__m256i *)(src + 8));
+  pix = _mm256_or_si256(_mm256_or_si256(avx2_component(lo, hi, 16,
+                                                       k->max[0],
+                                                       k->shift[0]),
+                                        avx2_component(lo, hi, 8,
+                                                       k->max[1],
+                                                       k->shift[1])),
+                        avx2_component(lo, hi, 0, k->max[2], k->shift[2]));
+  return _mm256_permute4x64_epi64(pix, 0xD8);
+}
+
+__attribute__((target("avx2")))
+static void transfunc8_avx2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD8 *dst_ptr = (CARD8 *)dst_buf;
+  AVX2_CONSTS k;
+  __m256i pix;
+  int x, y;
+
+  avx2_init_consts(&k, table, 8);
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 16 <= r->w; x += 16) {
+      pix = _mm256_and_si256(avx2_translate(&fb_ptr[x], &k),
+                             _mm256_set1_epi16(0xFF));
+      pix = _mm256_permute4x64_epi64(_mm256_packus_epi16(pix, pix), 0xD8);
+      _mm_storeu_si128((__m128i *)&dst_ptr[x], _mm256_castsi256_si128(pix));
+    }
+    translate_row_tail8(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+__attribute__((target("avx2")))
+static void transfunc16_avx2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD16 *dst_ptr = (CARD16 *)dst_buf;
+  AVX2_CONSTS k;
+  __m256i pix;
+  int swap_f, x, y;
+
+  avx2_init_consts(&k, table, 16);
+  swap_f = TRANS_PARAMS_PTR(table, 16)->swap_f;
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 16 <= r->w; x += 16) {
+      pix = avx2_translate(&fb_ptr[x], &k);
+      if (swap_f)
+        pix = _mm256_or_si256(_mm256_slli_epi16(pix, 8),
+                              _mm256_srli_epi16(pix, 8));
+      _mm256_storeu_si256((__m256i *)&dst_ptr[x], pix);
+    }
+    translate_row_tail16(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+__attribute__((target("avx2")))
+static void transfunc32_avx2(void *dst_buf, FB_RECT *r, void *table)
+{
+  CARD32 *fb_ptr;
+  CARD32 *dst_ptr = (CARD32 *)dst_buf;
+  AVX2_CONSTS k;
+  __m256i mask, src, pix;
+  int x, y;
+
+  avx2_init_consts(&k, table, 32);
+  mask = _mm256_set1_epi32(0xFF);
+  fb_ptr = &g_framebuffer[r->y * g_fb_width + r->x];
+
+  for (y = 0; y < r->h; y++) {
+    for (x = 0; x + 8 <= r->w; x += 8) {
+      src = _mm256_loadu_si256((__m256i *)&fb_ptr[x]);
+      pix = _mm256_or_si256(
+        _mm256_or_si256(
+          _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(src, 16), mask),
+                           k.shift[0]),
+          _mm256_sll_epi32(_mm256_and_si256(_mm256_srli_epi32(src, 8), mask),
+                           k.shift[1])),
+        _mm256_sll_epi32(_mm256_and_si256(src, mask), k.shift[2]));
+      _mm256_storeu_si256((__m256i *)&dst_ptr[x], pix);
+    }
+    translate_row_tail32(dst_ptr, fb_ptr, x, r->w, table);
+    fb_ptr += g_fb_width;
+    dst_ptr += r->w;
+  }
+}
+
+#endif /* TRANSLATE_SIMD */
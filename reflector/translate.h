@@ -27,6 +27,12 @@
 
 typedef void (*TRANSFUNC_PTR)(void *dst_buf, FB_RECT *r, void *table);
 
+/* Instruction sets for vectorized translation, see set_trans_simd() */
+#define TRANS_SIMD_NONE  0
+#define TRANS_SIMD_SSE2  1
+#define TRANS_SIMD_AVX2  2
+
+int set_trans_simd(int max_level);
 void *gen_trans_table(RFB_PIXEL_FORMAT *fmt);
 
 void transfunc_null(void *dst_buf, FB_RECT *r, void *table);
@@ -0,0 +1,221 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Pixel format translation benchmark
+ */
+
+/*
+ * Measures speed of pixel format translation functions for common
+ * client pixel formats, using lookup tables and each of vectorized
+ * implementations supported by the processor. Results of vectorized
+ * functions are compared with the ones of lookup tables. Not a part
+ * of the reflector, build with "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "rfblib.h"
+#include "reflector.h"
+#include "async_io.h"
+#include "translate.h"
+#include "client_io.h"
+
+#define BENCH_WIDTH   1024
+#define BENCH_HEIGHT  768
+#define BENCH_SECONDS 0.5
+
+RFB_SCREEN_INFO g_screen_info;
+CARD32 *g_framebuffer;
+CARD16 g_fb_width, g_fb_height;
+
+typedef struct _BENCH_FORMAT {
+  const char *name;
+  RFB_PIXEL_FORMAT fmt;
+} BENCH_FORMAT;
+
+/* bits_pixel, color_depth, big_endian, true_color, max, shift */
+static BENCH_FORMAT s_formats[] = {
+  { "BGR233",          { 8,  8, 0, 1,   7,   7,   3,  0,  3,  6 } },
+  { "RGB565",          { 16, 16, 0, 1,  31,  63,  31, 11,  5,  0 } },
+  { "RGB555",          { 16, 15, 0, 1,  31,  31,  31, 10,  5,  0 } },
+  { "RGB565 swapped",  { 16, 16, 1, 1,  31,  63,  31, 11,  5,  0 } },
+  { "RGB888 swapped",  { 32, 24, 1, 1, 255, 255, 255, 16,  8,  0 } },
+  { "BGR888",          { 32, 24, 0, 1, 255, 255, 255,  0,  8, 16 } }
+};
+
+static const char *s_level_names[] = { "tables", "SSE2", "AVX2" };
+
+static TRANSFUNC_PTR get_transfunc(RFB_PIXEL_FORMAT *fmt);
+static void fill_framebuffer(int photo_f);
+static double get_time(void);
+static double run_bench(RFB_PIXEL_FORMAT *fmt, int tile_size, void *dst);
+
+int main(int argc, char **argv)
+{
+  static const int tile_sizes[] = { 16, 64, BENCH_WIDTH };
+  RFB_PIXEL_FORMAT *fmt;
+  FB_RECT r;
+  void *ref_buf, *dst_buf, *table;
+  int photo_f, mismatch_f, max_level, level, i, j;
+  size_t buf_size;
+
+  g_fb_width = BENCH_WIDTH;
+  g_fb_height = BENCH_HEIGHT;
+  g_screen_info.pixformat.bits_pixel = 32;
+  g_screen_info.pixformat.color_depth = 24;
+  g_screen_info.pixformat.big_endian = is_big_endian();
+  g_screen_info.pixformat.true_color = 1;
+  g_screen_info.pixformat.r_max = 255;
+  g_screen_info.pixformat.g_max = 255;
+  g_screen_info.pixformat.b_max = 255;
+  g_screen_info.pixformat.r_shift = 16;
+  g_screen_info.pixformat.g_shift = 8;
+  g_screen_info.pixformat.b_shift = 0;
+
+  buf_size = (size_t)BENCH_WIDTH * BENCH_HEIGHT * sizeof(CARD32);
+  g_framebuffer = malloc(buf_size);
+  ref_buf = malloc(buf_size);
+  dst_buf = malloc(buf_size);
+  if (g_framebuffer == NULL || ref_buf == NULL || dst_buf == NULL) {
+    fprintf(stderr, "Error allocating memory\n");
+    return 1;
+  }
+
+  max_level = set_trans_simd(TRANS_SIMD_AVX2);
+  printf("Translating %dx%d framebuffer, Mpixels per second\n",
+         BENCH_WIDTH, BENCH_HEIGHT);
+
+  /* Odd rectangle position and width to check unaligned access */
+  r.x = 1;
+  r.y = 0;
+  r.w = BENCH_WIDTH - 5;
+  r.h = BENCH_HEIGHT;
+
+  for (photo_f = 0; photo_f <= 1; photo_f++) {
+    fill_framebuffer(photo_f);
+    printf("\n%s pixels:\n", photo_f ? "Random" : "Smooth");
+    printf("%-16s %-7s", "Format", "Method");
+    for (j = 0; j < (int)(sizeof(tile_sizes) / sizeof(int)); j++)
+      printf("  %6dpx", tile_sizes[j]);
+    printf("\n");
+
+    for (i = 0; i < (int)(sizeof(s_formats) / sizeof(BENCH_FORMAT)); i++) {
+      fmt = &s_formats[i].fmt;
+      buf_size = (size_t)BENCH_WIDTH * BENCH_HEIGHT * (fmt->bits_pixel / 8);
+
+      set_trans_simd(TRANS_SIMD_NONE);
+      table = gen_trans_table(fmt);
+      memset(ref_buf, 0, buf_size);
+      (*get_transfunc(fmt))(ref_buf, &r, table);
+      free(table);
+
+      for (level = TRANS_SIMD_NONE; level <= max_level; level++) {
+        set_trans_simd(level);
+        table = gen_trans_table(fmt);
+        memset(dst_buf, 0, buf_size);
+        (*get_transfunc(fmt))(dst_buf, &r, table);
+        free(table);
+
+        mismatch_f = (memcmp(dst_buf, ref_buf, buf_size) != 0);
+
+        printf("%-16s %-7s", s_formats[i].name, s_level_names[level]);
+        for (j = 0; j < (int)(sizeof(tile_sizes) / sizeof(int)); j++)
+          printf("  %8.1f", run_bench(fmt, tile_sizes[j], dst_buf));
+        printf(mismatch_f ? "  MISMATCH\n" : "\n");
+      }
+    }
+  }
+
+  return 0;
+}
+
+static TRANSFUNC_PTR get_transfunc(RFB_PIXEL_FORMAT *fmt)
+{
+  switch(fmt->bits_pixel) {
+  case 8:
+    return transfunc8;
+  case 16:
+    return transfunc16;
+  }
+  return transfunc32;
+}
+
+/*
+ * Smooth gradients with runs of equal pixels, or random pixels.
+ */
+
+static void fill_framebuffer(int photo_f)
+{
+  int x, y;
+
+  srand(1);
+  for (y = 0; y < BENCH_HEIGHT; y++) {
+    for (x = 0; x < BENCH_WIDTH; x++) {
+      if (photo_f) {
+        g_framebuffer[y * BENCH_WIDTH + x] =
+          (CARD32)(rand() & 0xFFFF) << 8 ^ (CARD32)rand();
+      } else {
+        g_framebuffer[y * BENCH_WIDTH + x] =
+          (CARD32)(x / 4 & 0xFF) << 16 | (CARD32)(y / 3 & 0xFF) << 8 |
+          (CARD32)((x + y) / 8 & 0xFF);
+      }
+      g_framebuffer[y * BENCH_WIDTH + x] &= 0xFFFFFF;
+    }
+  }
+}
+
+static double get_time(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Translate the whole framebuffer in tiles of the specified size
+ * until BENCH_SECONDS elapse, return millions of pixels per second.
+ */
+
+static double run_bench(RFB_PIXEL_FORMAT *fmt, int tile_size, void *dst)
+{
+  TRANSFUNC_PTR func;
+  FB_RECT r;
+  void *table;
+  double start, elapsed;
+  long pixels = 0;
+
+  func = get_transfunc(fmt);
+  table = gen_trans_table(fmt);
+  start = get_time();
+
+  do {
+    for (r.y = 0; r.y < BENCH_HEIGHT; r.y += tile_size) {
+      r.h = (BENCH_HEIGHT - r.y < tile_size) ? BENCH_HEIGHT - r.y : tile_size;
+      for (r.x = 0; r.x < BENCH_WIDTH; r.x += tile_size) {
+        r.w = (BENCH_WIDTH - r.x < tile_size) ? BENCH_WIDTH - r.x : tile_size;
+        (*func)(dst, &r, table);
+        pixels += r.w * r.h;
+      }
+    }
+    elapsed = get_time() - start;
+  } while (elapsed < BENCH_SECONDS);
+
+  free(table);
+  return pixels / elapsed / 1000000.0;
+}
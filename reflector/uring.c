@@ -0,0 +1,288 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Minimal io_uring(7) interface, used by async_io.c
+ */
+
+/*
+ * Just enough to set up a ring with raw system calls, so that no
+ * extra library is needed. Only one thread should use a ring.
+ */
+
+#ifdef USE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags,
+                              void *arg, size_t arg_size)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                      flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Create a ring. Returns 0 if io_uring is not available or lacks
+ * features we rely on (single mapping of both rings, no dropped
+ * completions, waiting with a timeout).
+ */
+
+int uring_init(URING *ring, unsigned entries, unsigned cq_entries)
+{
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  unsigned char *ptr;
+  unsigned i;
+
+  memset(ring, 0, sizeof(URING));
+  ring->fd = -1;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if (ring->fd < 0)
+    return 0;
+
+  if ( !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+       !(p.features & IORING_FEAT_NODROP) ||
+       !(p.features & IORING_FEAT_EXT_ARG) ) {
+    uring_exit(ring);
+    return 0;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    ring->ring_ptr = NULL;
+    uring_exit(ring);
+    return 0;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_exit(ring);
+    return 0;
+  }
+
+  ptr = ring->ring_ptr;
+  ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(ptr + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+  /* Submission entries are always used in order */
+  for (i = 0; i < p.sq_entries; i++)
+    ((unsigned *)(ptr + p.sq_off.array))[i] = i;
+
+  return 1;
+}
+
+void uring_exit(URING *ring)
+{
+  if (ring->fd >= 0)
+    close(ring->fd);
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring_ptr != NULL)
+    munmap(ring->ring_ptr, ring->ring_size);
+  if (ring->br != NULL)
+    munmap(ring->br, ring->br_size);
+  if (ring->bufs != NULL)
+    free(ring->bufs);
+  memset(ring, 0, sizeof(URING));
+  ring->fd = -1;
+}
+
+/*
+ * Register a ring of num_bufs receive buffers of buf_size bytes each
+ * (num_bufs should be a power of two). The kernel picks a buffer for
+ * each receive request with IOSQE_BUFFER_SELECT flag, the buffer
+ * should be returned with uring_put_buffer() when its data has been
+ * processed. Requires Linux 5.19.
+ */
+
+int uring_setup_buffers(URING *ring, unsigned num_bufs, size_t buf_size)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  ring->br_size = num_bufs * sizeof(struct io_uring_buf);
+  ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring->br == MAP_FAILED) {
+    ring->br = NULL;
+    return 0;
+  }
+  ring->bufs = malloc(num_bufs * buf_size);
+  if (ring->bufs == NULL)
+    return 0;
+  ring->buf_size = buf_size;
+  ring->br_mask = num_bufs - 1;
+  ring->br_tail = 0;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ring->br;
+  reg.ring_entries = num_bufs;
+  reg.bgid = URING_BGID;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+                            &reg, 1) != 0)
+    return 0;
+
+  for (i = 0; i < num_bufs; i++)
+    uring_put_buffer(ring, i);
+
+  return 1;
+}
+
+unsigned char *uring_get_buffer(URING *ring, int bid)
+{
+  return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void uring_put_buffer(URING *ring, int bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = &ring->br->bufs[ring->br_tail & ring->br_mask];
+  buf->addr = (unsigned long)uring_get_buffer(ring, bid);
+  buf->len = ring->buf_size;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Get a zeroed submission entry, or NULL if the submission queue is
+ * full. Prepared entries are passed to the kernel by uring_submit()
+ * or uring_wait().
+ */
+
+struct io_uring_sqe *uring_get_sqe(URING *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  if (uring_sq_space(ring) == 0)
+    return NULL;
+
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqe_tail++;
+  return sqe;
+}
+
+unsigned uring_sq_space(URING *ring)
+{
+  unsigned head;
+
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+int uring_submit(URING *ring)
+{
+  unsigned to_submit;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head,
+                                               __ATOMIC_ACQUIRE);
+  if (to_submit == 0)
+    return 0;
+
+  return sys_io_uring_enter(ring->fd, to_submit, 0, 0, NULL, 0);
+}
+
+/*
+ * Submit prepared entries and wait for at least one completion, but
+ * not longer than timeout_ms milliseconds. Returns 1 if there are
+ * completions to process, 0 otherwise (timeout or signal).
+ */
+
+int uring_wait(URING *ring, int timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned to_submit;
+
+  if (uring_peek_cqe(ring) != NULL) {
+    uring_submit(ring);
+    return 1;
+  }
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (unsigned long)&ts;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head,
+                                               __ATOMIC_ACQUIRE);
+  sys_io_uring_enter(ring->fd, to_submit, 1,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg));
+
+  return (uring_peek_cqe(ring) != NULL);
+}
+
+struct io_uring_cqe *uring_peek_cqe(URING *ring)
+{
+  unsigned head, tail;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return NULL;
+
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URING *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+/* ISO C does not allow an empty translation unit */
+typedef int URING_UNUSED;
+
+#endif /* USE_IO_URING */
@@ -0,0 +1,64 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Minimal io_uring(7) interface, used by async_io.c
+ */
+
+#ifndef _REFLIB_URING_H
+#define _REFLIB_URING_H
+
+#include <linux/io_uring.h>
+
+/* Buffer group used for provided receive buffers */
+#define URING_BGID  0
+
+typedef struct _URING {
+  int fd;                       /* io_uring descriptor, -1 if not set up   */
+
+  void *ring_ptr;               /* Mapped SQ and CQ rings                  */
+  size_t ring_size;
+  struct io_uring_sqe *sqes;    /* Mapped array of submission entries      */
+  size_t sqes_size;
+
+  unsigned *sq_head;            /* Submission queue, shared with kernel    */
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail;            /* Entries prepared, not published yet     */
+
+  unsigned *cq_head;            /* Completion queue, shared with kernel    */
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *br; /* Ring of provided receive buffers        */
+  size_t br_size;
+  unsigned br_mask;
+  unsigned short br_tail;
+  unsigned char *bufs;          /* Memory of provided receive buffers      */
+  size_t buf_size;
+} URING;
+
+int uring_init(URING *ring, unsigned entries, unsigned cq_entries);
+void uring_exit(URING *ring);
+int uring_setup_buffers(URING *ring, unsigned num_bufs, size_t buf_size);
+unsigned char *uring_get_buffer(URING *ring, int bid);
+void uring_put_buffer(URING *ring, int bid);
+struct io_uring_sqe *uring_get_sqe(URING *ring);
+unsigned uring_sq_space(URING *ring);
+int uring_submit(URING *ring);
+int uring_wait(URING *ring, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(URING *ring);
+void uring_cqe_seen(URING *ring);
+
+#endif /* _REFLIB_URING_H */
@@ -0,0 +1,752 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Serving clients in worker threads
+ */
+
+/*
+ * If worker threads are enabled, the main (host) thread accepts client
+ * connections and passes them to worker threads, each running its own
+ * event loop. From that moment, all the client I/O and encoding is
+ * done by the worker. The host thread decodes data into the
+ * framebuffer and posts messages about changes to each worker.
+ *
+ * Consistency model. There is only one framebuffer, written by the
+ * host thread and read by workers without copying. The host thread
+ * changes pixels first, then posts a WMSG_RECT message for the changed
+ * rectangle, so a worker encodes the rectangle again after it has
+ * been changed. A worker may read pixels newer than the messages it
+ * has processed. Rectangles whose final pixels are the same as before
+ * are not posted at all (see tile_hash_update()), so a worker that
+ * has read them half-drawn would keep wrong pixels. To avoid that,
+ * such rectangles are still posted if any thread might have read the
+ * framebuffer while they were being decoded, see fb_read_since().
+ *
+ * That's not enough for CopyRect, which copies pixels the client
+ * already has. Each change of the framebuffer increments the epoch
+ * counter (before the pixels are written, see fb_modified()). Each
+ * message carries the epoch it was posted at, and each worker
+ * remembers the epoch at the end of its latest encoding (see
+ * fb_unlock_read()). If the worker might have sent pixels written at
+ * or after the copy, the CopyRect is handled as a normal rectangle.
+ * The host thread checks all threads before passing CopyRects found
+ * by motion detection, see fb_read_since().
+ *
+ * Reallocation of the framebuffer and changes in g_screen_info are
+ * protected with a read-write lock, held by workers while encoding.
+ */
+
+#define _GNU_SOURCE             /* for pthread_setaffinity_np() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "rfblib.h"
+#include "async_io.h"
+#include "logging.h"
+#include "reflector.h"
+#include "host_io.h"
+#include "translate.h"
+#include "client_io.h"
+#include "encode.h"
+#include "workers.h"
+
+typedef struct _WORKER_MSG {
+  struct _WORKER_MSG *next;
+  int type;                     /* One of WMSG_* constants                 */
+  unsigned long epoch;          /* Framebuffer epoch at the time of post   */
+  FB_RECT rect;                 /* WMSG_RECT                               */
+  AIO_SHARED *shared;           /* WMSG_CUTTEXT, WMSG_TO_HOST              */
+  int fd;                       /* WMSG_ADD_CLIENT, WMSG_LISTEN, or -1     */
+  char *name;                   /* WMSG_ADD_CLIENT                         */
+} WORKER_MSG;
+
+/* Message queue, with a pipe to wake up the event loop of its thread */
+typedef struct _MAILBOX {
+  pthread_mutex_t mutex;
+  WORKER_MSG *first;
+  WORKER_MSG *last;
+  int fds[2];
+  int signalled;                /* 1 if a byte is waiting in the pipe      */
+  int closed;                   /* 1 if the reading slot has been closed   */
+} MAILBOX;
+
+typedef struct _WORKER {
+  MAILBOX mbox;
+  pthread_t thread;
+  int num;
+  int num_clients;              /* Changed atomically                      */
+  long cache_hits;              /* Hextile caching stats, set on exit      */
+  long cache_misses;
+  AIO_BLOCK_STATS block_stats;  /* Output block allocation stats, on exit  */
+} WORKER;
+
+static WORKER *s_workers = NULL;
+static int s_num_workers = 0;
+static MAILBOX s_host_mbox;
+
+static pthread_rwlock_t s_fb_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile unsigned long s_fb_epoch = 0;
+static volatile unsigned long s_epoch_read_max = 0;
+static volatile int s_num_readers = 0;
+
+/* Each thread has its own copy of these; s_worker is NULL in the host
+   thread. */
+static AIO_THREAD_LOCAL WORKER *s_worker = NULL;
+static AIO_THREAD_LOCAL MAILBOX *s_mbox = NULL;
+static AIO_THREAD_LOCAL unsigned long s_epoch_seen = 0;
+static AIO_THREAD_LOCAL WORKER_MSG *s_cur_msg = NULL;
+
+static void *worker_thread(void *arg);
+static void set_affinity(WORKER *w);
+
+static int mailbox_init(MAILBOX *mbox);
+static void mailbox_free(MAILBOX *mbox);
+static void mailbox_post(MAILBOX *mbox, WORKER_MSG *msg);
+static WORKER_MSG *mailbox_get(MAILBOX *mbox);
+static void af_mailbox(void);
+static void rf_mailbox(void);
+static void cf_mailbox(void);
+
+static WORKER_MSG *new_msg(int msg_type);
+static void free_msg(WORKER_MSG *msg);
+static void process_msg(WORKER_MSG *msg);
+
+static void fn_add_rect(AIO_SLOT *slot);
+static void fn_send_cuttext(AIO_SLOT *slot);
+static void fn_close_client(AIO_SLOT *slot);
+
+/*
+ * Start worker threads. Should be called from the host thread after
+ * aio_init(), before entering the main loop. Does nothing if
+ * num_workers is 0.
+ */
+
+int workers_start(int num_workers)
+{
+  sigset_t set, old_set;
+  WORKER *w;
+  int i;
+
+  if (num_workers <= 0)
+    return 1;
+
+  /* The host thread receives messages from workers as well */
+  if (!mailbox_init(&s_host_mbox)) {
+    log_write(LL_ERROR, "Error creating pipe for worker threads");
+    return 0;
+  }
+  s_mbox = &s_host_mbox;
+  if (!aio_add_slot(s_host_mbox.fds[0], "[workers]", af_mailbox,
+                    sizeof(AIO_SLOT))) {
+    log_write(LL_ERROR, "Error registering pipe for worker threads");
+    return 0;
+  }
+
+  s_workers = calloc(num_workers, sizeof(WORKER));
+  if (s_workers == NULL) {
+    log_write(LL_ERROR, "Error allocating memory for worker threads");
+    return 0;
+  }
+
+  /* Signals should be delivered to the host thread only */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+
+  for (i = 0; i < num_workers; i++) {
+    w = &s_workers[i];
+    w->num = i;
+    if (!mailbox_init(&w->mbox))
+      break;
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+      mailbox_free(&w->mbox);
+      break;
+    }
+    set_affinity(w);
+    s_num_workers++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  if (s_num_workers != num_workers) {
+    log_write(LL_ERROR, "Error creating worker thread");
+    workers_stop();
+    return 0;
+  }
+
+  log_write(LL_INFO, "Started %d worker thread(s)", num_workers);
+  return 1;
+}
+
+/*
+ * Stop worker threads and wait until they exit. Should be called
+ * from the host thread after the main loop has finished.
+ */
+
+void workers_stop(void)
+{
+  WORKER_MSG *msg;
+  int i;
+
+  if (s_workers == NULL)
+    return;
+
+  for (i = 0; i < s_num_workers; i++) {
+    msg = new_msg(WMSG_STOP);
+    if (msg != NULL)
+      mailbox_post(&s_workers[i].mbox, msg);
+  }
+  for (i = 0; i < s_num_workers; i++) {
+    pthread_join(s_workers[i].thread, NULL);
+    mailbox_free(&s_workers[i].mbox);
+  }
+  log_write(LL_DETAIL, "Stopped %d worker thread(s)", s_num_workers);
+
+  mailbox_free(&s_host_mbox);
+
+  s_num_workers = 0;
+}
+
+/*
+ * Post a message to all worker threads. Shared data is referenced,
+ * so the caller still owns its reference. Does nothing if there are
+ * no workers.
+ */
+
+void workers_post(int msg_type, FB_RECT *r, AIO_SHARED *shared)
+{
+  WORKER_MSG *msg;
+  int i;
+
+  for (i = 0; i < s_num_workers; i++) {
+    msg = new_msg(msg_type);
+    if (msg == NULL)
+      return;
+    if (r != NULL)
+      msg->rect = *r;
+    if (shared != NULL) {
+      aio_shared_ref(shared);
+      msg->shared = shared;
+    }
+    mailbox_post(&s_workers[i].mbox, msg);
+  }
+}
+
+/*
+ * Make each worker thread accept client connections on the port by
+ * itself, so that the host thread would not be busy with bursts of
+ * new connections. Each worker gets its own listening socket, with
+ * SO_REUSEPORT option. Returns 0 if there are no workers or the
+ * sockets could not be created, then the host thread should listen
+ * as usual.
+ */
+
+int workers_listen(int port)
+{
+  WORKER_MSG *msg;
+  int *fds;
+  int i;
+
+  if (s_num_workers == 0)
+    return 0;
+
+  fds = malloc(s_num_workers * sizeof(int));
+  if (fds == NULL)
+    return 0;
+
+  for (i = 0; i < s_num_workers; i++) {
+    fds[i] = aio_listen_socket(port, 1);
+    if (fds[i] < 0) {
+      log_write(LL_WARN, "Cannot listen in worker threads: %s",
+                strerror(errno));
+      while (--i >= 0)
+        close(fds[i]);
+      free(fds);
+      return 0;
+    }
+  }
+
+  for (i = 0; i < s_num_workers; i++) {
+    msg = new_msg(WMSG_LISTEN);
+    if (msg == NULL) {
+      close(fds[i]);
+      continue;
+    }
+    msg->fd = fds[i];
+    mailbox_post(&s_workers[i].mbox, msg);
+  }
+  free(fds);
+
+  log_write(LL_DETAIL, "Worker threads accept client connections");
+  return 1;
+}
+
+/*
+ * Called on accepting a new client connection (operates on cur_slot).
+ * If there are worker threads, pass the connection to the least
+ * loaded one and return 1. Otherwise, return 0, so the client would
+ * be served by the current thread.
+ */
+
+int workers_add_client(void)
+{
+  WORKER *w;
+  WORKER_MSG *msg;
+  int i;
+
+  /* Accepted by the worker itself, see workers_listen() */
+  if (s_worker != NULL && s_cur_msg == NULL) {
+    __sync_fetch_and_add(&s_worker->num_clients, 1);
+    return 0;
+  }
+
+  if (s_num_workers == 0 || s_worker != NULL)
+    return 0;
+
+  w = &s_workers[0];
+  for (i = 1; i < s_num_workers; i++) {
+    if (s_workers[i].num_clients < w->num_clients)
+      w = &s_workers[i];
+  }
+
+  msg = new_msg(WMSG_ADD_CLIENT);
+  if (msg == NULL)
+    return 0;
+  msg->name = strdup(cur_slot->name);
+  msg->fd = aio_detach();
+
+  log_write(LL_DETAIL, "Passing connection from %s to worker thread %d",
+            cur_slot->name, w->num);
+
+  __sync_fetch_and_add(&w->num_clients, 1);
+  mailbox_post(&w->mbox, msg);
+  return 1;
+}
+
+/*
+ * Should be called when a client connection is closed.
+ */
+
+void workers_client_closed(void)
+{
+  if (s_worker != NULL)
+    __sync_fetch_and_sub(&s_worker->num_clients, 1);
+}
+
+/*
+ * If called from a worker thread, queue a message (header and data)
+ * to be sent to the host by the host thread, and return 1. Return 0
+ * if called from the host thread.
+ */
+
+int workers_pass_to_host(CARD8 *hdr, size_t hdr_len,
+                         CARD8 *data, size_t data_len)
+{
+  WORKER_MSG *msg;
+  AIO_SHARED *shared;
+
+  if (s_worker == NULL)
+    return 0;
+
+  shared = aio_shared_new(hdr_len + data_len);
+  if (shared == NULL) {
+    log_write(LL_ERROR, "Error allocating message to host");
+    return 1;
+  }
+  memcpy(shared->data, hdr, hdr_len);
+  if (data_len)
+    memcpy(&shared->data[hdr_len], data, data_len);
+
+  msg = new_msg(WMSG_TO_HOST);
+  if (msg == NULL) {
+    aio_shared_unref(shared);
+    return 1;
+  }
+  msg->shared = shared;
+  mailbox_post(&s_host_mbox, msg);
+
+  return 1;
+}
+
+/*
+ * Add hextile caching stats collected by worker threads (after they
+ * have been stopped).
+ */
+
+void workers_add_caching_stats(long *hits, long *misses)
+{
+  int i;
+
+  for (i = 0; i < s_num_workers; i++) {
+    *hits += s_workers[i].cache_hits;
+    *misses += s_workers[i].cache_misses;
+  }
+}
+
+/*
+ * Add output block allocation stats collected by worker threads (after
+ * they have been stopped).
+ */
+
+void workers_add_block_stats(AIO_BLOCK_STATS *stats)
+{
+  int i;
+
+  for (i = 0; i < s_num_workers; i++) {
+    stats->allocs += s_workers[i].block_stats.allocs;
+    stats->allocs_malloc += s_workers[i].block_stats.allocs_malloc;
+    stats->frees += s_workers[i].block_stats.frees;
+    stats->frees_free += s_workers[i].block_stats.frees_free;
+  }
+}
+
+/*
+ * Framebuffer access. Readers (encoders) should hold the read lock,
+ * the host thread should hold the write lock while reallocating the
+ * framebuffer or changing g_screen_info. Changing pixels does not
+ * require the lock, but fb_modified() should be called before.
+ */
+
+void fb_lock_read(void)
+{
+  pthread_rwlock_rdlock(&s_fb_lock);
+  __sync_fetch_and_add(&s_num_readers, 1);
+}
+
+void fb_unlock_read(void)
+{
+  unsigned long epoch, read_max;
+
+  /* Pixels read so far are not newer than the current epoch */
+  __sync_synchronize();
+  epoch = s_fb_epoch;
+  s_epoch_seen = epoch;
+
+  /* The same for all threads, see fb_read_since() */
+  read_max = s_epoch_read_max;
+  while (read_max < epoch &&
+         !__sync_bool_compare_and_swap(&s_epoch_read_max, read_max, epoch))
+    read_max = s_epoch_read_max;
+  __sync_fetch_and_sub(&s_num_readers, 1);
+
+  pthread_rwlock_unlock(&s_fb_lock);
+}
+
+void fb_lock_write(void)
+{
+  pthread_rwlock_wrlock(&s_fb_lock);
+}
+
+void fb_unlock_write(void)
+{
+  pthread_rwlock_unlock(&s_fb_lock);
+}
+
+unsigned long fb_modified(void)
+{
+  return __sync_add_and_fetch(&s_fb_epoch, 1);
+}
+
+/*
+ * Check if any thread has read the framebuffer for encoding since
+ * fb_modified() has returned the specified epoch, or is reading it
+ * now, i.e. if clients might have got pixels written after that.
+ */
+
+int fb_read_since(unsigned long epoch)
+{
+  __sync_synchronize();
+  return (s_num_readers != 0 || s_epoch_read_max >= epoch);
+}
+
+/*
+ * Worker thread
+ */
+
+static void *worker_thread(void *arg)
+{
+  WORKER *w = (WORKER *)arg;
+
+  s_worker = w;
+  s_mbox = &w->mbox;
+
+  if (!aio_init()) {
+    log_write(LL_ERROR, "Error initializing I/O in worker thread %d: %s",
+              w->num, strerror(errno));
+  } else if (aio_add_slot(w->mbox.fds[0], "[worker]", af_mailbox,
+                          sizeof(AIO_SLOT))) {
+    log_write(LL_DETAIL, "Worker thread %d started", w->num);
+    aio_mainloop();
+  } else {
+    log_write(LL_ERROR, "Error registering pipe in worker thread %d",
+              w->num);
+  }
+
+  get_hextile_caching_stats(&w->cache_hits, &w->cache_misses);
+  free_enc_cache();
+  aio_get_block_stats(&w->block_stats);
+  aio_free_block_pools();
+
+  return NULL;
+}
+
+/* FIXME: The host thread is not bound to a CPU, CPU 0 is left for it. */
+
+static void set_affinity(WORKER *w)
+{
+#ifdef CPU_SET
+  cpu_set_t cpus;
+  long num_cpus;
+
+  num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus < 2)
+    return;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(1 + w->num % (num_cpus - 1), &cpus);
+  if (pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus) != 0) {
+    log_write(LL_WARN, "Could not set CPU affinity for worker thread %d",
+              w->num);
+  }
+#endif
+}
+
+/*
+ * Mailboxes
+ */
+
+static int mailbox_init(MAILBOX *mbox)
+{
+  if (pipe(mbox->fds) != 0)
+    return 0;
+
+  /* The pipe is used for wakeups only, never wait on writing */
+  fcntl(mbox->fds[1], F_SETFL, O_NONBLOCK);
+
+  pthread_mutex_init(&mbox->mutex, NULL);
+  mbox->first = NULL;
+  mbox->last = NULL;
+  mbox->signalled = 0;
+  mbox->closed = 0;
+
+  return 1;
+}
+
+/* The reading end of the pipe is closed with its slot */
+
+static void mailbox_free(MAILBOX *mbox)
+{
+  WORKER_MSG *msg, *next_msg;
+
+  msg = mailbox_get(mbox);
+  while (msg != NULL) {
+    next_msg = msg->next;
+    free_msg(msg);
+    msg = next_msg;
+  }
+  close(mbox->fds[1]);
+  pthread_mutex_destroy(&mbox->mutex);
+}
+
+static void mailbox_post(MAILBOX *mbox, WORKER_MSG *msg)
+{
+  msg->next = NULL;
+
+  pthread_mutex_lock(&mbox->mutex);
+
+  if (mbox->closed) {
+    pthread_mutex_unlock(&mbox->mutex);
+    free_msg(msg);
+    return;
+  }
+
+  if (mbox->last == NULL)
+    mbox->first = msg;
+  else
+    mbox->last->next = msg;
+  mbox->last = msg;
+
+  /* One byte in the pipe is enough to wake up the reader */
+  if (!mbox->signalled) {
+    mbox->signalled = 1;
+    if (write(mbox->fds[1], "", 1) != 1)
+      log_write(LL_WARN, "Error writing to wakeup pipe");
+  }
+
+  pthread_mutex_unlock(&mbox->mutex);
+}
+
+/* Get all the messages queued so far, as a list */
+
+static WORKER_MSG *mailbox_get(MAILBOX *mbox)
+{
+  WORKER_MSG *msg;
+
+  pthread_mutex_lock(&mbox->mutex);
+  msg = mbox->first;
+  mbox->first = NULL;
+  mbox->last = NULL;
+  mbox->signalled = 0;
+  pthread_mutex_unlock(&mbox->mutex);
+
+  return msg;
+}
+
+static void af_mailbox(void)
+{
+  aio_setclose(cf_mailbox);
+  aio_setread(rf_mailbox, NULL, 1);
+}
+
+static void rf_mailbox(void)
+{
+  AIO_SLOT *mbox_slot = cur_slot;
+  WORKER_MSG *msg, *next_msg;
+
+  msg = mailbox_get(s_mbox);
+  while (msg != NULL) {
+    next_msg = msg->next;
+    process_msg(msg);
+    free_msg(msg);
+    msg = next_msg;
+  }
+
+  cur_slot = mbox_slot;
+  aio_setread(rf_mailbox, NULL, 1);
+}
+
+static void cf_mailbox(void)
+{
+  pthread_mutex_lock(&s_mbox->mutex);
+  s_mbox->closed = 1;
+  pthread_mutex_unlock(&s_mbox->mutex);
+}
+
+/*
+ * Messages
+ */
+
+static WORKER_MSG *new_msg(int msg_type)
+{
+  WORKER_MSG *msg;
+
+  msg = calloc(1, sizeof(WORKER_MSG));
+  if (msg == NULL) {
+    log_write(LL_ERROR, "Error allocating message for worker thread");
+    return NULL;
+  }
+  msg->type = msg_type;
+  msg->epoch = s_fb_epoch;
+  msg->fd = -1;
+
+  return msg;
+}
+
+static void free_msg(WORKER_MSG *msg)
+{
+  if (msg->fd >= 0)
+    close(msg->fd);
+  if (msg->name != NULL)
+    free(msg->name);
+  aio_shared_unref(msg->shared);
+  free(msg);
+}
+
+static void process_msg(WORKER_MSG *msg)
+{
+  s_cur_msg = msg;
+
+  switch (msg->type) {
+  case WMSG_ADD_CLIENT:
+    if (aio_add_slot(msg->fd, msg->name, af_client_accept,
+                     sizeof(CL_SLOT))) {
+      msg->fd = -1;
+    } else {
+      log_write(LL_ERROR, "Error adding connection from %s to worker",
+                msg->name);
+      workers_client_closed();
+    }
+    break;
+  case WMSG_RECT:
+    /* See the comments on the consistency model above */
+    if (msg->rect.enc == RFB_ENCODING_COPYRECT &&
+        s_epoch_seen >= msg->epoch) {
+      log_write(LL_DEBUG, "Converting CopyRect in worker thread %d",
+                s_worker->num);
+      msg->rect.enc = RFB_ENCODING_RAW;
+    }
+    pthread_rwlock_rdlock(&s_fb_lock);
+    invalidate_enc_cache(&msg->rect);
+    pthread_rwlock_unlock(&s_fb_lock);
+    aio_walk_slots(fn_add_rect, TYPE_CL_SLOT);
+    break;
+  case WMSG_SEND_RECTS:
+    aio_walk_slots(fn_client_send_rects, TYPE_CL_SLOT);
+    break;
+  case WMSG_CUTTEXT:
+    aio_walk_slots(fn_send_cuttext, TYPE_CL_SLOT);
+    break;
+  case WMSG_CURSOR:
+    aio_walk_slots(fn_client_send_xcursor, TYPE_CL_SLOT);
+    break;
+  case WMSG_POINTERPOS:
+    aio_walk_slots(fn_client_send_pointerpos, TYPE_CL_SLOT);
+    break;
+  case WMSG_CLOSE_CLIENTS:
+    aio_walk_slots(fn_close_client, TYPE_CL_SLOT);
+    break;
+  case WMSG_REPORT_QUEUES:
+    aio_walk_slots(fn_client_report_queue, TYPE_CL_SLOT);
+    break;
+  case WMSG_LISTEN:
+    if (aio_add_listening(msg->fd, NULL, af_client_accept,
+                          sizeof(CL_SLOT))) {
+      msg->fd = -1;
+    } else {
+      log_write(LL_ERROR, "Error adding listening socket to worker");
+    }
+    break;
+  case WMSG_STOP:
+    aio_close(1);
+    break;
+  case WMSG_TO_HOST:
+    pass_msg_to_host(msg->shared->data, msg->shared->data_size);
+    break;
+  }
+
+  s_cur_msg = NULL;
+}
+
+static void fn_add_rect(AIO_SLOT *slot)
+{
+  fn_client_add_rect(slot, &s_cur_msg->rect);
+}
+
+static void fn_send_cuttext(AIO_SLOT *slot)
+{
+  fn_client_send_cuttext(slot, s_cur_msg->shared);
+}
+
+static void fn_close_client(AIO_SLOT *slot)
+{
+  aio_close_other(slot, 0);
+}
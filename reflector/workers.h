@@ -0,0 +1,54 @@
+/* VNC Reflector
+ * Copyright (C) 2001-2004 HorizonLive.com, Inc.  All rights reserved.
+ *
+ * This software is released under the terms specified in the file LICENSE,
+ * included.  HorizonLive provides e-Learning and collaborative synchronous
+ * presentation solutions in a totally Web-based environment.  For more
+ * information about HorizonLive, please see our website at
+ * http://www.horizonlive.com.
+ *
+ * This software was authored by Constantin Kaplinsky <const@ce.cctpu.edu.ru>
+ * and sponsored by HorizonLive.com, Inc.
+ *
+ * $Id$
+ * Serving clients in worker threads
+ */
+
+#ifndef _REFLIB_WORKERS_H
+#define _REFLIB_WORKERS_H
+
+/* Messages passed from the host thread to worker threads */
+#define WMSG_ADD_CLIENT     0   /* New client connection                 */
+#define WMSG_RECT           1   /* Rectangle changed (see FB_RECT.enc)   */
+#define WMSG_SEND_RECTS     2   /* End of framebuffer update             */
+#define WMSG_CUTTEXT        3   /* ServerCutText message (shared data)   */
+#define WMSG_CURSOR         4   /* Cursor shape changed                  */
+#define WMSG_POINTERPOS     5   /* Pointer position changed              */
+#define WMSG_CLOSE_CLIENTS  6   /* Disconnect all clients                */
+#define WMSG_STOP           7   /* Exit worker thread                    */
+#define WMSG_LISTEN         8   /* Accept clients on a listening socket  */
+#define WMSG_REPORT_QUEUES 10   /* Log output queue depth of each client */
+
+/* Message passed from worker threads to the host thread */
+#define WMSG_TO_HOST        9   /* Message to forward to the host        */
+
+int workers_start(int num_workers);
+void workers_stop(void);
+void workers_post(int msg_type, FB_RECT *r, AIO_SHARED *shared);
+int workers_listen(int port);
+int workers_add_client(void);
+void workers_client_closed(void);
+int workers_pass_to_host(CARD8 *hdr, size_t hdr_len,
+                         CARD8 *data, size_t data_len);
+void workers_add_caching_stats(long *hits, long *misses);
+void workers_add_block_stats(AIO_BLOCK_STATS *stats);
+
+/* Access to the framebuffer shared with worker threads */
+void fb_lock_read(void);
+void fb_unlock_read(void);
+void fb_lock_write(void);
+void fb_unlock_write(void);
+unsigned long fb_modified(void);
+int fb_read_since(unsigned long epoch);
+
+#endif /* _REFLIB_WORKERS_H */